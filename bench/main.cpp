@@ -0,0 +1,865 @@
+#include "byteswap.hpp"
+#include "compression.hpp"
+#include "concurrency.hpp"
+#include "datagram.hpp"
+#include "delta.hpp"
+#include "packets.hpp"
+#include "world.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <format>
+#include <initializer_list>
+#include <limits>
+#include <mutex>
+#include <print>
+#include <random>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace {
+
+namespace Concurrency = Moonlapse::Concurrency;
+namespace Datagram = Moonlapse::Datagram;
+namespace Lz4 = Moonlapse::Protocol::Lz4;
+namespace Protocol = Moonlapse::Protocol;
+namespace World = Moonlapse::World;
+
+using Clock = std::chrono::steady_clock;
+
+constexpr std::size_t playerCount = 1000;
+constexpr auto runTime = std::chrono::milliseconds{500};
+constexpr auto tickPeriod = std::chrono::milliseconds{1};
+
+constexpr std::array populations{std::size_t{10}, std::size_t{100},
+                                 std::size_t{1000}, std::size_t{10000}};
+// Each measurement repeats its work for at least this long.
+constexpr auto measureTime = std::chrono::milliseconds{200};
+// The fan-out world grows with the population so crowding stays the same:
+// one player per this many cells, seen through a view radius a server that
+// size would plausibly run with.
+constexpr std::size_t cellsPerPlayer = 4;
+constexpr std::int32_t fanOutViewRadius = 16;
+// Share of players that move between two broadcast rounds.
+constexpr std::size_t moverInterval = 10;
+constexpr double nanosecondsPerMillisecond = 1e6;
+constexpr double bytesPerMegabyte = 1024.0 * 1024.0;
+
+// Results are folded in here so the optimiser cannot discard the work.
+std::atomic<std::uint64_t> retained{0};
+
+void keep(std::uint64_t value) {
+  retained.fetch_add(value, std::memory_order_relaxed);
+}
+
+struct Timing {
+  double nanosecondsPerRun;
+  std::uint64_t runs;
+};
+
+// Runs work once to warm caches and buffers, then repeatedly until
+// measureTime has passed.
+template <typename Work> [[nodiscard]] auto measure(Work &&work) -> Timing {
+  work();
+  std::uint64_t runs = 0;
+  auto start = Clock::now();
+  auto elapsed = Clock::duration{};
+  do {
+    work();
+    ++runs;
+    elapsed = Clock::now() - start;
+  } while (elapsed < measureTime);
+  auto nanoseconds =
+      std::chrono::duration<double, std::nano>(elapsed).count();
+  return Timing{.nanosecondsPerRun = nanoseconds / static_cast<double>(runs),
+                .runs = runs};
+}
+
+struct Result {
+  std::uint64_t reads;
+  std::uint64_t publishes;
+  // Time the writer spent inside publish, which is all stall for a
+  // simulation thread on a fixed tick.
+  double averagePublishMicroseconds;
+  double longestPublishMicroseconds;
+};
+
+// Readers walk their pinned state this many times before letting go: once
+// for a quick look, many times for an event loop encoding a whole shard.
+constexpr std::size_t quickReadPasses = 1;
+constexpr std::size_t slowReadPasses = 200;
+
+[[nodiscard]] auto makeStates(std::uint32_t tick)
+    -> std::vector<Protocol::PlayerState> {
+  std::vector<Protocol::PlayerState> states(playerCount);
+  for (std::size_t index = 0; index < states.size(); ++index) {
+    states[index] = Protocol::PlayerState{
+        .player = static_cast<Protocol::PlayerId>(index + 1),
+        .position = {static_cast<std::int32_t>(index + tick),
+                     static_cast<std::int32_t>(tick)}};
+  }
+  return states;
+}
+
+// Stands in for building sessions' deltas from the shared state.
+[[nodiscard]] auto consume(std::span<const Protocol::PlayerState> states,
+                           std::size_t passes) -> std::int64_t {
+  std::int64_t sum = 0;
+  for (std::size_t pass = 0; pass < passes; ++pass) {
+    for (const auto &state : states) {
+      sum += state.position.x;
+    }
+  }
+  return sum;
+}
+
+// One writer publishes a new world every tick while readers walk it as fast
+// as they can, mirroring the simulation thread and the event loops.
+template <typename Publish, typename Read>
+[[nodiscard]] auto runContended(std::size_t readerCount, Publish publish,
+                                Read read) -> Result {
+  std::atomic<bool> running{true};
+  std::atomic<std::uint64_t> reads{0};
+  std::atomic<std::int64_t> sink{0};
+
+  std::vector<std::jthread> readers;
+  readers.reserve(readerCount);
+  for (std::size_t index = 0; index < readerCount; ++index) {
+    readers.emplace_back([&]() {
+      std::uint64_t local = 0;
+      std::int64_t sum = 0;
+      while (running.load(std::memory_order_relaxed)) {
+        sum += read();
+        ++local;
+      }
+      reads.fetch_add(local);
+      sink.fetch_add(sum);
+    });
+  }
+
+  std::uint64_t publishes = 0;
+  Clock::duration publishing{};
+  Clock::duration longestPublish{};
+  auto deadline = Clock::now() + runTime;
+  auto nextTick = Clock::now();
+  while (Clock::now() < deadline) {
+    auto next = makeStates(static_cast<std::uint32_t>(publishes));
+    auto start = Clock::now();
+    publish(next);
+    auto spent = Clock::now() - start;
+    publishing += spent;
+    longestPublish = std::max(longestPublish, spent);
+    ++publishes;
+    nextTick += tickPeriod;
+    std::this_thread::sleep_until(nextTick);
+  }
+  running.store(false);
+  readers.clear();
+  auto microseconds = [](Clock::duration duration) {
+    return std::chrono::duration<double, std::micro>(duration).count();
+  };
+  return Result{.reads = reads.load(),
+                .publishes = publishes,
+                .averagePublishMicroseconds =
+                    microseconds(publishing) /
+                    static_cast<double>(std::max<std::uint64_t>(publishes, 1)),
+                .longestPublishMicroseconds = microseconds(longestPublish)};
+}
+
+[[nodiscard]] auto benchMutex(std::size_t readerCount, std::size_t passes)
+    -> Result {
+  std::mutex mutex;
+  auto states = makeStates(0);
+  return runContended(
+      readerCount,
+      [&](std::vector<Protocol::PlayerState> &next) {
+        std::scoped_lock guard{mutex};
+        states.swap(next);
+      },
+      [&]() {
+        std::scoped_lock guard{mutex};
+        return consume(states, passes);
+      });
+}
+
+[[nodiscard]] auto benchVersioned(std::size_t readerCount, std::size_t passes)
+    -> Result {
+  Concurrency::VersionedBuffer<std::vector<Protocol::PlayerState>> world;
+  return runContended(
+      readerCount,
+      [&](std::vector<Protocol::PlayerState> &next) {
+        world.publish([&next](std::vector<Protocol::PlayerState> &states) {
+          states.swap(next);
+        });
+      },
+      [&]() {
+        auto states = world.read();
+        return consume(*states, passes);
+      });
+}
+
+void report(std::string_view name, std::size_t readerCount,
+            const Result &result) {
+  auto seconds = std::chrono::duration<double>(runTime).count();
+  std::println("{:<14} {:>2} reader(s): {:>12.0f} reads/s, {:>6.0f} "
+               "publishes/s, publish {:>8.1f} us avg {:>8.1f} us max",
+               name, readerCount, static_cast<double>(result.reads) / seconds,
+               static_cast<double>(result.publishes) / seconds,
+               result.averagePublishMicroseconds,
+               result.longestPublishMicroseconds);
+}
+
+void benchContention() {
+  auto maxReaders = std::max(std::thread::hardware_concurrency(), 2U);
+  for (auto passes : {quickReadPasses, slowReadPasses}) {
+    std::println("world snapshot contention, {} players, {} pass(es) per "
+                 "read, {} ms per run",
+                 playerCount, passes, runTime.count());
+    for (std::size_t readers = 1; readers <= maxReaders; readers *= 2) {
+      report("mutex", readers, benchMutex(readers, passes));
+      report("versioned", readers, benchVersioned(readers, passes));
+    }
+  }
+}
+
+// Players laid out the way the server spawns them on the stock map.
+[[nodiscard]] auto spawnStates(std::size_t count)
+    -> std::vector<Protocol::PlayerState> {
+  std::vector<Protocol::PlayerState> states(count);
+  for (std::size_t index = 0; index < count; ++index) {
+    auto player = static_cast<Protocol::PlayerId>(index + 1);
+    states[index] = Protocol::PlayerState{
+        .player = player, .position = World::spawnPosition(player)};
+  }
+  return states;
+}
+
+void reportCodec(std::string_view name, std::size_t players,
+                 const Timing &timing, std::size_t bytes) {
+  auto bytesPerSecond =
+      static_cast<double>(bytes) * 1e9 / timing.nanosecondsPerRun;
+  std::println("{:<24} N={:>5}: {:>10.0f} ns/op, {:>8.1f} MB/s, {:>7} byte(s)",
+               name, players, timing.nanosecondsPerRun,
+               bytesPerSecond / bytesPerMegabyte, bytes);
+}
+
+template <typename Packet>
+void benchPacketCodec(std::string_view name, std::size_t players,
+                      const Packet &packet, Protocol::EntityEncoding encoding) {
+  std::vector<std::byte> encoded;
+  auto encodeTiming = measure([&]() {
+    encoded = Protocol::encode(packet, encoding, std::move(encoded));
+    keep(encoded.size());
+  });
+  reportCodec(std::format("encode {}", name), players, encodeTiming,
+              encoded.size());
+
+  auto decodeTiming = measure([&]() {
+    auto frame = Protocol::extractFrame(encoded);
+    if (!frame || !frame->has_value()) {
+      return;
+    }
+    auto decoded =
+        Protocol::decodePacket((*frame)->header, (*frame)->payload);
+    keep(decoded ? decoded->index() : 0);
+  });
+  reportCodec(std::format("decode {}", name), players, decodeTiming,
+              encoded.size());
+}
+
+void benchCodec() {
+  std::println("packet encode/decode, {} ms per measurement",
+               measureTime.count());
+  for (auto players : populations) {
+    Protocol::StateSnapshotPacket snapshot{.focusPlayer = 1,
+                                           .players = spawnStates(players)};
+    Protocol::StateDeltaPacket delta{};
+    delta.sequence = 2;
+    delta.baseline = 1;
+    delta.focusPlayer = 1;
+    for (std::size_t index = 0; index < players; index += moverInterval) {
+      auto moved = snapshot.players[index];
+      World::applyMovement(moved.position, Protocol::Direction::Down);
+      delta.moved.push_back(moved);
+    }
+
+    benchPacketCodec("snapshot full", players, snapshot,
+                     Protocol::EntityEncoding::Full);
+    benchPacketCodec("snapshot compact", players, snapshot,
+                     Protocol::EntityEncoding::Compact);
+    benchPacketCodec("delta compact", players, delta,
+                     Protocol::EntityEncoding::Compact);
+  }
+}
+
+// The simulation thread's per-tick publish: collect every live player, then
+// index them for view queries.
+void benchGather() {
+  std::println("snapshot gather and grid rebuild, {} ms per measurement",
+               measureTime.count());
+  for (auto players : populations) {
+    World::PlayerStore store;
+    for (std::size_t index = 0; index < players; ++index) {
+      auto handle = store.allocate();
+      static_cast<void>(store.spawn(
+          handle, World::spawnPosition(World::PlayerStore::idOf(handle))));
+    }
+
+    std::vector<Protocol::PlayerState> states;
+    auto gatherTiming = measure([&]() {
+      store.gather(states);
+      keep(states.size());
+    });
+    World::SpatialGrid grid{World::gridWidth, World::gridHeight,
+                            World::gridWidth};
+    auto rebuildTiming = measure([&]() {
+      grid.rebuild(states);
+      keep(states.size());
+    });
+    std::println("{:<24} N={:>5}: {:>10.0f} ns/op", "gather", players,
+                 gatherTiming.nanosecondsPerRun);
+    std::println("{:<24} N={:>5}: {:>10.0f} ns/op", "grid rebuild", players,
+                 rebuildTiming.nanosecondsPerRun);
+  }
+}
+
+// One broadcast round as the event loops run it: every player queries its
+// view, diffs it against what it last acknowledged and encodes the delta.
+void benchFanOut() {
+  std::println("broadcast fan-out, view radius {}, {} cell(s) per player, "
+               "1 in {} player(s) moving per round",
+               fanOutViewRadius, cellsPerPlayer, moverInterval);
+  for (auto players : populations) {
+    auto side = static_cast<std::int32_t>(
+        std::ceil(std::sqrt(static_cast<double>(players * cellsPerPlayer))));
+    std::mt19937 random{static_cast<std::mt19937::result_type>(players)};
+    std::uniform_int_distribution<std::int32_t> coordinate{0, side - 1};
+    std::uniform_int_distribution<std::int32_t> step{-1, 1};
+
+    std::vector<Protocol::PlayerState> states(players);
+    for (std::size_t index = 0; index < players; ++index) {
+      states[index] = Protocol::PlayerState{
+          .player = static_cast<Protocol::PlayerId>(index + 1),
+          .position = {coordinate(random), coordinate(random)}};
+    }
+
+    World::SpatialGrid grid{side, side, fanOutViewRadius};
+    std::vector<std::vector<Protocol::PlayerState>> baselines(players);
+    std::vector<Protocol::PlayerState> visible;
+    Protocol::StateDeltaPacket delta;
+    std::size_t round = 0;
+    std::uint64_t bytes = 0;
+    auto timing = measure([&]() {
+      for (auto index = round % moverInterval; index < players;
+           index += moverInterval) {
+        auto &position = states[index].position;
+        position.x = std::clamp(position.x + step(random), 0, side - 1);
+        position.y = std::clamp(position.y + step(random), 0, side - 1);
+      }
+      ++round;
+      grid.rebuild(states);
+
+      bytes = 0;
+      for (std::size_t index = 0; index < players; ++index) {
+        grid.query(states[index].position, fanOutViewRadius, visible);
+        delta.sequence = static_cast<std::uint32_t>(round);
+        delta.focusPlayer = states[index].player;
+        Protocol::diffStates(baselines[index], visible, delta);
+        auto frame =
+            Protocol::encodeFrame(delta, Protocol::EntityEncoding::Compact);
+        bytes += frame.size();
+        baselines[index].assign(visible.begin(), visible.end());
+      }
+      keep(bytes);
+    });
+    std::println("{:<24} N={:>5}: {:>10.3f} ms/round, {:>8.0f} ns/recipient, "
+                 "{:>7} byte(s)/round",
+                 "fan-out", players,
+                 timing.nanosecondsPerRun / nanosecondsPerMillisecond,
+                 timing.nanosecondsPerRun / static_cast<double>(players),
+                 bytes);
+  }
+}
+
+// Set by any failed check so the run exits non-zero.
+bool checkFailed = false;
+
+void expect(bool condition, std::string_view what) {
+  if (!condition) {
+    std::println("FAIL {}", what);
+    checkFailed = true;
+  }
+}
+
+// Revisits every length up to a few vector widths, so the scalar tail runs
+// after zero, one and several vector blocks.
+constexpr std::size_t maxCheckedWords = 40;
+constexpr std::size_t maxCheckedPlayers = 24;
+
+// The vector kernels against one word at a time, at every length and every
+// misalignment of the source, and in place.
+void checkByteswap() {
+  constexpr auto wordSize = sizeof(std::uint32_t);
+  std::mt19937 random{1};
+  std::uniform_int_distribution<unsigned> byte{0, 255};
+  std::vector<std::byte> source((maxCheckedWords + 1) * wordSize);
+  for (auto &value : source) {
+    value = static_cast<std::byte>(byte(random));
+  }
+
+  for (std::size_t shift = 0; shift < wordSize; ++shift) {
+    for (std::size_t words = 0; words <= maxCheckedWords; ++words) {
+      auto input =
+          std::span<const std::byte>{source}.subspan(shift, words * wordSize);
+      std::vector<std::byte> expected(input.size());
+      for (std::size_t offset = 0; offset < input.size();
+           offset += wordSize) {
+        std::uint32_t word{};
+        std::memcpy(&word, input.subspan(offset).data(), wordSize);
+        word = Protocol::toBigEndian(word);
+        std::memcpy(expected.data() + offset, &word, wordSize);
+      }
+
+      std::vector<std::byte> copied(input.size());
+      Protocol::copyBigEndianWords(input, copied);
+      std::vector<std::byte> inPlace(input.begin(), input.end());
+      Protocol::copyBigEndianWords(inPlace, inPlace);
+      expect(copied == expected && inPlace == expected,
+             std::format("byteswap of {} word(s) at offset {}", words, shift));
+    }
+  }
+}
+
+// The encoding from before the bulk kernels: one write() per field.
+void writeStatesByField(Protocol::PayloadWriter &writer,
+                        std::span<const Protocol::PlayerState> states) {
+  writer.write<std::uint32_t>(static_cast<std::uint32_t>(states.size()));
+  for (const auto &state : states) {
+    writer.write<std::uint32_t>(state.player);
+    writer.write<std::int32_t>(state.position.x);
+    writer.write<std::int32_t>(state.position.y);
+  }
+}
+
+[[nodiscard]] auto withHeader(Protocol::PacketType type,
+                              const Protocol::PayloadWriter &payload)
+    -> std::vector<std::byte> {
+  auto header = Protocol::encodeHeader(Protocol::PacketHeader{
+      .type = type,
+      .payloadSize = static_cast<std::uint32_t>(payload.bytes().size())});
+  std::vector<std::byte> frame(header.begin(), header.end());
+  frame.insert(frame.end(), payload.bytes().begin(), payload.bytes().end());
+  return frame;
+}
+
+template <typename Decode>
+[[nodiscard]] auto decodeFrame(std::span<const std::byte> encoded,
+                               Decode decode) -> decltype(decode(encoded)) {
+  auto frame = Protocol::extractFrame(encoded);
+  if (!frame || !frame->has_value()) {
+    return std::unexpected(Protocol::PacketError::Truncated);
+  }
+  return decode((*frame)->payload);
+}
+
+// Bulk PlayerState encoding and decoding against the per-field wire format,
+// with extreme coordinates so every byte of every field is exercised.
+void checkPlayerStates() {
+  std::mt19937 random{2};
+  std::uniform_int_distribution<std::int32_t> coordinate{
+      std::numeric_limits<std::int32_t>::min(),
+      std::numeric_limits<std::int32_t>::max()};
+  for (std::size_t count = 0; count <= maxCheckedPlayers; ++count) {
+    std::vector<Protocol::PlayerState> states(count);
+    std::vector<Protocol::PlayerId> removed(count);
+    for (std::size_t index = 0; index < count; ++index) {
+      states[index] = Protocol::PlayerState{
+          .player = static_cast<Protocol::PlayerId>(coordinate(random)),
+          .position = {coordinate(random), coordinate(random)}};
+      removed[index] = static_cast<Protocol::PlayerId>(coordinate(random));
+    }
+
+    Protocol::StateSnapshotPacket snapshot{.focusPlayer = 7,
+                                           .players = states};
+    Protocol::PayloadWriter snapshotFields;
+    snapshotFields.write<Protocol::PlayerId>(snapshot.focusPlayer);
+    writeStatesByField(snapshotFields, states);
+    auto encodedSnapshot = Protocol::encode(snapshot);
+    expect(encodedSnapshot ==
+               withHeader(Protocol::PacketType::StateSnapshot, snapshotFields),
+           std::format("snapshot encoding of {} player(s)", count));
+    auto decodedSnapshot = decodeFrame(encodedSnapshot, [](auto payload) {
+      return Protocol::decodeStateSnapshot(payload);
+    });
+    expect(decodedSnapshot && decodedSnapshot->players == states,
+           std::format("snapshot decoding of {} player(s)", count));
+
+    auto half = states.begin() + static_cast<std::ptrdiff_t>(count / 2);
+    Protocol::StateDeltaPacket delta{.sequence = 3,
+                                     .baseline = 2,
+                                     .focusPlayer = 7,
+                                     .lastProcessedInput = 5,
+                                     .removed = removed,
+                                     .added = {states.begin(), half},
+                                     .moved = {half, states.end()}};
+    Protocol::PayloadWriter deltaFields;
+    for (auto field : {delta.sequence, delta.baseline, delta.focusPlayer,
+                       delta.lastProcessedInput,
+                       static_cast<std::uint32_t>(removed.size())}) {
+      deltaFields.write<std::uint32_t>(field);
+    }
+    for (auto player : removed) {
+      deltaFields.write<std::uint32_t>(player);
+    }
+    writeStatesByField(deltaFields, delta.added);
+    writeStatesByField(deltaFields, delta.moved);
+    auto encodedDelta = Protocol::encode(delta);
+    expect(encodedDelta ==
+               withHeader(Protocol::PacketType::StateDelta, deltaFields),
+           std::format("delta encoding of {} player(s)", count));
+    auto decodedDelta = decodeFrame(encodedDelta, [](auto payload) {
+      return Protocol::decodeStateDelta(payload);
+    });
+    expect(decodedDelta && decodedDelta->removed == delta.removed &&
+               decodedDelta->added == delta.added &&
+               decodedDelta->moved == delta.moved,
+           std::format("delta decoding of {} player(s)", count));
+  }
+}
+
+[[nodiscard]] auto toBytes(std::initializer_list<unsigned> values)
+    -> std::vector<std::byte> {
+  std::vector<std::byte> bytes;
+  for (auto value : values) {
+    bytes.push_back(static_cast<std::byte>(value));
+  }
+  return bytes;
+}
+
+// Compresses with a shared compressor, so stale match-table entries from
+// earlier inputs are exercised too. Every proper prefix of the block and
+// every wrongly sized output must be rejected.
+void checkLz4RoundTrip(Lz4::Compressor &compressor,
+                       std::span<const std::byte> input,
+                       std::string_view name) {
+  std::vector<std::byte> block;
+  compressor.compress(input, block);
+  expect(block.size() <= Lz4::maxCompressedSize(input.size()),
+         std::format("lz4 {} fits the worst-case size", name));
+
+  std::vector<std::byte> output(input.size());
+  expect(Lz4::decompress(block, output) && std::ranges::equal(output, input),
+         std::format("lz4 {} round trip", name));
+
+  std::vector<std::byte> longer(input.size() + 1);
+  expect(!Lz4::decompress(block, longer),
+         std::format("lz4 {} rejects a larger output", name));
+  if (!input.empty()) {
+    std::vector<std::byte> shorter(input.size() - 1);
+    expect(!Lz4::decompress(block, shorter),
+           std::format("lz4 {} rejects a smaller output", name));
+  }
+
+  auto truncatedAccepted = false;
+  for (std::size_t length = 0; length < block.size(); ++length) {
+    truncatedAccepted = truncatedAccepted ||
+                        Lz4::decompress(std::span{block}.first(length), output);
+  }
+  expect(!truncatedAccepted, std::format("lz4 {} rejects truncation", name));
+}
+
+[[nodiscard]] auto randomBytes(std::mt19937 &random, std::size_t size)
+    -> std::vector<std::byte> {
+  std::uniform_int_distribution<unsigned> byte{0, 255};
+  std::vector<std::byte> bytes(size);
+  for (auto &value : bytes) {
+    value = static_cast<std::byte>(byte(random));
+  }
+  return bytes;
+}
+
+void checkLz4() {
+  Lz4::Compressor compressor;
+  std::mt19937 random{3};
+
+  checkLz4RoundTrip(compressor, {}, "empty input");
+  // Up to and just past the twelve bytes below which nothing is matched.
+  for (std::size_t size = 1; size <= Lz4::matchSafeDistance + 1; ++size) {
+    std::vector<std::byte> repeated(size, std::byte{0x2A});
+    checkLz4RoundTrip(compressor, repeated,
+                      std::format("{} repeated byte(s)", size));
+    checkLz4RoundTrip(compressor, randomBytes(random, size),
+                      std::format("{} random byte(s)", size));
+  }
+  // Literal and match lengths that need several continuation bytes.
+  checkLz4RoundTrip(compressor, randomBytes(random, 4000), "long literal run");
+  checkLz4RoundTrip(compressor, std::vector<std::byte>(5000, std::byte{7}),
+                    "long match run");
+  // Matches that overlap their own output, at offsets below the length.
+  for (std::size_t period = 1; period <= 5; ++period) {
+    auto pattern = randomBytes(random, period);
+    std::vector<std::byte> input;
+    while (input.size() < 600) {
+      input.insert(input.end(), pattern.begin(), pattern.end());
+    }
+    checkLz4RoundTrip(compressor, input,
+                      std::format("period-{} pattern", period));
+  }
+  // A match reaching back almost as far as an offset can.
+  auto distant = randomBytes(random, Lz4::maxOffset + 64);
+  std::copy_n(distant.begin(), 256, distant.end() - 256);
+  checkLz4RoundTrip(compressor, distant, "distant match");
+  auto encodedStates = Protocol::encode(
+      Protocol::StateSnapshotPacket{.focusPlayer = 1,
+                                    .players = spawnStates(500)});
+  checkLz4RoundTrip(compressor, encodedStates, "encoded snapshot");
+
+  std::vector<std::byte> ten(10);
+  // Two literals, then a match of eight copying from two bytes back.
+  expect(Lz4::decompress(toBytes({0x24, 'a', 'b', 2, 0, 0x00}), ten) &&
+             std::ranges::equal(ten, toBytes({'a', 'b', 'a', 'b', 'a', 'b',
+                                              'a', 'b', 'a', 'b'})),
+         "lz4 overlapping match from a hand-built block");
+  struct Corrupt {
+    std::string_view name;
+    std::vector<std::byte> block;
+  };
+  std::array corrupt{
+      Corrupt{"empty block", {}},
+      Corrupt{"zero offset", toBytes({0x24, 'a', 'b', 0, 0, 0x00})},
+      Corrupt{"offset before the start",
+              toBytes({0x24, 'a', 'b', 3, 0, 0x00})},
+      Corrupt{"match past the end", toBytes({0x2F, 'a', 'b', 2, 0, 0, 0x00})},
+      Corrupt{"literals past the input", toBytes({0xA0, 'a', 'b'})},
+      Corrupt{"unterminated length", toBytes({0xF0, 0xFF, 0xFF})},
+      Corrupt{"missing final literals", toBytes({0x24, 'a', 'b', 2, 0})},
+  };
+  for (const auto &[name, block] : corrupt) {
+    expect(!Lz4::decompress(block, ten), std::format("lz4 rejects {}", name));
+  }
+
+  // Garbage must be refused or decoded without straying out of bounds; a
+  // sanitizer build catches the latter.
+  std::vector<std::byte> block;
+  compressor.compress(encodedStates, block);
+  std::vector<std::byte> output(encodedStates.size());
+  std::uniform_int_distribution<std::size_t> position{0, block.size() - 1};
+  for (int round = 0; round < 2000; ++round) {
+    auto damaged = block;
+    damaged[position(random)] ^= static_cast<std::byte>(1U << (round % 8));
+    keep(Lz4::decompress(damaged, output) ? 1 : 0);
+  }
+}
+
+[[nodiscard]] auto splitFrame(Datagram::Fragmenter &fragmenter,
+                              std::span<const std::byte> frame,
+                              std::uint32_t sequence)
+    -> std::vector<std::vector<std::byte>> {
+  std::vector<std::vector<std::byte>> datagrams;
+  if (fragmenter.split(frame, sequence)) {
+    for (std::size_t index = 0; index < fragmenter.count(); ++index) {
+      auto datagram = fragmenter.datagram(index);
+      datagrams.emplace_back(datagram.begin(), datagram.end());
+    }
+  }
+  return datagrams;
+}
+
+// Every frame the datagrams complete, in order. None may be refused.
+[[nodiscard]] auto feed(Datagram::Reassembler &reassembler,
+                        std::span<const std::vector<std::byte>> datagrams,
+                        std::string_view name)
+    -> std::vector<std::vector<std::byte>> {
+  std::vector<std::vector<std::byte>> frames;
+  for (const auto &datagram : datagrams) {
+    auto frame = reassembler.accept(datagram);
+    expect(frame.has_value(), std::format("{}: fragment accepted", name));
+    if (frame && frame->has_value()) {
+      frames.emplace_back((*frame)->begin(), (*frame)->end());
+    }
+  }
+  return frames;
+}
+
+[[nodiscard]] auto forgeFragment(const Datagram::FragmentHeader &header,
+                                 std::size_t sliceSize)
+    -> std::vector<std::byte> {
+  constexpr auto headerSize =
+      Protocol::fixedPayloadSize<Datagram::FragmentHeader>;
+  Protocol::PayloadWriter writer;
+  writer.writeBytes(Protocol::encodeHeader(Protocol::PacketHeader{
+      .type = Protocol::PacketType::DatagramFragment,
+      .payloadSize = static_cast<std::uint32_t>(headerSize + sliceSize)}));
+  writer.writeBytes(Protocol::encodeFixed(header));
+  writer.writePadding(sliceSize);
+  return std::move(writer).release();
+}
+
+// Splitting and reassembly under the reordering, duplication and loss UDP
+// allows, with sequences running across the 32-bit wrap.
+void checkFragments() {
+  constexpr auto slice = Datagram::fragmentDataSize;
+  std::mt19937 random{4};
+  Datagram::Fragmenter fragmenter;
+  Datagram::Reassembler reassembler;
+  std::uint32_t sequence = std::numeric_limits<std::uint32_t>::max() - 8;
+
+  for (auto size : {std::size_t{1}, slice - 1, slice, slice + 1,
+                    5 * slice + 17, Datagram::maxFragments * slice}) {
+    auto frame = randomBytes(random, size);
+    auto name = std::format("{}-byte frame", size);
+    auto datagrams = splitFrame(fragmenter, frame, ++sequence);
+    expect(datagrams.size() == (size + slice - 1) / slice,
+           std::format("{} split into fragments", name));
+    expect(std::ranges::all_of(datagrams,
+                               [](const auto &datagram) {
+                                 return datagram.size() <=
+                                        Datagram::maxDatagramSize;
+                               }),
+           std::format("{} fragments fit a datagram", name));
+
+    // Shuffled, with every other fragment sent twice.
+    auto sent = datagrams;
+    for (std::size_t index = 0; index < datagrams.size(); index += 2) {
+      sent.push_back(datagrams[index]);
+    }
+    std::ranges::shuffle(sent, random);
+    auto frames = feed(reassembler, sent, name);
+    expect(frames.size() == 1 && frames.front() == frame,
+           std::format("{} reassembled once from shuffled duplicates", name));
+    expect(feed(reassembler, datagrams, name).empty(),
+           std::format("{} not delivered again", name));
+  }
+
+  expect(!fragmenter.split(randomBytes(random,
+                                       Datagram::maxFragments * slice + 1),
+                           ++sequence),
+         "frame needing more than maxFragments datagrams refused");
+  expect(!fragmenter.split({}, ++sequence), "empty frame refused");
+
+  // Losing one fragment abandons the frame once a newer one arrives, and
+  // the missing piece turning up late does not revive it.
+  auto lostFrame = randomBytes(random, 3 * slice);
+  auto nextFrame = randomBytes(random, 2 * slice);
+  auto lost = splitFrame(fragmenter, lostFrame, ++sequence);
+  auto next = splitFrame(fragmenter, nextFrame, ++sequence);
+  auto staleBefore = reassembler.staleFragments();
+  auto late = lost[1];
+  lost.erase(lost.begin() + 1);
+  expect(feed(reassembler, lost, "lost fragment").empty(),
+         "frame with a lost fragment not delivered");
+  auto frames = feed(reassembler, next, "after a lost fragment");
+  expect(frames.size() == 1 && frames.front() == nextFrame,
+         "newer frame delivered after an abandoned one");
+  expect(feed(reassembler, std::span{&late, 1}, "late fragment").empty(),
+         "late fragment of an abandoned frame dropped");
+  expect(reassembler.staleFragments() - staleBefore == lost.size() + 1,
+         "abandoned and late fragments counted as stale");
+
+  // An older frame that arrives while a newer one is half collected is
+  // dropped without disturbing it.
+  auto olderFrame = randomBytes(random, 2 * slice);
+  auto newerFrame = randomBytes(random, 2 * slice);
+  auto older = splitFrame(fragmenter, olderFrame, ++sequence);
+  auto newer = splitFrame(fragmenter, newerFrame, ++sequence);
+  std::vector interleaved{newer[1], older[0], older[1], newer[0]};
+  frames = feed(reassembler, interleaved, "interleaved frames");
+  expect(frames.size() == 1 && frames.front() == newerFrame,
+         "older frame dropped while a newer one is collected");
+
+  // Fragment headers no Fragmenter writes.
+  auto nextSequence = sequence + 1;
+  struct Forged {
+    std::string_view name;
+    std::vector<std::byte> datagram;
+  };
+  std::array forged{
+      Forged{"more than maxFragments",
+             forgeFragment({.sequence = nextSequence,
+                            .index = 0,
+                            .count = Datagram::maxFragments + 1},
+                           slice)},
+      Forged{"index past the count",
+             forgeFragment({.sequence = nextSequence, .index = 2, .count = 2},
+                           1)},
+      Forged{"short middle fragment",
+             forgeFragment({.sequence = nextSequence, .index = 0, .count = 2},
+                           slice - 1)},
+      Forged{"oversized fragment",
+             forgeFragment({.sequence = nextSequence, .index = 0, .count = 1},
+                           slice + 1)},
+      Forged{"empty fragment",
+             forgeFragment({.sequence = nextSequence, .index = 0, .count = 1},
+                           0)},
+  };
+  for (const auto &[name, datagram] : forged) {
+    expect(!reassembler.accept(datagram),
+           std::format("fragment refused: {}", name));
+  }
+  auto started = forgeFragment(
+      {.sequence = nextSequence, .index = 0, .count = 2}, slice);
+  auto recounted = forgeFragment(
+      {.sequence = nextSequence, .index = 1, .count = 3}, slice);
+  auto startedResult = reassembler.accept(started);
+  expect(startedResult && !startedResult->has_value() &&
+             !reassembler.accept(recounted),
+         "fragment refused: count changed within a frame");
+}
+
+void runChecks() {
+  std::println("correctness checks");
+  checkByteswap();
+  checkPlayerStates();
+  checkLz4();
+  checkFragments();
+  std::println("checks {}", checkFailed ? "failed" : "passed");
+}
+
+struct Section {
+  std::string_view name;
+  void (*run)();
+};
+
+constexpr std::array sections{
+    Section{.name = "check", .run = runChecks},
+    Section{.name = "codec", .run = benchCodec},
+    Section{.name = "gather", .run = benchGather},
+    Section{.name = "fanout", .run = benchFanOut},
+    Section{.name = "contention", .run = benchContention},
+};
+
+} // namespace
+
+// Runs every section, or only those named on the command line, and exits
+// non-zero if a check failed.
+auto main(int argc, char **argv) -> int {
+  auto arguments = std::span<char *const>{argv, static_cast<std::size_t>(argc)}
+                       .subspan(1);
+  for (auto argument : arguments) {
+    if (std::ranges::find(sections, std::string_view{argument},
+                          &Section::name) == sections.end()) {
+      std::println("usage: moonlapse_bench [check] [codec] [gather] [fanout] "
+                   "[contention]");
+      return 1;
+    }
+  }
+
+  for (const auto &section : sections) {
+    if (arguments.empty() ||
+        std::ranges::find(arguments, section.name, [](const char *argument) {
+          return std::string_view{argument};
+        }) != arguments.end()) {
+      section.run();
+    }
+  }
+  return checkFailed ? 1 : 0;
+}
@@ -1,19 +1,30 @@
+#include "concurrency.hpp"
+#include "datagram.hpp"
+#include "delta.hpp"
+#include "interpolation.hpp"
 #include "network.hpp"
 #include "packets.hpp"
+#include "world.hpp"
 
 #ifdef _WIN32
 #include <curses.h>
 #else
 #include <ncurses.h>
+#include <unistd.h>
 #endif
 
+#include <algorithm>
+#include <array>
 #include <atomic>
 #include <cctype>
+#include <charconv>
 #include <chrono>
 #include <cstdint>
 #include <deque>
+#include <expected>
 #include <format>
 #include <functional>
+#include <iterator>
 #include <memory>
 #include <mutex>
 #include <optional>
@@ -22,31 +33,98 @@
 #include <string>
 #include <string_view>
 #include <thread>
-#include <unordered_map>
 #include <vector>
 
+using Moonlapse::Net::EventLoop;
+using Moonlapse::Net::IoEvent;
+using Moonlapse::Net::IoInterest;
 using Moonlapse::Net::SocketError;
 using Moonlapse::Net::SocketErrorCode;
 using Moonlapse::Net::SocketResult;
 using Moonlapse::Net::TcpSocket;
+using Moonlapse::Net::UdpSocket;
+using Moonlapse::World::gridHeight;
+using Moonlapse::World::gridWidth;
 
+namespace Datagram = Moonlapse::Datagram;
 namespace Protocol = Moonlapse::Protocol;
 
 namespace {
 
 constexpr std::string_view serverAddress = "127.0.0.1";
 constexpr std::uint16_t serverPort = 40500;
-constexpr int gridWidth = 40;
-constexpr int gridHeight = 20;
-constexpr auto refreshDelay = std::chrono::milliseconds{50};
+constexpr unsigned defaultFrameRate = 30;
+constexpr unsigned maxFrameRate = 240;
+// Other players are drawn this far behind the newest state, a server tick at
+// 10 Hz plus room for jitter, so there is nearly always a later state to
+// move them towards.
+constexpr auto interpolationDelay = std::chrono::milliseconds{150};
 constexpr std::size_t maxChatMessages = 8;
+constexpr std::size_t snapshotHistory = 64;
+// Far more moves than can be in flight on any usable link; past this the
+// oldest are assumed lost.
+constexpr std::size_t maxPendingInputs = 128;
+constexpr std::size_t receiveChunkSize = 4096;
 constexpr std::size_t maxChatInputLength = 200;
+constexpr std::string_view chatPromptPrefix = "Chat> ";
 constexpr int escapeKeyCode = 27;
 constexpr int deleteKeyCode = 127;
 constexpr int backspaceKeyCode = 8;
 constexpr int printableAsciiMin = 32;
 constexpr int printableAsciiMax = 126;
 
+struct ClientConfig {
+  // Upper bound only: frames are drawn when something changed.
+  unsigned frameRate{defaultFrameRate};
+  // Accept state updates over UDP when the server offers them.
+  bool datagrams{true};
+};
+
+template <typename T>
+[[nodiscard]] auto parseNumber(std::string_view text) -> std::optional<T> {
+  T value{};
+  const auto *first = text.data();
+  const auto *last = text.data() + text.size();
+  auto [position, error] = std::from_chars(first, last, value);
+  if (error != std::errc{} || position != last) {
+    return std::nullopt;
+  }
+  return value;
+}
+
+[[nodiscard]] auto parseClientConfig(std::span<char *const> arguments)
+    -> std::expected<ClientConfig, std::string> {
+  ClientConfig config{};
+  for (std::size_t index = 1; index < arguments.size(); ++index) {
+    std::string_view option{arguments[index]};
+    if (index + 1 >= arguments.size()) {
+      return std::unexpected(std::format("missing value for '{}'", option));
+    }
+    std::string_view value{arguments[++index]};
+
+    if (option == "--max-fps") {
+      auto rate = parseNumber<unsigned>(value);
+      if (!rate || *rate == 0 || *rate > maxFrameRate) {
+        return std::unexpected(
+            std::format("--max-fps expects 1-{} frames per second",
+                        maxFrameRate));
+      }
+      config.frameRate = *rate;
+      continue;
+    }
+    if (option == "--udp") {
+      if (value != "on" && value != "off") {
+        return std::unexpected("--udp expects 'on' or 'off'");
+      }
+      config.datagrams = value == "on";
+      continue;
+    }
+
+    return std::unexpected(std::format("unknown option '{}'", option));
+  }
+  return config;
+}
+
 template <typename... Handlers> struct Overloaded : Handlers... {
   using Handlers::operator()...;
 };
@@ -68,6 +146,8 @@ Overloaded(Handlers...) -> Overloaded<Handlers...>;
     return "size mismatch";
   case PacketError::InvalidPayload:
     return "invalid payload";
+  case PacketError::PayloadTooLarge:
+    return "payload too large";
   }
   return "unclassified packet error";
 }
@@ -102,27 +182,134 @@ struct CursesSession {
 
 struct ChatEntry {
   Protocol::PlayerId player{};
+  Protocol::ChatChannel channel{Protocol::ChatChannel::World};
   std::string message;
 };
 
+// Typed in front of a message to pick its channel; anything else goes to
+// the world channel.
+struct ChannelPrefix {
+  std::string_view prefix;
+  Protocol::ChatChannel channel;
+};
+
+constexpr std::array channelPrefixes{
+    ChannelPrefix{.prefix = "/l ", .channel = Protocol::ChatChannel::Local},
+    ChannelPrefix{.prefix = "/t ", .channel = Protocol::ChatChannel::Trade}};
+
+[[nodiscard]] constexpr auto channelLabel(Protocol::ChatChannel channel)
+    -> std::string_view {
+  switch (channel) {
+  case Protocol::ChatChannel::Local:
+    return " local";
+  case Protocol::ChatChannel::Trade:
+    return " trade";
+  case Protocol::ChatChannel::World:
+    break;
+  }
+  return "";
+}
+
 struct ChatUiState {
   bool active{false};
   std::string input;
 };
 
-struct ClientState {
-  std::unordered_map<Protocol::PlayerId, Protocol::Position> players;
+struct PendingInput {
+  std::uint32_t sequence{};
+  Protocol::Direction direction{Protocol::Direction::Up};
+};
+
+// The newest maxChatMessages lines, oldest first. Each push allocates one
+// immutable entry that replaces the oldest once the ring is full; entries are
+// shared, so copying the ring copies references rather than strings.
+class ChatRing {
+public:
+  void push(Protocol::PlayerId player, Protocol::ChatChannel channel,
+            std::string_view message) {
+    m_entries.at((m_first + m_size) % maxChatMessages) =
+        std::make_shared<const ChatEntry>(
+            ChatEntry{.player = player,
+                      .channel = channel,
+                      .message = std::string{message}});
+    if (m_size < maxChatMessages) {
+      ++m_size;
+    } else {
+      m_first = (m_first + 1) % maxChatMessages;
+    }
+  }
+
+  [[nodiscard]] auto size() const noexcept -> std::size_t { return m_size; }
+
+  [[nodiscard]] auto operator[](std::size_t index) const -> const ChatEntry & {
+    return *m_entries.at((m_first + index) % maxChatMessages);
+  }
+
+private:
+  std::array<std::shared_ptr<const ChatEntry>, maxChatMessages> m_entries{};
+  std::size_t m_first{0};
+  std::size_t m_size{0};
+};
+
+// Everything the receiver has learned, handed to the main thread whole.
+// Player states and chat are shared rather than copied, so publishing a
+// new version copies a few dozen references.
+struct ReceivedState {
   std::optional<Protocol::PlayerId> selfId;
-  std::deque<ChatEntry> chatLog;
-  mutable std::mutex mutex;
+  // The own player as the server last reported it, and the newest move it
+  // had applied by then.
+  std::optional<Protocol::Position> selfPosition;
+  std::uint32_t lastProcessedInput{0};
+  // Received states for drawing everyone but the own player.
+  Moonlapse::World::InterpolationBuffer remote{interpolationDelay};
+  ChatRing chatLog;
+  // Bumped by everything from the network that may change the screen.
+  std::uint64_t revision{0};
+};
+
+struct ClientState {
+  // Republished by the receiver after each read that changed something; the
+  // main thread reads the current version without locking.
+  Moonlapse::Concurrency::VersionedBuffer<ReceivedState> published;
+
+  // Receiver and datagram threads, under receiveMutex: the state being
+  // built up, and recent states that server deltas may refer to.
+  std::mutex receiveMutex;
+  ReceivedState latest;
+  bool changed{false};
+  Protocol::BaselineRing history{snapshotHistory};
+  std::vector<Protocol::PlayerState> scratch;
+  // Newest delta applied; one sent over UDP can be overtaken by a later one.
+  std::optional<std::uint32_t> newestDelta;
+
+  // Main thread only: moves sent but not yet confirmed by the server.
+  std::deque<PendingInput> pendingInputs;
+  std::uint32_t lastInput{0};
+};
+
+// The UDP side of the connection, opened when the server offers it.
+struct DatagramChannel {
+  UdpSocket socket;
+  std::vector<std::byte> hello;
+  // Set once a state has come over UDP; until then every TCP delta repeats
+  // the hello in case it was lost.
+  std::atomic_bool flowing{false};
+
+  // Datagram thread only.
+  Datagram::Reassembler reassembler;
+  Protocol::PayloadInflater inflater;
 };
 
 enum class LoopAction : std::uint8_t { Continue, Stop };
 
+// Refilled in place every frame, so drawing does not allocate once the
+// vector has grown to the number of visible players.
 struct RenderState {
   std::vector<Protocol::PlayerState> snapshot;
-  std::vector<ChatEntry> chatMessages;
   std::optional<Protocol::PlayerId> selfId;
+  std::uint64_t revision{0};
+  // Nothing left to interpolate, so later frames would look the same.
+  bool settled{true};
 };
 
 struct RuntimeContext {
@@ -160,82 +347,147 @@ void drawBorder() {
   }
 }
 
-void drawPlayers(const std::vector<Protocol::PlayerState> &snapshot,
-                 std::optional<Protocol::PlayerId> selfId) {
-  for (const auto &player : snapshot) {
-    auto positionRow = static_cast<int>(player.position.y) + 1;
-    auto positionColumn = static_cast<int>(player.position.x) + 1;
-    if (positionColumn < 1 || positionColumn > gridWidth || positionRow < 1 ||
-        positionRow > gridHeight) {
-      continue;
+// Text below the grid, one entry per screen row starting at infoRow. The
+// strings already in lines are reused. The chat prompt is always last.
+void composeLines(const RenderState &render, const ChatRing &chatLog,
+                  const ChatUiState &chatUi, std::vector<std::string> &lines) {
+  std::size_t count = 0;
+  auto next = [&lines, &count]() -> std::string & {
+    if (count == lines.size()) {
+      lines.emplace_back();
     }
-    const bool isSelf = selfId.has_value() && player.player == *selfId;
-    const auto glyph = static_cast<unsigned char>(isSelf ? '@' : 'o');
-    mvaddch(positionRow, positionColumn, static_cast<chtype>(glyph));
+    auto &line = lines[count++];
+    line.clear();
+    return line;
+  };
+
+  next().assign("Controls: arrow keys to move, q to quit, Enter to chat.");
+  if (render.selfId) {
+    std::format_to(std::back_inserter(next()), "You are player {}",
+                   static_cast<unsigned>(*render.selfId));
   }
-}
+  next().assign(chatUi.active
+                    ? "Chat mode: Enter to send, Esc to cancel, start with /l "
+                      "for local or /t for trade."
+                    : "Press Enter to chat with other players.");
+  next();
+
+  next().assign("Recent chat:");
+  for (std::size_t index = 0; index < chatLog.size(); ++index) {
+    const auto &entry = chatLog[index];
+    std::format_to(std::back_inserter(next()), "[{}{}] {}",
+                   static_cast<unsigned>(entry.player),
+                   channelLabel(entry.channel), entry.message);
+  }
+  next();
 
-auto drawInfoLines(std::optional<Protocol::PlayerId> selfId,
-                   const ChatUiState &chatUi) -> int {
-  const int infoRowIndex = gridHeight + 3;
-  const std::string controlsMessage =
-      "Controls: arrow keys to move, q to quit, Enter to chat.";
-  mvaddnstr(infoRowIndex, 1, controlsMessage.c_str(),
-            static_cast<int>(controlsMessage.size()));
-
-  int nextRow = infoRowIndex + 1;
-  if (selfId) {
-    const auto idText =
-        std::format("You are player {}", static_cast<unsigned>(*selfId));
-    mvaddnstr(nextRow, 1, idText.c_str(), static_cast<int>(idText.size()));
-    ++nextRow;
-  }
-
-  const std::string chatHint = chatUi.active
-                                   ? "Chat mode: Enter to send, Esc to cancel."
-                                   : "Press Enter to chat with other players.";
-  mvaddnstr(nextRow, 1, chatHint.c_str(), static_cast<int>(chatHint.size()));
-  return nextRow + 2;
+  auto &prompt = next();
+  prompt.append(chatPromptPrefix).append(chatUi.input);
+  if (chatUi.active) {
+    prompt.push_back('_');
+  }
+  lines.resize(count);
 }
 
-auto drawChatLog(int startRow, std::span<const ChatEntry> chatMessages) -> int {
-  mvaddnstr(startRow, 1, "Recent chat:", 12);
-  int row = startRow + 1;
-  for (const auto &entry : chatMessages) {
-    const auto line = std::format(
-        "[{}] {}", static_cast<unsigned>(entry.player), entry.message);
-    mvaddnstr(row, 1, line.c_str(), static_cast<int>(line.size()));
-    ++row;
+// Remembers what is on the terminal and only repaints the grid cells and
+// text rows that differ from it. paint only touches curses' virtual screen;
+// flush sends everything to the terminal in one doupdate.
+class FrameRenderer {
+public:
+  static constexpr int infoRow = gridHeight + 3;
+
+  FrameRenderer()
+      : m_cells(static_cast<std::size_t>(gridWidth) * gridHeight, ' ') {}
+
+  // Forgets the screen contents, e.g. after a resize.
+  void invalidate() noexcept { m_painted = false; }
+
+  void paint(const RenderState &render, const ChatRing &chatLog,
+             const ChatUiState &chatUi) {
+    if (!m_painted) {
+      clearok(stdscr, true);
+      erase();
+      drawBorder();
+      std::ranges::fill(m_cells, ' ');
+      m_lines.clear();
+      m_painted = true;
+    }
+
+    drawCells(render);
+    composeLines(render, chatLog, chatUi, m_composed);
+    drawLines(m_composed);
+
+    if (chatUi.active) {
+      move(infoRow + static_cast<int>(m_composed.size()) - 1,
+           static_cast<int>(chatPromptPrefix.size() + chatUi.input.size()));
+    }
+    if (chatUi.active != m_cursorVisible) {
+      curs_set(chatUi.active ? 1 : 0);
+      m_cursorVisible = chatUi.active;
+    }
   }
-  return row + 1;
-}
 
-void drawChatPrompt(int row, const ChatUiState &chatUi) {
-  constexpr std::string_view promptPrefix = "Chat> ";
-  auto prompt = std::format("{}{}", promptPrefix, chatUi.input);
-  if (chatUi.active) {
-    prompt.push_back('_');
+  static void flush() {
+    wnoutrefresh(stdscr);
+    doupdate();
   }
 
-  mvaddnstr(row, 1, prompt.c_str(), static_cast<int>(prompt.size()));
-  if (chatUi.active) {
-    move(row, static_cast<int>(promptPrefix.size() + chatUi.input.size()));
+private:
+  void drawCells(const RenderState &render) {
+    m_next.assign(m_cells.size(), ' ');
+    for (const auto &player : render.snapshot) {
+      auto x = static_cast<int>(player.position.x);
+      auto y = static_cast<int>(player.position.y);
+      if (x < 0 || x >= gridWidth || y < 0 || y >= gridHeight) {
+        continue;
+      }
+      const bool isSelf = render.selfId && player.player == *render.selfId;
+      m_next[cellIndex(x, y)] = isSelf ? '@' : 'o';
+    }
+
+    for (int y = 0; y < gridHeight; ++y) {
+      for (int x = 0; x < gridWidth; ++x) {
+        auto index = cellIndex(x, y);
+        if (m_next[index] != m_cells[index]) {
+          mvaddch(
+              y + 1, x + 1,
+              static_cast<chtype>(static_cast<unsigned char>(m_next[index])));
+          m_cells[index] = m_next[index];
+        }
+      }
+    }
   }
-  curs_set(chatUi.active ? 1 : 0);
-}
 
-void drawFrame(const std::vector<Protocol::PlayerState> &snapshot,
-               std::optional<Protocol::PlayerId> selfId,
-               std::span<const ChatEntry> chatMessages,
-               const ChatUiState &chatUi) {
-  erase();
-  drawBorder();
-  drawPlayers(snapshot, selfId);
-  auto nextRow = drawInfoLines(selfId, chatUi);
-  nextRow = drawChatLog(nextRow, chatMessages);
-  drawChatPrompt(nextRow, chatUi);
-  refresh();
-}
+  void drawLines(const std::vector<std::string> &lines) {
+    static const std::string blank;
+    auto rows = std::max(lines.size(), m_lines.size());
+    m_lines.resize(rows);
+    for (std::size_t index = 0; index < rows; ++index) {
+      const auto &line = index < lines.size() ? lines[index] : blank;
+      if (line == m_lines[index]) {
+        continue;
+      }
+      auto row = infoRow + static_cast<int>(index);
+      move(row, 1);
+      clrtoeol();
+      mvaddnstr(row, 1, line.c_str(), static_cast<int>(line.size()));
+      m_lines[index] = line;
+    }
+    m_lines.resize(lines.size());
+  }
+
+  [[nodiscard]] static auto cellIndex(int x, int y) noexcept -> std::size_t {
+    return static_cast<std::size_t>(y) * gridWidth +
+           static_cast<std::size_t>(x);
+  }
+
+  std::vector<char> m_cells;
+  std::vector<char> m_next;
+  std::vector<std::string> m_lines;
+  std::vector<std::string> m_composed;
+  bool m_painted{false};
+  bool m_cursorVisible{false};
+};
 
 auto sendMovement(const std::shared_ptr<TcpSocket> &socket, ClientState &state,
                   Protocol::Direction direction, std::mutex &sendMutex)
@@ -245,28 +497,79 @@ auto sendChat(const std::shared_ptr<TcpSocket> &socket, ClientState &state,
               std::string_view message, std::mutex &sendMutex)
     -> SocketResult<void>;
 
+// Folds one world state from the server into the receiver's copy.
+void recordState(ClientState &state,
+                 std::span<const Protocol::PlayerState> players,
+                 Protocol::PlayerId focusPlayer) {
+  auto &latest = state.latest;
+  latest.remote.push(std::chrono::steady_clock::now(), players);
+  if (focusPlayer != 0) {
+    latest.selfId = focusPlayer;
+  }
+  latest.selfPosition.reset();
+  if (latest.selfId) {
+    auto self = std::ranges::lower_bound(players, *latest.selfId, {},
+                                         &Protocol::PlayerState::player);
+    if (self != players.end() && self->player == *latest.selfId) {
+      latest.selfPosition = self->position;
+    }
+  }
+  ++latest.revision;
+  state.changed = true;
+}
+
 auto handleSnapshot(ClientState &state,
                     const Protocol::StateSnapshotPacket &snapshot) -> void {
-  std::unordered_map<Protocol::PlayerId, Protocol::Position> updated;
-  updated.reserve(snapshot.players.size());
-  for (const auto &player : snapshot.players) {
-    updated.emplace(player.player, player.position);
+  state.scratch.assign(snapshot.players.begin(), snapshot.players.end());
+  std::ranges::sort(state.scratch, {}, &Protocol::PlayerState::player);
+  recordState(state, state.scratch, snapshot.focusPlayer);
+}
+
+// Returns the sequence to acknowledge, or nullopt for a delta older than
+// one already applied. Acknowledging noBaseline asks the server for a full
+// state because the referenced baseline is gone.
+auto handleDelta(ClientState &state, const Protocol::StateDeltaPacket &delta)
+    -> std::optional<std::uint32_t> {
+  if (state.newestDelta &&
+      !Protocol::isNewerSequence(delta.sequence, *state.newestDelta)) {
+    return std::nullopt;
+  }
+  std::span<const Protocol::PlayerState> baseline{};
+  if (delta.baseline != Protocol::noBaseline) {
+    const auto *stored = state.history.find(delta.baseline);
+    if (stored == nullptr) {
+      return Protocol::noBaseline;
+    }
+    baseline = *stored;
   }
 
-  std::scoped_lock guard{state.mutex};
-  state.players = std::move(updated);
-  if (snapshot.focusPlayer != 0) {
-    state.selfId = snapshot.focusPlayer;
+  if (!Protocol::applyDelta(baseline, delta, state.scratch)) {
+    return Protocol::noBaseline;
   }
+  state.history.store(delta.sequence, state.scratch);
+  state.newestDelta = delta.sequence;
+
+  recordState(state, state.scratch, delta.focusPlayer);
+  state.latest.lastProcessedInput = delta.lastProcessedInput;
+  return delta.sequence;
 }
 
-auto handleChat(ClientState &state, const Protocol::ChatPacket &chat) -> void {
-  ChatEntry entry{.player = chat.player, .message = chat.message};
-  std::scoped_lock guard{state.mutex};
-  state.chatLog.push_back(std::move(entry));
-  while (state.chatLog.size() > maxChatMessages) {
-    state.chatLog.pop_front();
+auto sendSnapshotAck(const std::shared_ptr<TcpSocket> &socket,
+                     std::uint32_t sequence, std::mutex &sendMutex)
+    -> SocketResult<void> {
+  auto encoded =
+      Protocol::encode(Protocol::SnapshotAckPacket{.sequence = sequence});
+  std::scoped_lock guard{sendMutex};
+  return socket->sendAll(std::span<const std::byte>{encoded});
+}
+
+auto handleChatBatch(ClientState &state,
+                     const Protocol::ChatBatchPacket &batch) -> void {
+  for (const auto &chat : batch.messages) {
+    state.latest.chatLog.push(chat.player, chat.channel, chat.message);
   }
+  ++state.latest.revision;
+  state.changed = true;
 }
 
 void recordSocketFailure(RuntimeContext &runtime, const std::string &message) {
@@ -364,107 +667,300 @@ auto handleInputKey(int inputKey, ChatUiState &chatState,
                                 runtime);
 }
 
-auto gatherRenderState(ClientState &state) -> RenderState {
-  RenderState render;
-  std::scoped_lock guard{state.mutex};
+struct DrawnFrame {
+  std::uint64_t revision{0};
+  bool settled{false};
+};
+
+[[nodiscard]] auto frameDue(const ClientState &state, DrawnFrame drawn)
+    -> bool {
+  return !drawn.settled || state.published.read()->revision != drawn.revision;
+}
+
+void gatherRenderState(const ReceivedState &received, ClientState &state,
+                       RenderState &render) {
+  // Moves the server has applied are in its position already; the rest are
+  // replayed so the own marker does not jump back while they are in flight.
+  std::erase_if(state.pendingInputs, [&received](const PendingInput &input) {
+    return input.sequence <= received.lastProcessedInput;
+  });
+
+  // Everyone else as they were a moment ago; the own player as predicted.
+  auto now = std::chrono::steady_clock::now();
+  received.remote.sample(now, render.snapshot);
+  render.settled = received.remote.settled(now);
+  if (received.selfId) {
+    std::erase_if(render.snapshot,
+                  [&received](const Protocol::PlayerState &player) {
+                    return player.player == *received.selfId;
+                  });
+    if (received.selfPosition) {
+      auto position = *received.selfPosition;
+      for (const auto &input : state.pendingInputs) {
+        Moonlapse::World::applyMovement(position, input.direction);
+      }
+      render.snapshot.push_back(Protocol::PlayerState{
+          .player = *received.selfId, .position = position});
+    }
+  }
 
-  render.snapshot.reserve(state.players.size());
-  for (const auto &[playerIdentifier, position] : state.players) {
-    render.snapshot.emplace_back(Protocol::PlayerState{
-        .player = playerIdentifier, .position = position});
+  render.selfId = received.selfId;
+  render.revision = received.revision;
+}
+
+// Caller holds receiveMutex.
+void publishChanges(ClientState &state, EventLoop &wakeups) {
+  if (state.changed) {
+    state.published.publish(
+        [&state](ReceivedState &spare) { spare = state.latest; });
+    state.changed = false;
+    wakeups.wake();
   }
+}
 
-  render.chatMessages.reserve(state.chatLog.size());
-  for (const auto &entry : state.chatLog) {
-    render.chatMessages.push_back(entry);
+// A datagram frame is dropped like a lost one when it does not decode: the
+// next state supersedes it anyway.
+[[nodiscard]] auto decodeDatagramDelta(std::span<const std::byte> bytes,
+                                       Protocol::PayloadInflater &inflater)
+    -> std::optional<Protocol::StateDeltaPacket> {
+  auto frame = Protocol::extractFrame(bytes);
+  if (!frame || !frame->has_value() || (*frame)->size() != bytes.size()) {
+    return std::nullopt;
+  }
+  auto inflated = inflater.inflate(**frame);
+  if (!inflated) {
+    return std::nullopt;
+  }
+  auto packet = Protocol::decodePacket(inflated->header, inflated->payload);
+  if (!packet) {
+    return std::nullopt;
+  }
+  auto *delta = std::get_if<Protocol::StateDeltaPacket>(&*packet);
+  if (delta == nullptr) {
+    return std::nullopt;
+  }
+  return std::move(*delta);
+}
+
+// Runs on the datagram thread whenever the UDP socket is readable. Only the
+// newest state of a burst is acknowledged, over TCP like the rest.
+void receiveDatagrams(DatagramChannel &channel,
+                      const std::shared_ptr<TcpSocket> &socket,
+                      ClientState &state, RuntimeContext &runtime,
+                      EventLoop &wakeups) {
+  std::array<std::byte, Datagram::maxDatagramSize> buffer{};
+  std::optional<std::uint32_t> ack;
+  {
+    std::scoped_lock guard{state.receiveMutex};
+    while (true) {
+      // Errors are left to the TCP connection, which still carries the rest.
+      auto received = channel.socket.receive(buffer);
+      if (!received) {
+        break;
+      }
+      auto frame =
+          channel.reassembler.accept(std::span{buffer}.first(*received));
+      if (!frame || !frame->has_value()) {
+        continue;
+      }
+      channel.flowing.store(true);
+      auto delta = decodeDatagramDelta(**frame, channel.inflater);
+      if (!delta) {
+        continue;
+      }
+      if (auto applied = handleDelta(state, *delta)) {
+        ack = applied;
+      }
+    }
+    publishChanges(state, wakeups);
   }
 
-  render.selfId = state.selfId;
-  return render;
+  // Sent unlocked: a full send buffer must not hold up the TCP receiver.
+  if (ack) {
+    if (auto result = sendSnapshotAck(socket, *ack, runtime.sendMutex.get());
+        !result) {
+      recordSocketFailure(runtime, result.error().message);
+      wakeups.wake();
+    }
+  }
+}
+
+// Opens the UDP side and hands its socket to the datagram loop. Failing
+// leaves the session on TCP, which the server falls back to by itself.
+auto openDatagrams(const Datagram::SetupPacket &setup,
+                   const std::shared_ptr<TcpSocket> &socket,
+                   ClientState &state, RuntimeContext &runtime,
+                   EventLoop &wakeups, EventLoop &datagramLoop)
+    -> std::shared_ptr<DatagramChannel> {
+  auto opened = UdpSocket::connect(serverAddress, setup.port);
+  if (!opened || !opened->setNonBlocking(true)) {
+    return nullptr;
+  }
+  auto channel = std::make_shared<DatagramChannel>();
+  channel->socket = std::move(*opened);
+  channel->hello =
+      Datagram::encodeHello(Datagram::HelloPacket{.token = setup.token});
+  static_cast<void>(channel->socket.send(channel->hello));
+
+  datagramLoop.post([channel, socket, &state, runtime, &wakeups,
+                     &datagramLoop]() mutable {
+    static_cast<void>(datagramLoop.watch(
+        channel->socket.nativeHandle(), IoInterest::Readable,
+        [channel, socket, &state, runtime, &wakeups](IoEvent) mutable {
+          receiveDatagrams(*channel, socket, state, runtime, wakeups);
+        }));
+  });
+  return channel;
 }
 
 void receiverLoop(const std::shared_ptr<TcpSocket> &socket, ClientState &state,
                   std::atomic_bool &running, std::atomic_bool &connectionActive,
-                  std::mutex &errorMutex, std::string &lastError) {
+                  std::mutex &errorMutex, std::string &lastError,
+                  std::mutex &sendMutex, EventLoop &wakeups,
+                  EventLoop *datagramLoop) {
+  Moonlapse::Net::ReceiveBuffer buffer;
+  Protocol::PayloadInflater inflater;
+  RuntimeContext runtime{sendMutex, errorMutex, lastError, running,
+                         connectionActive};
+  std::shared_ptr<DatagramChannel> datagrams;
   while (running.load()) {
-    auto headerBytes = socket->receiveExact(Protocol::packetHeaderSize);
-    if (!headerBytes) {
-      {
-        std::scoped_lock guard{errorMutex};
-        lastError = headerBytes.error().message;
+    auto received = socket->receive(buffer.writable(receiveChunkSize));
+    if (!received) {
+      if (!running.load()) {
+        // Shut down by the main loop on the way out.
+        return;
       }
-      connectionActive.store(false);
-      running.store(false);
-      return;
-    }
-
-    auto &headerBuffer = headerBytes.value();
-    auto headerResult =
-        Protocol::decodeHeader(std::span<const std::byte>{headerBuffer});
-    if (!headerResult) {
       {
         std::scoped_lock guard{errorMutex};
-        lastError = std::string{describePacketError(headerResult.error())};
+        lastError = received.error().message;
       }
       connectionActive.store(false);
       running.store(false);
       return;
     }
+    buffer.commit(received.value());
+
+    // Only the newest delta of a read is acknowledged, after the lock is
+    // released, so a full send buffer does not hold up the datagram thread.
+    std::optional<std::uint32_t> ack;
+    std::unique_lock guard{state.receiveMutex};
+    while (true) {
+      auto frameResult = Protocol::extractFrame(buffer.readable());
+      if (!frameResult) {
+        {
+          std::scoped_lock guard{errorMutex};
+          lastError = std::string{describePacketError(frameResult.error())};
+        }
+        connectionActive.store(false);
+        running.store(false);
+        return;
+      }
+      if (!frameResult->has_value()) {
+        break;
+      }
 
-    auto packetHeader = headerResult.value();
-    auto payloadBytes = socket->receiveExact(packetHeader.payloadSize);
-    if (!payloadBytes) {
-      {
-        std::scoped_lock guard{errorMutex};
-        lastError = payloadBytes.error().message;
+      auto frame = **frameResult;
+      // The UDP offer is not a packet the rest of the client deals with.
+      if (frame.header.type == Protocol::PacketType::DatagramSetup) {
+        auto setup = Datagram::decodeSetup(frame.payload);
+        if (setup && datagramLoop != nullptr && !datagrams) {
+          datagrams = openDatagrams(*setup, socket, state, runtime, wakeups,
+                                    *datagramLoop);
+        }
+        buffer.consume(frame.size());
+        continue;
       }
-      connectionActive.store(false);
-      running.store(false);
-      return;
+      auto inflated = inflater.inflate(frame);
+      auto packetResult =
+          inflated
+              ? Protocol::decodePacket(inflated->header, inflated->payload)
+              : Protocol::PacketResult<Protocol::PacketVariant>{
+                    std::unexpected(inflated.error())};
+      if (!packetResult) {
+        {
+          std::scoped_lock guard{errorMutex};
+          lastError = std::string{describePacketError(packetResult.error())};
+        }
+        connectionActive.store(false);
+        running.store(false);
+        return;
+      }
+
+      std::visit(
+          Overloaded{[&](const Protocol::StateSnapshotPacket &snapshot) {
+                       handleSnapshot(state, snapshot);
+                     },
+                     [](const Protocol::MovementPacket &) {
+                       // Movement updates are broadcast as state
+                       // snapshots; ignore stray packets.
+                     },
+                     [](const Protocol::ChatPacket &) {
+                       // The server hands chat out in batches.
+                     },
+                     [&](const Protocol::ChatBatchPacket &batch) {
+                       handleChatBatch(state, batch);
+                     },
+                     [](const Protocol::ChatSubscriptionPacket &) {
+                       // Subscriptions only flow client to server.
+                     },
+                     [&](const Protocol::StateDeltaPacket &delta) {
+                       if (datagrams && !datagrams->flowing.load()) {
+                         static_cast<void>(
+                             datagrams->socket.send(datagrams->hello));
+                       }
+                       if (auto applied = handleDelta(state, delta)) {
+                         ack = applied;
+                       }
+                     },
+                     [](const Protocol::SnapshotAckPacket &) {
+                       // Acknowledgements only flow client to server.
+                     },
+                     [](const Protocol::CapabilitiesPacket &) {
+                       // Each delta's header says how it was encoded, so
+                       // the server's answer needs no bookkeeping.
+                     }},
+          packetResult.value());
+      buffer.consume(frame.size());
     }
 
-    auto &payloadBuffer = payloadBytes.value();
-    auto packetResult = Protocol::decodePacket(
-        packetHeader, std::span<const std::byte>{payloadBuffer});
-    if (!packetResult) {
-      {
-        std::scoped_lock guard{errorMutex};
-        lastError = std::string{describePacketError(packetResult.error())};
+    // One publication and one wakeup per read, however many packets it
+    // carried.
+    publishChanges(state, wakeups);
+    guard.unlock();
+
+    if (ack) {
+      if (auto result = sendSnapshotAck(socket, *ack, sendMutex); !result) {
+        {
+          std::scoped_lock errorGuard{errorMutex};
+          lastError = result.error().message;
+        }
+        connectionActive.store(false);
+        running.store(false);
+        return;
       }
-      connectionActive.store(false);
-      running.store(false);
-      return;
     }
-
-    std::visit(Overloaded{[&](const Protocol::StateSnapshotPacket &snapshot) {
-                            handleSnapshot(state, snapshot);
-                          },
-                          [](const Protocol::MovementPacket &) {
-                            // Movement updates are broadcast as state
-                            // snapshots; ignore stray packets.
-                          },
-                          [&](const Protocol::ChatPacket &chat) {
-                            handleChat(state, chat);
-                          }},
-               packetResult.value());
   }
 }
 
 auto sendMovement(const std::shared_ptr<TcpSocket> &socket, ClientState &state,
                   Protocol::Direction direction, std::mutex &sendMutex)
     -> SocketResult<void> {
-  std::optional<Protocol::PlayerId> playerIdentifier;
-  {
-    std::scoped_lock guard{state.mutex};
-    playerIdentifier = state.selfId;
-  }
-
-  if (!playerIdentifier) {
+  auto selfId = state.published.read()->selfId;
+  if (!selfId) {
     return {};
   }
+  Protocol::MovementPacket packet{.player = *selfId,
+                                  .direction = direction,
+                                  .sequence = ++state.lastInput};
+
+  // Shown on the next frame rather than a round trip later;
+  // gatherRenderState reconciles once the server has processed it.
+  state.pendingInputs.push_back(
+      PendingInput{.sequence = packet.sequence, .direction = direction});
+  if (state.pendingInputs.size() > maxPendingInputs) {
+    state.pendingInputs.pop_front();
+  }
 
-  Protocol::MovementPacket packet{.player = *playerIdentifier,
-                                  .direction = direction};
   auto encoded = Protocol::encode(packet);
   std::scoped_lock guard{sendMutex};
   return socket->sendAll(std::span<const std::byte>{encoded});
@@ -477,17 +973,25 @@ auto sendChat(const std::shared_ptr<TcpSocket> &socket, ClientState &state,
     return {};
   }
 
-  std::optional<Protocol::PlayerId> playerIdentifier;
-  {
-    std::scoped_lock guard{state.mutex};
-    playerIdentifier = state.selfId;
+  auto playerIdentifier = state.published.read()->selfId;
+  if (!playerIdentifier) {
+    return {};
   }
 
-  if (!playerIdentifier) {
+  auto channel = Protocol::ChatChannel::World;
+  for (const auto &option : channelPrefixes) {
+    if (message.starts_with(option.prefix)) {
+      channel = option.channel;
+      message.remove_prefix(option.prefix.size());
+      break;
+    }
+  }
+  if (message.empty()) {
     return {};
   }
 
   Protocol::ChatPacket packet{.player = *playerIdentifier,
+                              .channel = channel,
                               .message = std::string{message}};
   auto encoded = Protocol::encode(packet);
   std::scoped_lock guard{sendMutex};
@@ -496,7 +1000,17 @@ auto sendChat(const std::shared_ptr<TcpSocket> &socket, ClientState &state,
 
 } // namespace
 
-auto main() -> int {
+auto main(int argc, char **argv) -> int {
+  auto configResult = parseClientConfig(
+      std::span<char *const>{argv, static_cast<std::size_t>(argc)});
+  if (!configResult) {
+    std::println("[client] {}", configResult.error());
+    std::println(
+        "[client] usage: moonlapse_client [--max-fps FPS] [--udp on|off]");
+    return 1;
+  }
+  const auto config = configResult.value();
+
   auto socketResult = TcpSocket::connect(serverAddress, serverPort);
   if (!socketResult) {
     std::println("[client] failed to connect: {}",
@@ -506,6 +1020,49 @@ auto main() -> int {
 
   auto connection =
       std::make_shared<TcpSocket>(std::move(socketResult.value()));
+  // Offered unconditionally: any server speaking this protocolVersion
+  // understands it, and older ones reject the version before the type.
+  auto offer = Protocol::encode(Protocol::CapabilitiesPacket{
+      .capabilities =
+          Protocol::compactEntitiesCapability |
+          Protocol::compressionCapability |
+          (config.datagrams ? Protocol::datagramCapability : 0U)});
+  if (auto offered = connection->sendAll(std::span<const std::byte>{offer});
+      !offered) {
+    std::println("[client] failed to send capabilities: {}",
+                 offered.error().message);
+    return 1;
+  }
+  // The main loop sleeps until a key is pressed or the receiver has news,
+  // instead of polling the keyboard on a timer.
+  auto wakeupsResult = EventLoop::create();
+  if (!wakeupsResult) {
+    std::println("[client] failed to create event loop: {}",
+                 wakeupsResult.error().message);
+    return 1;
+  }
+  auto &wakeups = **wakeupsResult;
+  // Datagrams are read on a thread of their own, since the receiver blocks
+  // on the TCP socket.
+  std::unique_ptr<EventLoop> datagramLoop;
+  if (config.datagrams) {
+    auto created = EventLoop::create();
+    if (!created) {
+      std::println("[client] failed to create event loop: {}",
+                   created.error().message);
+      return 1;
+    }
+    datagramLoop = std::move(*created);
+  }
+#ifndef _WIN32
+  if (auto watched =
+          wakeups.watch(STDIN_FILENO, IoInterest::Readable, [](IoEvent) {});
+      !watched) {
+    std::println("[client] failed to watch the terminal: {}",
+                 watched.error().message);
+    return 1;
+  }
+#endif
   std::string lastError;
 
   {
@@ -521,38 +1078,102 @@ auto main() -> int {
     std::mutex errorMutex;
     std::mutex sendMutex;
 
-    std::jthread receiver(receiverLoop, connection, std::ref(state),
-                          std::ref(running), std::ref(connectionActive),
-                          std::ref(errorMutex), std::ref(lastError));
+    std::jthread receiver([&] {
+      receiverLoop(connection, state, running, connectionActive, errorMutex,
+                   lastError, sendMutex, wakeups, datagramLoop.get());
+      wakeups.wake();
+    });
+    std::jthread datagramThread;
+    if (datagramLoop) {
+      // A loop that fails stops the acknowledgements, and with them the
+      // server's datagrams; the TCP connection carries on.
+      datagramThread = std::jthread([&](const std::stop_token &stopToken) {
+        static_cast<void>(datagramLoop->run(stopToken));
+      });
+    }
 
     ChatUiState chatState;
+    FrameRenderer renderer;
+    RenderState render;
+    DrawnFrame drawn{.revision = 0, .settled = false};
     RuntimeContext runtime{sendMutex, errorMutex, lastError, running,
                            connectionActive};
 
-    while (running.load()) {
-      if (!connectionActive.load()) {
+    using Clock = std::chrono::steady_clock;
+    const auto frameInterval =
+        std::chrono::duration_cast<Clock::duration>(std::chrono::seconds{1}) /
+        config.frameRate;
+    auto nextFrame = Clock::now();
+    bool frameWanted = false;
+
+    while (running.load() && connectionActive.load()) {
+      // Keys are acted on as soon as they arrive; only drawing is paced.
+      bool stop = false;
+      while (!stop) {
+        auto inputKey = getch();
+        if (inputKey == ERR) {
+          break;
+        }
+        if (inputKey == KEY_RESIZE) {
+          renderer.invalidate();
+        }
+        stop = handleInputKey(inputKey, chatState, connection, state,
+                              runtime) == LoopAction::Stop;
+        frameWanted = true;
+      }
+      if (stop) {
         break;
       }
 
-      auto inputKey = getch();
-      if (handleInputKey(inputKey, chatState, connection, state, runtime) ==
-          LoopAction::Stop) {
-        break;
+      // Frames with no input, no news from the server and nothing still
+      // gliding into place would repaint exactly what is already there.
+      frameWanted = frameWanted || frameDue(state, drawn);
+      auto now = Clock::now();
+      if (frameWanted && now >= nextFrame) {
+        {
+          // Pinned only while painting: a flush to a slow terminal must not
+          // hold up the receiver's next publication.
+          auto received = state.published.read();
+          gatherRenderState(*received, state, render);
+          renderer.paint(render, received->chatLog, chatState);
+        }
+        FrameRenderer::flush();
+        drawn = {.revision = render.revision, .settled = render.settled};
+        frameWanted = false;
+        nextFrame = now + frameInterval;
       }
 
-      auto renderState = gatherRenderState(state);
-      drawFrame(renderState.snapshot, renderState.selfId,
-                std::span<const ChatEntry>{renderState.chatMessages},
-                chatState);
-      std::this_thread::sleep_for(refreshDelay);
+      auto timeout = Moonlapse::Net::waitForever;
+      if (frameWanted || !drawn.settled) {
+        timeout = std::chrono::ceil<std::chrono::milliseconds>(
+            std::max(nextFrame - Clock::now(), Clock::duration::zero()));
+      }
+#ifdef _WIN32
+      // WSAPoll only takes sockets, so keys are picked up on the frame timer.
+      const auto keyPollInterval =
+          std::chrono::ceil<std::chrono::milliseconds>(frameInterval);
+      if (timeout == Moonlapse::Net::waitForever ||
+          timeout > keyPollInterval) {
+        timeout = keyPollInterval;
+      }
+#endif
+      if (auto waited = wakeups.runOnce(timeout); !waited) {
+        recordSocketFailure(runtime, waited.error().message);
+        break;
+      }
     }
 
     running.store(false);
     connectionActive.store(false);
+    // Unblocks the receiver, which may be waiting on a quiet server.
+    connection->shutdown();
     receiver.request_stop();
     receiver.join();
+    if (datagramThread.joinable()) {
+      datagramThread.request_stop();
+      datagramThread.join();
+    }
 
-    connection->shutdown();
     connection->close();
   }
 
@@ -0,0 +1,668 @@
+#include "logging.hpp"
+#include "network.hpp"
+#include "packets.hpp"
+#include "world.hpp"
+#include "zone_link.hpp"
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <expected>
+#include <format>
+#include <memory>
+#include <optional>
+#include <print>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+using Moonlapse::Net::EventLoop;
+using Moonlapse::Net::Frame;
+using Moonlapse::Net::FrameBuffer;
+using Moonlapse::Net::FrameKind;
+using Moonlapse::Net::IoEvent;
+using Moonlapse::Net::IoInterest;
+using Moonlapse::Net::OutboundPolicy;
+using Moonlapse::Net::SocketResult;
+using Moonlapse::Net::TcpConnection;
+using Moonlapse::Net::TcpListener;
+using Moonlapse::Net::TcpSocket;
+using Moonlapse::World::EntityHandle;
+using Moonlapse::World::PlayerStore;
+
+namespace Logging = Moonlapse::Logging;
+namespace Protocol = Moonlapse::Protocol;
+namespace ZoneLink = Moonlapse::ZoneLink;
+
+namespace {
+
+constexpr std::uint16_t defaultGatewayPort = 40500;
+constexpr std::size_t defaultMaxQueuedBytes = std::size_t{1} << 20;
+// Per-second caps on log lines a misbehaving client can trigger.
+constexpr std::uint32_t clientWarningsPerSecond = 20;
+constexpr std::uint32_t sessionEventsPerSecond = 50;
+
+struct ZoneAddress {
+  std::string host;
+  std::uint16_t port{};
+};
+
+struct GatewayConfig {
+  std::uint16_t port{defaultGatewayPort};
+  // Zone i serves the i-th strip of the map and must run with --zone i/N.
+  std::vector<ZoneAddress> zones;
+};
+
+template <typename T>
+[[nodiscard]] auto parseNumber(std::string_view text) -> std::optional<T> {
+  T value{};
+  const auto *first = text.data();
+  const auto *last = text.data() + text.size();
+  auto [position, error] = std::from_chars(first, last, value);
+  if (error != std::errc{} || position != last) {
+    return std::nullopt;
+  }
+  return value;
+}
+
+[[nodiscard]] auto parseGatewayConfig(std::span<char *const> arguments)
+    -> std::expected<GatewayConfig, std::string> {
+  GatewayConfig config{};
+  for (std::size_t index = 1; index < arguments.size(); ++index) {
+    std::string_view option{arguments[index]};
+    if (index + 1 >= arguments.size()) {
+      return std::unexpected(std::format("missing value for '{}'", option));
+    }
+    std::string_view value{arguments[++index]};
+
+    if (option == "--port") {
+      auto port = parseNumber<std::uint16_t>(value);
+      if (!port || *port == 0) {
+        return std::unexpected(std::string{"--port expects 1-65535"});
+      }
+      config.port = *port;
+      continue;
+    }
+
+    if (option == "--zone") {
+      auto separator = value.rfind(':');
+      auto port = separator == std::string_view::npos
+                      ? std::nullopt
+                      : parseNumber<std::uint16_t>(value.substr(separator + 1));
+      if (!port || *port == 0 || separator == 0) {
+        return std::unexpected(std::string{"--zone expects HOST:PORT"});
+      }
+      config.zones.push_back(ZoneAddress{
+          .host = std::string{value.substr(0, separator)}, .port = *port});
+      continue;
+    }
+
+    return std::unexpected(std::format("unknown option '{}'", option));
+  }
+
+  if (config.zones.empty()) {
+    return std::unexpected(std::string{"at least one --zone is required"});
+  }
+  if (config.zones.size() >
+      static_cast<std::size_t>(Moonlapse::World::gridWidth)) {
+    return std::unexpected(std::format("at most {} zones are supported",
+                                       Moonlapse::World::gridWidth));
+  }
+  return config;
+}
+
+[[nodiscard]] auto describePacketError(Protocol::PacketError error)
+    -> std::string_view {
+  using Protocol::PacketError;
+  switch (error) {
+  case PacketError::VersionMismatch:
+    return "version mismatch";
+  case PacketError::UnknownType:
+    return "unknown packet type";
+  case PacketError::Truncated:
+    return "truncated payload";
+  case PacketError::SizeMismatch:
+    return "size mismatch";
+  case PacketError::InvalidPayload:
+    return "invalid payload";
+  case PacketError::PayloadTooLarge:
+    return "payload too large";
+  }
+  return "unclassified error";
+}
+
+[[nodiscard]] auto copyFrame(const Protocol::FrameView &view,
+                             std::span<const std::byte> buffer) -> Frame {
+  auto bytes = buffer.first(view.size());
+  FrameBuffer copy;
+  copy.storage().assign(bytes.begin(), bytes.end());
+  return Frame{std::move(copy)};
+}
+
+// Terminates client connections and relays each player to the zone server
+// that owns the strip they stand in. Clients keep speaking the plain
+// protocol; zone servers see one upstream connection per player that starts
+// with a ZoneEnter. When a zone reports a handoff, the player's upstream is
+// moved to the neighbouring zone. World and trade chat is batched here so
+// it reaches every zone; local chat goes to the speaker's zone, which knows
+// who is in earshot. Everything runs on one event loop thread, so zone
+// connections are made without blocking it.
+class Gateway {
+public:
+  Gateway(TcpListener listener, std::unique_ptr<EventLoop> eventLoop,
+          GatewayConfig gatewayConfig)
+      : listener{std::move(listener)}, loop{std::move(eventLoop)},
+        config{std::move(gatewayConfig)},
+        layout{Moonlapse::World::gridWidth, config.zones.size()} {}
+
+  void run() {
+    loopThread = std::jthread{[this](const std::stop_token &stopToken) {
+      if (auto result = loop->run(stopToken); !result) {
+        log.error("event loop stopped: {}", result.error().message);
+      }
+    }};
+
+    log.info("routing players across {} zone(s)...", config.zones.size());
+    while (true) {
+      auto connection = listener.accept();
+      if (!connection) {
+        log.write(socketWarnings, Logging::Level::Warning, "accept failed: {}",
+                  connection.error().message);
+        continue;
+      }
+      auto socket = std::move(connection.value());
+      if (auto nonBlocking = socket.setNonBlocking(true); !nonBlocking) {
+        log.write(socketWarnings, Logging::Level::Warning,
+                  "dropping connection: {}", nonBlocking.error().message);
+        continue;
+      }
+      static_cast<void>(socket.setNoDelay(true));
+
+      auto route = std::make_shared<Route>(std::move(socket), policy);
+      loop->post([this, route]() { admit(route); });
+    }
+  }
+
+private:
+  struct Route {
+    Route(TcpSocket &&socket, OutboundPolicy outbound) noexcept
+        : client{std::move(socket), outbound} {}
+
+    TcpConnection client;
+    std::optional<TcpConnection> zone;
+    // Until the zone's socket turns writable; what goes upstream meanwhile
+    // waits in its queue.
+    bool zoneConnecting{false};
+    std::size_t zoneIndex{};
+    EntityHandle entity{};
+    Protocol::PlayerId player{};
+    // The client's last capability offer and chat subscription, replayed to
+    // every zone it enters.
+    Frame capabilities;
+    Frame chatSubscription;
+    std::uint32_t chatChannels{Protocol::allChatChannels};
+    bool closed{false};
+  };
+
+  void admit(const std::shared_ptr<Route> &route) {
+    route->entity = players.allocate();
+    route->player = PlayerStore::idOf(route->entity);
+    auto position = Moonlapse::World::spawnPosition(route->player);
+    static_cast<void>(players.spawn(route->entity, position));
+    routes.push_back(route);
+
+    auto handle = route->client.socket().nativeHandle();
+    auto watched = loop->watch(
+        handle, IoInterest::Readable,
+        [this, route](IoEvent event) { handleClientEvent(route, event); });
+    if (!watched) {
+      log.write(socketWarnings, Logging::Level::Warning,
+                "watch failed for player {}: {}", route->player,
+                watched.error().message);
+      closeRoute(route);
+      return;
+    }
+
+    if (!enterZone(route, ZoneLink::TransferPacket{
+                              .player = route->player,
+                              .position = position,
+                              .sequence = Protocol::noBaseline})) {
+      closeRoute(route);
+      return;
+    }
+    log.write(sessionEvents, Logging::Level::Info,
+              "player {} connected, routed to zone {}", route->player,
+              route->zoneIndex);
+  }
+
+  // Starts the player's upstream to whichever zone owns the position. The
+  // ZoneEnter and replayed settings are queued now and sent once
+  // finishZoneConnect sees the connection up.
+  auto enterZone(const std::shared_ptr<Route> &route,
+                 const ZoneLink::TransferPacket &transfer) -> bool {
+    route->zoneIndex = layout.zoneOf(transfer.position);
+    const auto &address = config.zones[route->zoneIndex];
+    auto socket = TcpSocket::startConnect(address.host, address.port);
+    if (!socket) {
+      log.write(socketWarnings, Logging::Level::Warning,
+                "zone {} at {}:{} unreachable: {}", route->zoneIndex,
+                address.host, address.port, socket.error().message);
+      return false;
+    }
+    static_cast<void>(socket->setNoDelay(true));
+    route->zone.emplace(std::move(socket.value()), policy);
+    route->zoneConnecting = true;
+
+    auto handle = route->zone->socket().nativeHandle();
+    auto watched = loop->watch(
+        handle, IoInterest::Writable,
+        [this, route](IoEvent event) { handleZoneEvent(route, event); });
+    if (!watched) {
+      log.write(socketWarnings, Logging::Level::Warning,
+                "watch failed for zone {}: {}", route->zoneIndex,
+                watched.error().message);
+      route->zone.reset();
+      return false;
+    }
+
+    auto &zone = *route->zone;
+    return zone.queue(ZoneLink::encodeEnter(transfer)).has_value() &&
+           zone.queue(route->capabilities).has_value() &&
+           zone.queue(route->chatSubscription).has_value();
+  }
+
+  auto finishZoneConnect(Route &route) -> bool {
+    route.zoneConnecting = false;
+    if (auto connected = route.zone->socket().finishConnect(); !connected) {
+      const auto &address = config.zones[route.zoneIndex];
+      log.write(socketWarnings, Logging::Level::Warning,
+                "zone {} at {}:{} unreachable: {}", route.zoneIndex,
+                address.host, address.port, connected.error().message);
+      return false;
+    }
+    if (auto result = flush(*route.zone); !result) {
+      log.write(socketWarnings, Logging::Level::Warning,
+                "send to zone {} failed: {}", route.zoneIndex,
+                result.error().message);
+      return false;
+    }
+    return true;
+  }
+
+  void leaveZone(Route &route) {
+    if (!route.zone) {
+      return;
+    }
+    loop->unwatch(route.zone->socket().nativeHandle());
+    route.zone->socket().shutdown();
+    route.zone->socket().close();
+    route.zone.reset();
+    route.zoneConnecting = false;
+  }
+
+  // Queues the frame and writes as much as the socket takes right away; the
+  // rest goes out when the socket reports writable.
+  auto deliver(TcpConnection &connection, Frame frame,
+               FrameKind kind = FrameKind::Reliable) -> bool {
+    if (auto queued = connection.queue(std::move(frame), kind); !queued) {
+      log.write(socketWarnings, Logging::Level::Warning, "send failed: {}",
+                queued.error().message);
+      return false;
+    }
+    return flush(connection).has_value();
+  }
+
+  // A zone connection still being made takes frames into its queue but
+  // cannot be written to yet.
+  auto queueUpstream(Route &route, Frame frame) -> bool {
+    if (auto queued = route.zone->queue(std::move(frame)); !queued) {
+      log.write(socketWarnings, Logging::Level::Warning,
+                "send to zone {} failed: {}", route.zoneIndex,
+                queued.error().message);
+      return false;
+    }
+    return true;
+  }
+
+  auto flush(TcpConnection &connection) -> SocketResult<void> {
+    auto flushed = connection.flush();
+    if (!flushed) {
+      return std::unexpected(flushed.error());
+    }
+    auto interest = flushed.value()
+                        ? IoInterest::Readable
+                        : IoInterest::Readable | IoInterest::Writable;
+    return loop->modify(connection.socket().nativeHandle(), interest);
+  }
+
+  void handleClientEvent(const std::shared_ptr<Route> &route, IoEvent event) {
+    if (event.writable) {
+      if (auto result = flush(route->client); !result) {
+        log.write(socketWarnings, Logging::Level::Warning,
+                  "send failed for player {}: {}", route->player,
+                  result.error().message);
+        closeRoute(route);
+        return;
+      }
+    }
+    if (event.readable || event.hangup) {
+      readClient(route);
+    }
+  }
+
+  void readClient(const std::shared_ptr<Route> &route) {
+    auto &connection = route->client;
+    if (auto filled = connection.fill(); !filled) {
+      log.write(socketWarnings, Logging::Level::Warning,
+                "receive failed for player {}: {}", route->player,
+                filled.error().message);
+      closeRoute(route);
+      return;
+    }
+
+    while (true) {
+      auto frameResult = Protocol::extractFrame(connection.received());
+      if (!frameResult) {
+        log.write(protocolWarnings, Logging::Level::Warning,
+                  "packet header error for player {}: {}", route->player,
+                  describePacketError(frameResult.error()));
+        closeRoute(route);
+        return;
+      }
+      if (!frameResult->has_value()) {
+        break;
+      }
+
+      auto frame = **frameResult;
+      if (!relayFromClient(route, frame)) {
+        closeRoute(route);
+        return;
+      }
+      if (route->closed) {
+        // A failed chat fan-out can close the sender too.
+        return;
+      }
+      connection.consume(frame.size());
+    }
+
+    if (connection.peerClosed()) {
+      closeRoute(route);
+    }
+  }
+
+  auto relayFromClient(const std::shared_ptr<Route> &route,
+                       const Protocol::FrameView &frame) -> bool {
+    if (ZoneLink::isZoneLink(frame.header.type)) {
+      log.write(protocolWarnings, Logging::Level::Warning,
+                "player {} sent a zone link packet", route->player);
+      return false;
+    }
+
+    if (frame.header.type == Protocol::PacketType::Chat) {
+      auto chat = Protocol::viewChat(frame.payload);
+      if (!chat) {
+        log.write(protocolWarnings, Logging::Level::Warning,
+                  "packet decode error for player {}: {}", route->player,
+                  describePacketError(chat.error()));
+        return false;
+      }
+      if (chat->player != route->player) {
+        log.write(spoofWarnings, Logging::Level::Warning,
+                  "ignoring spoofed chat for player {}", route->player);
+        return true;
+      }
+      if (chat->channel != Protocol::ChatChannel::Local) {
+        queueChat(*chat);
+        return true;
+      }
+    }
+
+    auto copy = copyFrame(frame, route->client.received());
+    if (frame.header.type == Protocol::PacketType::Capabilities) {
+      route->capabilities = copy;
+    }
+    if (frame.header.type == Protocol::PacketType::ChatSubscription) {
+      auto subscription =
+          Protocol::decodeFixed<Protocol::ChatSubscriptionPacket>(
+              frame.payload);
+      if (!subscription) {
+        log.write(protocolWarnings, Logging::Level::Warning,
+                  "packet decode error for player {}: {}", route->player,
+                  describePacketError(subscription.error()));
+        return false;
+      }
+      route->chatChannels = subscription->channels;
+      route->chatSubscription = copy;
+    }
+    // Input sent mid-handoff has nowhere to go; the client resends state
+    // changes as the player keeps moving.
+    if (!route->zone) {
+      return true;
+    }
+    // Held behind the ZoneEnter until finishZoneConnect flushes the queue.
+    if (route->zoneConnecting) {
+      return queueUpstream(*route, std::move(copy));
+    }
+    return deliver(*route->zone, std::move(copy));
+  }
+
+  // Messages that arrive in the same loop round go out together.
+  void queueChat(const Protocol::ChatView &chat) {
+    if (pendingChat.empty()) {
+      loop->post([this]() { broadcastChat(); });
+    }
+    pendingChat.push_back(
+        Protocol::ChatPacket{.player = chat.player,
+                             .channel = chat.channel,
+                             .message = std::string{chat.message}});
+  }
+
+  // What a route hears depends only on its subscription, so each distinct
+  // one is encoded once.
+  void broadcastChat() {
+    std::array<std::optional<std::vector<Frame>>,
+               std::size_t{Protocol::allChatChannels} + 1>
+        encoded;
+    std::vector<std::shared_ptr<Route>> failed;
+    for (const auto &recipient : routes) {
+      auto &batches = encoded[recipient->chatChannels];
+      if (!batches) {
+        chatViews.clear();
+        for (const auto &message : pendingChat) {
+          if ((recipient->chatChannels &
+               Protocol::channelBit(message.channel)) != 0) {
+            chatViews.push_back(Protocol::ChatView{.player = message.player,
+                                                   .channel = message.channel,
+                                                   .message = message.message});
+          }
+        }
+        batches.emplace();
+        if (!chatViews.empty()) {
+          *batches = Protocol::encodeChatBatches(chatViews);
+        }
+      }
+      for (const auto &batch : *batches) {
+        if (!deliver(recipient->client, batch)) {
+          failed.push_back(recipient);
+          break;
+        }
+      }
+    }
+    pendingChat.clear();
+    for (const auto &route : failed) {
+      closeRoute(route);
+    }
+  }
+
+  void handleZoneEvent(const std::shared_ptr<Route> &route, IoEvent event) {
+    if (!route->zone) {
+      return;
+    }
+    if (route->zoneConnecting) {
+      if ((event.writable || event.hangup) && !finishZoneConnect(*route)) {
+        closeRoute(route);
+      }
+      return;
+    }
+    if (event.writable) {
+      if (auto result = flush(*route->zone); !result) {
+        log.write(socketWarnings, Logging::Level::Warning,
+                  "send to zone {} failed: {}", route->zoneIndex,
+                  result.error().message);
+        closeRoute(route);
+        return;
+      }
+    }
+    if (event.readable || event.hangup) {
+      readZone(route);
+    }
+  }
+
+  void readZone(const std::shared_ptr<Route> &route) {
+    auto &connection = *route->zone;
+    if (auto filled = connection.fill(); !filled) {
+      log.write(socketWarnings, Logging::Level::Warning,
+                "zone {} receive failed for player {}: {}", route->zoneIndex,
+                route->player, filled.error().message);
+      closeRoute(route);
+      return;
+    }
+
+    while (true) {
+      auto frameResult = Protocol::extractFrame(connection.received());
+      if (!frameResult) {
+        log.write(protocolWarnings, Logging::Level::Warning,
+                  "zone {} packet header error: {}", route->zoneIndex,
+                  describePacketError(frameResult.error()));
+        closeRoute(route);
+        return;
+      }
+      if (!frameResult->has_value()) {
+        break;
+      }
+
+      auto frame = **frameResult;
+      if (frame.header.type == Protocol::PacketType::ZoneHandoff) {
+        // Moving to the next zone drops this connection and its buffer.
+        handOff(route, frame);
+        return;
+      }
+
+      auto kind = frame.header.type == Protocol::PacketType::StateDelta
+                      ? FrameKind::Latest
+                      : FrameKind::Reliable;
+      if (!deliver(route->client, copyFrame(frame, connection.received()),
+                   kind)) {
+        closeRoute(route);
+        return;
+      }
+      connection.consume(frame.size());
+    }
+
+    if (connection.peerClosed()) {
+      log.write(sessionEvents, Logging::Level::Info,
+                "zone {} dropped player {}", route->zoneIndex, route->player);
+      closeRoute(route);
+    }
+  }
+
+  void handOff(const std::shared_ptr<Route> &route,
+               const Protocol::FrameView &frame) {
+    auto transfer = ZoneLink::decodeTransfer(frame.payload);
+    if (!transfer || transfer->player != route->player) {
+      log.write(protocolWarnings, Logging::Level::Warning,
+                "zone {} sent a bad handoff for player {}", route->zoneIndex,
+                route->player);
+      closeRoute(route);
+      return;
+    }
+
+    auto previousZone = route->zoneIndex;
+    leaveZone(*route);
+    if (!enterZone(route, *transfer)) {
+      closeRoute(route);
+      return;
+    }
+    log.write(sessionEvents, Logging::Level::Info,
+              "player {} handed from zone {} to zone {}", route->player,
+              previousZone, route->zoneIndex);
+  }
+
+  void closeRoute(const std::shared_ptr<Route> &route) {
+    if (route->closed) {
+      return;
+    }
+    route->closed = true;
+    leaveZone(*route);
+    loop->unwatch(route->client.socket().nativeHandle());
+    route->client.socket().shutdown();
+    route->client.socket().close();
+    static_cast<void>(players.release(route->entity));
+    std::erase(routes, route);
+    log.write(sessionEvents, Logging::Level::Info, "player {} disconnected",
+              route->player);
+  }
+
+  Logging::Logger log{"gateway"};
+  Logging::Throttle protocolWarnings{clientWarningsPerSecond};
+  Logging::Throttle socketWarnings{clientWarningsPerSecond};
+  Logging::Throttle spoofWarnings{clientWarningsPerSecond};
+  Logging::Throttle sessionEvents{sessionEventsPerSecond};
+  TcpListener listener;
+  std::unique_ptr<EventLoop> loop;
+  GatewayConfig config;
+  Moonlapse::World::ZoneLayout layout;
+  OutboundPolicy policy{.coalesceLatest = true,
+                        .maxPendingBytes = defaultMaxQueuedBytes};
+  // Loop thread only. Used to hand out player ids, which every zone claims
+  // as given.
+  PlayerStore players;
+  std::vector<std::shared_ptr<Route>> routes;
+  std::vector<Protocol::ChatPacket> pendingChat;
+  std::vector<Protocol::ChatView> chatViews;
+  std::jthread loopThread;
+};
+
+} // namespace
+
+auto main(int argc, char **argv) -> int {
+  auto configResult = parseGatewayConfig(
+      std::span<char *const>{argv, static_cast<std::size_t>(argc)});
+  if (!configResult) {
+    std::println("[gateway] {}", configResult.error());
+    std::println("[gateway] usage: moonlapse_gateway --zone HOST:PORT "
+                 "[--zone HOST:PORT ...] [--port PORT]");
+    return 1;
+  }
+  auto config = std::move(configResult.value());
+
+  constexpr std::string_view listenAddress = "0.0.0.0";
+  auto listenerResult = TcpListener::bind(listenAddress, config.port);
+  if (!listenerResult) {
+    std::println("[gateway] bind failed: {}", listenerResult.error().message);
+    return 1;
+  }
+
+  auto listenerInstance = std::move(listenerResult.value());
+  if (auto listenResult = listenerInstance.listen(); !listenResult) {
+    std::println("[gateway] listen failed: {}", listenResult.error().message);
+    return 1;
+  }
+
+  auto loopResult = EventLoop::create();
+  if (!loopResult) {
+    std::println("[gateway] event loop setup failed: {}",
+                 loopResult.error().message);
+    return 1;
+  }
+
+  std::println("[gateway] listening on {}:{}", listenAddress, config.port);
+  Gateway gateway{std::move(listenerInstance), std::move(loopResult.value()),
+                  std::move(config)};
+  gateway.run();
+  return 0;
+}
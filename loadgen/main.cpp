@@ -0,0 +1,822 @@
+#include "datagram.hpp"
+#include "metrics.hpp"
+#include "network.hpp"
+#include "packets.hpp"
+#include "world.hpp"
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <expected>
+#include <format>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <print>
+#include <random>
+#include <span>
+#include <stop_token>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <variant>
+#include <vector>
+
+using Moonlapse::Net::EventLoop;
+using Moonlapse::Net::IoEvent;
+using Moonlapse::Net::IoInterest;
+using Moonlapse::Net::TcpConnection;
+using Moonlapse::Net::TcpSocket;
+using Moonlapse::Net::UdpSocket;
+using Moonlapse::World::applyMovement;
+
+namespace Datagram = Moonlapse::Datagram;
+namespace Metrics = Moonlapse::Metrics;
+namespace Protocol = Moonlapse::Protocol;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr std::uint16_t defaultServerPort = 40500;
+constexpr std::size_t maxDefaultThreads = 4;
+constexpr std::size_t defaultBots = 100;
+constexpr unsigned defaultDuration = 30;
+constexpr unsigned defaultMoveRate = 5;
+constexpr unsigned defaultConnectRate = 200;
+// Actions are scheduled at this granularity; replies are handled as soon as
+// they arrive regardless.
+constexpr auto schedulerTick = std::chrono::milliseconds{5};
+// A move the server never reflects back (throttled, dropped or blocked) is
+// written off after this long.
+constexpr auto probeTimeout = std::chrono::seconds{2};
+constexpr auto reportInterval = std::chrono::seconds{1};
+constexpr double nanosecondsPerMillisecond = 1e6;
+constexpr double bytesPerMegabyte = 1024.0 * 1024.0;
+constexpr double secondsPerMinute = 60.0;
+
+enum class MovePattern : std::uint8_t {
+  // Uniformly random directions.
+  Random,
+  // Walks to the edge of the map and back along its row.
+  Sweep,
+  // Circles a 2x2 square: right, down, left, up.
+  Circle,
+};
+
+struct LoadConfig {
+  std::string host{"127.0.0.1"};
+  std::uint16_t port{defaultServerPort};
+  std::size_t bots{defaultBots};
+  std::size_t threads{1};
+  unsigned duration{defaultDuration};
+  // Per bot; 0 only listens.
+  unsigned moveRate{defaultMoveRate};
+  // Per bot per minute.
+  unsigned chatRate{0};
+  // Across all threads, so a large fleet does not stampede the listener.
+  unsigned connectRate{defaultConnectRate};
+  MovePattern pattern{MovePattern::Random};
+  bool compactEntities{true};
+  bool compressPayloads{true};
+  bool datagrams{true};
+};
+
+template <typename T>
+[[nodiscard]] auto parseNumber(std::string_view text) -> std::optional<T> {
+  T value{};
+  const auto *first = text.data();
+  const auto *last = text.data() + text.size();
+  auto [position, error] = std::from_chars(first, last, value);
+  if (error != std::errc{} || position != last) {
+    return std::nullopt;
+  }
+  return value;
+}
+
+[[nodiscard]] auto parsePattern(std::string_view name)
+    -> std::optional<MovePattern> {
+  if (name == "random") {
+    return MovePattern::Random;
+  }
+  if (name == "sweep") {
+    return MovePattern::Sweep;
+  }
+  if (name == "circle") {
+    return MovePattern::Circle;
+  }
+  return std::nullopt;
+}
+
+[[nodiscard]] auto parseLoadConfig(std::span<char *const> arguments)
+    -> std::expected<LoadConfig, std::string> {
+  LoadConfig config{.threads = std::clamp<std::size_t>(
+                        std::thread::hardware_concurrency(), 1,
+                        maxDefaultThreads)};
+  for (std::size_t index = 1; index < arguments.size(); ++index) {
+    std::string_view option{arguments[index]};
+    if (index + 1 >= arguments.size()) {
+      return std::unexpected(std::format("missing value for '{}'", option));
+    }
+    std::string_view value{arguments[++index]};
+
+    if (option == "--host") {
+      config.host = std::string{value};
+      continue;
+    }
+
+    if (option == "--port") {
+      auto port = parseNumber<std::uint16_t>(value);
+      if (!port || *port == 0) {
+        return std::unexpected(std::string{"--port expects 1-65535"});
+      }
+      config.port = *port;
+      continue;
+    }
+
+    if (option == "--bots") {
+      auto bots = parseNumber<std::size_t>(value);
+      if (!bots || *bots == 0) {
+        return std::unexpected(
+            std::string{"--bots expects a positive integer"});
+      }
+      config.bots = *bots;
+      continue;
+    }
+
+    if (option == "--threads") {
+      auto threads = parseNumber<std::size_t>(value);
+      if (!threads || *threads == 0) {
+        return std::unexpected(
+            std::string{"--threads expects a positive integer"});
+      }
+      config.threads = *threads;
+      continue;
+    }
+
+    if (option == "--duration") {
+      auto seconds = parseNumber<unsigned>(value);
+      if (!seconds || *seconds == 0) {
+        return std::unexpected(
+            std::string{"--duration expects a positive number of seconds"});
+      }
+      config.duration = *seconds;
+      continue;
+    }
+
+    if (option == "--move-rate") {
+      auto rate = parseNumber<unsigned>(value);
+      if (!rate || *rate > 1000) {
+        return std::unexpected(
+            std::string{"--move-rate expects 0-1000 moves per second"});
+      }
+      config.moveRate = *rate;
+      continue;
+    }
+
+    if (option == "--chat-rate") {
+      auto rate = parseNumber<unsigned>(value);
+      if (!rate || *rate > 6000) {
+        return std::unexpected(
+            std::string{"--chat-rate expects 0-6000 messages per minute"});
+      }
+      config.chatRate = *rate;
+      continue;
+    }
+
+    if (option == "--connect-rate") {
+      auto rate = parseNumber<unsigned>(value);
+      if (!rate || *rate == 0) {
+        return std::unexpected(std::string{
+            "--connect-rate expects a positive number of connections per "
+            "second"});
+      }
+      config.connectRate = *rate;
+      continue;
+    }
+
+    if (option == "--pattern") {
+      auto pattern = parsePattern(value);
+      if (!pattern) {
+        return std::unexpected(
+            std::string{"--pattern expects random, sweep or circle"});
+      }
+      config.pattern = *pattern;
+      continue;
+    }
+
+    if (option == "--compact") {
+      if (value != "on" && value != "off") {
+        return std::unexpected(std::string{"--compact expects on or off"});
+      }
+      config.compactEntities = value == "on";
+      continue;
+    }
+
+    if (option == "--compress") {
+      if (value != "on" && value != "off") {
+        return std::unexpected(std::string{"--compress expects on or off"});
+      }
+      config.compressPayloads = value == "on";
+      continue;
+    }
+
+    if (option == "--udp") {
+      if (value != "on" && value != "off") {
+        return std::unexpected(std::string{"--udp expects on or off"});
+      }
+      config.datagrams = value == "on";
+      continue;
+    }
+
+    return std::unexpected(std::format("unknown option '{}'", option));
+  }
+
+  config.threads = std::min(config.threads, config.bots);
+  return config;
+}
+
+// Shared by every worker; each one writes through its own index.
+struct LoadStats {
+  explicit LoadStats(std::size_t writers)
+      : connected{writers}, connectFailures{writers}, disconnected{writers},
+        movesSent{writers}, chatsSent{writers}, framesReceived{writers},
+        bytesReceived{writers}, datagramsReceived{writers},
+        chatsReceived{writers}, probesLost{writers}, roundTrip{writers} {}
+
+  Metrics::Counter connected;
+  Metrics::Counter connectFailures;
+  Metrics::Counter disconnected;
+  Metrics::Counter movesSent;
+  Metrics::Counter chatsSent;
+  Metrics::Counter framesReceived;
+  Metrics::Counter bytesReceived;
+  Metrics::Counter datagramsReceived;
+  Metrics::Counter chatsReceived;
+  Metrics::Counter probesLost;
+  // Nanoseconds from sending a move to the first state showing it.
+  Metrics::Histogram roundTrip;
+};
+
+// A move in flight whose result the bot is waiting to see.
+struct Probe {
+  Clock::time_point sent;
+  Protocol::Position expected;
+};
+
+struct Bot {
+  Bot(TcpSocket socket, std::uint64_t seed) noexcept
+      : connection{std::move(socket)}, random{seed} {}
+
+  TcpConnection connection;
+  // Opened when the server offers UDP; the hello is repeated with every TCP
+  // delta until a state comes over it.
+  UdpSocket datagrams;
+  std::vector<std::byte> hello;
+  Datagram::Reassembler reassembler;
+  bool datagramsFlowing{false};
+  // Learnt from the first state the server sends.
+  std::optional<Protocol::PlayerId> player;
+  // Where the bot believes it stands once every move sent so far lands.
+  std::optional<Protocol::Position> predicted;
+  std::optional<Probe> probe;
+  // Sequence of the last move sent; the first one is 1.
+  std::uint32_t lastInput{0};
+  Clock::time_point nextMove;
+  Clock::time_point nextChat;
+  std::size_t step{};
+  Protocol::Direction heading{Protocol::Direction::Right};
+  std::mt19937_64 random;
+  // Until the socket turns writable and finishConnect says how it went.
+  bool connecting{true};
+  bool closed{false};
+};
+
+template <typename... Handlers> struct Overloaded : Handlers... {
+  using Handlers::operator()...;
+};
+
+template <typename... Handlers>
+Overloaded(Handlers...) -> Overloaded<Handlers...>;
+
+// One event loop thread driving its share of the bots.
+class Worker {
+public:
+  Worker(const LoadConfig &config, LoadStats &stats, std::size_t writer,
+         std::size_t botCount, std::unique_ptr<EventLoop> loop)
+      : m_config{config}, m_stats{stats}, m_writer{writer},
+        m_botCount{botCount}, m_loop{std::move(loop)} {
+    m_bots.reserve(botCount);
+  }
+
+  Worker(const Worker &) = delete;
+  auto operator=(const Worker &) -> Worker & = delete;
+  Worker(Worker &&) = delete;
+  auto operator=(Worker &&) -> Worker & = delete;
+  ~Worker() = default;
+
+  void run(const std::stop_token &stopToken) {
+    auto start = Clock::now();
+    auto connectRate =
+        std::max(static_cast<double>(m_config.get().connectRate) /
+                     static_cast<double>(m_config.get().threads),
+                 1.0);
+    while (!stopToken.stop_requested()) {
+      auto now = Clock::now();
+      auto elapsed = std::chrono::duration<double>(now - start).count();
+      auto due = std::min(
+          m_botCount, static_cast<std::size_t>(elapsed * connectRate) + 1);
+      while (m_attempted < due) {
+        connectBot(now);
+      }
+
+      if (!m_loop->runOnce(schedulerTick)) {
+        return;
+      }
+      now = Clock::now();
+      for (auto &bot : m_bots) {
+        if (!bot->closed && !bot->connecting) {
+          act(*bot, now);
+        }
+      }
+    }
+  }
+
+private:
+  // Only starts the handshake, so a slow or unreachable server cannot hold
+  // up the bots already running on this loop.
+  void connectBot(Clock::time_point now) {
+    ++m_attempted;
+    const auto &config = m_config.get();
+    auto socket = TcpSocket::startConnect(config.host, config.port);
+    if (!socket || !socket->setNoDelay(true)) {
+      reportConnectFailure(socket ? "socket setup failed"
+                                  : socket.error().message);
+      return;
+    }
+
+    auto seed = (std::uint64_t{m_writer} << 32) | m_attempted;
+    auto bot = std::make_unique<Bot>(std::move(socket.value()), seed);
+    auto &self = *bot;
+    // Spread the first actions over one period so the fleet is not in step.
+    std::uniform_real_distribution<double> phase{0.0, 1.0};
+    if (config.moveRate > 0) {
+      self.nextMove = now + std::chrono::duration_cast<Clock::duration>(
+                                std::chrono::duration<double>{
+                                    phase(self.random) / config.moveRate});
+    }
+    if (config.chatRate > 0) {
+      self.nextChat = now + std::chrono::duration_cast<Clock::duration>(
+                                std::chrono::duration<double>{
+                                    phase(self.random) * secondsPerMinute /
+                                    config.chatRate});
+    }
+    auto capabilities =
+        (config.compactEntities ? Protocol::compactEntitiesCapability : 0U) |
+        (config.compressPayloads ? Protocol::compressionCapability : 0U) |
+        (config.datagrams ? Protocol::datagramCapability : 0U);
+    if (capabilities != 0) {
+      static_cast<void>(self.connection.queue(Protocol::encodeFrame(
+          Protocol::CapabilitiesPacket{.capabilities = capabilities})));
+    }
+
+    auto handle = self.connection.socket().nativeHandle();
+    auto watching = m_loop->watch(
+        handle, IoInterest::Writable,
+        [this, &self](IoEvent event) { handleEvent(self, event); });
+    if (!watching) {
+      reportConnectFailure(watching.error().message);
+      return;
+    }
+    m_bots.push_back(std::move(bot));
+  }
+
+  void handleEvent(Bot &bot, IoEvent event) {
+    if (!bot.connecting) {
+      handleReadable(bot);
+      return;
+    }
+    if (event.writable || event.hangup) {
+      finishConnect(bot);
+    }
+  }
+
+  // The queued capability offer goes out with act()'s next flush.
+  void finishConnect(Bot &bot) {
+    bot.connecting = false;
+    auto &socket = bot.connection.socket();
+    auto connected = socket.finishConnect();
+    if (connected) {
+      connected = m_loop->modify(socket.nativeHandle(), IoInterest::Readable);
+    }
+    if (!connected) {
+      reportConnectFailure(connected.error().message);
+      bot.closed = true;
+      m_loop->unwatch(socket.nativeHandle());
+      socket.close();
+      return;
+    }
+    m_stats.get().connected.add(m_writer);
+  }
+
+  void reportConnectFailure(std::string_view reason) {
+    m_stats.get().connectFailures.add(m_writer);
+    if (!m_reportedFailure) {
+      m_reportedFailure = true;
+      std::println("[loadgen] connect failed: {}", reason);
+    }
+  }
+
+  void handleReadable(Bot &bot) {
+    auto &stats = m_stats.get();
+    auto filled = bot.connection.fill();
+    if (!filled) {
+      close(bot);
+      return;
+    }
+    stats.bytesReceived.add(m_writer, filled.value());
+
+    auto now = Clock::now();
+    while (!bot.closed) {
+      auto frameResult = Protocol::extractFrame(bot.connection.received());
+      if (!frameResult) {
+        close(bot);
+        return;
+      }
+      if (!frameResult->has_value()) {
+        break;
+      }
+      auto frame = **frameResult;
+      if (frame.header.type == Protocol::PacketType::DatagramSetup) {
+        openDatagrams(bot, frame.payload);
+      } else {
+        if (!bot.datagramsFlowing && bot.datagrams.isOpen() &&
+            frame.header.type == Protocol::PacketType::StateDelta) {
+          static_cast<void>(bot.datagrams.send(bot.hello));
+        }
+        handleFrame(bot, frame, now);
+      }
+      bot.connection.consume(frame.size());
+    }
+
+    if (bot.connection.peerClosed()) {
+      close(bot);
+    }
+  }
+
+  // Datagrams that do not decode are dropped like lost ones.
+  void handleDatagrams(Bot &bot) {
+    auto &stats = m_stats.get();
+    std::array<std::byte, Datagram::maxDatagramSize> buffer{};
+    auto now = Clock::now();
+    while (!bot.closed) {
+      auto received = bot.datagrams.receive(buffer);
+      if (!received) {
+        return;
+      }
+      stats.bytesReceived.add(m_writer, *received);
+      stats.datagramsReceived.add(m_writer);
+      auto assembled =
+          bot.reassembler.accept(std::span{buffer}.first(*received));
+      if (!assembled || !assembled->has_value()) {
+        continue;
+      }
+      bot.datagramsFlowing = true;
+      auto frame = Protocol::extractFrame(**assembled);
+      if (frame && frame->has_value() &&
+          (*frame)->size() == (*assembled)->size()) {
+        handleFrame(bot, **frame, now);
+      }
+    }
+  }
+
+  void openDatagrams(Bot &bot, std::span<const std::byte> payload) {
+    auto setup = Datagram::decodeSetup(payload);
+    if (!setup || bot.datagrams.isOpen()) {
+      return;
+    }
+    auto socket = UdpSocket::connect(m_config.get().host, setup->port);
+    if (!socket || !socket->setNonBlocking(true)) {
+      return;
+    }
+    auto watching = m_loop->watch(
+        socket->nativeHandle(), IoInterest::Readable,
+        [this, &bot](IoEvent /*event*/) { handleDatagrams(bot); });
+    if (!watching) {
+      return;
+    }
+    bot.datagrams = std::move(*socket);
+    bot.hello =
+        Datagram::encodeHello(Datagram::HelloPacket{.token = setup->token});
+    static_cast<void>(bot.datagrams.send(bot.hello));
+  }
+
+  void handleFrame(Bot &bot, const Protocol::FrameView &frame,
+                   Clock::time_point now) {
+    auto &stats = m_stats.get();
+    stats.framesReceived.add(m_writer);
+    auto inflated = m_inflater.inflate(frame);
+    auto packet =
+        inflated ? Protocol::decodePacket(inflated->header, inflated->payload)
+                 : Protocol::PacketResult<Protocol::PacketVariant>{
+                       std::unexpected(inflated.error())};
+    if (!packet) {
+      return;
+    }
+    std::visit(
+        Overloaded{
+            [&](const Protocol::StateDeltaPacket &delta) {
+              observe(bot, delta.focusPlayer, delta.added, now);
+              observe(bot, delta.focusPlayer, delta.moved, now);
+              static_cast<void>(bot.connection.queue(Protocol::encodeFrame(
+                  Protocol::SnapshotAckPacket{.sequence = delta.sequence})));
+            },
+            [&](const Protocol::StateSnapshotPacket &snapshot) {
+              observe(bot, snapshot.focusPlayer, snapshot.players, now);
+            },
+            [&](const Protocol::ChatBatchPacket &batch) {
+              stats.chatsReceived.add(m_writer, batch.messages.size());
+            },
+            [](const auto & /*other*/) {}},
+        *packet);
+  }
+
+  // Completes the bot's probe once a state shows where its move was meant
+  // to land.
+  void observe(Bot &bot, Protocol::PlayerId focus,
+               std::span<const Protocol::PlayerState> states,
+               Clock::time_point now) {
+    bot.player = focus;
+    auto self =
+        std::ranges::find(states, focus, &Protocol::PlayerState::player);
+    if (self == states.end()) {
+      return;
+    }
+    if (!bot.predicted) {
+      bot.predicted = self->position;
+    }
+    if (bot.probe && self->position == bot.probe->expected) {
+      m_stats.get().roundTrip.record(
+          m_writer, static_cast<std::uint64_t>(
+                        std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            now - bot.probe->sent)
+                            .count()));
+      bot.probe.reset();
+    }
+  }
+
+  void act(Bot &bot, Clock::time_point now) {
+    const auto &config = m_config.get();
+    if (bot.probe && now - bot.probe->sent > probeTimeout) {
+      m_stats.get().probesLost.add(m_writer);
+      bot.probe.reset();
+      // Whatever went missing, the server's word is what counts now.
+      bot.predicted.reset();
+    }
+    // A bot that fell behind resumes its rate instead of bursting to catch
+    // up.
+    if (bot.player && config.moveRate > 0 && now >= bot.nextMove) {
+      sendMove(bot, now);
+      bot.nextMove = std::max(
+          bot.nextMove + std::chrono::duration_cast<Clock::duration>(
+                             std::chrono::duration<double>{
+                                 1.0 / config.moveRate}),
+          now);
+    }
+    if (bot.player && config.chatRate > 0 && now >= bot.nextChat) {
+      sendChat(bot);
+      bot.nextChat = std::max(
+          bot.nextChat + std::chrono::duration_cast<Clock::duration>(
+                             std::chrono::duration<double>{
+                                 secondsPerMinute / config.chatRate}),
+          now);
+    }
+
+    // Acks and moves are tiny, so writes are simply retried each tick rather
+    // than waiting on writability.
+    if (bot.connection.pendingWriteBytes() > 0 && !bot.connection.flush()) {
+      close(bot);
+    }
+  }
+
+  [[nodiscard]] auto nextDirection(Bot &bot) -> Protocol::Direction {
+    using Protocol::Direction;
+    switch (m_config.get().pattern) {
+    case MovePattern::Random: {
+      std::uniform_int_distribution<int> pick{0, 3};
+      return static_cast<Direction>(pick(bot.random));
+    }
+    case MovePattern::Sweep: {
+      if (bot.predicted) {
+        auto next = *bot.predicted;
+        applyMovement(next, bot.heading);
+        if (next == *bot.predicted) {
+          bot.heading = bot.heading == Direction::Right ? Direction::Left
+                                                        : Direction::Right;
+        }
+      }
+      return bot.heading;
+    }
+    case MovePattern::Circle: {
+      constexpr std::array loop{Direction::Right, Direction::Down,
+                                Direction::Left, Direction::Up};
+      return loop.at(bot.step++ % loop.size());
+    }
+    }
+    return Direction::Up;
+  }
+
+  void sendMove(Bot &bot, Clock::time_point now) {
+    auto direction = nextDirection(bot);
+    if (!bot.connection
+             .queue(Protocol::encodeFrame(Protocol::MovementPacket{
+                 .player = *bot.player,
+                 .direction = direction,
+                 .sequence = ++bot.lastInput}))
+             .has_value()) {
+      close(bot);
+      return;
+    }
+    m_stats.get().movesSent.add(m_writer);
+
+    // Until the server reports the bot's position again there is nothing to
+    // predict from.
+    if (!bot.predicted) {
+      return;
+    }
+    auto before = *bot.predicted;
+    applyMovement(*bot.predicted, direction);
+    // A move into a wall shows up as nothing at all, so it is not timed.
+    if (!bot.probe && *bot.predicted != before) {
+      bot.probe = Probe{.sent = now, .expected = *bot.predicted};
+    }
+  }
+
+  void sendChat(Bot &bot) {
+    auto message = std::format("load test {}", bot.step);
+    if (!bot.connection
+             .queue(Protocol::encodeFrame(Protocol::ChatPacket{
+                 .player = *bot.player, .message = std::move(message)}))
+             .has_value()) {
+      close(bot);
+      return;
+    }
+    m_stats.get().chatsSent.add(m_writer);
+  }
+
+  void close(Bot &bot) {
+    if (bot.closed) {
+      return;
+    }
+    bot.closed = true;
+    auto &socket = bot.connection.socket();
+    m_loop->unwatch(socket.nativeHandle());
+    socket.shutdown();
+    socket.close();
+    if (bot.datagrams.isOpen()) {
+      m_loop->unwatch(bot.datagrams.nativeHandle());
+      bot.datagrams.close();
+    }
+    m_stats.get().disconnected.add(m_writer);
+  }
+
+  std::reference_wrapper<const LoadConfig> m_config;
+  std::reference_wrapper<LoadStats> m_stats;
+  std::size_t m_writer;
+  std::size_t m_botCount;
+  std::size_t m_attempted{};
+  bool m_reportedFailure{false};
+  std::unique_ptr<EventLoop> m_loop;
+  std::vector<std::unique_ptr<Bot>> m_bots;
+  Protocol::PayloadInflater m_inflater;
+};
+
+[[nodiscard]] auto milliseconds(std::uint64_t nanoseconds) -> double {
+  return static_cast<double>(nanoseconds) / nanosecondsPerMillisecond;
+}
+
+struct Totals {
+  std::uint64_t moves{};
+  std::uint64_t chats{};
+  std::uint64_t frames{};
+  std::uint64_t bytes{};
+  std::uint64_t datagrams{};
+  Metrics::Histogram::Snapshot roundTrip{};
+};
+
+[[nodiscard]] auto readTotals(const LoadStats &stats) -> Totals {
+  return Totals{.moves = stats.movesSent.value(),
+                .chats = stats.chatsSent.value(),
+                .frames = stats.framesReceived.value(),
+                .bytes = stats.bytesReceived.value(),
+                .datagrams = stats.datagramsReceived.value(),
+                .roundTrip = stats.roundTrip.snapshot()};
+}
+
+void reportProgress(std::chrono::seconds elapsed, const LoadStats &stats,
+                    const Totals &now, const Totals &before) {
+  auto seconds = std::chrono::duration<double>(reportInterval).count();
+  auto roundTrip = Metrics::difference(now.roundTrip, before.roundTrip);
+  std::println("[loadgen] {:>4}s: {} bot(s) up, {:.0f} move(s)/s, {:.0f} "
+               "chat(s)/s, {:.0f} frame(s)/s, {:.2f} MB/s in, rtt p50 {:.2f} "
+               "ms p99 {:.2f} ms",
+               elapsed.count(),
+               stats.connected.value() - stats.disconnected.value(),
+               static_cast<double>(now.moves - before.moves) / seconds,
+               static_cast<double>(now.chats - before.chats) / seconds,
+               static_cast<double>(now.frames - before.frames) / seconds,
+               static_cast<double>(now.bytes - before.bytes) / seconds /
+                   bytesPerMegabyte,
+               milliseconds(Metrics::quantile(roundTrip, 0.5)),
+               milliseconds(Metrics::quantile(roundTrip, 0.99)));
+}
+
+void reportSummary(const LoadConfig &config, const LoadStats &stats,
+                   const Totals &totals) {
+  auto seconds = static_cast<double>(config.duration);
+  const auto &roundTrip = totals.roundTrip;
+  std::println("[loadgen] {} of {} bot(s) connected, {} failed to connect, "
+               "{} disconnected early",
+               stats.connected.value(), config.bots,
+               stats.connectFailures.value(), stats.disconnected.value());
+  std::println("[loadgen] sent {} move(s) and {} chat(s); received {} "
+               "frame(s), {} byte(s) ({:.2f} MB/s), {} datagram(s), {} "
+               "chat(s)",
+               totals.moves, totals.chats, totals.frames, totals.bytes,
+               static_cast<double>(totals.bytes) / seconds / bytesPerMegabyte,
+               totals.datagrams, stats.chatsReceived.value());
+  std::println("[loadgen] snapshot round trip over {} move(s), {} lost: p50 "
+               "{:.2f} ms, p90 {:.2f} ms, p99 {:.2f} ms, p99.9 {:.2f} ms, max "
+               "{:.2f} ms",
+               roundTrip.count, stats.probesLost.value(),
+               milliseconds(Metrics::quantile(roundTrip, 0.5)),
+               milliseconds(Metrics::quantile(roundTrip, 0.9)),
+               milliseconds(Metrics::quantile(roundTrip, 0.99)),
+               milliseconds(Metrics::quantile(roundTrip, 0.999)),
+               milliseconds(Metrics::quantile(roundTrip, 1.0)));
+}
+
+} // namespace
+
+auto main(int argc, char **argv) -> int {
+  auto configResult = parseLoadConfig(
+      std::span<char *const>{argv, static_cast<std::size_t>(argc)});
+  if (!configResult) {
+    std::println("[loadgen] {}", configResult.error());
+    std::println(
+        "[loadgen] usage: moonlapse_loadgen [--host HOST] [--port PORT] "
+        "[--bots N] [--threads N] [--duration SECONDS] [--move-rate "
+        "PER_SECOND] [--chat-rate PER_MINUTE] [--connect-rate PER_SECOND] "
+        "[--pattern random|sweep|circle] [--compact on|off] "
+        "[--compress on|off] [--udp on|off]");
+    return 1;
+  }
+  auto config = std::move(configResult.value());
+
+  LoadStats stats{config.threads};
+  std::vector<std::unique_ptr<Worker>> workers;
+  workers.reserve(config.threads);
+  for (std::size_t index = 0; index < config.threads; ++index) {
+    auto loop = EventLoop::create();
+    if (!loop) {
+      std::println("[loadgen] event loop setup failed: {}",
+                   loop.error().message);
+      return 1;
+    }
+    auto share = config.bots / config.threads +
+                 (index < config.bots % config.threads ? 1 : 0);
+    workers.push_back(std::make_unique<Worker>(config, stats, index, share,
+                                               std::move(loop.value())));
+  }
+
+  std::println("[loadgen] driving {} bot(s) against {}:{} from {} thread(s) "
+               "for {} s",
+               config.bots, config.host, config.port, config.threads,
+               config.duration);
+  {
+    std::vector<std::jthread> threads;
+    threads.reserve(workers.size());
+    for (auto &worker : workers) {
+      threads.emplace_back([&worker](const std::stop_token &stopToken) {
+        worker->run(stopToken);
+      });
+    }
+
+    auto start = Clock::now();
+    auto previous = readTotals(stats);
+    for (auto elapsed = reportInterval;
+         elapsed <= std::chrono::seconds{config.duration};
+         elapsed += reportInterval) {
+      std::this_thread::sleep_until(start + elapsed);
+      auto current = readTotals(stats);
+      reportProgress(elapsed, stats, current, previous);
+      previous = current;
+    }
+  }
+
+  reportSummary(config, stats, readTotals(stats));
+  return 0;
+}
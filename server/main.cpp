@@ -1,29 +1,368 @@
+#include "concurrency.hpp"
+#include "datagram.hpp"
+#include "delta.hpp"
+#include "logging.hpp"
+#include "metrics.hpp"
 #include "network.hpp"
 #include "packets.hpp"
+#include "persistence.hpp"
+#include "rate_limit.hpp"
+#include "scrape_endpoint.hpp"
+#include "world.hpp"
+#include "zone_link.hpp"
 
+#include <algorithm>
 #include <atomic>
+#include <charconv>
+#include <chrono>
+#include <expected>
+#include <filesystem>
+#include <format>
+#include <functional>
+#include <map>
 #include <memory>
 #include <mutex>
+#include <optional>
 #include <print>
+#include <random>
 #include <span>
+#include <string>
 #include <string_view>
 #include <thread>
 #include <unordered_map>
 #include <vector>
 
+using Moonlapse::Net::EventLoop;
+using Moonlapse::Net::Frame;
+using Moonlapse::Net::FrameKind;
+using Moonlapse::Net::IoEvent;
+using Moonlapse::Net::IoInterest;
+using Moonlapse::Net::OutboundPolicy;
+using Moonlapse::Net::OutboundStats;
 using Moonlapse::Net::SocketError;
 using Moonlapse::Net::SocketErrorCode;
 using Moonlapse::Net::SocketResult;
+using Moonlapse::Net::TcpConnection;
 using Moonlapse::Net::TcpListener;
 using Moonlapse::Net::TcpSocket;
+using Moonlapse::Net::TokenBucket;
+using Moonlapse::Net::UdpSocket;
+using Moonlapse::World::applyMovement;
+using Moonlapse::World::EntityHandle;
+using Moonlapse::World::gridHeight;
+using Moonlapse::World::gridWidth;
+using Moonlapse::World::PlayerStore;
+using Moonlapse::World::SpatialGrid;
+using Moonlapse::World::spawnPosition;
 
+namespace Concurrency = Moonlapse::Concurrency;
+namespace Datagram = Moonlapse::Datagram;
+namespace Logging = Moonlapse::Logging;
+namespace Metrics = Moonlapse::Metrics;
+namespace Persistence = Moonlapse::Persistence;
 namespace Protocol = Moonlapse::Protocol;
+namespace ZoneLink = Moonlapse::ZoneLink;
 
 namespace {
 
-constexpr std::uint16_t serverPort = 40500;
-constexpr int gridWidth = 40;
-constexpr int gridHeight = 20;
+constexpr std::uint16_t defaultServerPort = 40500;
+constexpr std::size_t maxDefaultIoThreads = 4;
+constexpr unsigned defaultTickRate = 30;
+constexpr unsigned maxTickRate = 1000;
+constexpr std::size_t baselineHistory = 32;
+// Covers the whole stock 40x20 map; lower it once the world grows.
+constexpr std::int32_t defaultViewRadius = 40;
+constexpr std::int32_t maxViewRadius = 1 << 16;
+// A client this far behind is disconnected rather than buffered forever.
+constexpr std::size_t defaultMaxQueuedBytes = std::size_t{1} << 20;
+constexpr unsigned defaultStatsInterval = 10;
+constexpr unsigned defaultCheckpointInterval = 30;
+constexpr auto journalInterval = std::chrono::milliseconds{100};
+// Comfortably above key repeat, so only scripted floods hit the limit.
+constexpr unsigned defaultMoveRate = 60;
+constexpr unsigned defaultMoveBurst = 30;
+constexpr unsigned defaultChatRate = 4;
+constexpr unsigned defaultChatBurst = 8;
+constexpr std::size_t defaultInputQueueCapacity = 8192;
+// Per-second caps on log lines a misbehaving client can trigger.
+constexpr std::uint32_t clientWarningsPerSecond = 20;
+constexpr std::uint32_t sessionEventsPerSecond = 50;
+constexpr std::uint32_t supportedCapabilities =
+    Moonlapse::Protocol::compactEntitiesCapability |
+    Moonlapse::Protocol::compressionCapability |
+    Moonlapse::Protocol::datagramCapability;
+// UDP deltas sent without a single acknowledgement coming back before the
+// session gives up on the path and returns to TCP; five seconds at 10 Hz.
+constexpr std::uint32_t datagramFallbackDeltas = 50;
+// Ticks a ZoneEnter waits for its id to come free. The gateway reuses an id
+// as soon as its player disconnects, and the zone may not have seen that
+// player's leave yet.
+constexpr std::uint32_t entryWaitTicks = 60;
+
+// This process's strip when running behind a gateway.
+struct ZoneAssignment {
+  std::size_t index{};
+  std::size_t count{1};
+};
+
+struct ServerConfig {
+  std::size_t ioThreads{1};
+  unsigned tickRate{defaultTickRate};
+  std::int32_t viewRadius{defaultViewRadius};
+  OutboundPolicy outbound{.coalesceLatest = true,
+                          .maxPendingBytes = defaultMaxQueuedBytes};
+  // Seconds between outbound queue reports; 0 turns them off.
+  unsigned statsInterval{defaultStatsInterval};
+  // Movement packets each client may send per second; 0 disables the limit.
+  unsigned moveRate{defaultMoveRate};
+  unsigned moveBurst{defaultMoveBurst};
+  unsigned chatRate{defaultChatRate};
+  unsigned chatBurst{defaultChatBurst};
+  std::size_t inputQueueCapacity{defaultInputQueueCapacity};
+  // What handleCapabilities may agree to.
+  std::uint32_t capabilities{supportedCapabilities};
+  Logging::Level logLevel{Logging::Level::Info};
+  std::uint16_t port{defaultServerPort};
+  // Serves Prometheus metrics at /metrics when set.
+  std::optional<std::uint16_t> adminPort{};
+  // Set when players arrive through moonlapse_gateway instead of directly.
+  std::optional<ZoneAssignment> zone{};
+  // Player positions survive restarts when set.
+  std::optional<std::filesystem::path> worldFile{};
+  unsigned checkpointInterval{defaultCheckpointInterval};
+};
+
+[[nodiscard]] auto defaultIoThreads() -> std::size_t {
+  auto hardwareThreads =
+      static_cast<std::size_t>(std::thread::hardware_concurrency());
+  return std::clamp<std::size_t>(hardwareThreads, 1, maxDefaultIoThreads);
+}
+
+template <typename T>
+[[nodiscard]] auto parseNumber(std::string_view text) -> std::optional<T> {
+  T value{};
+  const auto *first = text.data();
+  const auto *last = text.data() + text.size();
+  auto [position, error] = std::from_chars(first, last, value);
+  if (error != std::errc{} || position != last) {
+    return std::nullopt;
+  }
+  return value;
+}
+
+[[nodiscard]] auto parseServerConfig(std::span<char *const> arguments)
+    -> std::expected<ServerConfig, std::string> {
+  ServerConfig config{.ioThreads = defaultIoThreads()};
+  for (std::size_t index = 1; index < arguments.size(); ++index) {
+    std::string_view option{arguments[index]};
+    if (index + 1 >= arguments.size()) {
+      return std::unexpected(std::format("missing value for '{}'", option));
+    }
+    std::string_view value{arguments[++index]};
+
+    if (option == "--port") {
+      auto port = parseNumber<std::uint16_t>(value);
+      if (!port || *port == 0) {
+        return std::unexpected(std::string{"--port expects 1-65535"});
+      }
+      config.port = *port;
+      continue;
+    }
+
+    if (option == "--admin-port") {
+      auto port = parseNumber<std::uint16_t>(value);
+      if (!port || *port == 0) {
+        return std::unexpected(std::string{"--admin-port expects 1-65535"});
+      }
+      config.adminPort = *port;
+      continue;
+    }
+
+    if (option == "--zone") {
+      auto separator = value.find('/');
+      auto index = parseNumber<std::size_t>(value.substr(0, separator));
+      auto count = separator == std::string_view::npos
+                       ? std::nullopt
+                       : parseNumber<std::size_t>(value.substr(separator + 1));
+      if (!index || !count || *count == 0 || *index >= *count ||
+          *count > static_cast<std::size_t>(gridWidth)) {
+        return std::unexpected(std::format(
+            "--zone expects INDEX/COUNT with at most {} zones", gridWidth));
+      }
+      config.zone = ZoneAssignment{.index = *index, .count = *count};
+      continue;
+    }
+
+    if (option == "--world-file") {
+      config.worldFile = std::filesystem::path{value};
+      continue;
+    }
+
+    if (option == "--checkpoint-interval") {
+      auto seconds = parseNumber<unsigned>(value);
+      if (!seconds || *seconds == 0) {
+        return std::unexpected(
+            std::string{"--checkpoint-interval expects a positive number of "
+                        "seconds"});
+      }
+      config.checkpointInterval = *seconds;
+      continue;
+    }
+
+    if (option == "--io-threads") {
+      auto threads = parseNumber<std::size_t>(value);
+      if (!threads || *threads == 0) {
+        return std::unexpected(
+            std::string{"--io-threads expects a positive integer"});
+      }
+      config.ioThreads = *threads;
+      continue;
+    }
+
+    if (option == "--tick-rate") {
+      auto rate = parseNumber<unsigned>(value);
+      if (!rate || *rate == 0 || *rate > maxTickRate) {
+        return std::unexpected(
+            std::format("--tick-rate expects 1-{} Hz", maxTickRate));
+      }
+      config.tickRate = *rate;
+      continue;
+    }
+
+    if (option == "--view-radius") {
+      auto radius = parseNumber<std::int32_t>(value);
+      if (!radius || *radius < 0 || *radius > maxViewRadius) {
+        return std::unexpected(
+            std::format("--view-radius expects 0-{} cells", maxViewRadius));
+      }
+      config.viewRadius = *radius;
+      continue;
+    }
+
+    if (option == "--max-queued-bytes") {
+      auto bytes = parseNumber<std::size_t>(value);
+      if (!bytes || *bytes == 0) {
+        return std::unexpected(
+            std::string{"--max-queued-bytes expects a positive integer"});
+      }
+      config.outbound.maxPendingBytes = *bytes;
+      continue;
+    }
+
+    if (option == "--snapshot-policy") {
+      if (value != "latest" && value != "all") {
+        return std::unexpected(
+            std::string{"--snapshot-policy expects 'latest' or 'all'"});
+      }
+      config.outbound.coalesceLatest = value == "latest";
+      continue;
+    }
+
+    if (option == "--compression") {
+      if (value != "on" && value != "off") {
+        return std::unexpected(
+            std::string{"--compression expects 'on' or 'off'"});
+      }
+      if (value == "off") {
+        config.capabilities &= ~Moonlapse::Protocol::compressionCapability;
+      }
+      continue;
+    }
+
+    if (option == "--udp") {
+      if (value != "on" && value != "off") {
+        return std::unexpected(std::string{"--udp expects 'on' or 'off'"});
+      }
+      if (value == "off") {
+        config.capabilities &= ~Moonlapse::Protocol::datagramCapability;
+      }
+      continue;
+    }
+
+    if (option == "--stats-interval") {
+      auto seconds = parseNumber<unsigned>(value);
+      if (!seconds) {
+        return std::unexpected(
+            std::string{"--stats-interval expects a number of seconds"});
+      }
+      config.statsInterval = *seconds;
+      continue;
+    }
+
+    if (option == "--move-rate") {
+      auto rate = parseNumber<unsigned>(value);
+      if (!rate) {
+        return std::unexpected(
+            std::string{"--move-rate expects a number of moves per second"});
+      }
+      config.moveRate = *rate;
+      continue;
+    }
+
+    if (option == "--move-burst") {
+      auto burst = parseNumber<unsigned>(value);
+      if (!burst || *burst == 0) {
+        return std::unexpected(
+            std::string{"--move-burst expects a positive integer"});
+      }
+      config.moveBurst = *burst;
+      continue;
+    }
+
+    if (option == "--chat-rate") {
+      auto rate = parseNumber<unsigned>(value);
+      if (!rate) {
+        return std::unexpected(std::string{
+            "--chat-rate expects a number of messages per second"});
+      }
+      config.chatRate = *rate;
+      continue;
+    }
+
+    if (option == "--chat-burst") {
+      auto burst = parseNumber<unsigned>(value);
+      if (!burst || *burst == 0) {
+        return std::unexpected(
+            std::string{"--chat-burst expects a positive integer"});
+      }
+      config.chatBurst = *burst;
+      continue;
+    }
+
+    if (option == "--log-level") {
+      auto level = Logging::parseLevel(value);
+      if (!level) {
+        return std::unexpected(std::string{
+            "--log-level expects debug, info, warning or error"});
+      }
+      config.logLevel = *level;
+      continue;
+    }
+
+    if (option == "--input-queue") {
+      auto capacity = parseNumber<std::size_t>(value);
+      if (!capacity || *capacity == 0) {
+        return std::unexpected(
+            std::string{"--input-queue expects a positive integer"});
+      }
+      config.inputQueueCapacity = *capacity;
+      continue;
+    }
+
+    return std::unexpected(std::format("unknown option '{}'", option));
+  }
+  // Behind a gateway a player's position travels with the player, and ids
+  // are not this node's to hand out.
+  if (config.zone && config.worldFile) {
+    return std::unexpected(
+        std::string{"--world-file cannot be combined with --zone"});
+  }
+  // The gateway only relays the TCP stream.
+  if (config.zone) {
+    config.capabilities &= ~Moonlapse::Protocol::datagramCapability;
+  }
+  return config;
+}
 
 template <typename... Handlers> struct Overloaded : Handlers... {
   using Handlers::operator()...;
@@ -46,53 +385,151 @@ Overloaded(Handlers...) -> Overloaded<Handlers...>;
     return "size mismatch";
   case PacketError::InvalidPayload:
     return "invalid payload";
+  case PacketError::PayloadTooLarge:
+    return "payload too large";
   }
   return "unclassified error";
 }
 
-[[nodiscard]] auto clampCoordinate(std::int32_t value, std::int32_t ceiling)
-    -> std::int32_t {
-  if (value < 0) {
-    return 0;
-  }
-  if (value >= ceiling) {
-    return ceiling - 1;
+class GameServer {
+public:
+  GameServer(TcpListener listener, std::optional<UdpSocket> datagrams,
+             std::vector<std::unique_ptr<EventLoop>> eventLoops,
+             ServerConfig serverConfig,
+             std::optional<Persistence::SavedWorld> saved)
+      : log{"server", serverConfig.logLevel}, listener{std::move(listener)},
+        datagramSocket{std::move(datagrams)}, config{serverConfig},
+        world{serverConfig.viewRadius},
+        metrics{eventLoops.size() + 1},
+        moveQueue{serverConfig.inputQueueCapacity},
+        chatQueue{serverConfig.inputQueueCapacity} {
+    if (config.zone) {
+      nodeZones.emplace(gridWidth, config.zone->count);
+    }
+    for (auto &loop : eventLoops) {
+      auto shard = std::make_unique<LoopShard>();
+      shard->loop = std::move(loop);
+      shards.push_back(std::move(shard));
+    }
+    if (config.worldFile) {
+      startWorldWriter(std::move(saved).value_or(Persistence::SavedWorld{}));
+    }
   }
-  return value;
-}
 
-void applyMovement(Protocol::Position &position,
-                   Protocol::Direction direction) {
-  switch (direction) {
-  case Protocol::Direction::Up:
-    --position.y;
-    break;
-  case Protocol::Direction::Down:
-    ++position.y;
-    break;
-  case Protocol::Direction::Left:
-    --position.x;
-    break;
-  case Protocol::Direction::Right:
-    ++position.x;
-    break;
-  }
-
-  position.x = clampCoordinate(position.x, gridWidth);
-  position.y = clampCoordinate(position.y, gridHeight);
-}
+  // Runs on the metrics endpoint's thread.
+  [[nodiscard]] auto renderMetrics() const -> std::string {
+    std::size_t sessions = 0;
+    OutboundStats total{};
+    std::size_t deepest = 0;
+    for (const auto &shard : shards) {
+      sessions += shard->stats.sessions.load();
+      total.queuedFrames += shard->stats.queuedFrames.load();
+      total.pendingBytes += shard->stats.pendingBytes.load();
+      total.droppedFrames += shard->stats.droppedFrames.load();
+      deepest = std::max(deepest, shard->stats.deepestQueue.load());
+    }
+    auto players = world.read()->states.size();
 
-class GameServer {
-public:
-  explicit GameServer(TcpListener listener) noexcept
-      : listener{std::move(listener)} {}
+    constexpr std::uint64_t microsecond = 1000;
+    constexpr std::uint64_t smallFrame = 64;
+    Metrics::Exposition page;
+    page.gauge("moonlapse_players", "Players in the published world.",
+               players);
+    page.gauge("moonlapse_sessions", "Sessions attached to event loops.",
+               sessions);
+    page.histogram("moonlapse_tick_duration_seconds",
+                   "Time spent in one simulation tick.",
+                   metrics.tickDuration.snapshot(),
+                   Metrics::nanosecondsToSeconds, microsecond);
+    page.histogram("moonlapse_snapshot_gather_seconds",
+                   "Time to gather and publish the world state.",
+                   metrics.gatherDuration.snapshot(),
+                   Metrics::nanosecondsToSeconds, microsecond);
+    page.histogram("moonlapse_delta_encode_seconds",
+                   "Time to encode one session's state delta.",
+                   metrics.encodeDuration.snapshot(),
+                   Metrics::nanosecondsToSeconds, microsecond);
+    page.histogram("moonlapse_flush_seconds",
+                   "Time spent writing one session's queued frames.",
+                   metrics.flushDuration.snapshot(),
+                   Metrics::nanosecondsToSeconds, microsecond);
+    page.histogram("moonlapse_delta_bytes", "Encoded size of one state delta.",
+                   metrics.deltaBytes.snapshot(), 1.0, smallFrame);
+    page.histogram("moonlapse_outbound_queue_bytes",
+                   "Unsent bytes per session after each state round.",
+                   metrics.queuedBytes.snapshot(), 1.0, smallFrame);
+    page.gauge("moonlapse_outbound_queued_frames",
+               "Frames waiting in outbound queues.", total.queuedFrames);
+    page.gauge("moonlapse_outbound_pending_bytes",
+               "Bytes waiting in outbound queues.", total.pendingBytes);
+    page.gauge("moonlapse_outbound_deepest_queue_bytes",
+               "Largest single outbound queue.", deepest);
+    page.gauge("moonlapse_outbound_dropped_frames",
+               "Stale snapshots dropped by connected sessions' queues.",
+               total.droppedFrames);
+    page.counter("moonlapse_frames_queued_total",
+                 "Frames queued for sending.", metrics.framesQueued.value());
+    page.counter("moonlapse_bytes_sent_total", "Bytes written to sockets.",
+                 metrics.bytesSent.value());
+    page.counter("moonlapse_datagrams_sent_total",
+                 "State update datagrams sent over UDP.",
+                 metrics.datagramsSent.value());
+    page.counter("moonlapse_datagram_fallbacks_total",
+                 "Sessions moved back to TCP for lack of acknowledgements.",
+                 metrics.datagramFallbacks.value());
+    page.counter("moonlapse_frames_received_total",
+                 "Frames received from clients.",
+                 metrics.framesReceived.value());
+    page.counter("moonlapse_bytes_received_total",
+                 "Bytes read from sockets.", metrics.bytesReceived.value());
+    page.counter("moonlapse_moves_throttled_total",
+                 "Moves rejected by the per-client rate limit.",
+                 metrics.throttledMoves.value());
+    page.counter("moonlapse_moves_dropped_total",
+                 "Moves dropped on a full input queue.",
+                 metrics.droppedMoves.value());
+    page.counter("moonlapse_chats_throttled_total",
+                 "Chat messages rejected by the per-client rate limit.",
+                 metrics.throttledChats.value());
+    page.counter("moonlapse_chats_dropped_total",
+                 "Chat messages dropped on a full input queue.",
+                 metrics.droppedChats.value());
+    return std::move(page).text();
+  }
 
   void run() {
-    std::println("[server] waiting for players...");
+    if (datagramSocket) {
+      // Before the loop threads start, so watching from here is safe.
+      auto watched = shards.front()->loop->watch(
+          datagramSocket->nativeHandle(), IoInterest::Readable,
+          [this](IoEvent /*event*/) { receiveDatagrams(); });
+      if (!watched) {
+        log.error("UDP channel disabled: {}", watched.error().message);
+        datagramSocket.reset();
+      }
+    }
+    for (auto &shard : shards) {
+      auto &loop = *shard->loop;
+      loopThreads.emplace_back(
+          [this, &loop](const std::stop_token &stopToken) {
+            if (auto result = loop.run(stopToken); !result) {
+              log.error("event loop stopped: {}", result.error().message);
+            }
+          });
+    }
+
+    simulationThread = std::jthread{[this](const std::stop_token &stopToken) {
+      simulationLoop(stopToken);
+    }};
+
+    log.info("waiting for players on {} event loop thread(s), ticking at {} "
+             "Hz...",
+             shards.size(), config.tickRate);
     while (true) {
       auto connection = listener.accept();
       if (!connection) {
-        std::println("[server] accept failed: {}", connection.error().message);
+        log.write(socketWarnings, Logging::Level::Warning, "accept failed: {}",
+                  connection.error().message);
         continue;
       }
       registerPlayer(std::move(connection.value()));
@@ -100,92 +537,531 @@ public:
   }
 
 private:
-  struct Session {
-    Session(Protocol::PlayerId playerIdentifier, TcpSocket &&socket) noexcept
-        : playerId{playerIdentifier}, socket{std::move(socket)} {}
+  enum class SessionStage : std::uint8_t {
+    // Behind a gateway: waiting for the ZoneEnter that names the player.
+    AwaitingEntry,
+    // Join queued; reads pause until the simulation has spawned the player.
+    Spawning,
+    Live,
+    // Walked into another zone; kept only until the gateway hangs up.
+    HandedOff,
+    Closed,
+  };
+
+  // Writer 0 is the simulation thread and writer i + 1 the event loop of
+  // shard i; the metrics endpoint only reads.
+  static constexpr std::size_t simulationWriter = 0;
+
+  [[nodiscard]] static constexpr auto loopWriter(std::size_t shard) noexcept
+      -> std::size_t {
+    return shard + 1;
+  }
+
+  // Durations are in nanoseconds.
+  struct ServerMetrics {
+    explicit ServerMetrics(std::size_t writers)
+        : tickDuration{writers}, gatherDuration{writers},
+          encodeDuration{writers}, flushDuration{writers},
+          deltaBytes{writers}, queuedBytes{writers}, framesQueued{writers},
+          bytesSent{writers}, datagramsSent{writers},
+          datagramFallbacks{writers}, framesReceived{writers},
+          bytesReceived{writers}, throttledMoves{writers},
+          droppedMoves{writers}, throttledChats{writers},
+          droppedChats{writers} {}
+
+    Metrics::Histogram tickDuration;
+    Metrics::Histogram gatherDuration;
+    Metrics::Histogram encodeDuration;
+    Metrics::Histogram flushDuration;
+    Metrics::Histogram deltaBytes;
+    // Each session's unsent backlog, sampled after every state round.
+    Metrics::Histogram queuedBytes;
+    Metrics::Counter framesQueued;
+    Metrics::Counter bytesSent;
+    Metrics::Counter datagramsSent;
+    Metrics::Counter datagramFallbacks;
+    Metrics::Counter framesReceived;
+    Metrics::Counter bytesReceived;
+    Metrics::Counter throttledMoves;
+    Metrics::Counter droppedMoves;
+    Metrics::Counter throttledChats;
+    Metrics::Counter droppedChats;
+  };
+
+  struct Session;
+
+  // Sessions of one loop with frames waiting for a flush. A single posted
+  // task flushes them all, and the list keeps its capacity, so scheduling a
+  // flush does not allocate. Loop thread only.
+  struct FlushBatch {
+    void schedule(EventLoop &loop, std::shared_ptr<Session> session) {
+      if (pending.empty()) {
+        loop.post([this]() { run(); });
+      }
+      pending.push_back(std::move(session));
+    }
+
+    void run() {
+      std::swap(pending, running);
+      for (const auto &session : running) {
+        if (auto result = session->flushPending(); !result) {
+          session->fail(result.error());
+        }
+      }
+      running.clear();
+    }
+
+    std::vector<std::shared_ptr<Session>> pending;
+    std::vector<std::shared_ptr<Session>> running;
+  };
+
+  struct Session : std::enable_shared_from_this<Session> {
+    Session(TcpSocket &&socket, std::size_t shardIndex, EventLoop &eventLoop,
+            FlushBatch &loopFlushes, ServerMetrics &serverMetrics,
+            OutboundPolicy policy, TokenBucket moveLimit,
+            TokenBucket chatLimit) noexcept
+        : connection{std::move(socket), policy}, shard{shardIndex},
+          loop{eventLoop}, flushes{loopFlushes}, metrics{serverMetrics},
+          moveBudget{moveLimit}, chatBudget{chatLimit} {}
+
+    // Must run on the owning event loop. Queues the frame and schedules a
+    // flush, so a slow peer never blocks the caller; everything queued
+    // before the flush runs leaves in one vectored write. A peer whose
+    // backlog passes the byte limit is shut down here.
+    auto send(Frame frame, FrameKind kind = FrameKind::Reliable)
+        -> SocketResult<void> {
+      {
+        std::scoped_lock guard{sendMutex};
+        if (closed) {
+          return std::unexpected(
+              SocketError{.code = SocketErrorCode::InvalidState,
+                          .message = "send on closed session",
+                          .system = {}});
+        }
+        if (auto queued = connection.queue(std::move(frame), kind); !queued) {
+          if (!failure) {
+            failure = queued.error();
+          }
+          connection.socket().shutdown();
+          return queued;
+        }
+        metrics.get().framesQueued.add(loopWriter(shard));
+        if (flushScheduled) {
+          return {};
+        }
+        flushScheduled = true;
+      }
+
+      flushes.get().schedule(loop, shared_from_this());
+      return {};
+    }
 
-    auto send(std::span<const std::byte> payload) -> SocketResult<void> {
+    // Must run on the owning event loop.
+    auto flushPending() -> SocketResult<void> {
       std::scoped_lock guard{sendMutex};
-      return socket.sendAll(payload);
+      flushScheduled = false;
+      if (closed) {
+        return {};
+      }
+
+      auto writer = loopWriter(shard);
+      auto pendingBefore = connection.pendingWriteBytes();
+      auto flushed = [&]() {
+        Metrics::ScopedTimer timer{metrics.get().flushDuration, writer};
+        return connection.flush();
+      }();
+      metrics.get().bytesSent.add(
+          writer, pendingBefore - connection.pendingWriteBytes());
+      if (!flushed) {
+        return std::unexpected(flushed.error());
+      }
+
+      auto interest = flushed.value()
+                          ? IoInterest::Readable
+                          : IoInterest::Readable | IoInterest::Writable;
+      return loop.get().modify(connection.socket().nativeHandle(), interest);
+    }
+
+    // Records the error and shuts the socket down; the event loop observes
+    // the hangup and finishes the teardown on its own thread.
+    void fail(SocketError error) {
+      std::scoped_lock guard{sendMutex};
+      if (closed) {
+        return;
+      }
+      if (!failure) {
+        failure = std::move(error);
+      }
+      connection.socket().shutdown();
     }
 
-    Protocol::PlayerId playerId;
-    TcpSocket socket;
+    [[nodiscard]] auto outboundStats() -> OutboundStats {
+      std::scoped_lock guard{sendMutex};
+      return connection.outboundStats();
+    }
+
+    [[nodiscard]] auto failureOr(SocketError fallback) -> SocketError {
+      std::scoped_lock guard{sendMutex};
+      return failure.value_or(std::move(fallback));
+    }
+
+    auto close() -> bool {
+      std::scoped_lock guard{sendMutex};
+      if (closed) {
+        return false;
+      }
+      closed = true;
+      loop.get().unwatch(connection.socket().nativeHandle());
+      connection.socket().shutdown();
+      connection.socket().close();
+      return true;
+    }
+
+    // Assigned by the simulation when the player spawns, before the session
+    // is attached to its event loop.
+    EntityHandle entity{};
+    Protocol::PlayerId playerId{};
+    TcpConnection connection;
+    std::size_t shard;
+    std::reference_wrapper<EventLoop> loop;
+    std::reference_wrapper<FlushBatch> flushes;
+    std::reference_wrapper<ServerMetrics> metrics;
     std::mutex sendMutex;
+    bool flushScheduled{false};
+    bool closed{false};
+    std::optional<SocketError> failure;
+
+    // Owned by the session's event loop, which both decodes acks and builds
+    // the deltas.
+    SessionStage stage{SessionStage::Spawning};
+    // The gateway's placement, read by the simulation when it spawns the
+    // player.
+    std::optional<ZoneLink::TransferPacket> entry;
+    // Simulation thread only: ticks spent waiting for the entry's id.
+    std::uint32_t entryWaits{0};
+    std::uint32_t ackedSequence{Protocol::noBaseline};
+    // The client acknowledged noBaseline and is still owed a full state.
+    bool fullStateWanted{false};
+    bool compactEntities{false};
+    bool compressPayloads{false};
+    TokenBucket moveBudget;
+    TokenBucket chatBudget;
+    Protocol::BaselineRing baselines{baselineHistory};
+    std::uint32_t lastSequence{Protocol::noBaseline};
+    // Newest move sequences handed to the simulation, turned away before
+    // reaching it, and last echoed back in a delta.
+    std::uint32_t queuedInput{};
+    std::uint32_t rejectedInput{};
+    std::uint32_t echoedInput{};
+    // Channels the client listens to, and the messages of the chat round
+    // being fanned out that it is due.
+    std::uint32_t chatChannels{Protocol::allChatChannels};
+    std::vector<std::uint32_t> chatSelection;
+    // The UDP channel: the token the client was given and, once it has said
+    // hello, where its deltas go. Given up for good after too many deltas
+    // go unacknowledged.
+    std::uint64_t datagramToken{};
+    std::optional<Moonlapse::Net::SocketAddress> datagramPeer;
+    std::uint32_t datagramSequence{};
+    std::uint32_t unackedDatagrams{};
+    bool datagramsFailed{false};
+    // First sequence that carried the view as it stands; over UDP it is
+    // repeated until one from here on is acknowledged.
+    std::uint32_t viewSequence{Protocol::noBaseline};
+
+    // The input sequence to echo given the newest one the simulation has
+    // applied. A rejected move only counts as processed once everything
+    // queued ahead of it has been applied too.
+    [[nodiscard]] auto inputEcho(std::uint32_t applied) const noexcept
+        -> std::uint32_t {
+      return applied >= queuedInput ? std::max(applied, rejectedInput)
+                                    : applied;
+    }
   };
 
-  struct PlayerEntry {
-    Protocol::Position position;
-    std::shared_ptr<Session> session;
+  // Queue figures as of the loop's latest state broadcast.
+  struct ShardStats {
+    std::atomic<std::size_t> sessions{};
+    std::atomic<std::size_t> queuedFrames{};
+    std::atomic<std::size_t> pendingBytes{};
+    std::atomic<std::size_t> deepestQueue{};
+    std::atomic<std::uint64_t> droppedFrames{};
+  };
+
+  // An event loop and the sessions it serves. The session list and scratch
+  // buffers are only touched on the loop's own thread.
+  struct LoopShard {
+    std::unique_ptr<EventLoop> loop;
+    std::vector<std::shared_ptr<Session>> sessions;
+    FlushBatch flushes;
+    std::atomic<bool> statePending{false};
+    // Set by the loop while a session is owed a state even if nothing
+    // changes: a UDP view not yet confirmed, or a requested full state.
+    std::atomic<bool> unconfirmed{false};
+    ShardStats stats;
+    Protocol::StateDeltaPacket delta;
+    Protocol::PayloadCompressor compressor;
+    Datagram::Fragmenter fragmenter;
+    std::random_device tokenSource;
+    std::vector<Protocol::PlayerState> visible;
+    // Live sessions subscribed to each channel.
+    std::array<std::vector<std::shared_ptr<Session>>,
+               Protocol::chatChannelCount>
+        chatSubscribers;
+    std::vector<std::shared_ptr<Session>> chatRecipients;
+    std::vector<std::optional<Protocol::Position>> chatSpeakers;
+    // Parallel to chatSubscribers[Local], as of the round being sent.
+    std::vector<std::optional<Protocol::Position>> chatListeners;
+    std::vector<Protocol::ChatView> chatViews;
+  };
+
+  // Published by the simulation after every tick that changed something.
+  // Event loops read it without locking to build their sessions' deltas.
+  struct WorldFrame {
+    explicit WorldFrame(std::int32_t viewRadius)
+        : grid{gridWidth, gridHeight, viewRadius} {}
+
+    [[nodiscard]] auto processedInput(EntityHandle entity) const noexcept
+        -> std::uint32_t {
+      return entity.slot < processedInputs.size()
+                 ? processedInputs[entity.slot]
+                 : 0;
+    }
+
+    std::vector<Protocol::PlayerState> states;
+    Moonlapse::World::SpatialGrid grid;
+    // Indexed by slot, as of the same tick as states.
+    std::vector<std::uint32_t> processedInputs;
+  };
+
+  struct QueuedMove {
+    EntityHandle entity;
+    Protocol::Direction direction;
+    std::uint32_t sequence;
+  };
+
+  // Inputs applied by one simulation tick. Moves and leaves carry the entity
+  // handle, so input from a departed player is dropped even if a newcomer
+  // has already been given the same slot.
+  struct TickInputs {
+    std::vector<std::shared_ptr<Session>> joins;
+    std::vector<QueuedMove> moves;
+    std::vector<EntityHandle> leaves;
+    // In arrival order; fanned out together once the tick is done.
+    std::vector<Protocol::ChatPacket> chats;
+
+    [[nodiscard]] auto empty() const noexcept -> bool {
+      return joins.empty() && moves.empty() && leaves.empty() &&
+             chats.empty();
+    }
+
+    void clear() noexcept {
+      joins.clear();
+      moves.clear();
+      leaves.clear();
+      chats.clear();
+    }
+  };
+
+  // One tick's chat, shared read-only by every event loop.
+  struct ChatRound {
+    std::vector<Protocol::ChatPacket> messages;
+    // Indices into messages, per channel, in arrival order.
+    std::array<std::vector<std::uint32_t>, Protocol::chatChannelCount>
+        byChannel;
   };
 
   void registerPlayer(TcpSocket socket) {
-    auto playerIdentifier = nextId.fetch_add(1);
-    auto session =
-        std::make_shared<Session>(playerIdentifier, std::move(socket));
-    auto position = spawnPosition(playerIdentifier);
+    if (auto nonBlocking = socket.setNonBlocking(true); !nonBlocking) {
+      log.write(socketWarnings, Logging::Level::Warning,
+                "dropping connection: {}", nonBlocking.error().message);
+      return;
+    }
+    // Outbound frames are already batched per flush, so Nagle only adds
+    // latency.
+    if (auto noDelay = socket.setNoDelay(true); !noDelay) {
+      log.write(socketWarnings, Logging::Level::Warning,
+                "could not disable Nagle: {}", noDelay.error().message);
+    }
 
-    {
-      std::scoped_lock guard{playersMutex};
-      players.emplace(playerIdentifier,
-                      PlayerEntry{.position = position, .session = session});
+    auto shardIndex = nextShard;
+    nextShard = (nextShard + 1) % shards.size();
+    auto session = std::make_shared<Session>(
+        std::move(socket), shardIndex, *shards[shardIndex]->loop,
+        shards[shardIndex]->flushes, metrics, config.outbound,
+        TokenBucket{static_cast<double>(config.moveRate),
+                    static_cast<double>(config.moveBurst)},
+        TokenBucket{static_cast<double>(config.chatRate),
+                    static_cast<double>(config.chatBurst)});
+
+    // A gateway names the player in its first frame, so the session has to
+    // be read before it can join.
+    if (config.zone) {
+      session->stage = SessionStage::AwaitingEntry;
+      session->loop.get().post([this, session]() { watchSession(session); });
+      return;
+    }
+
+    queueJoin(std::move(session));
+  }
+
+  void queueJoin(std::shared_ptr<Session> session) {
+    std::scoped_lock guard{inputMutex};
+    queuedInputs.joins.push_back(std::move(session));
+  }
+
+  void watchSession(const std::shared_ptr<Session> &session) {
+    auto handle = session->connection.socket().nativeHandle();
+    auto watchResult = session->loop.get().watch(
+        handle, IoInterest::Readable,
+        [this, session](IoEvent event) { handleEvent(session, event); });
+    if (!watchResult) {
+      logSocketError("watch", session->playerId, watchResult.error());
+      closeSession(session);
+    }
+  }
+
+  // Runs on the session's event loop once the simulation has spawned it.
+  void attachSession(const std::shared_ptr<Session> &session) {
+    if (session->stage == SessionStage::Closed) {
+      // Hung up while the join was in flight.
+      std::scoped_lock guard{inputMutex};
+      queuedInputs.leaves.push_back(session->entity);
+      return;
     }
 
-    std::println("[server] player {} connected at ({}, {})", playerIdentifier,
-                 position.x, position.y);
+    shards[session->shard]->sessions.push_back(session);
+    updateChatSubscriptions(*shards[session->shard], session, 0,
+                            session->chatChannels);
+    session->stage = SessionStage::Live;
+    if (!config.zone) {
+      watchSession(session);
+      return;
+    }
 
-    if (auto snapshotResult = sendSnapshot(session, playerIdentifier);
-        !snapshotResult) {
-      std::println("[server] failed to initialize player {}: {}",
-                   playerIdentifier, snapshotResult.error().message);
-      session->socket.shutdown();
-      session->socket.close();
-      removePlayer(playerIdentifier);
+    // Resume reading and handle whatever arrived behind the ZoneEnter.
+    auto handle = session->connection.socket().nativeHandle();
+    if (auto resumed =
+            session->loop.get().modify(handle, IoInterest::Readable);
+        !resumed) {
+      logSocketError("watch", session->playerId, resumed.error());
+      closeSession(session);
       return;
     }
+    handleReadable(session);
+  }
 
-    broadcastState();
+  // Takes the placement from the gateway's first frame and queues the join.
+  // The loop stops watching the socket until the player has spawned, so no
+  // input is handled for an entity that does not exist yet.
+  auto handleZoneEntry(const std::shared_ptr<Session> &session,
+                       const Protocol::FrameView &frame) -> bool {
+    if (frame.header.type != Protocol::PacketType::ZoneEnter) {
+      log.write(protocolWarnings, Logging::Level::Warning,
+                "expected a zone entry, got packet type {}",
+                static_cast<unsigned>(frame.header.type));
+      return false;
+    }
+    auto entry = ZoneLink::decodeTransfer(frame.payload);
+    if (!entry) {
+      log.write(protocolWarnings, Logging::Level::Warning,
+                "zone entry decode error: {}",
+                describePacketError(entry.error()));
+      return false;
+    }
 
-    workers.emplace_back([this, session]() { handleClient(session); });
+    session->entry = *entry;
+    session->lastSequence = entry->sequence;
+    session->stage = SessionStage::Spawning;
+    auto handle = session->connection.socket().nativeHandle();
+    if (auto paused = session->loop.get().modify(handle, IoInterest::None);
+        !paused) {
+      logSocketError("watch", entry->player, paused.error());
+      return false;
+    }
+    queueJoin(session);
+    return true;
   }
 
-  void handleClient(const std::shared_ptr<Session> &session) {
+  void handleEvent(const std::shared_ptr<Session> &session, IoEvent event) {
+    if (event.writable) {
+      if (auto result = session->flushPending(); !result) {
+        logSocketError("send", session->playerId, result.error());
+        closeSession(session);
+        return;
+      }
+    }
+    if (event.readable || event.hangup) {
+      handleReadable(session);
+    }
+  }
+
+  void handleReadable(const std::shared_ptr<Session> &session) {
+    auto &connection = session->connection;
+    auto writer = loopWriter(session->shard);
+    auto filled = connection.fill();
+    if (!filled) {
+      logSocketError("receive", session->playerId, filled.error());
+      closeSession(session);
+      return;
+    }
+    metrics.bytesReceived.add(writer, *filled);
+
     while (true) {
-      auto headerBytes =
-          session->socket.receiveExact(Protocol::packetHeaderSize);
-      if (!headerBytes) {
-        logSocketError("receive header", session->playerId,
-                       headerBytes.error());
+      auto frameResult = Protocol::extractFrame(connection.received());
+      if (!frameResult) {
+        logPacketError("packet header", session->playerId,
+                       frameResult.error());
+        closeSession(session);
+        return;
+      }
+      if (!frameResult->has_value()) {
         break;
       }
 
-      auto &headerBuffer = headerBytes.value();
-      auto headerResult =
-          Protocol::decodeHeader(std::span<const std::byte>{headerBuffer});
-      if (!headerResult) {
-        std::println("[server] packet header error for player {}: {}",
-                     session->playerId,
-                     describePacketError(headerResult.error()));
+      auto frame = **frameResult;
+      metrics.framesReceived.add(writer);
+      if (session->stage == SessionStage::AwaitingEntry) {
+        if (!handleZoneEntry(session, frame)) {
+          closeSession(session);
+          return;
+        }
+        connection.consume(frame.size());
         break;
       }
+      if (session->stage == SessionStage::HandedOff) {
+        // The player belongs to another zone now.
+        connection.consume(frame.size());
+        continue;
+      }
+      if (ZoneLink::isZoneLink(frame.header.type)) {
+        log.write(protocolWarnings, Logging::Level::Warning,
+                  "unexpected zone link packet from player {}",
+                  session->playerId);
+        closeSession(session);
+        return;
+      }
 
-      auto packetHeader = headerResult.value();
-      auto payloadBytes =
-          session->socket.receiveExact(packetHeader.payloadSize);
-      if (!payloadBytes) {
-        logSocketError("receive payload", session->playerId,
-                       payloadBytes.error());
-        break;
+      // Chat is checked straight out of the receive buffer; only messages
+      // that pass are copied for the tick.
+      if (frame.header.type == Protocol::PacketType::Chat) {
+        auto chat = Protocol::viewChat(frame.payload);
+        if (!chat) {
+          logPacketError("packet decode", session->playerId, chat.error());
+          closeSession(session);
+          return;
+        }
+        handleChat(session, *chat);
+        connection.consume(frame.size());
+        continue;
       }
 
-      auto &payloadBuffer = payloadBytes.value();
-      auto packetResult = Protocol::decodePacket(
-          packetHeader, std::span<const std::byte>{payloadBuffer});
+      auto packetResult = Protocol::decodePacket(frame.header, frame.payload);
       if (!packetResult) {
-        std::println("[server] packet decode error for player {}: {}",
-                     session->playerId,
-                     describePacketError(packetResult.error()));
-        break;
+        logPacketError("packet decode", session->playerId,
+                       packetResult.error());
+        closeSession(session);
+        return;
       }
 
       std::visit(Overloaded{[&](const Protocol::MovementPacket &movement) {
@@ -195,174 +1071,917 @@ private:
                               // Clients should not send snapshots back to the
                               // server.
                             },
-                            [&](const Protocol::ChatPacket &chat) {
-                              handleChat(session, chat);
+                            [](const Protocol::ChatPacket &) {
+                              // Relayed from the view above.
+                            },
+                            [](const Protocol::ChatBatchPacket &) {
+                              // Batches only flow from server to client.
+                            },
+                            [&](const Protocol::ChatSubscriptionPacket
+                                    &subscription) {
+                              updateChatSubscriptions(
+                                  *shards[session->shard], session,
+                                  session->chatChannels,
+                                  subscription.channels);
+                            },
+                            [](const Protocol::StateDeltaPacket &) {
+                              // Deltas only flow from server to client.
+                            },
+                            [&](const Protocol::SnapshotAckPacket &ack) {
+                              handleAck(*session, ack);
+                            },
+                            [&](const Protocol::CapabilitiesPacket &offer) {
+                              handleCapabilities(session, offer);
                             }},
                  packetResult.value());
+      connection.consume(frame.size());
     }
 
-    session->socket.shutdown();
-    session->socket.close();
-    removePlayer(session->playerId);
-    broadcastState();
-    std::println("[server] player {} disconnected", session->playerId);
+    if (connection.peerClosed()) {
+      auto failure = session->failureOr(
+          SocketError{.code = SocketErrorCode::ConnectionClosed,
+                      .message = "receive",
+                      .system = {}});
+      logSocketError("receive", session->playerId, failure);
+      closeSession(session);
+    }
+  }
+
+  // Runs on the session's event loop; safe to call more than once.
+  void closeSession(const std::shared_ptr<Session> &session) {
+    if (!session->close()) {
+      return;
+    }
+    auto previous = std::exchange(session->stage, SessionStage::Closed);
+    if (session->datagramToken != 0) {
+      std::scoped_lock guard{datagramMutex};
+      datagramSessions.erase(session->datagramToken);
+    }
+    if (previous == SessionStage::AwaitingEntry) {
+      return;
+    }
+    // A session still spawning has no entity yet; attachSession queues its
+    // leave once the spawn lands. A handed-off one has already left.
+    if (previous == SessionStage::Live ||
+        previous == SessionStage::HandedOff) {
+      std::erase(shards[session->shard]->sessions, session);
+      updateChatSubscriptions(*shards[session->shard], session,
+                              session->chatChannels, 0);
+    }
+    if (previous == SessionStage::Live) {
+      std::scoped_lock guard{inputMutex};
+      queuedInputs.leaves.push_back(session->entity);
+    }
+    log.write(sessionEvents, Logging::Level::Info, "player {} disconnected",
+              session->playerId);
   }
 
   void handleMovement(const std::shared_ptr<Session> &session,
                       const Protocol::MovementPacket &movement) {
     if (movement.player != session->playerId) {
-      std::println("[server] ignoring spoofed movement for player {}",
-                   session->playerId);
+      log.write(spoofWarnings, Logging::Level::Warning,
+                "ignoring spoofed movement for player {}", session->playerId);
       return;
     }
 
-    bool updated = false;
-    {
-      std::scoped_lock guard{playersMutex};
-      auto entry = players.find(session->playerId);
-      if (entry == players.end()) {
+    // Throttled per session before it reaches the shared queue, so a flood
+    // from one client cannot crowd out everyone else's moves.
+    if (!session->moveBudget.tryTake()) {
+      metrics.throttledMoves.add(loopWriter(session->shard));
+      session->rejectedInput =
+          std::max(session->rejectedInput, movement.sequence);
+      return;
+    }
+    if (!moveQueue.tryPush(QueuedMove{.entity = session->entity,
+                                      .direction = movement.direction,
+                                      .sequence = movement.sequence})) {
+      metrics.droppedMoves.add(loopWriter(session->shard));
+      session->rejectedInput =
+          std::max(session->rejectedInput, movement.sequence);
+      return;
+    }
+    session->queuedInput = std::max(session->queuedInput, movement.sequence);
+  }
+
+  // Accepts whatever the server supports and echoes the agreed set back.
+  void handleCapabilities(const std::shared_ptr<Session> &session,
+                          const Protocol::CapabilitiesPacket &offer) {
+    auto accepted = offer.capabilities & config.capabilities;
+    session->compactEntities =
+        (accepted & Protocol::compactEntitiesCapability) != 0;
+    session->compressPayloads =
+        (accepted & Protocol::compressionCapability) != 0;
+    if (!datagramSocket) {
+      accepted &= ~Protocol::datagramCapability;
+    }
+    auto reply = Protocol::encodeFrame(
+        Protocol::CapabilitiesPacket{.capabilities = accepted});
+    if (auto result = session->send(std::move(reply)); !result) {
+      logSocketError("send", session->playerId, result.error());
+      closeSession(session);
+      return;
+    }
+    if ((accepted & Protocol::datagramCapability) != 0) {
+      offerDatagrams(session);
+    }
+  }
+
+  // Hands the client a token to quote from its UDP socket. Deltas keep going
+  // over TCP until the hello arrives.
+  void offerDatagrams(const std::shared_ptr<Session> &session) {
+    if (session->datagramToken == 0) {
+      auto &source = shards[session->shard]->tokenSource;
+      std::scoped_lock guard{datagramMutex};
+      while (session->datagramToken == 0 ||
+             datagramSessions.contains(session->datagramToken)) {
+        session->datagramToken =
+            (std::uint64_t{source()} << 32U) | std::uint64_t{source()};
+      }
+      datagramSessions.emplace(session->datagramToken, session);
+    }
+    auto setup = Datagram::encodeSetup(Datagram::SetupPacket{
+        .token = session->datagramToken, .port = config.port});
+    if (auto result = session->send(std::move(setup)); !result) {
+      logSocketError("send", session->playerId, result.error());
+      closeSession(session);
+    }
+  }
+
+  // Acknowledging noBaseline asks for a full state. The world may be quiet,
+  // so the next tick is told to run a round even if nothing changes.
+  void handleAck(Session &session, const Protocol::SnapshotAckPacket &ack) {
+    session.ackedSequence = ack.sequence;
+    session.unackedDatagrams = 0;
+    if (ack.sequence == Protocol::noBaseline) {
+      session.fullStateWanted = true;
+      shards[session.shard]->unconfirmed.store(true);
+    }
+  }
+
+  // Runs on the first shard's loop. Hellos are all clients send over UDP;
+  // each is handed to its session's own loop.
+  void receiveDatagrams() {
+    std::array<std::byte, Datagram::maxDatagramSize> buffer{};
+    while (true) {
+      Moonlapse::Net::SocketAddress source;
+      auto received = datagramSocket->receiveFrom(buffer, source);
+      if (!received) {
+        if (received.error().code != SocketErrorCode::WouldBlock) {
+          log.write(socketWarnings, Logging::Level::Warning,
+                    "UDP receive failed: {}", received.error().message);
+        }
         return;
       }
-      auto &position = entry->second.position;
-      Protocol::Position previous = position;
-      applyMovement(position, movement.direction);
-      updated = previous.x != position.x || previous.y != position.y;
+      metrics.bytesReceived.add(loopWriter(0), *received);
+
+      auto hello =
+          Datagram::decodeHello(std::span{buffer}.first(*received));
+      if (!hello) {
+        log.write(protocolWarnings, Logging::Level::Warning,
+                  "ignoring datagram: {}", describePacketError(hello.error()));
+        continue;
+      }
+      std::shared_ptr<Session> session;
+      {
+        std::scoped_lock guard{datagramMutex};
+        if (auto found = datagramSessions.find(hello->token);
+            found != datagramSessions.end()) {
+          session = found->second.lock();
+        }
+      }
+      if (!session) {
+        continue;
+      }
+      session->loop.get().post([this, session, source]() {
+        adoptDatagramPeer(*session, source);
+      });
     }
+  }
 
-    if (updated) {
-      broadcastState();
+  // A repeated hello from a new address follows the client across a NAT
+  // rebinding.
+  void adoptDatagramPeer(Session &session,
+                         const Moonlapse::Net::SocketAddress &source) {
+    if (session.stage == SessionStage::Closed || session.datagramsFailed ||
+        session.datagramPeer == source) {
+      return;
+    }
+    if (!session.datagramPeer) {
+      log.write(sessionEvents, Logging::Level::Info,
+                "player {} receives state updates over UDP",
+                session.playerId);
     }
+    session.datagramPeer = source;
+    session.unackedDatagrams = 0;
   }
 
   void handleChat(const std::shared_ptr<Session> &session,
-                  const Protocol::ChatPacket &chat) {
+                  const Protocol::ChatView &chat) {
     if (chat.player != session->playerId) {
-      std::println("[server] ignoring spoofed chat for player {}",
-                   session->playerId);
+      log.write(spoofWarnings, Logging::Level::Warning,
+                "ignoring spoofed chat for player {}", session->playerId);
       return;
     }
 
-    broadcastChat(chat);
+    // Bounded the same way as moves: a chatty client spends its own budget
+    // and the queue caps what a tick can be asked to fan out.
+    if (!session->chatBudget.tryTake()) {
+      metrics.throttledChats.add(loopWriter(session->shard));
+      return;
+    }
+    if (!chatQueue.tryPush(
+            Protocol::ChatPacket{.player = chat.player,
+                                 .channel = chat.channel,
+                                 .message = std::string{chat.message}})) {
+      metrics.droppedChats.add(loopWriter(session->shard));
+    }
   }
 
-  static void logSocketError(std::string_view action,
-                             Protocol::PlayerId playerIdentifier,
-                             const SocketError &error) {
+  // Loop thread only. Moves the session between the shard's channel lists
+  // so fan-out never looks at sessions that are not listening.
+  static void updateChatSubscriptions(LoopShard &shard,
+                                      const std::shared_ptr<Session> &session,
+                                      std::uint32_t before,
+                                      std::uint32_t after) {
+    for (std::size_t channel = 0; channel < Protocol::chatChannelCount;
+         ++channel) {
+      auto bit =
+          Protocol::channelBit(static_cast<Protocol::ChatChannel>(channel));
+      if (((before ^ after) & bit) == 0) {
+        continue;
+      }
+      auto &subscribers = shard.chatSubscribers[channel];
+      if ((after & bit) != 0) {
+        subscribers.push_back(session);
+      } else {
+        std::erase(subscribers, session);
+      }
+    }
+    session->chatChannels = after;
+  }
+
+  void logSocketError(std::string_view action,
+                      Protocol::PlayerId playerIdentifier,
+                      const SocketError &error) {
     if (error.code == SocketErrorCode::ConnectionClosed) {
-      std::println("[server] player {} closed the connection",
-                   playerIdentifier);
+      log.write(sessionEvents, Logging::Level::Info,
+                "player {} closed the connection", playerIdentifier);
       return;
     }
 
-    std::println("[server] {} failed for player {}: {}", action,
-                 playerIdentifier, error.message);
+    log.write(socketWarnings, Logging::Level::Warning,
+              "{} failed for player {}: {}", action, playerIdentifier,
+              error.message);
+  }
+
+  void logPacketError(std::string_view stage,
+                      Protocol::PlayerId playerIdentifier,
+                      Protocol::PacketError error) {
+    log.write(protocolWarnings, Logging::Level::Warning,
+              "{} error for player {}: {}", stage, playerIdentifier,
+              describePacketError(error));
   }
 
-  [[nodiscard]] auto gatherSnapshot(Protocol::PlayerId focus) const
-      -> Protocol::StateSnapshotPacket {
-    Protocol::StateSnapshotPacket snapshot{};
-    snapshot.focusPlayer = focus;
+  void simulationLoop(const std::stop_token &stopToken) {
+    using Clock = std::chrono::steady_clock;
+    const auto period = std::chrono::duration_cast<Clock::duration>(
+                            std::chrono::seconds{1}) /
+                        config.tickRate;
+
+    const auto statsPeriod = std::chrono::duration_cast<Clock::duration>(
+        std::chrono::seconds{config.statsInterval});
+
+    auto nextTick = Clock::now();
+    auto nextStats = nextTick + statsPeriod;
+    while (!stopToken.stop_requested()) {
+      nextTick += period;
+      {
+        Metrics::ScopedTimer timer{metrics.tickDuration, simulationWriter};
+        tick();
+      }
 
-    std::scoped_lock guard{playersMutex};
-    snapshot.players.reserve(players.size());
-    for (const auto &[playerIdentifier, entry] : players) {
-      snapshot.players.emplace_back(
-          Protocol::PlayerState{playerIdentifier, entry.position});
+      auto now = Clock::now();
+      if (config.statsInterval > 0 && now >= nextStats) {
+        logOutboundStats();
+        logInputStats();
+        nextStats = now + statsPeriod;
+      }
+      if (now > nextTick + period) {
+        // Too far behind to catch up; skip the missed ticks instead of
+        // bursting through them.
+        nextTick = now;
+        continue;
+      }
+      std::this_thread::sleep_until(nextTick);
     }
-    return snapshot;
   }
 
-  [[nodiscard]] auto snapshotSessions() const
-      -> std::vector<std::shared_ptr<Session>> {
-    std::vector<std::shared_ptr<Session>> sessions;
-    std::scoped_lock guard{playersMutex};
-    sessions.reserve(players.size());
-    for (const auto &[playerIdentifier, entry] : players) {
-      sessions.push_back(entry.session);
+  // Applies everything queued since the previous tick, publishes the new
+  // world state and asks each event loop to send at most one snapshot to
+  // each of its sessions.
+  void tick() {
+    {
+      std::scoped_lock guard{inputMutex};
+      std::swap(queuedInputs, tickInputs);
     }
-    return sessions;
+    while (auto movement = moveQueue.tryPop()) {
+      tickInputs.moves.push_back(*movement);
+    }
+    while (auto chat = chatQueue.tryPop()) {
+      tickInputs.chats.push_back(std::move(*chat));
+    }
+    if (tickInputs.empty() && waitingEntries.empty()) {
+      repeatUnconfirmed();
+      return;
+    }
+
+    // Leaves first, so an id freed and handed out again within one tick is
+    // free by the time the new player claims it.
+    bool changed = false;
+    for (auto entity : tickInputs.leaves) {
+      changed = removePlayer(entity) || changed;
+    }
+    retryingEntries.swap(waitingEntries);
+    for (const auto &session : retryingEntries) {
+      changed = addPlayer(session) || changed;
+    }
+    retryingEntries.clear();
+    for (const auto &session : tickInputs.joins) {
+      changed = addPlayer(session) || changed;
+    }
+    for (const auto &movement : tickInputs.moves) {
+      changed = movePlayer(movement) || changed;
+    }
+
+    if (changed) {
+      publishWorld();
+      broadcastState();
+    } else {
+      repeatUnconfirmed();
+    }
+    // After the publish, so local chat is placed by this tick's positions.
+    if (!tickInputs.chats.empty()) {
+      broadcastChat(tickInputs.chats);
+    }
+    tickInputs.clear();
+  }
+
+  void logOutboundStats() {
+    std::size_t sessions = 0;
+    OutboundStats total{};
+    std::size_t deepest = 0;
+    for (const auto &shard : shards) {
+      sessions += shard->stats.sessions.load();
+      total.queuedFrames += shard->stats.queuedFrames.load();
+      total.pendingBytes += shard->stats.pendingBytes.load();
+      total.droppedFrames += shard->stats.droppedFrames.load();
+      deepest = std::max(deepest, shard->stats.deepestQueue.load());
+    }
+    if (sessions == 0) {
+      return;
+    }
+    log.info("outbound queues: {} session(s), {} frame(s) / {} byte(s) "
+             "pending, deepest {} byte(s), {} stale snapshot(s) dropped",
+             sessions, total.queuedFrames, total.pendingBytes, deepest,
+             total.droppedFrames);
   }
 
-  void broadcastState(Protocol::PlayerId focus = 0) {
-    auto snapshot = gatherSnapshot(focus);
-    auto encoded = Protocol::encode(snapshot);
-    auto recipients = snapshotSessions();
+  void logInputStats() {
+    auto throttled = metrics.throttledMoves.value() - loggedThrottledMoves;
+    auto dropped = metrics.droppedMoves.value() - loggedDroppedMoves;
+    auto throttledChats =
+        metrics.throttledChats.value() - loggedThrottledChats;
+    auto droppedChats = metrics.droppedChats.value() - loggedDroppedChats;
+    loggedThrottledMoves += throttled;
+    loggedDroppedMoves += dropped;
+    loggedThrottledChats += throttledChats;
+    loggedDroppedChats += droppedChats;
+    if (throttled != 0 || dropped != 0) {
+      log.info("inputs: {} move(s) over the rate limit, {} dropped on a "
+               "full queue",
+               throttled, dropped);
+    }
+    if (throttledChats != 0 || droppedChats != 0) {
+      log.info("inputs: {} chat message(s) over the rate limit, {} dropped "
+               "on a full queue",
+               throttledChats, droppedChats);
+    }
+  }
 
-    for (const auto &recipient : recipients) {
-      if (!recipient) {
-        continue;
+  // Gives the session its entity and hands it to its event loop, which
+  // starts reading from it.
+  auto addPlayer(const std::shared_ptr<Session> &session) -> bool {
+    EntityHandle entity{};
+    Protocol::Position position{};
+    if (session->entry) {
+      auto claimed = players.claim(session->entry->player);
+      if (!claimed && session->entryWaits++ < entryWaitTicks) {
+        waitingEntries.push_back(session);
+        return false;
+      }
+      if (!claimed) {
+        log.warning("player {} is already in this zone",
+                    session->entry->player);
+        session->loop.get().post(
+            [this, session]() { closeSession(session); });
+        return false;
       }
-      if (auto result = recipient->send(std::span<const std::byte>{encoded});
-          !result) {
-        std::println("[server] broadcast failed for player {}: {}",
-                     recipient->playerId, result.error().message);
-        removePlayer(recipient->playerId);
+      entity = *claimed;
+      position = session->entry->position;
+    } else {
+      entity = players.allocate();
+      position = spawnPosition(PlayerStore::idOf(entity));
+      auto restored = dormantPositions.find(PlayerStore::idOf(entity));
+      if (restored != dormantPositions.end()) {
+        position = restored->second;
+        dormantPositions.erase(restored);
+        worldWriter->claimed(PlayerStore::idOf(entity));
       }
     }
+    session->entity = entity;
+    session->playerId = PlayerStore::idOf(entity);
+    if (!players.spawn(entity, position)) {
+      return false;
+    }
+    processedInputs.resize(players.slotCount());
+    processedInputs[entity.slot] =
+        session->entry ? session->entry->lastProcessedInput : 0;
+
+    session->loop.get().post(
+        [this, session]() { attachSession(session); });
+    log.write(sessionEvents, Logging::Level::Info,
+              "player {} connected at ({}, {})", session->playerId, position.x,
+              position.y);
+    return true;
   }
 
-  void broadcastChat(const Protocol::ChatPacket &chat) {
-    auto encoded = Protocol::encode(chat);
-    auto recipients = snapshotSessions();
+  // A move into a wall still counts as a change, since the client is
+  // waiting to hear that it was processed.
+  auto movePlayer(const QueuedMove &movement) -> bool {
+    auto *position = players.position(movement.entity);
+    if (position == nullptr) {
+      return false;
+    }
+    applyMovement(*position, movement.direction);
+    processedInputs[movement.entity.slot] = movement.sequence;
+    return true;
+  }
 
-    for (const auto &recipient : recipients) {
-      if (!recipient) {
-        continue;
-      }
-      if (auto result = recipient->send(std::span<const std::byte>{encoded});
-          !result) {
-        std::println("[server] chat broadcast failed for player {}: {}",
-                     recipient->playerId, result.error().message);
-        removePlayer(recipient->playerId);
+  void publishWorld() {
+    Metrics::ScopedTimer timer{metrics.gatherDuration, simulationWriter};
+    world.publish([this](WorldFrame &frame) {
+      players.gather(frame.states);
+      frame.grid.rebuild(frame.states);
+      frame.processedInputs.assign(processedInputs.begin(),
+                                   processedInputs.end());
+    });
+  }
+
+  // A loop that has not yet run the previous request picks up the newer
+  // frame when it does, so slow loops skip versions rather than queue them.
+  void broadcastState() {
+    for (auto &shard : shards) {
+      postStateRound(*shard);
+    }
+  }
+
+  // A UDP delta may have been lost, or a client may have asked for a full
+  // state, without anything changing since; those loops still get a round.
+  void repeatUnconfirmed() {
+    for (auto &shard : shards) {
+      if (shard->unconfirmed.exchange(false)) {
+        postStateRound(*shard);
       }
     }
   }
 
-  SocketResult<void> sendSnapshot(const std::shared_ptr<Session> &session,
-                                  Protocol::PlayerId focus) {
-    auto snapshot = gatherSnapshot(focus);
-    auto encoded = Protocol::encode(snapshot);
-    return session->send(std::span<const std::byte>{encoded});
+  void postStateRound(LoopShard &shard) {
+    if (shard.statePending.exchange(true)) {
+      return;
+    }
+    shard.loop->post([this, &shard]() {
+      shard.statePending.store(false);
+      sendStateDeltas(shard);
+    });
   }
 
-  void removePlayer(Protocol::PlayerId playerIdentifier) {
-    std::shared_ptr<Session> removed;
+  // Runs on the shard's event loop. Each session only hears about players
+  // inside its view radius; entities crossing the edge show up as
+  // added/removed entries in its delta.
+  void sendStateDeltas(LoopShard &shard) {
+    std::vector<std::shared_ptr<Session>> failed;
+    bool unconfirmed = false;
     {
-      std::scoped_lock guard{playersMutex};
-      auto entry = players.find(playerIdentifier);
-      if (entry == players.end()) {
-        return;
+      auto frame = world.read();
+      const auto &current = frame->states;
+      for (const auto &recipient : shard.sessions) {
+        if (recipient->stage != SessionStage::Live) {
+          continue;
+        }
+        auto self = std::ranges::lower_bound(current, recipient->playerId, {},
+                                             &Protocol::PlayerState::player);
+        if (self == current.end() || self->player != recipient->playerId) {
+          continue;
+        }
+        auto processedInput = recipient->inputEcho(
+            frame->processedInput(recipient->entity));
+        if (nodeZones &&
+            nodeZones->zoneOf(self->position) != config.zone->index) {
+          if (auto result = handOff(*recipient, *self, processedInput);
+              !result) {
+            failed.push_back(recipient);
+          }
+          continue;
+        }
+
+        frame->grid.query(self->position, config.viewRadius, shard.visible);
+        if (auto result =
+                sendDelta(*recipient, shard.visible, processedInput,
+                          shard.delta, shard.compressor, shard.fragmenter);
+            !result) {
+          logSocketError("broadcast", recipient->playerId, result.error());
+          failed.push_back(recipient);
+        }
+        unconfirmed = unconfirmed ||
+                      (recipient->datagramPeer &&
+                       Protocol::isNewerSequence(recipient->viewSequence,
+                                                 recipient->ackedSequence));
+      }
+    }
+    if (unconfirmed) {
+      shard.unconfirmed.store(true);
+    }
+
+    for (const auto &session : failed) {
+      closeSession(session);
+    }
+    // Queued behind the flushes the sends just posted, so the figures show
+    // what is still stuck once this round has gone out.
+    shard.loop->post([this, &shard]() { recordShardStats(shard); });
+  }
+
+  // The player walked out of this zone's strip: tell the gateway where, and
+  // drop them from this zone's world.
+  auto handOff(Session &session, const Protocol::PlayerState &state,
+               std::uint32_t processedInput) -> SocketResult<void> {
+    session.stage = SessionStage::HandedOff;
+    {
+      std::scoped_lock guard{inputMutex};
+      queuedInputs.leaves.push_back(session.entity);
+    }
+    log.write(sessionEvents, Logging::Level::Info,
+              "player {} left the zone at ({}, {})", state.player,
+              state.position.x, state.position.y);
+    return session.send(
+        ZoneLink::encodeHandoff(ZoneLink::TransferPacket{
+            .player = state.player,
+            .position = state.position,
+            .sequence = session.lastSequence,
+            .lastProcessedInput = processedInput}));
+  }
+
+  void recordShardStats(LoopShard &shard) {
+    OutboundStats total{};
+    std::size_t deepest = 0;
+    for (const auto &session : shard.sessions) {
+      auto stats = session->outboundStats();
+      metrics.queuedBytes.record(loopWriter(session->shard),
+                                 stats.pendingBytes);
+      total.queuedFrames += stats.queuedFrames;
+      total.pendingBytes += stats.pendingBytes;
+      total.droppedFrames += stats.droppedFrames;
+      deepest = std::max(deepest, stats.pendingBytes);
+    }
+    shard.stats.sessions.store(shard.sessions.size());
+    shard.stats.queuedFrames.store(total.queuedFrames);
+    shard.stats.pendingBytes.store(total.pendingBytes);
+    shard.stats.deepestQueue.store(deepest);
+    shard.stats.droppedFrames.store(total.droppedFrames);
+  }
+
+  // Encodes the changes since the newest snapshot the client acknowledged,
+  // or the full state when that baseline is unknown or already evicted.
+  // Nothing is sent unless the view or the input echo has moved on.
+  auto sendDelta(Session &session,
+                 std::span<const Protocol::PlayerState> current,
+                 std::uint32_t processedInput,
+                 Protocol::StateDeltaPacket &delta,
+                 Protocol::PayloadCompressor &compressor,
+                 Datagram::Fragmenter &fragmenter) -> SocketResult<void> {
+    const auto *latest = session.baselines.latest();
+    bool unchanged = latest != nullptr &&
+                     std::ranges::equal(*latest, current) &&
+                     processedInput == session.echoedInput;
+    // A datagram may have been lost, so over UDP the view is repeated until
+    // the client confirms it has it.
+    if (unchanged && !session.fullStateWanted &&
+        (!session.datagramPeer ||
+         !Protocol::isNewerSequence(session.viewSequence,
+                                    session.ackedSequence))) {
+      return {};
+    }
+
+    auto acked = session.ackedSequence;
+    session.fullStateWanted = false;
+    const auto *baseline = session.baselines.find(acked);
+    delta.sequence = Protocol::nextSequence(session.lastSequence);
+    delta.baseline = baseline != nullptr ? acked : Protocol::noBaseline;
+    delta.focusPlayer = session.playerId;
+    delta.lastProcessedInput = processedInput;
+    session.echoedInput = processedInput;
+    auto previous = baseline != nullptr
+                        ? std::span<const Protocol::PlayerState>{*baseline}
+                        : std::span<const Protocol::PlayerState>{};
+    Protocol::diffStates(previous, current, delta);
+
+    session.baselines.store(delta.sequence, current);
+    session.lastSequence = delta.sequence;
+    if (!unchanged) {
+      session.viewSequence = delta.sequence;
+    }
+    auto encoding = session.compactEntities
+                        ? Protocol::EntityEncoding::Compact
+                        : Protocol::EntityEncoding::Full;
+    auto writer = loopWriter(session.shard);
+    auto frame = [&]() {
+      Metrics::ScopedTimer timer{metrics.encodeDuration, writer};
+      return session.compressPayloads
+                 ? Protocol::encodeFrame(delta, encoding, compressor)
+                 : Protocol::encodeFrame(delta, encoding);
+    }();
+    metrics.deltaBytes.record(writer, frame.size());
+    if (session.datagramPeer && sendDatagrams(session, frame, fragmenter)) {
+      return {};
+    }
+    return session.send(std::move(frame), FrameKind::Latest);
+  }
+
+  // False when the frame has to go over TCP after all: it needs too many
+  // fragments, or the UDP path has stopped delivering. A datagram the
+  // socket cannot take right now is lost like any other.
+  auto sendDatagrams(Session &session, const Frame &frame,
+                     Datagram::Fragmenter &fragmenter) -> bool {
+    auto writer = loopWriter(session.shard);
+    if (session.unackedDatagrams >= datagramFallbackDeltas) {
+      log.write(sessionEvents, Logging::Level::Warning,
+                "no acknowledgements over UDP from player {}; back to TCP",
+                session.playerId);
+      metrics.datagramFallbacks.add(writer);
+      session.datagramPeer.reset();
+      session.datagramsFailed = true;
+      return false;
+    }
+    session.datagramSequence =
+        Protocol::nextSequence(session.datagramSequence);
+    if (!fragmenter.split(frame.bytes(), session.datagramSequence)) {
+      return false;
+    }
+
+    ++session.unackedDatagrams;
+    for (std::size_t index = 0; index < fragmenter.count(); ++index) {
+      auto sent = datagramSocket->sendTo(fragmenter.datagram(index),
+                                         *session.datagramPeer);
+      if (!sent) {
+        if (sent.error().code != SocketErrorCode::WouldBlock) {
+          logSocketError("UDP send", session.playerId, sent.error());
+        }
+        break;
       }
-      removed = std::move(entry->second.session);
-      players.erase(entry);
+      metrics.datagramsSent.add(writer);
+      metrics.bytesSent.add(writer, *sent);
     }
+    return true;
+  }
 
-    if (removed) {
-      removed->socket.shutdown();
-      removed->socket.close();
+  // Hands the tick's chat to every loop as one round.
+  void broadcastChat(std::vector<Protocol::ChatPacket> &messages) {
+    auto round = std::make_shared<ChatRound>();
+    round->messages.swap(messages);
+    for (std::size_t index = 0; index < round->messages.size(); ++index) {
+      auto channel = static_cast<std::size_t>(round->messages[index].channel);
+      round->byChannel[channel].push_back(static_cast<std::uint32_t>(index));
+    }
+    std::shared_ptr<const ChatRound> shared = std::move(round);
+    for (auto &shard : shards) {
+      shard->loop->post([this, &shard = *shard, shared]() {
+        sendChatRound(shard, *shared);
+      });
     }
   }
 
-  [[nodiscard]] static auto spawnPosition(Protocol::PlayerId playerIdentifier)
-      -> Protocol::Position {
-    auto positionIndex = static_cast<std::int32_t>(playerIdentifier - 1);
-    auto coordinateX = positionIndex % gridWidth;
-    auto coordinateY = (positionIndex / gridWidth) % gridHeight;
-    return Protocol::Position{coordinateX, coordinateY};
+  // Runs on the shard's event loop. Each channel's subscribers collect the
+  // messages they are due, local ones only from speakers within their view
+  // radius, and then every recipient gets the round in a single batch.
+  // Recipients due the same messages share one encoding.
+  void sendChatRound(LoopShard &shard, const ChatRound &round) {
+    constexpr auto localChannel =
+        static_cast<std::size_t>(Protocol::ChatChannel::Local);
+    const auto &localSubscribers = shard.chatSubscribers[localChannel];
+    shard.chatSpeakers.resize(round.messages.size());
+    shard.chatListeners.clear();
+    if (!round.byChannel[localChannel].empty()) {
+      // Only local chat depends on where players stand. Their positions are
+      // copied out so the world is not pinned while the round fans out.
+      auto frame = world.read();
+      const auto &states = frame->states;
+      auto positionOf = [&states](Protocol::PlayerId player)
+          -> std::optional<Protocol::Position> {
+        auto found = std::ranges::lower_bound(states, player, {},
+                                              &Protocol::PlayerState::player);
+        if (found == states.end() || found->player != player) {
+          return std::nullopt;
+        }
+        return found->position;
+      };
+      for (auto index : round.byChannel[localChannel]) {
+        shard.chatSpeakers[index] = positionOf(round.messages[index].player);
+      }
+      for (const auto &recipient : localSubscribers) {
+        shard.chatListeners.push_back(positionOf(recipient->playerId));
+      }
+    }
+
+    for (std::size_t channel = 0; channel < Protocol::chatChannelCount;
+         ++channel) {
+      const auto &indices = round.byChannel[channel];
+      if (indices.empty()) {
+        continue;
+      }
+      const auto &subscribers = shard.chatSubscribers[channel];
+      for (std::size_t subscriber = 0; subscriber < subscribers.size();
+           ++subscriber) {
+        const auto &recipient = subscribers[subscriber];
+        if (recipient->stage != SessionStage::Live) {
+          continue;
+        }
+        std::optional<Protocol::Position> listener;
+        if (channel == localChannel) {
+          listener = shard.chatListeners[subscriber];
+          if (!listener) {
+            continue;
+          }
+        }
+        for (auto index : indices) {
+          if (listener) {
+            const auto &speaker = shard.chatSpeakers[index];
+            if (!speaker || !SpatialGrid::withinRadius(*speaker, *listener,
+                                                       config.viewRadius)) {
+              continue;
+            }
+          }
+          if (recipient->chatSelection.empty()) {
+            shard.chatRecipients.push_back(recipient);
+          }
+          recipient->chatSelection.push_back(index);
+        }
+      }
+    }
+
+    std::map<std::vector<std::uint32_t>, std::vector<Frame>> encoded;
+    std::vector<std::shared_ptr<Session>> failed;
+    for (const auto &recipient : shard.chatRecipients) {
+      auto &selection = recipient->chatSelection;
+      // Channels were walked one after another; restore arrival order.
+      std::ranges::sort(selection);
+      auto [batches, inserted] = encoded.try_emplace(selection);
+      if (inserted) {
+        shard.chatViews.clear();
+        for (auto index : selection) {
+          const auto &message = round.messages[index];
+          shard.chatViews.push_back(Protocol::ChatView{
+              .player = message.player,
+              .channel = message.channel,
+              .message = message.message});
+        }
+        batches->second = Protocol::encodeChatBatches(shard.chatViews);
+      }
+      selection.clear();
+      for (const auto &batch : batches->second) {
+        if (auto result = recipient->send(batch); !result) {
+          logSocketError("chat broadcast", recipient->playerId,
+                         result.error());
+          failed.push_back(recipient);
+          break;
+        }
+      }
+    }
+    shard.chatRecipients.clear();
+
+    for (const auto &session : failed) {
+      closeSession(session);
+    }
   }
 
+  // Restored players are seated again as their ids are handed out.
+  void startWorldWriter(Persistence::SavedWorld saved) {
+    for (const auto &state : saved.states) {
+      dormantPositions.emplace(state.player, state.position);
+    }
+    worldWriter = std::make_unique<Persistence::WorldWriter>(
+        *config.worldFile, std::move(saved),
+        [this](std::vector<Protocol::PlayerState> &states) {
+          // Copied into the writer's own storage and let go before any
+          // diffing or disk work.
+          auto frame = world.read();
+          states.assign(frame->states.begin(), frame->states.end());
+        },
+        Persistence::WorldWriter::Settings{
+            .journalInterval = journalInterval,
+            .checkpointInterval = std::chrono::seconds{
+                config.checkpointInterval}},
+        log);
+  }
+
+  auto removePlayer(EntityHandle entity) -> bool {
+    return players.release(entity);
+  }
+
+  // First in, last out: every thread below may still be logging while it
+  // shuts down.
+  Logging::Logger log;
+  // Per-client trouble tends to arrive in storms.
+  Logging::Throttle protocolWarnings{clientWarningsPerSecond};
+  Logging::Throttle socketWarnings{clientWarningsPerSecond};
+  Logging::Throttle spoofWarnings{clientWarningsPerSecond};
+  Logging::Throttle sessionEvents{sessionEventsPerSecond};
   TcpListener listener;
-  std::atomic<Protocol::PlayerId> nextId{1};
-  mutable std::mutex playersMutex;
-  std::unordered_map<Protocol::PlayerId, PlayerEntry> players;
-  std::vector<std::jthread> workers;
+  // Shared by every loop: sends go straight out, receives are watched on
+  // the first loop.
+  std::optional<UdpSocket> datagramSocket;
+  // Outstanding tokens from offerDatagrams.
+  std::mutex datagramMutex;
+  std::unordered_map<std::uint64_t, std::weak_ptr<Session>> datagramSessions;
+  std::vector<std::unique_ptr<LoopShard>> shards;
+  ServerConfig config;
+  std::size_t nextShard{0};
+  std::optional<Moonlapse::World::ZoneLayout> nodeZones;
+  // Owned by the simulation thread; everyone else reads the published world.
+  PlayerStore players;
+  // Indexed by slot: the newest move sequence applied to each player.
+  std::vector<std::uint32_t> processedInputs;
+  Concurrency::VersionedBuffer<WorldFrame> world;
+  // Simulation thread only: ZoneEnters waiting for their id to be released.
+  std::vector<std::shared_ptr<Session>> waitingEntries;
+  std::vector<std::shared_ptr<Session>> retryingEntries;
+  // Simulation thread only: saved positions whose ids are not back yet.
+  std::unordered_map<Protocol::PlayerId, Protocol::Position> dormantPositions;
+  // Reads world from its own thread, so it goes before world does.
+  std::unique_ptr<Persistence::WorldWriter> worldWriter;
+  ServerMetrics metrics;
+  // Joins and leaves are rare and must never be dropped, so they go through
+  // the mutex; moves and chat take bounded lock-free queues.
+  std::mutex inputMutex;
+  TickInputs queuedInputs;
+  Concurrency::MpscQueue<QueuedMove> moveQueue;
+  Concurrency::MpscQueue<Protocol::ChatPacket> chatQueue;
+  // Simulation thread only.
+  std::uint64_t loggedThrottledMoves{0};
+  std::uint64_t loggedDroppedMoves{0};
+  std::uint64_t loggedThrottledChats{0};
+  std::uint64_t loggedDroppedChats{0};
+  TickInputs tickInputs;
+  std::vector<std::jthread> loopThreads;
+  std::jthread simulationThread;
 };
 
 } // namespace
 
-auto main() -> int {
+auto main(int argc, char **argv) -> int {
+  auto configResult = parseServerConfig(
+      std::span<char *const>{argv, static_cast<std::size_t>(argc)});
+  if (!configResult) {
+    std::println("[server] {}", configResult.error());
+    std::println(
+        "[server] usage: moonlapse_server [--port PORT] [--zone INDEX/COUNT] "
+        "[--admin-port PORT] [--io-threads N] [--tick-rate HZ] "
+        "[--view-radius CELLS] [--max-queued-bytes BYTES] "
+        "[--snapshot-policy latest|all] [--stats-interval SECONDS] "
+        "[--move-rate PER_SECOND] [--move-burst MOVES] "
+        "[--chat-rate PER_SECOND] [--chat-burst MESSAGES] "
+        "[--input-queue ENTRIES] [--compression on|off] [--udp on|off] "
+        "[--log-level debug|info|warning|error] "
+        "[--world-file PATH] [--checkpoint-interval SECONDS]");
+    return 1;
+  }
+  auto config = configResult.value();
+
+  std::optional<Persistence::SavedWorld> saved;
+  if (config.worldFile) {
+    auto loaded = Persistence::loadWorld(*config.worldFile);
+    if (!loaded) {
+      std::println("[server] world load failed: {}", loaded.error().message);
+      return 1;
+    }
+    std::println("[server] restored {} player(s) from {} with {} journal "
+                 "record(s){}",
+                 loaded->states.size(), config.worldFile->string(),
+                 loaded->journalRecords,
+                 loaded->discardedTail ? ", dropping a torn tail" : "");
+    saved = std::move(loaded.value());
+  }
+
   constexpr std::string_view listenAddress = "0.0.0.0";
-  auto listenerResult = TcpListener::bind(listenAddress, serverPort);
+  auto listenerResult = TcpListener::bind(listenAddress, config.port);
   if (!listenerResult) {
     std::println("[server] bind failed: {}", listenerResult.error().message);
     return 1;
@@ -374,8 +1993,59 @@ auto main() -> int {
     return 1;
   }
 
-  std::println("[server] listening on {}:{}", listenAddress, serverPort);
-  GameServer server{std::move(listenerInstance)};
+  // State deltas for clients that ask go over UDP on the same port number.
+  std::optional<UdpSocket> datagrams;
+  if ((config.capabilities & Protocol::datagramCapability) != 0) {
+    auto bound = UdpSocket::bind(listenAddress, config.port);
+    if (!bound) {
+      std::println("[server] UDP bind failed: {}", bound.error().message);
+      return 1;
+    }
+    if (auto nonBlocking = bound->setNonBlocking(true); !nonBlocking) {
+      std::println("[server] UDP setup failed: {}",
+                   nonBlocking.error().message);
+      return 1;
+    }
+    datagrams = std::move(bound.value());
+  }
+
+  std::vector<std::unique_ptr<EventLoop>> loops;
+  loops.reserve(config.ioThreads);
+  for (std::size_t index = 0; index < config.ioThreads; ++index) {
+    auto loopResult = EventLoop::create();
+    if (!loopResult) {
+      std::println("[server] event loop setup failed: {}",
+                   loopResult.error().message);
+      return 1;
+    }
+    loops.push_back(std::move(loopResult.value()));
+  }
+
+  std::println("[server] listening on {}:{}", listenAddress, config.port);
+  if (datagrams) {
+    std::println("[server] state updates over UDP on {}:{}", listenAddress,
+                 config.port);
+  }
+  if (config.zone) {
+    std::println("[server] serving zone {} of {} for a gateway",
+                 config.zone->index, config.zone->count);
+  }
+  GameServer server{std::move(listenerInstance), std::move(datagrams),
+                    std::move(loops), config, std::move(saved)};
+  std::unique_ptr<Metrics::ScrapeEndpoint> scrapeEndpoint;
+  if (config.adminPort) {
+    auto endpoint = Metrics::ScrapeEndpoint::start(
+        listenAddress, *config.adminPort,
+        [&server]() { return server.renderMetrics(); });
+    if (!endpoint) {
+      std::println("[server] metrics endpoint failed: {}",
+                   endpoint.error().message);
+      return 1;
+    }
+    scrapeEndpoint = std::move(endpoint.value());
+    std::println("[server] metrics on {}:{}/metrics", listenAddress,
+                 *config.adminPort);
+  }
   server.run();
   return 0;
 }
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <span>
+
+#if defined(__AVX2__) || defined(__SSSE3__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace Moonlapse::Protocol {
+
+namespace Detail {
+
+inline void byteswapWordsScalar(std::span<const std::byte> source,
+                                std::span<std::byte> destination) noexcept {
+  for (std::size_t offset = 0; offset + sizeof(std::uint32_t) <= source.size();
+       offset += sizeof(std::uint32_t)) {
+    std::uint32_t word{};
+    std::memcpy(&word, source.subspan(offset).data(), sizeof(word));
+    word = std::byteswap(word);
+    std::memcpy(destination.subspan(offset).data(), &word, sizeof(word));
+  }
+}
+
+// Swaps as many whole vector blocks as the widest available instruction set
+// allows and returns how many bytes it handled.
+inline auto byteswapWordsVector(std::span<const std::byte> source,
+                                std::span<std::byte> destination) noexcept
+    -> std::size_t {
+  std::size_t offset = 0;
+#if defined(__AVX2__)
+  const auto wideMask = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8,
+                                         15, 14, 13, 12, 3, 2, 1, 0, 7, 6, 5, 4,
+                                         11, 10, 9, 8, 15, 14, 13, 12);
+  for (; offset + sizeof(__m256i) <= source.size(); offset += sizeof(__m256i)) {
+    auto block = _mm256_loadu_si256(
+        std::bit_cast<const __m256i *>(source.subspan(offset).data()));
+    _mm256_storeu_si256(
+        std::bit_cast<__m256i *>(destination.subspan(offset).data()),
+        _mm256_shuffle_epi8(block, wideMask));
+  }
+#endif
+#if defined(__AVX2__) || defined(__SSSE3__)
+  const auto mask =
+      _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+  for (; offset + sizeof(__m128i) <= source.size(); offset += sizeof(__m128i)) {
+    auto block = _mm_loadu_si128(
+        std::bit_cast<const __m128i *>(source.subspan(offset).data()));
+    _mm_storeu_si128(
+        std::bit_cast<__m128i *>(destination.subspan(offset).data()),
+        _mm_shuffle_epi8(block, mask));
+  }
+#elif defined(__SSE2__) || defined(_M_X64)
+  // No byte shuffle: swap bytes within each 16-bit lane, then the lanes.
+  constexpr int swapHalves = 0xB1;
+  for (; offset + sizeof(__m128i) <= source.size(); offset += sizeof(__m128i)) {
+    auto block = _mm_loadu_si128(
+        std::bit_cast<const __m128i *>(source.subspan(offset).data()));
+    block = _mm_or_si128(_mm_slli_epi16(block, 8), _mm_srli_epi16(block, 8));
+    block = _mm_shufflehi_epi16(_mm_shufflelo_epi16(block, swapHalves),
+                                swapHalves);
+    _mm_storeu_si128(
+        std::bit_cast<__m128i *>(destination.subspan(offset).data()), block);
+  }
+#elif defined(__ARM_NEON)
+  constexpr std::size_t blockSize = 16;
+  for (; offset + blockSize <= source.size(); offset += blockSize) {
+    auto block = vld1q_u8(
+        std::bit_cast<const std::uint8_t *>(source.subspan(offset).data()));
+    vst1q_u8(std::bit_cast<std::uint8_t *>(destination.subspan(offset).data()),
+             vrev32q_u8(block));
+  }
+#endif
+  return offset;
+}
+
+} // namespace Detail
+
+// Copies a run of 32-bit words between host and network byte order. Both
+// spans must be the same size, a multiple of four bytes, and either identical
+// or non-overlapping.
+inline void copyBigEndianWords(std::span<const std::byte> source,
+                               std::span<std::byte> destination) noexcept {
+  if constexpr (std::endian::native == std::endian::big) {
+    if (source.data() != destination.data()) {
+      std::memcpy(destination.data(), source.data(), source.size());
+    }
+    return;
+  }
+
+  auto handled = Detail::byteswapWordsVector(source, destination);
+  Detail::byteswapWordsScalar(source.subspan(handled),
+                              destination.subspan(handled));
+}
+
+} // namespace Moonlapse::Protocol
@@ -0,0 +1,211 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <span>
+#include <vector>
+
+namespace Moonlapse::Protocol {
+
+// The LZ4 block format, so any LZ4 implementation can read what this writes.
+// Each block stands alone: no frame header, checksum or dictionary.
+namespace Lz4 {
+
+inline constexpr std::size_t minMatch = 4;
+// The format requires the last five bytes to be literals and the last match
+// to start at least twelve bytes before the end.
+inline constexpr std::size_t lastLiterals = 5;
+inline constexpr std::size_t matchSafeDistance = 12;
+inline constexpr std::size_t maxOffset = 65535;
+
+// Worst case for incompressible input.
+[[nodiscard]] constexpr auto maxCompressedSize(std::size_t inputSize) noexcept
+    -> std::size_t {
+  return inputSize + inputSize / 255 + 16;
+}
+
+namespace Detail {
+
+inline constexpr std::uint8_t lengthNibble = 15;
+inline constexpr std::uint8_t lengthByte = 255;
+
+[[nodiscard]] inline auto load32(const std::byte *source) noexcept
+    -> std::uint32_t {
+  std::uint32_t value{};
+  std::memcpy(&value, source, sizeof(value));
+  return value;
+}
+
+// Lengths past the token's nibble continue in bytes of 255 and a remainder.
+inline auto writeLength(std::byte *out, std::size_t length) noexcept
+    -> std::byte * {
+  while (length >= lengthByte) {
+    *out++ = std::byte{lengthByte};
+    length -= lengthByte;
+  }
+  *out++ = static_cast<std::byte>(length);
+  return out;
+}
+
+inline auto writeLiterals(std::byte *out, std::byte *token,
+                          std::span<const std::byte> literals) noexcept
+    -> std::byte * {
+  auto length = literals.size();
+  *token = static_cast<std::byte>(
+      std::min<std::size_t>(length, lengthNibble) << 4U);
+  if (length >= lengthNibble) {
+    out = writeLength(out, length - lengthNibble);
+  }
+  std::ranges::copy(literals, out);
+  return out + length;
+}
+
+} // namespace Detail
+
+// Greedy single-pass compressor. The match table is kept between calls so
+// compressing does not allocate; stale entries are harmless because every
+// candidate is checked against the input before it is used.
+class Compressor {
+public:
+  // Appends the compressed form of input to output.
+  void compress(std::span<const std::byte> input,
+                std::vector<std::byte> &output) {
+    auto start = output.size();
+    output.resize(start + maxCompressedSize(input.size()));
+    auto *out = output.data() + start;
+    const auto *in = input.data();
+    auto size = input.size();
+
+    std::size_t anchor = 0;
+    if (size > matchSafeDistance) {
+      auto searchLimit = size - matchSafeDistance;
+      auto matchLimit = size - lastLiterals;
+      std::size_t position = 0;
+      while (position < searchLimit) {
+        auto sequence = Detail::load32(in + position);
+        auto &slot = m_table[hash(sequence)];
+        std::size_t candidate = slot;
+        slot = static_cast<std::uint32_t>(position);
+        if (candidate >= position || position - candidate > maxOffset ||
+            Detail::load32(in + candidate) != sequence) {
+          ++position;
+          continue;
+        }
+
+        while (position > anchor && candidate > 0 &&
+               in[position - 1] == in[candidate - 1]) {
+          --position;
+          --candidate;
+        }
+        auto length = minMatch;
+        while (position + length < matchLimit &&
+               in[position + length] == in[candidate + length]) {
+          ++length;
+        }
+
+        auto *token = out++;
+        out = Detail::writeLiterals(out, token,
+                                    input.subspan(anchor, position - anchor));
+        auto offset = position - candidate;
+        *out++ = static_cast<std::byte>(offset & 0xFFU);
+        *out++ = static_cast<std::byte>(offset >> 8U);
+        auto extra = length - minMatch;
+        *token |= static_cast<std::byte>(
+            std::min<std::size_t>(extra, Detail::lengthNibble));
+        if (extra >= Detail::lengthNibble) {
+          out = Detail::writeLength(out, extra - Detail::lengthNibble);
+        }
+
+        position += length;
+        anchor = position;
+      }
+    }
+
+    auto *token = out++;
+    out = Detail::writeLiterals(out, token, input.subspan(anchor));
+    output.resize(static_cast<std::size_t>(out - output.data()));
+  }
+
+private:
+  static constexpr unsigned hashBits = 12;
+
+  [[nodiscard]] static constexpr auto hash(std::uint32_t sequence) noexcept
+      -> std::size_t {
+    constexpr std::uint32_t multiplier = 2654435761U;
+    return (sequence * multiplier) >> (32U - hashBits);
+  }
+
+  std::array<std::uint32_t, std::size_t{1} << hashBits> m_table{};
+};
+
+// Fills output, which must be exactly the original size. False on any
+// malformed or mis-sized block; never reads or writes out of bounds.
+[[nodiscard]] inline auto decompress(std::span<const std::byte> input,
+                                     std::span<std::byte> output) noexcept
+    -> bool {
+  std::size_t in = 0;
+  std::size_t out = 0;
+  auto readLength = [&](std::size_t length) -> std::optional<std::size_t> {
+    if (length != Detail::lengthNibble) {
+      return length;
+    }
+    while (true) {
+      if (in >= input.size()) {
+        return std::nullopt;
+      }
+      auto next = static_cast<std::uint8_t>(input[in++]);
+      length += next;
+      if (next != Detail::lengthByte) {
+        return length;
+      }
+    }
+  };
+
+  while (true) {
+    if (in >= input.size()) {
+      return false;
+    }
+    auto token = static_cast<std::uint8_t>(input[in++]);
+
+    auto literals = readLength(token >> 4U);
+    if (!literals || *literals > input.size() - in ||
+        *literals > output.size() - out) {
+      return false;
+    }
+    std::ranges::copy(input.subspan(in, *literals),
+                      output.subspan(out).begin());
+    in += *literals;
+    out += *literals;
+    if (in == input.size()) {
+      return out == output.size();
+    }
+
+    if (input.size() - in < 2) {
+      return false;
+    }
+    auto offset = std::size_t{static_cast<std::uint8_t>(input[in])} |
+                  (std::size_t{static_cast<std::uint8_t>(input[in + 1])} << 8U);
+    in += 2;
+    if (offset == 0 || offset > out) {
+      return false;
+    }
+
+    auto extra = readLength(token & Detail::lengthNibble);
+    if (!extra || *extra + minMatch > output.size() - out) {
+      return false;
+    }
+    auto length = *extra + minMatch;
+    // Matches may overlap their own output, so this goes byte by byte.
+    for (std::size_t index = 0; index < length; ++index, ++out) {
+      output[out] = output[out - offset];
+    }
+  }
+}
+
+} // namespace Lz4
+
+} // namespace Moonlapse::Protocol
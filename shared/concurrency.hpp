@@ -0,0 +1,186 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace Moonlapse::Concurrency {
+
+// Keeps counters written by different threads from sharing a cache line.
+inline constexpr std::size_t cacheLineSize = 64;
+
+// Single-writer, many-reader publication of a value without a lock. The
+// writer fills a spare version and makes it current; readers pin whichever
+// version is current. A version is only rewritten once every reader pinned
+// to it has let go, and when all spares are pinned the writer adds another
+// instead of waiting, so a slow reader costs memory, never a stalled writer.
+template <typename T> class VersionedBuffer {
+  struct Version {
+    template <typename... Args>
+    explicit Version(const Args &...args) : value(args...) {}
+
+    T value;
+    std::atomic<std::uint32_t> readers{0};
+  };
+
+public:
+  class ReadGuard {
+  public:
+    ReadGuard(const ReadGuard &) = delete;
+    auto operator=(const ReadGuard &) -> ReadGuard & = delete;
+    ReadGuard(ReadGuard &&other) noexcept
+        : m_version{std::exchange(other.m_version, nullptr)} {}
+    auto operator=(ReadGuard &&) -> ReadGuard & = delete;
+    ~ReadGuard() {
+      if (m_version != nullptr) {
+        m_version->readers.fetch_sub(1);
+      }
+    }
+
+    [[nodiscard]] auto operator*() const noexcept -> const T & {
+      return m_version->value;
+    }
+    [[nodiscard]] auto operator->() const noexcept -> const T * {
+      return &m_version->value;
+    }
+
+  private:
+    friend class VersionedBuffer;
+    explicit ReadGuard(Version *version) noexcept : m_version{version} {}
+
+    Version *m_version;
+  };
+
+  template <typename... Args> explicit VersionedBuffer(const Args &...args) {
+    for (std::size_t index = 0; index < initialVersions; ++index) {
+      m_versions.push_back(std::make_unique<Version>(args...));
+    }
+    m_front.store(m_versions.front().get());
+  }
+
+  // Pins the current version for the lifetime of the guard.
+  [[nodiscard]] auto read() const -> ReadGuard {
+    while (true) {
+      auto *version = m_front.load();
+      version->readers.fetch_add(1);
+      // A newer publication between the load and the increment means the
+      // writer may already be rewriting this version; retry on the new one.
+      if (m_front.load() == version) {
+        return ReadGuard{version};
+      }
+      version->readers.fetch_sub(1);
+    }
+  }
+
+  // Writer only. The spare handed to writer holds some older version, so
+  // writer must leave it fully up to date rather than patch it.
+  template <typename Writer> void publish(Writer &&writer) {
+    auto *spare = takeSpare();
+    std::forward<Writer>(writer)(spare->value);
+    m_front.store(spare);
+  }
+
+  // Versions allocated so far: two, plus one for every spare that was
+  // still pinned when the writer needed it.
+  [[nodiscard]] auto versionCount() const noexcept -> std::size_t {
+    return m_versions.size();
+  }
+
+private:
+  static constexpr std::size_t initialVersions = 2;
+
+  [[nodiscard]] auto takeSpare() -> Version * {
+    auto *front = m_front.load();
+    for (const auto &version : m_versions) {
+      if (version.get() != front && version->readers.load() == 0) {
+        return version.get();
+      }
+    }
+    // Every spare is pinned. The copy only happens while readers outlast
+    // a publication, and the new version is kept for reuse.
+    m_versions.push_back(std::make_unique<Version>(front->value));
+    return m_versions.back().get();
+  }
+
+  // Only the writer touches the list; readers reach versions via m_front.
+  std::vector<std::unique_ptr<Version>> m_versions;
+  std::atomic<Version *> m_front{nullptr};
+};
+
+// Bounded multi-producer, single-consumer queue. Every cell carries a
+// sequence number that tells producers whether it is free for the current
+// lap and tells the consumer whether it has been filled, so neither side
+// takes a lock and a full queue refuses the push instead of blocking.
+template <typename T> class MpscQueue {
+public:
+  // Capacity is rounded up to a power of two.
+  explicit MpscQueue(std::size_t capacity)
+      : m_cells(std::bit_ceil(std::max<std::size_t>(capacity, 2))),
+        m_mask{m_cells.size() - 1} {
+    for (std::size_t index = 0; index < m_cells.size(); ++index) {
+      m_cells[index].sequence.store(index, std::memory_order_relaxed);
+    }
+  }
+
+  // Any thread. Returns false, leaving value untouched, when the queue is
+  // full.
+  [[nodiscard]] auto tryPush(T &value) -> bool {
+    auto position = m_enqueue.load(std::memory_order_relaxed);
+    while (true) {
+      auto &cell = m_cells[position & m_mask];
+      auto sequence = cell.sequence.load(std::memory_order_acquire);
+      auto lap = static_cast<std::ptrdiff_t>(sequence - position);
+      if (lap == 0) {
+        if (m_enqueue.compare_exchange_weak(position, position + 1,
+                                            std::memory_order_relaxed)) {
+          cell.value = std::move(value);
+          cell.sequence.store(position + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (lap < 0) {
+        return false;
+      } else {
+        position = m_enqueue.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  [[nodiscard]] auto tryPush(T &&value) -> bool { return tryPush(value); }
+
+  // Consumer thread only.
+  [[nodiscard]] auto tryPop() -> std::optional<T> {
+    auto &cell = m_cells[m_dequeue & m_mask];
+    if (cell.sequence.load(std::memory_order_acquire) != m_dequeue + 1) {
+      return std::nullopt;
+    }
+    std::optional<T> value{std::move(cell.value)};
+    cell.sequence.store(m_dequeue + m_cells.size(), std::memory_order_release);
+    ++m_dequeue;
+    return value;
+  }
+
+  [[nodiscard]] auto capacity() const noexcept -> std::size_t {
+    return m_cells.size();
+  }
+
+private:
+  struct Cell {
+    std::atomic<std::size_t> sequence;
+    T value{};
+  };
+
+  std::vector<Cell> m_cells;
+  std::size_t m_mask;
+  alignas(cacheLineSize) std::atomic<std::size_t> m_enqueue{0};
+  alignas(cacheLineSize) std::size_t m_dequeue{0};
+};
+
+} // namespace Moonlapse::Concurrency
@@ -0,0 +1,281 @@
+#pragma once
+
+#include "delta.hpp"
+#include "frame.hpp"
+#include "packets.hpp"
+
+#include <algorithm>
+#include <bitset>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <vector>
+
+// The UDP channel for state deltas. Chat, joins and acknowledgements stay on
+// the TCP connection, where a lost segment only delays what follows it; a
+// lost delta is simply superseded by the next one. After the client accepts
+// datagramCapability the server sends a DatagramSetup with a token, and the
+// client quotes the token from its UDP socket in a DatagramHello. From then
+// on the session's deltas go to the hello's source address. Each datagram
+// is a DatagramFragment frame carrying one slice of an ordinary frame.
+namespace Moonlapse::Datagram {
+
+// Fits the 1280-byte IPv6 minimum MTU with room for the IP and UDP headers,
+// so no router has to fragment it.
+inline constexpr std::size_t maxDatagramSize = 1200;
+// Losing any fragment loses the frame, so frames needing more than this go
+// over TCP instead.
+inline constexpr std::uint16_t maxFragments = 32;
+
+// DatagramSetup, over TCP: the token to quote and the server's UDP port.
+struct SetupPacket {
+  std::uint64_t token{};
+  std::uint16_t port{};
+};
+
+// DatagramHello, over UDP: claims the session that was given token.
+struct HelloPacket {
+  std::uint64_t token{};
+};
+
+// Leads every DatagramFragment payload. The sequence counts frames sent to
+// one peer; index and count place the slice within its frame.
+struct FragmentHeader {
+  std::uint32_t sequence{};
+  std::uint16_t index{};
+  std::uint16_t count{};
+};
+
+} // namespace Moonlapse::Datagram
+
+namespace Moonlapse::Protocol {
+
+template <> struct WireSchema<Datagram::SetupPacket> {
+  using Packet = Datagram::SetupPacket;
+  using Fields = FieldList<Field<&Packet::token, std::uint64_t>,
+                           Field<&Packet::port, std::uint16_t>, Padding<2>>;
+};
+
+template <> struct WireSchema<Datagram::HelloPacket> {
+  using Packet = Datagram::HelloPacket;
+  using Fields = FieldList<Field<&Packet::token, std::uint64_t>>;
+};
+
+template <> struct WireSchema<Datagram::FragmentHeader> {
+  using Packet = Datagram::FragmentHeader;
+  using Fields = FieldList<Field<&Packet::sequence, std::uint32_t>,
+                           Field<&Packet::index, std::uint16_t>,
+                           Field<&Packet::count, std::uint16_t>>;
+
+  [[nodiscard]] static constexpr auto valid(const Packet &packet) noexcept
+      -> bool {
+    return packet.count != 0 && packet.count <= Datagram::maxFragments &&
+           packet.index < packet.count;
+  }
+};
+
+static_assert(fixedPayloadSize<Datagram::SetupPacket> == 12 &&
+              fixedPayloadSize<Datagram::HelloPacket> == 8 &&
+              fixedPayloadSize<Datagram::FragmentHeader> == 8);
+
+} // namespace Moonlapse::Protocol
+
+namespace Moonlapse::Datagram {
+
+// Frame bytes carried by every fragment but the last.
+inline constexpr std::size_t fragmentDataSize =
+    maxDatagramSize - Protocol::packetHeaderSize -
+    Protocol::fixedPayloadSize<FragmentHeader>;
+
+[[nodiscard]] inline auto encodeSetup(const SetupPacket &packet)
+    -> Net::Frame {
+  Net::FrameBuffer buffer;
+  buffer.storage() = Protocol::encodeWithHeader(
+      Protocol::PacketType::DatagramSetup, packet, std::move(buffer.storage()));
+  return Net::Frame{std::move(buffer)};
+}
+
+[[nodiscard]] inline auto decodeSetup(std::span<const std::byte> payload)
+    -> Protocol::PacketResult<SetupPacket> {
+  return Protocol::decodeFixed<SetupPacket>(payload);
+}
+
+[[nodiscard]] inline auto encodeHello(const HelloPacket &packet)
+    -> std::vector<std::byte> {
+  return Protocol::encodeWithHeader(Protocol::PacketType::DatagramHello,
+                                    packet);
+}
+
+// A received datagram has to be exactly one frame of the expected type.
+[[nodiscard]] inline auto
+unwrapDatagram(std::span<const std::byte> datagram, Protocol::PacketType type)
+    -> Protocol::PacketResult<std::span<const std::byte>> {
+  auto frame = Protocol::extractFrame(datagram);
+  if (!frame) {
+    return std::unexpected(frame.error());
+  }
+  if (!frame->has_value()) {
+    return std::unexpected(Protocol::PacketError::Truncated);
+  }
+  if ((*frame)->size() != datagram.size()) {
+    return std::unexpected(Protocol::PacketError::SizeMismatch);
+  }
+  if ((*frame)->header.type != type) {
+    return std::unexpected(Protocol::PacketError::UnknownType);
+  }
+  return (*frame)->payload;
+}
+
+[[nodiscard]] inline auto decodeHello(std::span<const std::byte> datagram)
+    -> Protocol::PacketResult<HelloPacket> {
+  auto payload = unwrapDatagram(datagram, Protocol::PacketType::DatagramHello);
+  if (!payload) {
+    return std::unexpected(payload.error());
+  }
+  return Protocol::decodeFixed<HelloPacket>(*payload);
+}
+
+// Cuts encoded frames into DatagramFragment datagrams. The storage is
+// reused, so splitting does not allocate once it has grown; not
+// thread-safe, each event loop keeps its own.
+class Fragmenter {
+public:
+  // False when the frame would need more than maxFragments datagrams.
+  [[nodiscard]] auto split(std::span<const std::byte> frame,
+                           std::uint32_t sequence) -> bool {
+    auto count = (frame.size() + fragmentDataSize - 1) / fragmentDataSize;
+    if (count == 0 || count > maxFragments) {
+      return false;
+    }
+
+    Protocol::PayloadWriter writer{std::move(m_storage)};
+    writer.reserve(frame.size() + count * (maxDatagramSize - fragmentDataSize));
+    m_ends.clear();
+    for (std::size_t index = 0; index < count; ++index) {
+      auto slice = frame.subspan(
+          index * fragmentDataSize,
+          std::min(fragmentDataSize, frame.size() - index * fragmentDataSize));
+      writer.writeBytes(Protocol::encodeHeader(Protocol::PacketHeader{
+          .version = Protocol::protocolVersion,
+          .type = Protocol::PacketType::DatagramFragment,
+          .payloadSize = static_cast<std::uint32_t>(
+              Protocol::fixedPayloadSize<FragmentHeader> + slice.size())}));
+      writer.writeBytes(Protocol::encodeFixed(
+          FragmentHeader{.sequence = sequence,
+                         .index = static_cast<std::uint16_t>(index),
+                         .count = static_cast<std::uint16_t>(count)}));
+      writer.writeBytes(slice);
+      m_ends.push_back(writer.bytes().size());
+    }
+    m_storage = std::move(writer).release();
+    return true;
+  }
+
+  [[nodiscard]] auto count() const noexcept -> std::size_t {
+    return m_ends.size();
+  }
+
+  [[nodiscard]] auto datagram(std::size_t index) const noexcept
+      -> std::span<const std::byte> {
+    auto begin = index == 0 ? 0 : m_ends[index - 1];
+    return std::span<const std::byte>{m_storage}.subspan(begin,
+                                                         m_ends[index] - begin);
+  }
+
+private:
+  std::vector<std::byte> m_storage;
+  std::vector<std::size_t> m_ends;
+};
+
+// Rebuilds frames from fragments, newest wins. Fragments of a frame older
+// than the one being collected, or no newer than the last one finished, are
+// stale and dropped; a fragment of a newer frame abandons the unfinished
+// one. Duplicates are ignored.
+class Reassembler {
+public:
+  // The frame this datagram completed, valid until the next call, or
+  // nullopt while pieces are missing.
+  [[nodiscard]] auto accept(std::span<const std::byte> datagram)
+      -> Protocol::PacketResult<std::optional<std::span<const std::byte>>> {
+    auto payload =
+        unwrapDatagram(datagram, Protocol::PacketType::DatagramFragment);
+    if (!payload) {
+      return std::unexpected(payload.error());
+    }
+    constexpr auto headerSize = Protocol::fixedPayloadSize<FragmentHeader>;
+    if (payload->size() <= headerSize) {
+      return std::unexpected(Protocol::PacketError::Truncated);
+    }
+    auto fragment =
+        Protocol::decodeFixed<FragmentHeader>(payload->first(headerSize));
+    if (!fragment) {
+      return std::unexpected(fragment.error());
+    }
+    auto slice = payload->subspan(headerSize);
+    bool last = fragment->index + 1U == fragment->count;
+    if (slice.size() > fragmentDataSize ||
+        (!last && slice.size() != fragmentDataSize)) {
+      return std::unexpected(Protocol::PacketError::SizeMismatch);
+    }
+
+    if (m_delivered &&
+        !Protocol::isNewerSequence(fragment->sequence, *m_delivered)) {
+      ++m_stale;
+      return std::nullopt;
+    }
+    if (m_count == 0 ||
+        Protocol::isNewerSequence(fragment->sequence, m_sequence)) {
+      m_stale += m_count != 0 ? m_received.count() : 0;
+      start(*fragment);
+    } else if (fragment->sequence != m_sequence) {
+      ++m_stale;
+      return std::nullopt;
+    } else if (fragment->count != m_count) {
+      return std::unexpected(Protocol::PacketError::InvalidPayload);
+    }
+
+    if (m_received.test(fragment->index)) {
+      return std::nullopt;
+    }
+    m_received.set(fragment->index);
+    auto offset = std::size_t{fragment->index} * fragmentDataSize;
+    std::ranges::copy(slice, m_frame.begin() + static_cast<std::ptrdiff_t>(
+                                                   offset));
+    if (last) {
+      m_size = offset + slice.size();
+    }
+    if (m_received.count() < m_count) {
+      return std::nullopt;
+    }
+
+    m_delivered = m_sequence;
+    m_count = 0;
+    return std::span<const std::byte>{m_frame}.first(m_size);
+  }
+
+  // Fragments dropped as stale, or as part of an abandoned frame.
+  [[nodiscard]] auto staleFragments() const noexcept -> std::uint64_t {
+    return m_stale;
+  }
+
+private:
+  void start(const FragmentHeader &fragment) {
+    m_sequence = fragment.sequence;
+    m_count = fragment.count;
+    m_received.reset();
+    m_size = 0;
+    m_frame.resize(std::size_t{m_count} * fragmentDataSize);
+  }
+
+  std::uint32_t m_sequence{};
+  // 0 while no frame is being collected.
+  std::uint16_t m_count{};
+  std::bitset<maxFragments> m_received;
+  std::size_t m_size{};
+  std::optional<std::uint32_t> m_delivered;
+  std::vector<std::byte> m_frame;
+  std::uint64_t m_stale{};
+};
+
+} // namespace Moonlapse::Datagram
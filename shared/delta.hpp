@@ -0,0 +1,137 @@
+#pragma once
+
+#include "packets.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+namespace Moonlapse::Protocol {
+
+// Both state lists must be sorted by player id.
+inline void diffStates(std::span<const PlayerState> baseline,
+                       std::span<const PlayerState> current,
+                       StateDeltaPacket &delta) {
+  delta.removed.clear();
+  delta.added.clear();
+  delta.moved.clear();
+
+  auto before = baseline.begin();
+  auto after = current.begin();
+  while (before != baseline.end() || after != current.end()) {
+    if (after == current.end() ||
+        (before != baseline.end() && before->player < after->player)) {
+      delta.removed.push_back(before->player);
+      ++before;
+    } else if (before == baseline.end() || after->player < before->player) {
+      delta.added.push_back(*after);
+      ++after;
+    } else {
+      if (before->position != after->position) {
+        delta.moved.push_back(*after);
+      }
+      ++before;
+      ++after;
+    }
+  }
+}
+
+// Rebuilds the sender's state from the baseline the delta was computed
+// against. The result is sorted by player id.
+[[nodiscard]] inline auto applyDelta(std::span<const PlayerState> baseline,
+                                     const StateDeltaPacket &delta,
+                                     std::vector<PlayerState> &result)
+    -> PacketResult<void> {
+  auto byPlayer = [](const PlayerState &entry) { return entry.player; };
+
+  result.assign(baseline.begin(), baseline.end());
+  for (const auto &entry : delta.moved) {
+    auto found = std::ranges::lower_bound(result, entry.player, {}, byPlayer);
+    if (found == result.end() || found->player != entry.player) {
+      return std::unexpected(PacketError::InvalidPayload);
+    }
+    found->position = entry.position;
+  }
+
+  for (auto playerIdentifier : delta.removed) {
+    auto found =
+        std::ranges::lower_bound(result, playerIdentifier, {}, byPlayer);
+    if (found == result.end() || found->player != playerIdentifier) {
+      return std::unexpected(PacketError::InvalidPayload);
+    }
+    result.erase(found);
+  }
+
+  result.insert(result.end(), delta.added.begin(), delta.added.end());
+  std::ranges::sort(result, {}, byPlayer);
+  auto duplicate = std::ranges::adjacent_find(
+      result, [](const PlayerState &left, const PlayerState &right) {
+        return left.player == right.player;
+      });
+  if (duplicate != result.end()) {
+    return std::unexpected(PacketError::InvalidPayload);
+  }
+  return {};
+}
+
+// Fixed-capacity history of recently sent (or received) states, indexed by
+// snapshot sequence. Slots keep their capacity across reuse.
+class BaselineRing {
+public:
+  explicit BaselineRing(std::size_t capacity) : m_slots(capacity) {}
+
+  void store(std::uint32_t sequence, std::span<const PlayerState> states) {
+    auto &slot = m_slots[sequence % m_slots.size()];
+    slot.sequence = sequence;
+    slot.states.assign(states.begin(), states.end());
+    m_latest = sequence;
+  }
+
+  [[nodiscard]] auto find(std::uint32_t sequence) const
+      -> const std::vector<PlayerState> * {
+    if (sequence == noBaseline) {
+      return nullptr;
+    }
+    const auto &slot = m_slots[sequence % m_slots.size()];
+    return slot.sequence == sequence ? &slot.states : nullptr;
+  }
+
+  [[nodiscard]] auto latest() const -> const std::vector<PlayerState> * {
+    return find(m_latest);
+  }
+
+  void clear() noexcept {
+    for (auto &slot : m_slots) {
+      slot.sequence = noBaseline;
+      slot.states.clear();
+    }
+    m_latest = noBaseline;
+  }
+
+private:
+  struct Slot {
+    std::uint32_t sequence{noBaseline};
+    std::vector<PlayerState> states;
+  };
+
+  std::vector<Slot> m_slots;
+  std::uint32_t m_latest{noBaseline};
+};
+
+[[nodiscard]] constexpr auto nextSequence(std::uint32_t sequence) noexcept
+    -> std::uint32_t {
+  ++sequence;
+  return sequence == noBaseline ? sequence + 1 : sequence;
+}
+
+// Serial-number order, so numbering may wrap: true when candidate was
+// issued after reference and less than half the range ago.
+[[nodiscard]] constexpr auto isNewerSequence(std::uint32_t candidate,
+                                             std::uint32_t reference) noexcept
+    -> bool {
+  return static_cast<std::int32_t>(candidate - reference) > 0;
+}
+
+} // namespace Moonlapse::Protocol
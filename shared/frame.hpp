@@ -0,0 +1,152 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <utility>
+#include <vector>
+
+namespace Moonlapse::Net {
+
+namespace Detail {
+
+// Reference-counted frame storage. Blocks are recycled through a per-thread
+// cache, keeping their byte capacity. A block returns to the cache of the
+// thread that releases it last, so a steady stream of similar frames stops
+// touching the heap once warm only where frames are encoded and released on
+// the same thread, as on the event loops. Frames released elsewhere leave
+// the encoding thread allocating fresh blocks.
+struct FrameBlock {
+  std::atomic<std::uint32_t> references{1};
+  std::vector<std::byte> bytes;
+};
+
+class FrameBlockCache {
+public:
+  // Bigger buffers are one-offs such as a full snapshot of a crowded world;
+  // keeping them would pin the memory for good.
+  static constexpr std::size_t maxCachedBlocks = 256;
+  static constexpr std::size_t maxCachedCapacity = std::size_t{64} << 10;
+
+  FrameBlockCache() = default;
+  FrameBlockCache(const FrameBlockCache &) = delete;
+  auto operator=(const FrameBlockCache &) -> FrameBlockCache & = delete;
+  FrameBlockCache(FrameBlockCache &&) = delete;
+  auto operator=(FrameBlockCache &&) -> FrameBlockCache & = delete;
+
+  ~FrameBlockCache() {
+    for (auto *block : m_blocks) {
+      delete block;
+    }
+  }
+
+  [[nodiscard]] static auto local() -> FrameBlockCache & {
+    thread_local FrameBlockCache cache;
+    return cache;
+  }
+
+  // The block comes back empty but with the capacity it had when recycled.
+  [[nodiscard]] auto acquire() -> FrameBlock * {
+    if (m_blocks.empty()) {
+      return new FrameBlock{};
+    }
+    auto *block = m_blocks.back();
+    m_blocks.pop_back();
+    block->references.store(1, std::memory_order_relaxed);
+    return block;
+  }
+
+  // Lands in the cache of whichever thread dropped the last reference.
+  void recycle(FrameBlock *block) {
+    if (m_blocks.size() >= maxCachedBlocks ||
+        block->bytes.capacity() > maxCachedCapacity) {
+      delete block;
+      return;
+    }
+    block->bytes.clear();
+    m_blocks.push_back(block);
+  }
+
+private:
+  std::vector<FrameBlock *> m_blocks;
+};
+
+} // namespace Detail
+
+// Writable storage for one frame, drawn from this thread's block cache.
+// Encoders fill storage() and then seal it into a Frame.
+class FrameBuffer {
+public:
+  FrameBuffer() : m_block{Detail::FrameBlockCache::local().acquire()} {}
+
+  FrameBuffer(const FrameBuffer &) = delete;
+  auto operator=(const FrameBuffer &) -> FrameBuffer & = delete;
+  FrameBuffer(FrameBuffer &&other) noexcept
+      : m_block{std::exchange(other.m_block, nullptr)} {}
+  auto operator=(FrameBuffer &&) -> FrameBuffer & = delete;
+
+  ~FrameBuffer() {
+    if (m_block != nullptr) {
+      Detail::FrameBlockCache::local().recycle(m_block);
+    }
+  }
+
+  [[nodiscard]] auto storage() noexcept -> std::vector<std::byte> & {
+    return m_block->bytes;
+  }
+
+private:
+  friend class Frame;
+
+  Detail::FrameBlock *m_block;
+};
+
+// Immutable, reference-counted encoded packet. Copies share one buffer, so a
+// broadcast frame can sit in many outbound queues without being duplicated.
+class Frame {
+public:
+  Frame() noexcept = default;
+
+  explicit Frame(FrameBuffer &&buffer) noexcept
+      : m_block{std::exchange(buffer.m_block, nullptr)} {}
+
+  Frame(const Frame &other) noexcept : m_block{other.m_block} {
+    if (m_block != nullptr) {
+      m_block->references.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  Frame(Frame &&other) noexcept
+      : m_block{std::exchange(other.m_block, nullptr)} {}
+
+  auto operator=(Frame other) noexcept -> Frame & {
+    std::swap(m_block, other.m_block);
+    return *this;
+  }
+
+  ~Frame() {
+    if (m_block != nullptr &&
+        m_block->references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      Detail::FrameBlockCache::local().recycle(m_block);
+    }
+  }
+
+  [[nodiscard]] auto bytes() const noexcept -> std::span<const std::byte> {
+    if (m_block == nullptr) {
+      return {};
+    }
+    return std::span<const std::byte>{m_block->bytes};
+  }
+
+  [[nodiscard]] auto size() const noexcept -> std::size_t {
+    return m_block != nullptr ? m_block->bytes.size() : 0;
+  }
+
+  [[nodiscard]] auto empty() const noexcept -> bool { return size() == 0; }
+
+private:
+  Detail::FrameBlock *m_block{nullptr};
+};
+
+} // namespace Moonlapse::Net
@@ -0,0 +1,138 @@
+#pragma once
+
+#include "packets.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <memory>
+#include <span>
+#include <vector>
+
+namespace Moonlapse::World {
+
+// Received world states stamped with their arrival time. Entities are drawn
+// a fixed delay in the past, between the two states either side of that
+// moment, so they glide from cell to cell at any snapshot rate instead of
+// jumping once per snapshot. Stored states are immutable and shared, so a
+// copy of the buffer costs one reference per entry, not one vector.
+class InterpolationBuffer {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  static constexpr std::size_t capacity = 32;
+  // Further apart than this between two states is a teleport, not a walk.
+  static constexpr std::int32_t maxInterpolatedDistance = 8;
+
+  explicit InterpolationBuffer(Clock::duration delay) noexcept
+      : m_delay{delay} {}
+
+  // states must be sorted by player id. Entries no longer needed for a
+  // sample at received or later are dropped.
+  void push(Clock::time_point received,
+            std::span<const Protocol::PlayerState> states) {
+    auto renderTime = received - m_delay;
+    while (m_entries.size() >= 2 &&
+           (m_entries.size() >= capacity ||
+            m_entries[1].received <= renderTime)) {
+      m_entries.pop_front();
+    }
+
+    using States = std::vector<Protocol::PlayerState>;
+    m_entries.push_back(
+        Entry{.received = received,
+              .states = std::make_shared<const States>(states.begin(),
+                                                       states.end())});
+  }
+
+  void clear() noexcept { m_entries.clear(); }
+
+  // True once sampling at now or later would keep giving the newest state.
+  [[nodiscard]] auto settled(Clock::time_point now) const noexcept -> bool {
+    return m_entries.empty() || now - m_delay >= m_entries.back().received;
+  }
+
+  // Replaces out with every entity as of now minus the delay, sorted by id.
+  // An entity shows up once the state that added it is reached and stays
+  // until the state that removed it is.
+  void sample(Clock::time_point now,
+              std::vector<Protocol::PlayerState> &out) const {
+    out.clear();
+    if (m_entries.empty()) {
+      return;
+    }
+
+    auto renderTime = now - m_delay;
+    auto next = std::ranges::upper_bound(m_entries, renderTime, {},
+                                         &Entry::received);
+    if (next == m_entries.begin() || next == m_entries.end()) {
+      const auto &nearest =
+          next == m_entries.end() ? m_entries.back() : m_entries.front();
+      out.assign(nearest.states->begin(), nearest.states->end());
+      return;
+    }
+
+    const auto &from = *(next - 1);
+    const auto &to = *next;
+    // States only arrive when something changed, so one after a quiet spell
+    // is still treated as a single step rather than stretched over the gap.
+    auto start = std::max(from.received, to.received - m_delay);
+    if (renderTime <= start) {
+      out.assign(from.states->begin(), from.states->end());
+      return;
+    }
+    auto fraction = std::chrono::duration<double>(renderTime - start) /
+                    std::chrono::duration<double>(to.received - start);
+    blend(*from.states, *to.states, fraction, out);
+  }
+
+private:
+  struct Entry {
+    Clock::time_point received;
+    std::shared_ptr<const std::vector<Protocol::PlayerState>> states;
+  };
+
+  static void blend(std::span<const Protocol::PlayerState> from,
+                    std::span<const Protocol::PlayerState> to, double fraction,
+                    std::vector<Protocol::PlayerState> &out) {
+    auto before = from.begin();
+    auto after = to.begin();
+    while (before != from.end()) {
+      while (after != to.end() && after->player < before->player) {
+        ++after;
+      }
+      if (after == to.end() || after->player != before->player) {
+        out.push_back(*before);
+      } else {
+        out.push_back(Protocol::PlayerState{
+            .player = before->player,
+            .position = between(before->position, after->position, fraction)});
+      }
+      ++before;
+    }
+  }
+
+  [[nodiscard]] static auto between(Protocol::Position from,
+                                    Protocol::Position to, double fraction)
+      -> Protocol::Position {
+    auto deltaX = to.x - from.x;
+    auto deltaY = to.y - from.y;
+    if (std::abs(deltaX) + std::abs(deltaY) > maxInterpolatedDistance) {
+      return from;
+    }
+    return Protocol::Position{
+        from.x + static_cast<std::int32_t>(
+                     std::lround(fraction * static_cast<double>(deltaX))),
+        from.y + static_cast<std::int32_t>(
+                     std::lround(fraction * static_cast<double>(deltaY)))};
+  }
+
+  Clock::duration m_delay;
+  std::deque<Entry> m_entries;
+};
+
+} // namespace Moonlapse::World
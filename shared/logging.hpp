@@ -0,0 +1,249 @@
+#pragma once
+
+#include "concurrency.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <format>
+#include <iterator>
+#include <optional>
+#include <span>
+#include <stop_token>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+
+namespace Moonlapse::Logging {
+
+enum class Level : std::uint8_t {
+  Debug,
+  Info,
+  Warning,
+  Error,
+};
+
+[[nodiscard]] constexpr auto levelName(Level level) noexcept
+    -> std::string_view {
+  switch (level) {
+  case Level::Debug:
+    return "debug";
+  case Level::Info:
+    return "info";
+  case Level::Warning:
+    return "warning";
+  case Level::Error:
+    return "error";
+  }
+  return "unknown";
+}
+
+[[nodiscard]] constexpr auto parseLevel(std::string_view name) noexcept
+    -> std::optional<Level> {
+  for (auto level : {Level::Debug, Level::Info, Level::Warning, Level::Error}) {
+    if (name == levelName(level)) {
+      return level;
+    }
+  }
+  return std::nullopt;
+}
+
+// Caps how often one kind of message is written: at most `limit` per
+// window, with the rest counted and reported on the next one let through.
+// Safe to share between threads; around a window boundary a racing writer
+// may get one message more or less than the limit.
+class Throttle {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  explicit Throttle(std::uint32_t limit,
+                    Clock::duration window = std::chrono::seconds{1}) noexcept
+      : m_limit{std::max<std::uint32_t>(limit, 1)}, m_window{window} {}
+
+  // Null when the message should be dropped; otherwise how many were dropped
+  // since the last one admitted.
+  [[nodiscard]] auto admit(Clock::time_point now = Clock::now()) noexcept
+      -> std::optional<std::uint64_t> {
+    auto window = static_cast<std::uint64_t>(now.time_since_epoch() / m_window);
+    auto current = m_currentWindow.load(std::memory_order_relaxed);
+    if (current != window &&
+        m_currentWindow.compare_exchange_strong(current, window,
+                                                std::memory_order_relaxed)) {
+      m_admitted.store(0, std::memory_order_relaxed);
+    }
+    if (m_admitted.fetch_add(1, std::memory_order_relaxed) >= m_limit) {
+      m_suppressed.fetch_add(1, std::memory_order_relaxed);
+      return std::nullopt;
+    }
+    return m_suppressed.exchange(0, std::memory_order_relaxed);
+  }
+
+private:
+  std::uint32_t m_limit;
+  Clock::duration m_window;
+  std::atomic<std::uint64_t> m_currentWindow{0};
+  std::atomic<std::uint32_t> m_admitted{0};
+  std::atomic<std::uint64_t> m_suppressed{0};
+};
+
+// Asynchronous logger. Callers format into a fixed-size record and push it
+// onto a lock-free queue; a background thread writes the queue to stdout in
+// batches. Network threads therefore never take the stdout lock or block on
+// a write, and a message that does not fit a full queue is counted and
+// dropped instead of stalling the caller.
+class Logger {
+public:
+  static constexpr std::size_t maxMessageBytes = 240;
+  static constexpr std::size_t defaultCapacity = 4096;
+  static constexpr std::chrono::milliseconds flushInterval{10};
+
+  explicit Logger(std::string_view component, Level minimum = Level::Info,
+                  std::size_t capacity = defaultCapacity)
+      : m_component{component}, m_minimum{minimum}, m_records{capacity},
+        m_writer{[this](const std::stop_token &stopToken) {
+          writeLoop(stopToken);
+        }} {}
+
+  Logger(const Logger &) = delete;
+  auto operator=(const Logger &) -> Logger & = delete;
+  Logger(Logger &&) = delete;
+  auto operator=(Logger &&) -> Logger & = delete;
+
+  // Stopping the writer thread flushes whatever is still queued.
+  ~Logger() = default;
+
+  [[nodiscard]] auto enabled(Level level) const noexcept -> bool {
+    return level >= m_minimum;
+  }
+
+  template <typename... Args>
+  void write(Level level, std::format_string<Args...> format, Args &&...args) {
+    if (!enabled(level)) {
+      return;
+    }
+    Record record{};
+    record.level = level;
+    auto text = std::span{record.text};
+    auto result = std::format_to_n(text.data(), text.size(), format,
+                                   std::forward<Args>(args)...);
+    record.length = static_cast<std::uint16_t>(
+        std::min<std::size_t>(static_cast<std::size_t>(result.size),
+                              text.size()));
+    if (static_cast<std::size_t>(result.size) > text.size()) {
+      std::ranges::copy(truncationMark,
+                        text.end() - static_cast<std::ptrdiff_t>(
+                                         truncationMark.size()));
+    }
+    push(record);
+  }
+
+  // As write(), but subject to throttle. The first message let through after
+  // a suppressed run says how many were dropped.
+  template <typename... Args>
+  void write(Throttle &throttle, Level level,
+             std::format_string<Args...> format, Args &&...args) {
+    if (!enabled(level)) {
+      return;
+    }
+    auto suppressed = throttle.admit();
+    if (!suppressed) {
+      return;
+    }
+    write(level, format, std::forward<Args>(args)...);
+    if (*suppressed > 0) {
+      write(level, "({} similar message(s) suppressed)", *suppressed);
+    }
+  }
+
+  template <typename... Args>
+  void info(std::format_string<Args...> format, Args &&...args) {
+    write(Level::Info, format, std::forward<Args>(args)...);
+  }
+
+  template <typename... Args>
+  void warning(std::format_string<Args...> format, Args &&...args) {
+    write(Level::Warning, format, std::forward<Args>(args)...);
+  }
+
+  template <typename... Args>
+  void error(std::format_string<Args...> format, Args &&...args) {
+    write(Level::Error, format, std::forward<Args>(args)...);
+  }
+
+  template <typename... Args>
+  void debug(std::format_string<Args...> format, Args &&...args) {
+    write(Level::Debug, format, std::forward<Args>(args)...);
+  }
+
+private:
+  static constexpr std::string_view truncationMark = "...";
+
+  struct Record {
+    Level level{Level::Info};
+    std::uint16_t length{};
+    std::array<char, maxMessageBytes> text{};
+  };
+
+  void push(Record &record) {
+    if (!m_records.tryPush(record)) {
+      m_dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  void writeLoop(const std::stop_token &stopToken) {
+    std::string batch;
+    while (true) {
+      auto stopping = stopToken.stop_requested();
+      drain(batch);
+      if (stopping) {
+        return;
+      }
+      std::this_thread::sleep_for(flushInterval);
+    }
+  }
+
+  // Info lines keep the plain "[component] message" shape; other levels are
+  // tagged so they can be grepped for.
+  void drain(std::string &batch) {
+    batch.clear();
+    while (auto record = m_records.tryPop()) {
+      append(batch, record->level,
+             std::string_view{record->text.data(), record->length});
+    }
+    if (auto dropped = m_dropped.exchange(0, std::memory_order_relaxed);
+        dropped > 0) {
+      append(batch, Level::Warning,
+             std::format("{} log message(s) dropped on a full queue",
+                         dropped));
+    }
+    if (batch.empty()) {
+      return;
+    }
+    std::fwrite(batch.data(), 1, batch.size(), stdout);
+    std::fflush(stdout);
+  }
+
+  void append(std::string &batch, Level level, std::string_view message) const {
+    if (level == Level::Info) {
+      std::format_to(std::back_inserter(batch), "[{}] {}\n", m_component,
+                     message);
+    } else {
+      std::format_to(std::back_inserter(batch), "[{}] {}: {}\n", m_component,
+                     levelName(level), message);
+    }
+  }
+
+  std::string m_component;
+  Level m_minimum;
+  Concurrency::MpscQueue<Record> m_records;
+  std::atomic<std::uint64_t> m_dropped{0};
+  // Declared last so it starts once the queue exists.
+  std::jthread m_writer;
+};
+
+} // namespace Moonlapse::Logging
@@ -0,0 +1,258 @@
+#pragma once
+
+#include "concurrency.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <format>
+#include <functional>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Instrumentation for hot paths. Each metric is written by a fixed set of
+// threads, every one through its own writer index, and the per-writer slots
+// are only summed when someone reads them. A slot has a single writer and
+// its own cache line, so recording is a relaxed load and store: no lock, no
+// read-modify-write and no line bouncing between threads.
+namespace Moonlapse::Metrics {
+
+namespace Detail {
+
+inline void bump(std::atomic<std::uint64_t> &slot,
+                 std::uint64_t amount) noexcept {
+  slot.store(slot.load(std::memory_order_relaxed) + amount,
+             std::memory_order_relaxed);
+}
+
+} // namespace Detail
+
+class Counter {
+public:
+  explicit Counter(std::size_t writers)
+      : m_slots(std::max<std::size_t>(writers, 1)) {}
+
+  // Only ever called by the thread that owns writer.
+  void add(std::size_t writer, std::uint64_t amount = 1) noexcept {
+    Detail::bump(m_slots[writer].value, amount);
+  }
+
+  [[nodiscard]] auto value() const noexcept -> std::uint64_t {
+    std::uint64_t total = 0;
+    for (const auto &slot : m_slots) {
+      total += slot.value.load(std::memory_order_relaxed);
+    }
+    return total;
+  }
+
+private:
+  struct alignas(Concurrency::cacheLineSize) Slot {
+    std::atomic<std::uint64_t> value{};
+  };
+
+  std::vector<Slot> m_slots;
+};
+
+// Log-linear buckets in the style of HdrHistogram: every power of two is cut
+// into subBuckets equal steps, so any 64-bit value is recorded with under 25%
+// relative error in a small fixed table and recording never allocates.
+class Histogram {
+public:
+  static constexpr unsigned subBucketBits = 2;
+  static constexpr std::size_t subBuckets = std::size_t{1} << subBucketBits;
+  static constexpr std::size_t bucketCount =
+      (64 - subBucketBits + 1) * subBuckets;
+
+  struct Snapshot {
+    std::array<std::uint64_t, bucketCount> buckets{};
+    std::uint64_t count{};
+    std::uint64_t sum{};
+  };
+
+  [[nodiscard]] static constexpr auto bucketOf(std::uint64_t value) noexcept
+      -> std::size_t {
+    if (value < subBuckets) {
+      return static_cast<std::size_t>(value);
+    }
+    auto shift =
+        static_cast<unsigned>(std::bit_width(value)) - 1 - subBucketBits;
+    auto step = static_cast<std::size_t>(value >> shift) & (subBuckets - 1);
+    return (shift + 1) * subBuckets + step;
+  }
+
+  // Largest value that lands in bucket.
+  [[nodiscard]] static constexpr auto upperBound(std::size_t bucket) noexcept
+      -> std::uint64_t {
+    if (bucket < subBuckets) {
+      return bucket;
+    }
+    auto shift = bucket / subBuckets - 1;
+    auto lower = std::uint64_t{subBuckets + bucket % subBuckets} << shift;
+    return lower + ((std::uint64_t{1} << shift) - 1);
+  }
+
+  explicit Histogram(std::size_t writers)
+      : m_writers(std::max<std::size_t>(writers, 1)) {}
+
+  // Only ever called by the thread that owns writer.
+  void record(std::size_t writer, std::uint64_t value) noexcept {
+    auto &slots = m_writers[writer];
+    Detail::bump(slots.buckets.at(bucketOf(value)), 1);
+    Detail::bump(slots.sum, value);
+  }
+
+  // Writers keep recording during the merge, so the figures can be a few
+  // samples apart from each other, never torn.
+  [[nodiscard]] auto snapshot() const -> Snapshot {
+    Snapshot merged{};
+    for (const auto &slots : m_writers) {
+      for (std::size_t bucket = 0; bucket < bucketCount; ++bucket) {
+        auto hits = slots.buckets.at(bucket).load(std::memory_order_relaxed);
+        merged.buckets.at(bucket) += hits;
+        merged.count += hits;
+      }
+      merged.sum += slots.sum.load(std::memory_order_relaxed);
+    }
+    return merged;
+  }
+
+private:
+  struct alignas(Concurrency::cacheLineSize) WriterSlots {
+    std::array<std::atomic<std::uint64_t>, bucketCount> buckets{};
+    std::atomic<std::uint64_t> sum{};
+  };
+
+  std::vector<WriterSlots> m_writers;
+};
+
+// Upper bound of the bucket holding the given fraction of the samples, e.g.
+// 0.99 for the 99th percentile. Zero when nothing was recorded.
+[[nodiscard]] inline auto quantile(const Histogram::Snapshot &snapshot,
+                                   double fraction) noexcept -> std::uint64_t {
+  if (snapshot.count == 0) {
+    return 0;
+  }
+  auto rank = static_cast<std::uint64_t>(
+      std::clamp(fraction, 0.0, 1.0) * static_cast<double>(snapshot.count - 1));
+  std::uint64_t seen = 0;
+  for (std::size_t bucket = 0; bucket < Histogram::bucketCount; ++bucket) {
+    seen += snapshot.buckets.at(bucket);
+    if (seen > rank) {
+      return Histogram::upperBound(bucket);
+    }
+  }
+  return Histogram::upperBound(Histogram::bucketCount - 1);
+}
+
+// Samples recorded between two snapshots of the same histogram.
+[[nodiscard]] inline auto
+difference(const Histogram::Snapshot &later,
+           const Histogram::Snapshot &earlier) noexcept -> Histogram::Snapshot {
+  Histogram::Snapshot result{};
+  for (std::size_t bucket = 0; bucket < Histogram::bucketCount; ++bucket) {
+    result.buckets.at(bucket) =
+        later.buckets.at(bucket) - earlier.buckets.at(bucket);
+  }
+  result.count = later.count - earlier.count;
+  result.sum = later.sum - earlier.sum;
+  return result;
+}
+
+// Records the lifetime of the timer, in nanoseconds, into a histogram.
+class ScopedTimer {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  ScopedTimer(Histogram &histogram, std::size_t writer) noexcept
+      : m_histogram{histogram}, m_writer{writer}, m_start{Clock::now()} {}
+
+  ScopedTimer(const ScopedTimer &) = delete;
+  auto operator=(const ScopedTimer &) -> ScopedTimer & = delete;
+  ScopedTimer(ScopedTimer &&) = delete;
+  auto operator=(ScopedTimer &&) -> ScopedTimer & = delete;
+
+  ~ScopedTimer() {
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        Clock::now() - m_start);
+    m_histogram.get().record(m_writer,
+                             static_cast<std::uint64_t>(elapsed.count()));
+  }
+
+private:
+  std::reference_wrapper<Histogram> m_histogram;
+  std::size_t m_writer;
+  Clock::time_point m_start;
+};
+
+inline constexpr double nanosecondsToSeconds = 1e-9;
+
+// Builds a page in the Prometheus text exposition format, version 0.0.4.
+class Exposition {
+public:
+  static constexpr std::string_view contentType =
+      "text/plain; version=0.0.4; charset=utf-8";
+
+  void counter(std::string_view name, std::string_view help,
+               std::uint64_t value) {
+    describe(name, help, "counter");
+    std::format_to(std::back_inserter(m_text), "{} {}\n", name, value);
+  }
+
+  template <typename Value>
+  void gauge(std::string_view name, std::string_view help, Value value) {
+    describe(name, help, "gauge");
+    std::format_to(std::back_inserter(m_text), "{} {}\n", name, value);
+  }
+
+  // Values are recorded in raw units and exported multiplied by scale, e.g.
+  // nanoseconds as seconds. Buckets below floor fold into the first one
+  // written, and those past the highest non-empty bucket are left out since
+  // they would only repeat the total.
+  void histogram(std::string_view name, std::string_view help,
+                 const Histogram::Snapshot &snapshot, double scale = 1.0,
+                 std::uint64_t floor = 0) {
+    describe(name, help, "histogram");
+    std::size_t last = 0;
+    for (std::size_t bucket = 0; bucket < Histogram::bucketCount; ++bucket) {
+      if (snapshot.buckets.at(bucket) != 0) {
+        last = bucket;
+      }
+    }
+
+    std::uint64_t cumulative = 0;
+    for (std::size_t bucket = 0; bucket <= last; ++bucket) {
+      cumulative += snapshot.buckets.at(bucket);
+      auto bound = Histogram::upperBound(bucket);
+      if (bound < floor && bucket != last) {
+        continue;
+      }
+      std::format_to(std::back_inserter(m_text), "{}_bucket{{le=\"{}\"}} {}\n",
+                     name, static_cast<double>(bound) * scale, cumulative);
+    }
+    std::format_to(std::back_inserter(m_text),
+                   "{}_bucket{{le=\"+Inf\"}} {}\n{}_sum {}\n{}_count {}\n",
+                   name, snapshot.count, name,
+                   static_cast<double>(snapshot.sum) * scale, name,
+                   snapshot.count);
+  }
+
+  [[nodiscard]] auto text() && -> std::string { return std::move(m_text); }
+
+private:
+  void describe(std::string_view name, std::string_view help,
+                std::string_view type) {
+    std::format_to(std::back_inserter(m_text), "# HELP {} {}\n# TYPE {} {}\n",
+                   name, help, name, type);
+  }
+
+  std::string m_text;
+};
+
+} // namespace Moonlapse::Metrics
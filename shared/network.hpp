@@ -1,32 +1,51 @@
 #pragma once
 
+#include "frame.hpp"
+
 #include <algorithm>
+#include <array>
 #include <bit>
+#include <chrono>
 #include <cstddef>
 #include <cstdint>
 #include <cstring>
 #include <expected>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
 #include <span>
+#include <stop_token>
 #include <string>
 #include <string_view>
 #include <system_error>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
 #ifdef _WIN32
-#include <limits>
-#include <mutex>
 #include <winsock2.h>
 #include <ws2tcpip.h>
 #else
 #include <arpa/inet.h>
 #include <cerrno>
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #endif
 
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#elif defined(__APPLE__)
+#include <sys/event.h>
+#include <sys/time.h>
+#endif
+
 #include <cstdlib>
 
 namespace Moonlapse::Net {
@@ -44,6 +63,7 @@ enum class SocketErrorCode : std::uint8_t {
   ConnectionClosed,
   InvalidState,
   WouldBlock,
+  QueueFull,
 };
 
 struct SocketError {
@@ -59,9 +79,11 @@ namespace Detail {
 #ifdef _WIN32
 using NativeHandle = SOCKET;
 inline constexpr NativeHandle invalidSocketHandle = INVALID_SOCKET;
+using AddressLength = int;
 #else
 using NativeHandle = int;
 inline constexpr NativeHandle invalidSocketHandle = -1;
+using AddressLength = socklen_t;
 #endif
 
 struct AddrInfoDeleter {
@@ -102,6 +124,25 @@ inline auto isWouldBlock(int nativeCode) noexcept -> bool {
 #endif
 }
 
+// A non-blocking connect that has been started but not yet finished.
+inline auto isConnectInProgress(int nativeCode) noexcept -> bool {
+#ifdef _WIN32
+  return nativeCode == WSAEWOULDBLOCK;
+#else
+  return nativeCode == EINPROGRESS;
+#endif
+}
+
+// A UDP socket reports an ICMP port-unreachable for an earlier datagram on
+// its next receive. It says nothing about the datagrams still queued.
+inline auto isUnreachableReport(int nativeCode) noexcept -> bool {
+#ifdef _WIN32
+  return nativeCode == WSAECONNRESET;
+#else
+  return nativeCode == ECONNREFUSED;
+#endif
+}
+
 inline void closeHandle(NativeHandle handle) noexcept {
 #ifdef _WIN32
   if (handle != invalidSocketHandle) {
@@ -114,6 +155,45 @@ inline void closeHandle(NativeHandle handle) noexcept {
 #endif
 }
 
+#if defined(__linux__)
+inline constexpr int sendFlags = MSG_NOSIGNAL;
+#else
+inline constexpr int sendFlags = 0;
+#endif
+
+inline void suppressSigPipe([[maybe_unused]] NativeHandle handle) noexcept {
+#if defined(__APPLE__)
+  int enable = 1;
+  ::setsockopt(handle, SOL_SOCKET, SO_NOSIGPIPE, &enable, sizeof(enable));
+#endif
+}
+
+inline auto setNonBlocking(NativeHandle handle, bool enable) noexcept -> bool {
+#ifdef _WIN32
+  u_long mode = enable ? 1 : 0;
+  return ::ioctlsocket(handle, FIONBIO, &mode) == 0;
+#else
+  int flags = ::fcntl(handle, F_GETFL, 0);
+  if (flags < 0) {
+    return false;
+  }
+  flags = enable ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+  return ::fcntl(handle, F_SETFL, flags) == 0;
+#endif
+}
+
+inline auto setNoDelay(NativeHandle handle, bool enable) noexcept -> bool {
+  int value = enable ? 1 : 0;
+#ifdef _WIN32
+  auto pointer = std::bit_cast<const char *>(&value);
+  return ::setsockopt(handle, IPPROTO_TCP, TCP_NODELAY, pointer,
+                      sizeof(value)) == 0;
+#else
+  return ::setsockopt(handle, IPPROTO_TCP, TCP_NODELAY, &value,
+                      sizeof(value)) == 0;
+#endif
+}
+
 inline void setReuseAddress(NativeHandle handle) noexcept {
   int enable = 1;
 #ifdef _WIN32
@@ -136,11 +216,12 @@ template <typename Pointer>
 }
 
 inline auto resolveAddress(std::string_view host, std::uint16_t port,
-                           bool passive) -> SocketResult<AddrInfoPtr> {
+                           bool passive, int socketType = SOCK_STREAM)
+    -> SocketResult<AddrInfoPtr> {
   addrinfo hints{};
   hints.ai_family = AF_UNSPEC;
-  hints.ai_socktype = SOCK_STREAM;
-  hints.ai_protocol = IPPROTO_TCP;
+  hints.ai_socktype = socketType;
+  hints.ai_protocol = socketType == SOCK_DGRAM ? IPPROTO_UDP : IPPROTO_TCP;
   hints.ai_flags = passive ? AI_PASSIVE : 0;
 
   addrinfo *rawInfo = nullptr;
@@ -208,6 +289,8 @@ class TcpSocket {
 public:
   using NativeHandle = Detail::NativeHandle;
 
+  static constexpr std::size_t maxVectoredBuffers = 64;
+
   TcpSocket() noexcept = default;
   explicit TcpSocket(NativeHandle nativeHandle) noexcept
       : m_handle{nativeHandle} {}
@@ -251,6 +334,51 @@ public:
       int connectStatus = ::connect(candidate, entry->ai_addr,
                                     static_cast<int>(entry->ai_addrlen));
       if (connectStatus == 0) {
+        Detail::suppressSigPipe(candidate);
+        return TcpSocket{candidate};
+      }
+
+      Detail::closeHandle(candidate);
+    }
+
+    return std::unexpected(
+        Detail::makeError(SocketErrorCode::ConnectFailed, "connect"));
+  }
+
+  // Like connect, but returns a non-blocking socket without waiting for the
+  // handshake. Once an event loop reports it writable, finishConnect() tells
+  // whether the connection was made. Name resolution still blocks, so hosts
+  // are best given as addresses.
+  [[nodiscard]] static auto startConnect(std::string_view host,
+                                         std::uint16_t port)
+      -> SocketResult<TcpSocket> {
+    auto initResult = ensureSocketLibrary();
+    if (!initResult) {
+      return std::unexpected(initResult.error());
+    }
+
+    auto addresses = Detail::resolveAddress(host, port, false);
+    if (!addresses) {
+      return std::unexpected(addresses.error());
+    }
+    auto info = std::move(addresses.value());
+
+    for (auto *entry = info.get(); entry != nullptr; entry = entry->ai_next) {
+      NativeHandle candidate =
+          ::socket(entry->ai_family, entry->ai_socktype, entry->ai_protocol);
+      if (candidate == Detail::invalidSocketHandle) {
+        continue;
+      }
+      if (!Detail::setNonBlocking(candidate, true)) {
+        Detail::closeHandle(candidate);
+        continue;
+      }
+
+      int connectStatus = ::connect(candidate, entry->ai_addr,
+                                    static_cast<int>(entry->ai_addrlen));
+      if (connectStatus == 0 ||
+          Detail::isConnectInProgress(Detail::lastErrorCode())) {
+        Detail::suppressSigPipe(candidate);
         return TcpSocket{candidate};
       }
 
@@ -261,6 +389,22 @@ public:
         Detail::makeError(SocketErrorCode::ConnectFailed, "connect"));
   }
 
+  // After startConnect, once the socket has been reported writable.
+  [[nodiscard]] auto finishConnect() const -> SocketResult<void> {
+    int error = 0;
+    Detail::AddressLength length = sizeof(error);
+    if (::getsockopt(m_handle, SOL_SOCKET, SO_ERROR,
+                     Detail::toCharPointer(&error), &length) != 0) {
+      return std::unexpected(
+          Detail::makeError(SocketErrorCode::ConnectFailed, "connect"));
+    }
+    if (error != 0) {
+      return std::unexpected(
+          Detail::makeError(SocketErrorCode::ConnectFailed, "connect", error));
+    }
+    return {};
+  }
+
   [[nodiscard]] auto isOpen() const noexcept -> bool {
     return m_handle != Detail::invalidSocketHandle;
   }
@@ -287,6 +431,33 @@ public:
     return m_handle;
   }
 
+  [[nodiscard]] auto setNonBlocking(bool enable) const -> SocketResult<void> {
+    if (!isOpen()) {
+      return std::unexpected(Detail::makeError(
+          SocketErrorCode::InvalidState, "set non-blocking on closed socket",
+          0));
+    }
+    if (!Detail::setNonBlocking(m_handle, enable)) {
+      return std::unexpected(
+          Detail::makeError(SocketErrorCode::InvalidState, "set non-blocking"));
+    }
+    return {};
+  }
+
+  // Disables Nagle's algorithm. Callers that batch their own writes (see
+  // sendVectored) want each batch on the wire immediately.
+  [[nodiscard]] auto setNoDelay(bool enable) const -> SocketResult<void> {
+    if (!isOpen()) {
+      return std::unexpected(Detail::makeError(
+          SocketErrorCode::InvalidState, "set no-delay on closed socket", 0));
+    }
+    if (!Detail::setNoDelay(m_handle, enable)) {
+      return std::unexpected(
+          Detail::makeError(SocketErrorCode::InvalidState, "set no-delay"));
+    }
+    return {};
+  }
+
   [[nodiscard]] auto send(std::span<const std::byte> buffer) const
       -> SocketResult<std::size_t> {
     if (!isOpen()) {
@@ -303,14 +474,82 @@ public:
           static_cast<std::size_t>(std::numeric_limits<int>::max());
       int length = static_cast<int>(std::min(buffer.size(), maxLength));
       auto pointer = Detail::toConstCharPointer(buffer.data());
-      int sendResult = ::send(m_handle, pointer, length, 0);
+      int sendResult = ::send(m_handle, pointer, length, Detail::sendFlags);
 #else
       auto length = buffer.size();
-      auto sendResult = ::send(m_handle, buffer.data(), length, 0);
+      auto sendResult =
+          ::send(m_handle, buffer.data(), length, Detail::sendFlags);
+#endif
+      if (sendResult >= 0) {
+        return static_cast<std::size_t>(sendResult);
+      }
+
+      int nativeCode = Detail::lastErrorCode();
+      if (Detail::isRetryable(nativeCode)) {
+        continue;
+      }
+      if (Detail::isWouldBlock(nativeCode)) {
+        return std::unexpected(
+            Detail::makeError(SocketErrorCode::WouldBlock, "send", nativeCode));
+      }
+      return std::unexpected(
+          Detail::makeError(SocketErrorCode::SendFailed, "send", nativeCode));
+    }
+  }
+
+  // Gathers several buffers into one system call. At most
+  // maxVectoredBuffers are submitted per call; like send(), the result may
+  // be a partial write.
+  [[nodiscard]] auto
+  sendVectored(std::span<const std::span<const std::byte>> buffers) const
+      -> SocketResult<std::size_t> {
+    if (!isOpen()) {
+      return std::unexpected(Detail::makeError(SocketErrorCode::InvalidState,
+                                               "send on closed socket", 0));
+    }
+    buffers = buffers.first(std::min(buffers.size(), maxVectoredBuffers));
+    if (buffers.empty()) {
+      return std::size_t{0};
+    }
+
+#ifdef _WIN32
+    std::array<WSABUF, maxVectoredBuffers> vectors{};
+    for (std::size_t index = 0; index < buffers.size(); ++index) {
+      constexpr auto maxLength =
+          static_cast<std::size_t>(std::numeric_limits<ULONG>::max());
+      vectors.at(index).len =
+          static_cast<ULONG>(std::min(buffers[index].size(), maxLength));
+      // WSASend never writes through buf; the API just isn't const-correct.
+      vectors.at(index).buf = std::bit_cast<char *>(buffers[index].data());
+    }
+#else
+    std::array<iovec, maxVectoredBuffers> vectors{};
+    for (std::size_t index = 0; index < buffers.size(); ++index) {
+      vectors.at(index).iov_base = std::bit_cast<void *>(buffers[index].data());
+      vectors.at(index).iov_len = buffers[index].size();
+    }
+    msghdr message{};
+    message.msg_iov = vectors.data();
+    message.msg_iovlen =
+        static_cast<decltype(message.msg_iovlen)>(buffers.size());
 #endif
+
+    while (true) {
+#ifdef _WIN32
+      DWORD sent = 0;
+      int sendResult =
+          ::WSASend(m_handle, vectors.data(),
+                    static_cast<DWORD>(buffers.size()), &sent, 0, nullptr,
+                    nullptr);
+      if (sendResult == 0) {
+        return static_cast<std::size_t>(sent);
+      }
+#else
+      auto sendResult = ::sendmsg(m_handle, &message, Detail::sendFlags);
       if (sendResult >= 0) {
         return static_cast<std::size_t>(sendResult);
       }
+#endif
 
       int nativeCode = Detail::lastErrorCode();
       if (Detail::isRetryable(nativeCode)) {
@@ -485,6 +724,25 @@ public:
     }
   }
 
+  [[nodiscard]] auto nativeHandle() const noexcept -> NativeHandle {
+    return m_handle;
+  }
+
+  // Non-blocking listeners report WouldBlock from accept() once the backlog
+  // is empty, so an event loop can watch them alongside connections.
+  [[nodiscard]] auto setNonBlocking(bool enable) const -> SocketResult<void> {
+    if (!isOpen()) {
+      return std::unexpected(Detail::makeError(
+          SocketErrorCode::InvalidState, "set non-blocking on closed socket",
+          0));
+    }
+    if (!Detail::setNonBlocking(m_handle, enable)) {
+      return std::unexpected(
+          Detail::makeError(SocketErrorCode::InvalidState, "set non-blocking"));
+    }
+    return {};
+  }
+
   [[nodiscard]] auto listen(int backlog = SOMAXCONN) const
       -> SocketResult<void> {
     if (!isOpen()) {
@@ -507,6 +765,11 @@ public:
 #ifdef _WIN32
     NativeHandle client = ::accept(m_handle, nullptr, nullptr);
     if (client == Detail::invalidSocketHandle) {
+      int nativeCode = Detail::lastErrorCode();
+      if (Detail::isWouldBlock(nativeCode)) {
+        return std::unexpected(Detail::makeError(SocketErrorCode::WouldBlock,
+                                                 "accept", nativeCode));
+      }
       return std::unexpected(
           Detail::makeError(SocketErrorCode::AcceptFailed, "accept"));
     }
@@ -516,11 +779,17 @@ public:
     auto *addressPointer = std::bit_cast<sockaddr *>(std::addressof(storage));
     NativeHandle client = ::accept(m_handle, addressPointer, &length);
     if (client == Detail::invalidSocketHandle) {
+      int nativeCode = Detail::lastErrorCode();
+      if (Detail::isWouldBlock(nativeCode)) {
+        return std::unexpected(Detail::makeError(SocketErrorCode::WouldBlock,
+                                                 "accept", nativeCode));
+      }
       return std::unexpected(
           Detail::makeError(SocketErrorCode::AcceptFailed, "accept"));
     }
 #endif
 
+    Detail::suppressSigPipe(client);
     return TcpSocket{client};
   }
 
@@ -529,4 +798,945 @@ private:
   int m_family{AF_UNSPEC};
 };
 
+// Where a datagram came from or is going to.
+class SocketAddress {
+public:
+  [[nodiscard]] auto data() const noexcept -> const sockaddr * {
+    return std::bit_cast<const sockaddr *>(std::addressof(m_storage));
+  }
+
+  [[nodiscard]] auto size() const noexcept -> Detail::AddressLength {
+    return m_length;
+  }
+
+  friend auto operator==(const SocketAddress &left,
+                         const SocketAddress &right) noexcept -> bool {
+    return left.m_length == right.m_length &&
+           std::memcmp(std::addressof(left.m_storage),
+                       std::addressof(right.m_storage),
+                       static_cast<std::size_t>(left.m_length)) == 0;
+  }
+
+private:
+  friend class UdpSocket;
+
+  sockaddr_storage m_storage{};
+  Detail::AddressLength m_length{};
+};
+
+// Datagram socket. Each send is one datagram and each receive returns at
+// most one; a datagram longer than the buffer is cut short.
+class UdpSocket {
+public:
+  using NativeHandle = Detail::NativeHandle;
+
+  UdpSocket() noexcept = default;
+  explicit UdpSocket(NativeHandle nativeHandle) noexcept
+      : m_handle{nativeHandle} {}
+
+  UdpSocket(UdpSocket &&other) noexcept
+      : m_handle{std::exchange(other.m_handle, Detail::invalidSocketHandle)} {}
+
+  auto operator=(UdpSocket &&other) noexcept -> UdpSocket & {
+    if (this != &other) {
+      close();
+      m_handle = std::exchange(other.m_handle, Detail::invalidSocketHandle);
+    }
+    return *this;
+  }
+
+  UdpSocket(const UdpSocket &) = delete;
+  auto operator=(const UdpSocket &) -> UdpSocket & = delete;
+
+  ~UdpSocket() { close(); }
+
+  // Receives from anyone on host:port.
+  [[nodiscard]] static auto bind(std::string_view host, std::uint16_t port)
+      -> SocketResult<UdpSocket> {
+    return open(host, port, true);
+  }
+
+  // Talks to host:port only: send() goes there and receive() drops
+  // datagrams from anywhere else.
+  [[nodiscard]] static auto connect(std::string_view host, std::uint16_t port)
+      -> SocketResult<UdpSocket> {
+    return open(host, port, false);
+  }
+
+  [[nodiscard]] auto isOpen() const noexcept -> bool {
+    return m_handle != Detail::invalidSocketHandle;
+  }
+
+  auto close() noexcept -> void {
+    if (isOpen()) {
+      Detail::closeHandle(m_handle);
+      m_handle = Detail::invalidSocketHandle;
+    }
+  }
+
+  [[nodiscard]] auto nativeHandle() const noexcept -> NativeHandle {
+    return m_handle;
+  }
+
+  [[nodiscard]] auto setNonBlocking(bool enable) const -> SocketResult<void> {
+    if (!isOpen()) {
+      return std::unexpected(Detail::makeError(
+          SocketErrorCode::InvalidState, "set non-blocking on closed socket",
+          0));
+    }
+    if (!Detail::setNonBlocking(m_handle, enable)) {
+      return std::unexpected(
+          Detail::makeError(SocketErrorCode::InvalidState, "set non-blocking"));
+    }
+    return {};
+  }
+
+  // To the connected peer.
+  [[nodiscard]] auto send(std::span<const std::byte> datagram) const
+      -> SocketResult<std::size_t> {
+    return sendTo(datagram, nullptr, 0);
+  }
+
+  [[nodiscard]] auto sendTo(std::span<const std::byte> datagram,
+                            const SocketAddress &destination) const
+      -> SocketResult<std::size_t> {
+    return sendTo(datagram, destination.data(), destination.size());
+  }
+
+  // From the connected peer.
+  [[nodiscard]] auto receive(std::span<std::byte> buffer) const
+      -> SocketResult<std::size_t> {
+    return receiveFrom(buffer, nullptr);
+  }
+
+  [[nodiscard]] auto receiveFrom(std::span<std::byte> buffer,
+                                 SocketAddress &source) const
+      -> SocketResult<std::size_t> {
+    return receiveFrom(buffer, &source);
+  }
+
+private:
+  [[nodiscard]] static auto open(std::string_view host, std::uint16_t port,
+                                 bool passive) -> SocketResult<UdpSocket> {
+    auto initResult = ensureSocketLibrary();
+    if (!initResult) {
+      return std::unexpected(initResult.error());
+    }
+
+    auto addresses = Detail::resolveAddress(host, port, passive, SOCK_DGRAM);
+    if (!addresses) {
+      return std::unexpected(addresses.error());
+    }
+    auto info = std::move(addresses.value());
+
+    for (auto *entry = info.get(); entry != nullptr; entry = entry->ai_next) {
+      NativeHandle candidate =
+          ::socket(entry->ai_family, entry->ai_socktype, entry->ai_protocol);
+      if (candidate == Detail::invalidSocketHandle) {
+        continue;
+      }
+
+      auto length = static_cast<Detail::AddressLength>(entry->ai_addrlen);
+      int status = passive ? ::bind(candidate, entry->ai_addr, length)
+                           : ::connect(candidate, entry->ai_addr, length);
+      if (status == 0) {
+        return UdpSocket{candidate};
+      }
+
+      Detail::closeHandle(candidate);
+    }
+
+    return std::unexpected(
+        passive ? Detail::makeError(SocketErrorCode::BindFailed, "bind")
+                : Detail::makeError(SocketErrorCode::ConnectFailed, "connect"));
+  }
+
+  [[nodiscard]] auto sendTo(std::span<const std::byte> datagram,
+                            const sockaddr *destination,
+                            Detail::AddressLength destinationLength) const
+      -> SocketResult<std::size_t> {
+    if (!isOpen()) {
+      return std::unexpected(Detail::makeError(SocketErrorCode::InvalidState,
+                                               "send on closed socket", 0));
+    }
+
+    while (true) {
+#ifdef _WIN32
+      auto pointer = Detail::toConstCharPointer(datagram.data());
+      int sendResult =
+          ::sendto(m_handle, pointer, static_cast<int>(datagram.size()), 0,
+                   destination, destinationLength);
+#else
+      auto sendResult =
+          ::sendto(m_handle, datagram.data(), datagram.size(),
+                   Detail::sendFlags, destination, destinationLength);
+#endif
+      if (sendResult >= 0) {
+        return static_cast<std::size_t>(sendResult);
+      }
+
+      int nativeCode = Detail::lastErrorCode();
+      if (Detail::isRetryable(nativeCode)) {
+        continue;
+      }
+      if (Detail::isWouldBlock(nativeCode)) {
+        return std::unexpected(
+            Detail::makeError(SocketErrorCode::WouldBlock, "send", nativeCode));
+      }
+      return std::unexpected(
+          Detail::makeError(SocketErrorCode::SendFailed, "send", nativeCode));
+    }
+  }
+
+  [[nodiscard]] auto receiveFrom(std::span<std::byte> buffer,
+                                 SocketAddress *source) const
+      -> SocketResult<std::size_t> {
+    if (!isOpen()) {
+      return std::unexpected(Detail::makeError(SocketErrorCode::InvalidState,
+                                               "receive on closed socket", 0));
+    }
+
+    while (true) {
+      sockaddr *address = nullptr;
+      Detail::AddressLength addressLength = 0;
+      if (source != nullptr) {
+        address = std::bit_cast<sockaddr *>(std::addressof(source->m_storage));
+        addressLength = sizeof(source->m_storage);
+      }
+#ifdef _WIN32
+      auto pointer = Detail::toCharPointer(buffer.data());
+      int receiveResult =
+          ::recvfrom(m_handle, pointer, static_cast<int>(buffer.size()), 0,
+                     address, source != nullptr ? &addressLength : nullptr);
+#else
+      auto receiveResult =
+          ::recvfrom(m_handle, buffer.data(), buffer.size(), 0, address,
+                     source != nullptr ? &addressLength : nullptr);
+#endif
+      if (receiveResult >= 0) {
+        if (source != nullptr) {
+          source->m_length = addressLength;
+        }
+        return static_cast<std::size_t>(receiveResult);
+      }
+
+      int nativeCode = Detail::lastErrorCode();
+#ifdef _WIN32
+      // Windows reports the cut as an error; the buffer is full regardless.
+      if (nativeCode == WSAEMSGSIZE) {
+        if (source != nullptr) {
+          source->m_length = addressLength;
+        }
+        return buffer.size();
+      }
+#endif
+      if (Detail::isRetryable(nativeCode) ||
+          Detail::isUnreachableReport(nativeCode)) {
+        continue;
+      }
+      if (Detail::isWouldBlock(nativeCode)) {
+        return std::unexpected(Detail::makeError(SocketErrorCode::WouldBlock,
+                                                 "receive", nativeCode));
+      }
+      return std::unexpected(Detail::makeError(SocketErrorCode::ReceiveFailed,
+                                               "receive", nativeCode));
+    }
+  }
+
+  NativeHandle m_handle{Detail::invalidSocketHandle};
+};
+
+enum class IoInterest : std::uint8_t {
+  None = 0,
+  Readable = 1U << 0U,
+  Writable = 1U << 1U,
+};
+
+[[nodiscard]] constexpr auto operator|(IoInterest left,
+                                      IoInterest right) noexcept
+    -> IoInterest {
+  return static_cast<IoInterest>(static_cast<std::uint8_t>(left) |
+                                 static_cast<std::uint8_t>(right));
+}
+
+[[nodiscard]] constexpr auto hasInterest(IoInterest set,
+                                         IoInterest flag) noexcept -> bool {
+  return (static_cast<std::uint8_t>(set) & static_cast<std::uint8_t>(flag)) !=
+         0;
+}
+
+struct IoEvent {
+  bool readable{false};
+  bool writable{false};
+  bool hangup{false};
+};
+
+using IoHandler = std::function<void(IoEvent)>;
+
+inline constexpr auto waitForever = std::chrono::milliseconds{-1};
+
+// Readiness reactor: epoll on Linux, kqueue on macOS/BSD and WSAPoll on
+// Windows. watch/modify/unwatch and the handlers run on the loop thread;
+// post() and wake() may be called from any thread.
+class EventLoop {
+public:
+  using NativeHandle = Detail::NativeHandle;
+  using Task = std::function<void()>;
+
+  EventLoop(const EventLoop &) = delete;
+  auto operator=(const EventLoop &) -> EventLoop & = delete;
+  EventLoop(EventLoop &&) = delete;
+  auto operator=(EventLoop &&) -> EventLoop & = delete;
+
+  ~EventLoop() {
+#if defined(__linux__)
+    Detail::closeHandle(m_wakeHandle);
+    Detail::closeHandle(m_pollHandle);
+#elif defined(__APPLE__)
+    Detail::closeHandle(m_pollHandle);
+#elif defined(_WIN32)
+    Detail::closeHandle(m_wakeHandle);
+#endif
+  }
+
+  [[nodiscard]] static auto create()
+      -> SocketResult<std::unique_ptr<EventLoop>> {
+    auto initResult = ensureSocketLibrary();
+    if (!initResult) {
+      return std::unexpected(initResult.error());
+    }
+
+    std::unique_ptr<EventLoop> loop{new EventLoop()};
+#if defined(__linux__)
+    loop->m_pollHandle = ::epoll_create1(EPOLL_CLOEXEC);
+    if (loop->m_pollHandle < 0) {
+      return std::unexpected(
+          Detail::makeError(SocketErrorCode::InvalidState, "epoll_create1"));
+    }
+    loop->m_wakeHandle = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop->m_wakeHandle < 0) {
+      return std::unexpected(
+          Detail::makeError(SocketErrorCode::InvalidState, "eventfd"));
+    }
+    epoll_event wakeEvent{};
+    wakeEvent.events = EPOLLIN;
+    wakeEvent.data.fd = loop->m_wakeHandle;
+    if (::epoll_ctl(loop->m_pollHandle, EPOLL_CTL_ADD, loop->m_wakeHandle,
+                    &wakeEvent) != 0) {
+      return std::unexpected(
+          Detail::makeError(SocketErrorCode::InvalidState, "epoll_ctl"));
+    }
+#elif defined(__APPLE__)
+    loop->m_pollHandle = ::kqueue();
+    if (loop->m_pollHandle < 0) {
+      return std::unexpected(
+          Detail::makeError(SocketErrorCode::InvalidState, "kqueue"));
+    }
+    struct kevent wakeEvent{};
+    EV_SET(&wakeEvent, 0, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, nullptr);
+    if (::kevent(loop->m_pollHandle, &wakeEvent, 1, nullptr, 0, nullptr) !=
+        0) {
+      return std::unexpected(
+          Detail::makeError(SocketErrorCode::InvalidState, "kevent"));
+    }
+#elif defined(_WIN32)
+    loop->m_wakeHandle = ::socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (loop->m_wakeHandle == Detail::invalidSocketHandle) {
+      return std::unexpected(
+          Detail::makeError(SocketErrorCode::InvalidState, "wake socket"));
+    }
+    sockaddr_in loopback{};
+    loopback.sin_family = AF_INET;
+    loopback.sin_addr.s_addr = ::htonl(INADDR_LOOPBACK);
+    auto *address = std::bit_cast<sockaddr *>(&loopback);
+    int addressLength = sizeof(loopback);
+    if (::bind(loop->m_wakeHandle, address, addressLength) != 0 ||
+        ::getsockname(loop->m_wakeHandle, address, &addressLength) != 0 ||
+        ::connect(loop->m_wakeHandle, address, addressLength) != 0 ||
+        !Detail::setNonBlocking(loop->m_wakeHandle, true)) {
+      return std::unexpected(
+          Detail::makeError(SocketErrorCode::InvalidState, "wake socket"));
+    }
+#endif
+    return loop;
+  }
+
+  [[nodiscard]] auto watch(NativeHandle handle, IoInterest interest,
+                           IoHandler handler) -> SocketResult<void> {
+    if (m_watches.contains(handle)) {
+      return std::unexpected(Detail::makeError(SocketErrorCode::InvalidState,
+                                               "handle already watched", 0));
+    }
+    if (auto result = applyInterest(handle, IoInterest::None, interest);
+        !result) {
+      return std::unexpected(result.error());
+    }
+    m_watches.emplace(
+        handle,
+        Watch{.interest = interest,
+              .handler = std::make_shared<IoHandler>(std::move(handler))});
+    return {};
+  }
+
+  [[nodiscard]] auto modify(NativeHandle handle, IoInterest interest)
+      -> SocketResult<void> {
+    auto found = m_watches.find(handle);
+    if (found == m_watches.end()) {
+      return std::unexpected(Detail::makeError(SocketErrorCode::InvalidState,
+                                               "handle not watched", 0));
+    }
+    if (found->second.interest == interest) {
+      return {};
+    }
+    if (auto result = applyInterest(handle, found->second.interest, interest);
+        !result) {
+      return std::unexpected(result.error());
+    }
+    found->second.interest = interest;
+    return {};
+  }
+
+  void unwatch(NativeHandle handle) noexcept {
+    auto found = m_watches.find(handle);
+    if (found == m_watches.end()) {
+      return;
+    }
+    static_cast<void>(
+        applyInterest(handle, found->second.interest, IoInterest::None));
+    m_watches.erase(found);
+  }
+
+  void post(Task task) {
+    bool wasIdle = false;
+    {
+      std::scoped_lock guard{m_taskMutex};
+      wasIdle = m_tasks.empty();
+      m_tasks.push_back(std::move(task));
+    }
+    if (wasIdle) {
+      wake();
+    }
+  }
+
+  void wake() noexcept {
+#if defined(__linux__)
+    std::uint64_t increment = 1;
+    static_cast<void>(::write(m_wakeHandle, &increment, sizeof(increment)));
+#elif defined(__APPLE__)
+    struct kevent trigger{};
+    EV_SET(&trigger, 0, EVFILT_USER, 0, NOTE_TRIGGER, 0, nullptr);
+    ::kevent(m_pollHandle, &trigger, 1, nullptr, 0, nullptr);
+#elif defined(_WIN32)
+    char signal = 0;
+    ::send(m_wakeHandle, &signal, 1, 0);
+#endif
+  }
+
+  // Waits for readiness (negative timeout blocks), dispatches handlers, then
+  // drains posted tasks. Returns the number of handler invocations.
+  [[nodiscard]] auto runOnce(std::chrono::milliseconds timeout)
+      -> SocketResult<std::size_t> {
+    auto dispatched = waitAndDispatch(timeout);
+    runPostedTasks();
+    return dispatched;
+  }
+
+  [[nodiscard]] auto run(const std::stop_token &stopToken)
+      -> SocketResult<void> {
+    std::stop_callback wakeOnStop{stopToken, [this]() { wake(); }};
+    while (!stopToken.stop_requested()) {
+      if (auto result = runOnce(waitForever); !result) {
+        return std::unexpected(result.error());
+      }
+    }
+    return {};
+  }
+
+private:
+  struct Watch {
+    IoInterest interest{IoInterest::None};
+    std::shared_ptr<IoHandler> handler;
+  };
+
+  static constexpr std::size_t maxEventsPerWait = 256;
+
+  EventLoop() = default;
+
+  void dispatch(NativeHandle handle, IoEvent event) {
+    auto found = m_watches.find(handle);
+    if (found == m_watches.end()) {
+      return;
+    }
+    // Keep the handler alive even if it unwatches its own handle.
+    auto handler = found->second.handler;
+    (*handler)(event);
+  }
+
+  void runPostedTasks() {
+    {
+      std::scoped_lock guard{m_taskMutex};
+      std::swap(m_tasks, m_runningTasks);
+    }
+    for (auto &task : m_runningTasks) {
+      task();
+    }
+    m_runningTasks.clear();
+  }
+
+#if defined(__linux__)
+  [[nodiscard]] auto applyInterest(NativeHandle handle, IoInterest previous,
+                                   IoInterest next) const
+      -> SocketResult<void> {
+    epoll_event event{};
+    event.data.fd = handle;
+    event.events = EPOLLRDHUP;
+    if (hasInterest(next, IoInterest::Readable)) {
+      event.events |= EPOLLIN;
+    }
+    if (hasInterest(next, IoInterest::Writable)) {
+      event.events |= EPOLLOUT;
+    }
+
+    int operation = EPOLL_CTL_MOD;
+    if (next == IoInterest::None) {
+      operation = EPOLL_CTL_DEL;
+    } else if (previous == IoInterest::None) {
+      operation = EPOLL_CTL_ADD;
+    }
+    if (::epoll_ctl(m_pollHandle, operation, handle, &event) != 0) {
+      return std::unexpected(
+          Detail::makeError(SocketErrorCode::InvalidState, "epoll_ctl"));
+    }
+    return {};
+  }
+
+  [[nodiscard]] auto waitAndDispatch(std::chrono::milliseconds timeout)
+      -> SocketResult<std::size_t> {
+    auto waitMilliseconds = static_cast<int>(timeout.count());
+    int readyCount = ::epoll_wait(m_pollHandle, m_events.data(),
+                                  static_cast<int>(m_events.size()),
+                                  waitMilliseconds);
+    if (readyCount < 0) {
+      if (Detail::isRetryable(Detail::lastErrorCode())) {
+        return std::size_t{0};
+      }
+      return std::unexpected(
+          Detail::makeError(SocketErrorCode::InvalidState, "epoll_wait"));
+    }
+
+    std::size_t dispatched = 0;
+    auto ready =
+        std::span{m_events}.first(static_cast<std::size_t>(readyCount));
+    for (const auto &entry : ready) {
+      if (entry.data.fd == m_wakeHandle) {
+        std::uint64_t drained = 0;
+        static_cast<void>(::read(m_wakeHandle, &drained, sizeof(drained)));
+        continue;
+      }
+      dispatch(entry.data.fd,
+               IoEvent{.readable = (entry.events & EPOLLIN) != 0,
+                       .writable = (entry.events & EPOLLOUT) != 0,
+                       .hangup = (entry.events &
+                                  (EPOLLHUP | EPOLLERR | EPOLLRDHUP)) != 0});
+      ++dispatched;
+    }
+    return dispatched;
+  }
+
+  NativeHandle m_pollHandle{Detail::invalidSocketHandle};
+  NativeHandle m_wakeHandle{Detail::invalidSocketHandle};
+  std::array<epoll_event, maxEventsPerWait> m_events{};
+#elif defined(__APPLE__)
+  [[nodiscard]] auto applyInterest(NativeHandle handle, IoInterest previous,
+                                   IoInterest next) const
+      -> SocketResult<void> {
+    std::array<struct kevent, 2> changes{};
+    int changeCount = 0;
+    auto stage = [&](IoInterest flag, std::int16_t filter) {
+      bool before = hasInterest(previous, flag);
+      bool after = hasInterest(next, flag);
+      if (before == after) {
+        return;
+      }
+      auto action = static_cast<std::uint16_t>(after ? EV_ADD : EV_DELETE);
+      EV_SET(&changes.at(static_cast<std::size_t>(changeCount)),
+             static_cast<uintptr_t>(handle), filter, action, 0, 0, nullptr);
+      ++changeCount;
+    };
+    stage(IoInterest::Readable, EVFILT_READ);
+    stage(IoInterest::Writable, EVFILT_WRITE);
+    if (changeCount == 0) {
+      return {};
+    }
+    if (::kevent(m_pollHandle, changes.data(), changeCount, nullptr, 0,
+                 nullptr) != 0 &&
+        next != IoInterest::None) {
+      return std::unexpected(
+          Detail::makeError(SocketErrorCode::InvalidState, "kevent"));
+    }
+    return {};
+  }
+
+  [[nodiscard]] auto waitAndDispatch(std::chrono::milliseconds timeout)
+      -> SocketResult<std::size_t> {
+    timespec waitTime{};
+    timespec *waitPointer = nullptr;
+    if (timeout.count() >= 0) {
+      auto seconds = std::chrono::duration_cast<std::chrono::seconds>(timeout);
+      waitTime.tv_sec = static_cast<time_t>(seconds.count());
+      waitTime.tv_nsec = static_cast<long>(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(timeout -
+                                                               seconds)
+              .count());
+      waitPointer = &waitTime;
+    }
+
+    int readyCount =
+        ::kevent(m_pollHandle, nullptr, 0, m_events.data(),
+                 static_cast<int>(m_events.size()), waitPointer);
+    if (readyCount < 0) {
+      if (Detail::isRetryable(Detail::lastErrorCode())) {
+        return std::size_t{0};
+      }
+      return std::unexpected(
+          Detail::makeError(SocketErrorCode::InvalidState, "kevent"));
+    }
+
+    std::size_t dispatched = 0;
+    auto ready =
+        std::span{m_events}.first(static_cast<std::size_t>(readyCount));
+    for (const auto &entry : ready) {
+      if (entry.filter == EVFILT_USER) {
+        continue;
+      }
+      dispatch(static_cast<NativeHandle>(entry.ident),
+               IoEvent{.readable = entry.filter == EVFILT_READ,
+                       .writable = entry.filter == EVFILT_WRITE,
+                       .hangup = (entry.flags & (EV_EOF | EV_ERROR)) != 0});
+      ++dispatched;
+    }
+    return dispatched;
+  }
+
+  NativeHandle m_pollHandle{Detail::invalidSocketHandle};
+  std::array<struct kevent, maxEventsPerWait> m_events{};
+#elif defined(_WIN32)
+  // IOCP is completion-based; WSAPoll keeps the readiness contract identical
+  // to the epoll/kqueue backends.
+  [[nodiscard]] auto applyInterest(NativeHandle /*handle*/,
+                                   IoInterest /*previous*/,
+                                   IoInterest /*next*/) const
+      -> SocketResult<void> {
+    return {};
+  }
+
+  [[nodiscard]] auto waitAndDispatch(std::chrono::milliseconds timeout)
+      -> SocketResult<std::size_t> {
+    m_pollSet.clear();
+    m_pollSet.push_back(
+        WSAPOLLFD{.fd = m_wakeHandle, .events = POLLRDNORM, .revents = 0});
+    for (const auto &[handle, watch] : m_watches) {
+      SHORT events = 0;
+      if (hasInterest(watch.interest, IoInterest::Readable)) {
+        events |= POLLRDNORM;
+      }
+      if (hasInterest(watch.interest, IoInterest::Writable)) {
+        events |= POLLWRNORM;
+      }
+      m_pollSet.push_back(
+          WSAPOLLFD{.fd = handle, .events = events, .revents = 0});
+    }
+
+    int readyCount =
+        ::WSAPoll(m_pollSet.data(), static_cast<ULONG>(m_pollSet.size()),
+                  static_cast<INT>(timeout.count()));
+    if (readyCount == SOCKET_ERROR) {
+      return std::unexpected(
+          Detail::makeError(SocketErrorCode::InvalidState, "WSAPoll"));
+    }
+
+    std::size_t dispatched = 0;
+    for (const auto &entry : m_pollSet) {
+      if (entry.revents == 0) {
+        continue;
+      }
+      if (entry.fd == m_wakeHandle) {
+        std::array<char, 64> drained{};
+        while (::recv(m_wakeHandle, drained.data(),
+                      static_cast<int>(drained.size()), 0) > 0) {
+        }
+        continue;
+      }
+      dispatch(entry.fd,
+               IoEvent{.readable = (entry.revents & POLLRDNORM) != 0,
+                       .writable = (entry.revents & POLLWRNORM) != 0,
+                       .hangup = (entry.revents & (POLLHUP | POLLERR)) != 0});
+      ++dispatched;
+    }
+    return dispatched;
+  }
+
+  NativeHandle m_wakeHandle{Detail::invalidSocketHandle};
+  std::vector<WSAPOLLFD> m_pollSet;
+#endif
+
+  std::unordered_map<NativeHandle, Watch> m_watches;
+  std::mutex m_taskMutex;
+  std::vector<Task> m_tasks;
+  std::vector<Task> m_runningTasks;
+};
+
+// Receive buffer reused for the lifetime of a connection. Consumed bytes are
+// reclaimed by sliding the unread tail to the front, which only ever moves a
+// partial frame, so frames are always handed out as contiguous spans.
+class ReceiveBuffer {
+public:
+  static constexpr std::size_t defaultCapacity = 16 * 1024;
+
+  explicit ReceiveBuffer(std::size_t capacity = defaultCapacity)
+      : m_storage(std::max<std::size_t>(capacity, 1)) {}
+
+  // Free space for the next read, compacting or growing so that at least
+  // minimumSpace bytes are available.
+  [[nodiscard]] auto writable(std::size_t minimumSpace)
+      -> std::span<std::byte> {
+    if (m_storage.size() - m_end < minimumSpace && m_begin > 0) {
+      std::memmove(m_storage.data(), m_storage.data() + m_begin,
+                   m_end - m_begin);
+      m_end -= m_begin;
+      m_begin = 0;
+    }
+    if (m_storage.size() - m_end < minimumSpace) {
+      m_storage.resize(std::max(m_storage.size() * 2, m_end + minimumSpace));
+    }
+    return std::span<std::byte>{m_storage}.subspan(m_end);
+  }
+
+  void commit(std::size_t byteCount) noexcept {
+    m_end = std::min(m_end + byteCount, m_storage.size());
+  }
+
+  [[nodiscard]] auto readable() const noexcept -> std::span<const std::byte> {
+    return std::span<const std::byte>{m_storage}.subspan(m_begin,
+                                                         m_end - m_begin);
+  }
+
+  void consume(std::size_t byteCount) noexcept {
+    m_begin = std::min(m_begin + byteCount, m_end);
+    if (m_begin == m_end) {
+      m_begin = 0;
+      m_end = 0;
+    }
+  }
+
+private:
+  std::vector<std::byte> m_storage;
+  std::size_t m_begin{};
+  std::size_t m_end{};
+};
+
+// How a queued frame may be treated while the peer is falling behind.
+enum class FrameKind : std::uint8_t {
+  // Always delivered, in order.
+  Reliable,
+  // Superseded by the next Latest frame; only the newest unsent one is kept.
+  Latest,
+};
+
+struct OutboundPolicy {
+  bool coalesceLatest{true};
+  std::size_t maxPendingBytes{std::numeric_limits<std::size_t>::max()};
+};
+
+struct OutboundStats {
+  std::size_t queuedFrames{};
+  std::size_t pendingBytes{};
+  std::uint64_t droppedFrames{};
+};
+
+// Non-blocking socket with per-connection read and write buffers. Not
+// synchronized: callers serialize access (normally on the owning EventLoop).
+class TcpConnection {
+public:
+  explicit TcpConnection(TcpSocket socket, OutboundPolicy policy = {}) noexcept
+      : m_socket{std::move(socket)}, m_policy{policy} {}
+
+  [[nodiscard]] auto socket() noexcept -> TcpSocket & { return m_socket; }
+  [[nodiscard]] auto socket() const noexcept -> const TcpSocket & {
+    return m_socket;
+  }
+
+  // Reads whatever the kernel has buffered straight into the reusable
+  // receive buffer; a burst of small frames costs one system call. An
+  // orderly shutdown by the peer is reported through peerClosed() so
+  // already-buffered frames still drain.
+  [[nodiscard]] auto fill() -> SocketResult<std::size_t> {
+    std::size_t total = 0;
+    while (true) {
+      auto space = m_readBuffer.writable(minimumReadSpace);
+      auto chunk = m_socket.receive(space);
+      if (!chunk) {
+        if (chunk.error().code == SocketErrorCode::WouldBlock) {
+          return total;
+        }
+        if (chunk.error().code == SocketErrorCode::ConnectionClosed) {
+          m_peerClosed = true;
+          return total;
+        }
+        return std::unexpected(chunk.error());
+      }
+
+      m_readBuffer.commit(chunk.value());
+      total += chunk.value();
+      if (chunk.value() < space.size()) {
+        return total;
+      }
+    }
+  }
+
+  [[nodiscard]] auto received() const noexcept -> std::span<const std::byte> {
+    return m_readBuffer.readable();
+  }
+
+  void consume(std::size_t byteCount) noexcept {
+    m_readBuffer.consume(byteCount);
+  }
+
+  [[nodiscard]] auto peerClosed() const noexcept -> bool {
+    return m_peerClosed;
+  }
+
+  // Frames are shared, not copied: a broadcast frame queued on many
+  // connections keeps a single buffer alive until the last one sends it.
+  // Fails once the unsent backlog exceeds the policy's byte limit; the frame
+  // stays queued and the caller is expected to drop the connection.
+  [[nodiscard]] auto queue(Frame frame, FrameKind kind = FrameKind::Reliable)
+      -> SocketResult<void> {
+    if (frame.empty()) {
+      return {};
+    }
+    if (kind == FrameKind::Latest && m_policy.coalesceLatest) {
+      dropUnsentLatest();
+    }
+
+    m_pendingBytes += frame.size();
+    m_outbound.push_back(QueuedFrame{.frame = std::move(frame), .kind = kind});
+    if (m_pendingBytes > m_policy.maxPendingBytes) {
+      return std::unexpected(
+          SocketError{.code = SocketErrorCode::QueueFull,
+                      .message = "outbound queue limit exceeded",
+                      .system = {}});
+    }
+    return {};
+  }
+
+  // Writes until the queue drains or the socket would block, gathering
+  // queued frames into one vectored write per batch so a backlog of small
+  // frames costs one system call rather than one each. Returns true once
+  // nothing is left pending.
+  [[nodiscard]] auto flush() -> SocketResult<bool> {
+    std::array<std::span<const std::byte>, TcpSocket::maxVectoredBuffers>
+        batch{};
+    while (m_outboundHead < m_outbound.size()) {
+      auto count = std::min(m_outbound.size() - m_outboundHead, batch.size());
+      batch.front() =
+          m_outbound[m_outboundHead].frame.bytes().subspan(m_frontOffset);
+      for (std::size_t index = 1; index < count; ++index) {
+        batch.at(index) = m_outbound[m_outboundHead + index].frame.bytes();
+      }
+
+      auto sent =
+          m_socket.sendVectored(std::span{batch}.first(count));
+      if (!sent) {
+        if (sent.error().code == SocketErrorCode::WouldBlock) {
+          return false;
+        }
+        return std::unexpected(sent.error());
+      }
+      consumeOutbound(sent.value());
+    }
+    return true;
+  }
+
+  [[nodiscard]] auto pendingWriteBytes() const noexcept -> std::size_t {
+    return m_pendingBytes;
+  }
+
+  [[nodiscard]] auto outboundStats() const noexcept -> OutboundStats {
+    return OutboundStats{.queuedFrames = m_outbound.size() - m_outboundHead,
+                         .pendingBytes = m_pendingBytes,
+                         .droppedFrames = m_droppedFrames};
+  }
+
+private:
+  static constexpr std::size_t minimumReadSpace = 4096;
+
+  struct QueuedFrame {
+    Frame frame;
+    FrameKind kind;
+  };
+
+  void consumeOutbound(std::size_t byteCount) noexcept {
+    m_pendingBytes -= byteCount;
+    while (byteCount > 0 && m_outboundHead < m_outbound.size()) {
+      auto &front = m_outbound[m_outboundHead];
+      auto remaining = front.frame.size() - m_frontOffset;
+      if (byteCount < remaining) {
+        m_frontOffset += byteCount;
+        return;
+      }
+      byteCount -= remaining;
+      front.frame = Frame{};
+      ++m_outboundHead;
+      m_frontOffset = 0;
+    }
+    compactOutbound();
+  }
+
+  // Sent entries are only trimmed once they make up most of the vector, so
+  // popping stays O(1) and a drained queue keeps its capacity.
+  void compactOutbound() noexcept {
+    if (m_outboundHead == m_outbound.size()) {
+      m_outbound.clear();
+      m_outboundHead = 0;
+    } else if (m_outboundHead > m_outbound.size() / 2) {
+      m_outbound.erase(m_outbound.begin(),
+                       m_outbound.begin() +
+                           static_cast<std::ptrdiff_t>(m_outboundHead));
+      m_outboundHead = 0;
+    }
+  }
+
+  // A partially written front frame has to finish, whatever its kind.
+  void dropUnsentLatest() {
+    auto first =
+        m_outbound.begin() + static_cast<std::ptrdiff_t>(m_outboundHead);
+    if (first != m_outbound.end() && m_frontOffset > 0) {
+      ++first;
+    }
+    auto isLatest = [](const QueuedFrame &queued) {
+      return queued.kind == FrameKind::Latest;
+    };
+    for (auto entry = first; entry != m_outbound.end(); ++entry) {
+      if (isLatest(*entry)) {
+        m_pendingBytes -= entry->frame.size();
+        ++m_droppedFrames;
+      }
+    }
+    m_outbound.erase(std::remove_if(first, m_outbound.end(), isLatest),
+                     m_outbound.end());
+  }
+
+  TcpSocket m_socket;
+  ReceiveBuffer m_readBuffer;
+  OutboundPolicy m_policy;
+  // Entries before m_outboundHead have been sent.
+  std::vector<QueuedFrame> m_outbound;
+  std::size_t m_outboundHead{};
+  std::size_t m_frontOffset{};
+  std::size_t m_pendingBytes{};
+  std::uint64_t m_droppedFrames{};
+  bool m_peerClosed{false};
+};
+
 } // namespace Moonlapse::Net
@@ -1,5 +1,9 @@
 #pragma once
 
+#include "byteswap.hpp"
+#include "compression.hpp"
+#include "frame.hpp"
+
 #include <algorithm>
 #include <array>
 #include <bit>
@@ -8,21 +12,71 @@
 #include <cstdint>
 #include <cstring>
 #include <expected>
+#include <initializer_list>
+#include <iterator>
+#include <limits>
+#include <optional>
 #include <span>
 #include <string>
+#include <string_view>
+#include <type_traits>
 #include <variant>
 #include <vector>
 
 namespace Moonlapse::Protocol {
 
-inline constexpr std::uint16_t protocolVersion = 1;
+inline constexpr std::uint16_t protocolVersion = 3;
 inline constexpr std::size_t packetHeaderSize =
     sizeof(std::uint16_t) + sizeof(std::uint16_t) + sizeof(std::uint32_t);
+// Wire size of one PlayerState record: id, x and y as 32-bit integers.
+inline constexpr std::size_t playerStateSize = 3 * sizeof(std::uint32_t);
+// Upper bound on a single payload. A header announcing more than this is
+// treated as a corrupt stream rather than something worth buffering for.
+inline constexpr std::uint32_t maxPayloadSize = std::uint32_t{1} << 20;
 
 enum class PacketType : std::uint8_t {
   Movement = 1,
   StateSnapshot = 2,
   Chat = 3,
+  StateDelta = 4,
+  SnapshotAck = 5,
+  Capabilities = 6,
+  ChatBatch = 7,
+  ChatSubscription = 8,
+  // Server-to-server only (see zone_link.hpp); decodePacket rejects them and
+  // clients never see them.
+  ZoneEnter = 16,
+  ZoneHandoff = 17,
+  // The UDP channel's set-up and framing (see datagram.hpp); decodePacket
+  // rejects them too.
+  DatagramSetup = 24,
+  DatagramHello = 25,
+  DatagramFragment = 26,
+};
+
+// Header flags travel in the high byte of the 16-bit type field, which older
+// peers always leave zero.
+inline constexpr std::uint8_t compactEntitiesFlag = 0x01;
+// The payload went through PayloadCompressor; PayloadInflater undoes it.
+inline constexpr std::uint8_t compressedPayloadFlag = 0x02;
+inline constexpr std::uint8_t knownPacketFlags =
+    compactEntitiesFlag | compressedPayloadFlag;
+
+// Bits a peer may set in CapabilitiesPacket.
+inline constexpr std::uint32_t compactEntitiesCapability = 1U << 0;
+// The peer may send frames with compressedPayloadFlag set.
+inline constexpr std::uint32_t compressionCapability = 1U << 1;
+// State deltas may arrive over UDP once the DatagramSetup handshake is done.
+inline constexpr std::uint32_t datagramCapability = 1U << 2;
+
+// Payloads smaller than this are never worth compressing.
+inline constexpr std::size_t compressionThreshold = 256;
+
+// How player records in snapshots and deltas are written. Compact uses
+// varint, delta-coded ids and bit-packed coordinates.
+enum class EntityEncoding : std::uint8_t {
+  Full,
+  Compact,
 };
 
 enum class Direction : std::uint8_t {
@@ -34,43 +88,136 @@ enum class Direction : std::uint8_t {
 
 using PlayerId = std::uint32_t;
 
+// Snapshot sequences start at 1; a delta against noBaseline is a full state.
+inline constexpr std::uint32_t noBaseline = 0;
+
 struct Position {
   std::int32_t x{};
   std::int32_t y{};
+
+  friend auto operator==(const Position &, const Position &) -> bool = default;
 };
 
 struct PacketHeader {
   std::uint16_t version{protocolVersion};
   PacketType type{PacketType::Movement};
   std::uint32_t payloadSize{};
+  std::uint8_t flags{};
 };
 
 struct MovementPacket {
   PlayerId player{};
   Direction direction{Direction::Up};
+  // Counts up from 1 per client. The server echoes the newest one it has
+  // applied so the client can drop its prediction of it.
+  std::uint32_t sequence{};
 };
 
 struct PlayerState {
   PlayerId player{};
   Position position{};
+
+  friend auto operator==(const PlayerState &, const PlayerState &)
+      -> bool = default;
 };
 
+// The bulk encoders copy PlayerState arrays as runs of 32-bit words, so the
+// in-memory layout has to match the wire record field for field.
+static_assert(std::is_trivially_copyable_v<PlayerState> &&
+              std::is_standard_layout_v<PlayerState>);
+static_assert(sizeof(PlayerState) == playerStateSize &&
+              offsetof(PlayerState, position) == sizeof(PlayerId) &&
+              sizeof(Position) == 2 * sizeof(std::int32_t));
+
 struct StateSnapshotPacket {
   PlayerId focusPlayer{};
   std::vector<PlayerState> players;
 };
 
+// World and Trade reach every subscriber; Local only those within the view
+// radius of the speaker.
+enum class ChatChannel : std::uint8_t {
+  World = 0,
+  Local = 1,
+  Trade = 2,
+};
+
+inline constexpr std::size_t chatChannelCount = 3;
+
+[[nodiscard]] constexpr auto channelBit(ChatChannel channel) noexcept
+    -> std::uint32_t {
+  return 1U << static_cast<unsigned>(channel);
+}
+
+inline constexpr std::uint32_t allChatChannels =
+    (1U << chatChannelCount) - 1;
+
+// Messages travel with a 16-bit length; longer text is cut to this.
+inline constexpr std::size_t maxChatMessageSize =
+    std::numeric_limits<std::uint16_t>::max();
+
+// Sent by clients. The server hands messages back in ChatBatchPackets.
 struct ChatPacket {
   PlayerId player{};
+  ChatChannel channel{ChatChannel::World};
   std::string message;
 };
 
+// Borrowed form of ChatPacket; the message aliases the receive buffer.
+struct ChatView {
+  PlayerId player{};
+  ChatChannel channel{ChatChannel::World};
+  std::string_view message;
+};
+
+// Every message one recipient gets from a simulation tick, in the order
+// they were sent.
+struct ChatBatchPacket {
+  std::vector<ChatPacket> messages;
+};
+
+// Encoding-only form for fanning out messages owned elsewhere.
+struct ChatBatchView {
+  std::span<const ChatView> messages;
+};
+
+// Channels, as channelBit flags, a client wants to hear. Sessions start out
+// subscribed to allChatChannels.
+struct ChatSubscriptionPacket {
+  std::uint32_t channels{allChatChannels};
+};
+
+struct StateDeltaPacket {
+  std::uint32_t sequence{};
+  std::uint32_t baseline{noBaseline};
+  PlayerId focusPlayer{};
+  // Newest MovementPacket::sequence from the focus player that this state
+  // already reflects.
+  std::uint32_t lastProcessedInput{};
+  std::vector<PlayerId> removed;
+  std::vector<PlayerState> added;
+  std::vector<PlayerState> moved;
+};
+
+struct SnapshotAckPacket {
+  std::uint32_t sequence{};
+};
+
+// Sent by the client to offer optional features; the server answers with
+// the subset it will use. Clients send it before anything else, so this
+// requires a server that knows the type: one that predates it speaks an
+// older protocolVersion and refuses the connection on the first header.
+struct CapabilitiesPacket {
+  std::uint32_t capabilities{};
+};
+
 enum class PacketError : std::uint8_t {
   VersionMismatch,
   UnknownType,
   Truncated,
   SizeMismatch,
   InvalidPayload,
+  PayloadTooLarge,
 };
 
 template <typename T> using PacketResult = std::expected<T, PacketError>;
@@ -113,12 +260,294 @@ template <std::integral T>
   return fromBigEndian(std::bit_cast<T>(raw));
 }
 
+// Unchecked counterpart of readIntegral for callers that validated the
+// length up front.
+template <std::integral T>
+[[nodiscard]] inline auto loadIntegral(std::span<const std::byte> bytes,
+                                       std::size_t offset) noexcept -> T {
+  std::array<std::byte, sizeof(T)> raw{};
+  std::memcpy(raw.data(), bytes.subspan(offset, sizeof(T)).data(), sizeof(T));
+  return fromBigEndian(std::bit_cast<T>(raw));
+}
+
+// Compile-time wire layouts. A WireSchema lists the fields of a struct in
+// wire order. Fixed-size packets get their payload size, encoder and decoder
+// generated from it: offsets are resolved at compile time, so the decoder
+// checks the length once and then loads every field unchecked.
+
+// A data member carried on the wire as Wire; enums travel as their
+// underlying value.
+template <auto Member, std::integral Wire> struct Field {};
+
+// Reserved bytes, written as zero and ignored on read.
+template <std::size_t Length> struct Padding {};
+
+// A member whose own WireSchema is laid out in place.
+template <auto Member> struct Nested {};
+
+template <typename... Fields> struct FieldList {};
+
+// Specialised per wire struct. Fixed-size layouts define Fields; anything
+// sent as a packet of its own defines type; compactForm marks packets that
+// may carry compactEntitiesFlag. An optional static valid() rejects decoded
+// values the field types alone cannot rule out.
+template <typename T> struct WireSchema {};
+
+template <typename T>
+concept FixedWire = requires { typename WireSchema<T>::Fields; };
+
+template <typename T>
+concept TypedPacket = requires {
+  { WireSchema<T>::type } -> std::convertible_to<PacketType>;
+};
+
+namespace Detail {
+
+template <auto Member> struct MemberOf;
+
+template <typename Owner, typename Value, Value Owner::*Member>
+struct MemberOf<Member> {
+  using Type = Value;
+};
+
+template <typename List> struct Layout;
+template <typename FieldSpec> struct FieldCodec;
+
+template <auto Member, std::integral Wire>
+struct FieldCodec<Field<Member, Wire>> {
+  using Value = typename MemberOf<Member>::Type;
+  static constexpr std::size_t size = sizeof(Wire);
+
+  template <typename T>
+  static void store(const T &object, std::span<std::byte> out) noexcept {
+    auto bytes = std::bit_cast<std::array<std::byte, size>>(
+        toBigEndian(static_cast<Wire>(object.*Member)));
+    std::memcpy(out.data(), bytes.data(), size);
+  }
+
+  template <typename T>
+  static void load(T &object, std::span<const std::byte> in) noexcept {
+    object.*Member = static_cast<Value>(loadIntegral<Wire>(in, 0));
+  }
+};
+
+template <std::size_t Length> struct FieldCodec<Padding<Length>> {
+  static constexpr std::size_t size = Length;
+
+  // The output starts zeroed.
+  template <typename T>
+  static void store(const T & /*object*/,
+                    std::span<std::byte> /*out*/) noexcept {}
+
+  template <typename T>
+  static void load(T & /*object*/,
+                   std::span<const std::byte> /*in*/) noexcept {}
+};
+
+template <auto Member> struct FieldCodec<Nested<Member>> {
+  using Value = typename MemberOf<Member>::Type;
+  using Inner = Layout<typename WireSchema<Value>::Fields>;
+  static constexpr std::size_t size = Inner::size;
+
+  template <typename T>
+  static void store(const T &object, std::span<std::byte> out) noexcept {
+    Inner::store(object.*Member, out);
+  }
+
+  template <typename T>
+  static void load(T &object, std::span<const std::byte> in) noexcept {
+    Inner::load(object.*Member, in);
+  }
+};
+
+// Folds over the field list, so each field becomes straight-line code at a
+// constant offset.
+template <typename... Fields> struct Layout<FieldList<Fields...>> {
+  static constexpr std::size_t size =
+      (std::size_t{0} + ... + FieldCodec<Fields>::size);
+
+  template <typename T>
+  static void store(const T &object, std::span<std::byte> out) noexcept {
+    std::size_t offset = 0;
+    ((FieldCodec<Fields>::store(object,
+                                out.subspan(offset, FieldCodec<Fields>::size)),
+      offset += FieldCodec<Fields>::size),
+     ...);
+  }
+
+  template <typename T>
+  static void load(T &object, std::span<const std::byte> in) noexcept {
+    std::size_t offset = 0;
+    ((FieldCodec<Fields>::load(object,
+                               in.subspan(offset, FieldCodec<Fields>::size)),
+      offset += FieldCodec<Fields>::size),
+     ...);
+  }
+};
+
+template <FixedWire T> using LayoutOf = Layout<typename WireSchema<T>::Fields>;
+
+} // namespace Detail
+
+template <FixedWire T>
+inline constexpr std::size_t fixedPayloadSize = Detail::LayoutOf<T>::size;
+
+template <FixedWire T>
+[[nodiscard]] inline auto encodeFixed(const T &value) noexcept
+    -> std::array<std::byte, fixedPayloadSize<T>> {
+  std::array<std::byte, fixedPayloadSize<T>> bytes{};
+  Detail::LayoutOf<T>::store(value, bytes);
+  return bytes;
+}
+
+template <FixedWire T>
+[[nodiscard]] inline auto decodeFixed(std::span<const std::byte> payload)
+    -> PacketResult<T> {
+  if (payload.size() < fixedPayloadSize<T>) {
+    return std::unexpected(PacketError::Truncated);
+  }
+  if (payload.size() != fixedPayloadSize<T>) {
+    return std::unexpected(PacketError::SizeMismatch);
+  }
+
+  T value{};
+  Detail::LayoutOf<T>::load(value, payload);
+  if constexpr (requires { WireSchema<T>::valid(value); }) {
+    if (!WireSchema<T>::valid(value)) {
+      return std::unexpected(PacketError::InvalidPayload);
+    }
+  }
+  return value;
+}
+
+template <> struct WireSchema<Position> {
+  using Fields = FieldList<Field<&Position::x, std::int32_t>,
+                           Field<&Position::y, std::int32_t>>;
+};
+
+template <> struct WireSchema<MovementPacket> {
+  static constexpr PacketType type = PacketType::Movement;
+  using Fields = FieldList<Field<&MovementPacket::player, PlayerId>,
+                           Field<&MovementPacket::direction, std::uint8_t>,
+                           Padding<3>,
+                           Field<&MovementPacket::sequence, std::uint32_t>>;
+
+  [[nodiscard]] static constexpr auto
+  valid(const MovementPacket &packet) noexcept -> bool {
+    return packet.direction <= Direction::Right;
+  }
+};
+
+template <> struct WireSchema<SnapshotAckPacket> {
+  static constexpr PacketType type = PacketType::SnapshotAck;
+  using Fields = FieldList<Field<&SnapshotAckPacket::sequence, std::uint32_t>>;
+};
+
+template <> struct WireSchema<CapabilitiesPacket> {
+  static constexpr PacketType type = PacketType::Capabilities;
+  using Fields =
+      FieldList<Field<&CapabilitiesPacket::capabilities, std::uint32_t>>;
+};
+
+template <> struct WireSchema<ChatSubscriptionPacket> {
+  static constexpr PacketType type = PacketType::ChatSubscription;
+  using Fields = FieldList<
+      Field<&ChatSubscriptionPacket::channels, std::uint32_t>>;
+
+  [[nodiscard]] static constexpr auto
+  valid(const ChatSubscriptionPacket &packet) noexcept -> bool {
+    return (packet.channels & ~allChatChannels) == 0;
+  }
+};
+
+static_assert(fixedPayloadSize<MovementPacket> == 12 &&
+              fixedPayloadSize<SnapshotAckPacket> == 4 &&
+              fixedPayloadSize<CapabilitiesPacket> == 4 &&
+              fixedPayloadSize<ChatSubscriptionPacket> == 4);
+
+// Variable-size packets keep hand-written codecs; decode() is defined with
+// them further down.
+template <> struct WireSchema<StateSnapshotPacket> {
+  static constexpr PacketType type = PacketType::StateSnapshot;
+  static constexpr bool compactForm = true;
+  static auto decode(std::span<const std::byte> payload, bool compact)
+      -> PacketResult<StateSnapshotPacket>;
+};
+
+template <> struct WireSchema<ChatPacket> {
+  static constexpr PacketType type = PacketType::Chat;
+  static auto decode(std::span<const std::byte> payload, bool compact)
+      -> PacketResult<ChatPacket>;
+};
+
+template <> struct WireSchema<ChatView> {
+  static constexpr PacketType type = PacketType::Chat;
+};
+
+template <> struct WireSchema<ChatBatchPacket> {
+  static constexpr PacketType type = PacketType::ChatBatch;
+  static auto decode(std::span<const std::byte> payload, bool compact)
+      -> PacketResult<ChatBatchPacket>;
+};
+
+template <> struct WireSchema<ChatBatchView> {
+  static constexpr PacketType type = PacketType::ChatBatch;
+};
+
+template <> struct WireSchema<StateDeltaPacket> {
+  static constexpr PacketType type = PacketType::StateDelta;
+  static constexpr bool compactForm = true;
+  static auto decode(std::span<const std::byte> payload, bool compact)
+      -> PacketResult<StateDeltaPacket>;
+};
+
+// Everything decodePacket hands back. The header check and the decoder
+// table are both generated from this list.
+using PacketVariant =
+    std::variant<MovementPacket, StateSnapshotPacket, ChatPacket,
+                 StateDeltaPacket, SnapshotAckPacket, CapabilitiesPacket,
+                 ChatBatchPacket, ChatSubscriptionPacket>;
+
+// Types that travel between servers only and never reach decodePacket.
+inline constexpr std::array linkPacketTypes{PacketType::ZoneEnter,
+                                            PacketType::ZoneHandoff};
+// Types the UDP channel handles below decodePacket.
+inline constexpr std::array datagramPacketTypes{PacketType::DatagramSetup,
+                                                PacketType::DatagramHello,
+                                                PacketType::DatagramFragment};
+
+namespace Detail {
+
+inline constexpr std::size_t packetTypeCount = 256;
+
+template <typename... Packets>
+consteval auto makeKnownTypes(std::type_identity<std::variant<Packets...>>)
+    -> std::array<bool, packetTypeCount> {
+  std::array<bool, packetTypeCount> known{};
+  ((known[static_cast<std::size_t>(WireSchema<Packets>::type)] = true), ...);
+  for (auto type : linkPacketTypes) {
+    known[static_cast<std::size_t>(type)] = true;
+  }
+  for (auto type : datagramPacketTypes) {
+    known[static_cast<std::size_t>(type)] = true;
+  }
+  return known;
+}
+
+inline constexpr auto knownPacketTypes =
+    makeKnownTypes(std::type_identity<PacketVariant>{});
+
+} // namespace Detail
+
 [[nodiscard]] inline auto encodeHeader(PacketHeader header) noexcept
     -> std::array<std::byte, packetHeaderSize> {
   std::array<std::byte, packetHeaderSize> buffer{};
   std::size_t offset = 0;
   writeIntegral(buffer, offset, header.version);
-  writeIntegral(buffer, offset, static_cast<std::uint16_t>(header.type));
+  writeIntegral(buffer, offset,
+                static_cast<std::uint16_t>(
+                    (std::uint16_t{header.flags} << 8U) |
+                    static_cast<std::uint16_t>(header.type)));
   writeIntegral(buffer, offset, header.payloadSize);
   return buffer;
 }
@@ -149,24 +578,69 @@ template <std::integral T>
     return std::unexpected(PacketError::VersionMismatch);
   }
 
-  auto decodedType = static_cast<PacketType>(*typeValue);
-  switch (decodedType) {
-  case PacketType::Movement:
-  case PacketType::StateSnapshot:
-  case PacketType::Chat:
-    break;
-  default:
+  auto flags = static_cast<std::uint8_t>(*typeValue >> 8U);
+  if ((flags & ~knownPacketFlags) != 0) {
+    return std::unexpected(PacketError::UnknownType);
+  }
+
+  auto typeIndex = std::size_t{*typeValue & 0xFFU};
+  if (!Detail::knownPacketTypes.at(typeIndex)) {
     return std::unexpected(PacketError::UnknownType);
   }
+  auto decodedType = static_cast<PacketType>(typeIndex);
 
-  return PacketHeader{
-      .version = *version, .type = decodedType, .payloadSize = *payloadSize};
+  return PacketHeader{.version = *version,
+                      .type = decodedType,
+                      .payloadSize = *payloadSize,
+                      .flags = flags};
+}
+
+// A complete frame inside a receive buffer. The payload aliases the buffer,
+// so it is only valid until those bytes are consumed.
+struct FrameView {
+  PacketHeader header;
+  std::span<const std::byte> payload;
+
+  [[nodiscard]] auto size() const noexcept -> std::size_t {
+    return packetHeaderSize + payload.size();
+  }
+};
+
+// Splits the first frame off the front of a byte stream. Yields nullopt
+// until the whole frame has arrived.
+[[nodiscard]] inline auto extractFrame(std::span<const std::byte> buffer)
+    -> PacketResult<std::optional<FrameView>> {
+  if (buffer.size() < packetHeaderSize) {
+    return std::nullopt;
+  }
+
+  auto header = decodeHeader(buffer.first(packetHeaderSize));
+  if (!header) {
+    return std::unexpected(header.error());
+  }
+  if (header->payloadSize > maxPayloadSize) {
+    return std::unexpected(PacketError::PayloadTooLarge);
+  }
+
+  auto frameSize = packetHeaderSize + std::size_t{header->payloadSize};
+  if (buffer.size() < frameSize) {
+    return std::nullopt;
+  }
+  return FrameView{.header = *header,
+                   .payload = buffer.subspan(packetHeaderSize,
+                                             header->payloadSize)};
 }
 
 class PayloadWriter {
 public:
   PayloadWriter() = default;
 
+  // Writes into recycled storage, keeping its capacity.
+  explicit PayloadWriter(std::vector<std::byte> storage) noexcept
+      : m_buffer{std::move(storage)} {
+    m_buffer.clear();
+  }
+
   template <std::integral T> void write(T value) {
     auto networkOrder = toBigEndian(value);
     auto bytes = std::bit_cast<std::array<std::byte, sizeof(T)>>(networkOrder);
@@ -181,6 +655,34 @@ public:
     m_buffer.insert(m_buffer.end(), length, std::byte{0});
   }
 
+  void writeBytes(std::span<const std::byte> bytes) {
+    m_buffer.insert(m_buffer.end(), bytes.begin(), bytes.end());
+  }
+
+  // LEB128: seven bits per byte, least significant group first.
+  void writeVarint(std::uint32_t value) {
+    constexpr std::uint32_t continuation = 0x80U;
+    while (value >= continuation) {
+      m_buffer.push_back(static_cast<std::byte>(value | continuation));
+      value >>= 7U;
+    }
+    m_buffer.push_back(static_cast<std::byte>(value));
+  }
+
+  // Appends an array of 32-bit fields in network order with one resize and
+  // one vectorised byteswap, instead of a write() per field.
+  template <typename T>
+    requires std::is_trivially_copyable_v<T> &&
+             (sizeof(T) % sizeof(std::uint32_t) == 0)
+  void writeWords(std::span<const T> values) {
+    auto used = m_buffer.size();
+    m_buffer.resize(used + values.size_bytes());
+    copyBigEndianWords(std::as_bytes(values),
+                       std::span<std::byte>{m_buffer}.subspan(used));
+  }
+
+  void reserve(std::size_t capacity) { m_buffer.reserve(capacity); }
+
   [[nodiscard]] auto bytes() const noexcept -> std::span<const std::byte> {
     return m_buffer;
   }
@@ -212,6 +714,37 @@ public:
 
   auto readByte() -> PacketResult<std::uint8_t> { return read<std::uint8_t>(); }
 
+  auto readVarint() -> PacketResult<std::uint32_t> {
+    constexpr unsigned lastShift = 28;
+    std::uint32_t value = 0;
+    for (unsigned shift = 0; shift <= lastShift; shift += 7) {
+      auto next = readByte();
+      if (!next) {
+        return std::unexpected(next.error());
+      }
+      auto group = static_cast<std::uint32_t>(*next & 0x7FU);
+      if (shift == lastShift && group > 0x0FU) {
+        return std::unexpected(PacketError::InvalidPayload);
+      }
+      value |= group << shift;
+      if ((*next & 0x80U) == 0) {
+        return value;
+      }
+    }
+    return std::unexpected(PacketError::InvalidPayload);
+  }
+
+  auto readBytes(std::size_t length)
+      -> PacketResult<std::span<const std::byte>> {
+    if (m_offset + length > m_payload.size()) {
+      return std::unexpected(PacketError::Truncated);
+    }
+
+    auto bytes = m_payload.subspan(m_offset, length);
+    m_offset += length;
+    return bytes;
+  }
+
   auto skip(std::size_t length) -> PacketResult<void> {
     if (m_offset + length > m_payload.size()) {
       return std::unexpected(PacketError::Truncated);
@@ -230,153 +763,830 @@ private:
   std::size_t m_offset{};
 };
 
-[[nodiscard]] inline auto encodePayload(const MovementPacket &packet)
-    -> std::vector<std::byte> {
-  constexpr std::size_t reservedBytes = 3;
-  PayloadWriter writer;
-  writer.write<PlayerId>(packet.player);
-  writer.writeByte(static_cast<std::uint8_t>(packet.direction));
-  writer.writePadding(reservedBytes);
-  return std::move(writer).release();
+// PlayerState records read in place, straight from the wire encoding.
+class PlayerStateRange {
+public:
+  class Iterator {
+  public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = PlayerState;
+    using difference_type = std::ptrdiff_t;
+
+    Iterator() noexcept = default;
+    Iterator(std::span<const std::byte> records, std::size_t index) noexcept
+        : m_records{records}, m_index{index} {}
+
+    auto operator*() const noexcept -> PlayerState {
+      auto offset = m_index * playerStateSize;
+      return PlayerState{
+          .player = loadIntegral<std::uint32_t>(m_records, offset),
+          .position = Position{
+              .x = loadIntegral<std::int32_t>(m_records,
+                                              offset + sizeof(std::uint32_t)),
+              .y = loadIntegral<std::int32_t>(
+                  m_records, offset + 2 * sizeof(std::uint32_t))}};
+    }
+
+    auto operator++() noexcept -> Iterator & {
+      ++m_index;
+      return *this;
+    }
+
+    auto operator++(int) noexcept -> Iterator {
+      auto previous = *this;
+      ++m_index;
+      return previous;
+    }
+
+    friend auto operator==(const Iterator &left,
+                           const Iterator &right) noexcept -> bool {
+      return left.m_index == right.m_index;
+    }
+
+  private:
+    std::span<const std::byte> m_records;
+    std::size_t m_index{};
+  };
+
+  PlayerStateRange() noexcept = default;
+  // records must hold a whole number of playerStateSize entries.
+  explicit PlayerStateRange(std::span<const std::byte> records) noexcept
+      : m_records{records} {}
+
+  [[nodiscard]] auto begin() const noexcept -> Iterator {
+    return Iterator{m_records, 0};
+  }
+  [[nodiscard]] auto end() const noexcept -> Iterator {
+    return Iterator{m_records, size()};
+  }
+  [[nodiscard]] auto size() const noexcept -> std::size_t {
+    return m_records.size() / playerStateSize;
+  }
+  [[nodiscard]] auto empty() const noexcept -> bool { return size() == 0; }
+  [[nodiscard]] auto bytes() const noexcept -> std::span<const std::byte> {
+    return m_records;
+  }
+  [[nodiscard]] auto operator[](std::size_t index) const noexcept
+      -> PlayerState {
+    return *Iterator{m_records, index};
+  }
+
+private:
+  std::span<const std::byte> m_records;
+};
+
+// Borrowed form of StateSnapshotPacket over the receive buffer.
+struct StateSnapshotView {
+  PlayerId focusPlayer{};
+  PlayerStateRange players;
+};
+
+template <FixedWire Packet>
+inline void encodePayload(PayloadWriter &writer, const Packet &packet) {
+  writer.writeBytes(encodeFixed(packet));
 }
 
-[[nodiscard]] inline auto encodePayload(const StateSnapshotPacket &packet)
-    -> std::vector<std::byte> {
-  PayloadWriter writer;
+inline void writePlayerStates(PayloadWriter &writer,
+                              std::span<const PlayerState> entries) {
+  writer.write<std::uint32_t>(static_cast<std::uint32_t>(entries.size()));
+  writer.writeWords(entries);
+}
+
+inline void encodePayload(PayloadWriter &writer,
+                          const StateSnapshotPacket &packet) {
   writer.write<PlayerId>(packet.focusPlayer);
+  writePlayerStates(writer, packet.players);
+}
+
+[[nodiscard]] constexpr auto chatText(std::string_view message) noexcept
+    -> std::string_view {
+  return message.substr(0, maxChatMessageSize);
+}
+
+// One chat message on the wire: player id, channel byte, 16-bit length and
+// the text. ChatPacket is one of these and ChatBatchPacket a counted run.
+inline void writeChatEntry(PayloadWriter &writer, PlayerId player,
+                           ChatChannel channel, std::string_view message) {
+  auto text = chatText(message);
+  writer.write<PlayerId>(player);
+  writer.writeByte(static_cast<std::uint8_t>(channel));
+  writer.write<std::uint16_t>(static_cast<std::uint16_t>(text.size()));
+  writer.writeBytes(std::as_bytes(std::span{text}));
+}
+
+[[nodiscard]] constexpr auto chatEntrySize(std::string_view message) noexcept
+    -> std::size_t {
+  return sizeof(PlayerId) + sizeof(std::uint8_t) + sizeof(std::uint16_t) +
+         chatText(message).size();
+}
+
+inline void encodePayload(PayloadWriter &writer, const ChatPacket &packet) {
+  writeChatEntry(writer, packet.player, packet.channel, packet.message);
+}
+
+inline void encodePayload(PayloadWriter &writer, const ChatView &packet) {
+  writeChatEntry(writer, packet.player, packet.channel, packet.message);
+}
+
+inline void encodePayload(PayloadWriter &writer,
+                          const ChatBatchPacket &packet) {
   writer.write<std::uint32_t>(
-      static_cast<std::uint32_t>(packet.players.size()));
-  for (const auto &entry : packet.players) {
-    writer.write<std::uint32_t>(entry.player);
-    writer.write<std::int32_t>(entry.position.x);
-    writer.write<std::int32_t>(entry.position.y);
+      static_cast<std::uint32_t>(packet.messages.size()));
+  for (const auto &message : packet.messages) {
+    writeChatEntry(writer, message.player, message.channel, message.message);
   }
-  return std::move(writer).release();
 }
 
-[[nodiscard]] inline auto encodePayload(const ChatPacket &packet)
-    -> std::vector<std::byte> {
-  PayloadWriter writer;
-  writer.write<PlayerId>(packet.player);
-  for (char chr : packet.message) {
-    writer.writeByte(static_cast<std::uint8_t>(chr));
+inline void encodePayload(PayloadWriter &writer, const ChatBatchView &packet) {
+  writer.write<std::uint32_t>(
+      static_cast<std::uint32_t>(packet.messages.size()));
+  for (const auto &message : packet.messages) {
+    writeChatEntry(writer, message.player, message.channel, message.message);
   }
-  return std::move(writer).release();
 }
 
-[[nodiscard]] inline auto encode(const MovementPacket &packet)
-    -> std::vector<std::byte> {
-  auto payload = encodePayload(packet);
-  PacketHeader header{.version = protocolVersion,
-                      .type = PacketType::Movement,
-                      .payloadSize =
-                          static_cast<std::uint32_t>(payload.size())};
-  auto headerBytes = encodeHeader(header);
-
-  std::vector<std::byte> buffer;
-  buffer.reserve(packetHeaderSize + payload.size());
-  buffer.insert(buffer.end(), headerBytes.begin(), headerBytes.end());
-  buffer.insert(buffer.end(), payload.begin(), payload.end());
-  return buffer;
+inline void encodePayload(PayloadWriter &writer,
+                          const StateDeltaPacket &packet) {
+  writer.write<std::uint32_t>(packet.sequence);
+  writer.write<std::uint32_t>(packet.baseline);
+  writer.write<PlayerId>(packet.focusPlayer);
+  writer.write<std::uint32_t>(packet.lastProcessedInput);
+  writer.write<std::uint32_t>(
+      static_cast<std::uint32_t>(packet.removed.size()));
+  writer.writeWords(std::span<const PlayerId>{packet.removed});
+  writePlayerStates(writer, packet.added);
+  writePlayerStates(writer, packet.moved);
+}
+
+template <FixedWire Packet>
+[[nodiscard]] constexpr auto payloadSize(const Packet & /*packet*/)
+    -> std::size_t {
+  return fixedPayloadSize<Packet>;
+}
+
+[[nodiscard]] constexpr auto payloadSize(const StateSnapshotPacket &packet)
+    -> std::size_t {
+  return sizeof(PlayerId) + sizeof(std::uint32_t) +
+         packet.players.size() * playerStateSize;
 }
 
-[[nodiscard]] inline auto encode(const StateSnapshotPacket &packet)
+[[nodiscard]] constexpr auto payloadSize(const ChatPacket &packet)
+    -> std::size_t {
+  return chatEntrySize(packet.message);
+}
+
+[[nodiscard]] constexpr auto payloadSize(const ChatView &packet)
+    -> std::size_t {
+  return chatEntrySize(packet.message);
+}
+
+[[nodiscard]] constexpr auto payloadSize(const ChatBatchPacket &packet)
+    -> std::size_t {
+  auto size = sizeof(std::uint32_t);
+  for (const auto &message : packet.messages) {
+    size += chatEntrySize(message.message);
+  }
+  return size;
+}
+
+[[nodiscard]] constexpr auto payloadSize(const ChatBatchView &packet)
+    -> std::size_t {
+  auto size = sizeof(std::uint32_t);
+  for (const auto &message : packet.messages) {
+    size += chatEntrySize(message.message);
+  }
+  return size;
+}
+
+[[nodiscard]] constexpr auto payloadSize(const StateDeltaPacket &packet)
+    -> std::size_t {
+  constexpr std::size_t fixedFields = 7 * sizeof(std::uint32_t);
+  return fixedFields + packet.removed.size() * sizeof(PlayerId) +
+         (packet.added.size() + packet.moved.size()) * playerStateSize;
+}
+
+// Header and payload go straight into one buffer sized up front.
+template <typename Packet>
+[[nodiscard]] inline auto encodeWithHeader(PacketType type,
+                                           const Packet &packet,
+                                           std::vector<std::byte> storage = {})
     -> std::vector<std::byte> {
-  auto payload = encodePayload(packet);
-  PacketHeader header{.version = protocolVersion,
-                      .type = PacketType::StateSnapshot,
-                      .payloadSize =
-                          static_cast<std::uint32_t>(payload.size())};
-  auto headerBytes = encodeHeader(header);
-
-  std::vector<std::byte> buffer;
-  buffer.reserve(packetHeaderSize + payload.size());
-  buffer.insert(buffer.end(), headerBytes.begin(), headerBytes.end());
-  buffer.insert(buffer.end(), payload.begin(), payload.end());
-  return buffer;
+  auto size = payloadSize(packet);
+  PayloadWriter writer{std::move(storage)};
+  writer.reserve(packetHeaderSize + size);
+  writer.writeBytes(encodeHeader(
+      PacketHeader{.version = protocolVersion,
+                   .type = type,
+                   .payloadSize = static_cast<std::uint32_t>(size)}));
+  encodePayload(writer, packet);
+  return std::move(writer).release();
 }
 
-[[nodiscard]] inline auto encode(const ChatPacket &packet)
+template <TypedPacket Packet>
+[[nodiscard]] inline auto encode(const Packet &packet,
+                                 std::vector<std::byte> storage = {})
     -> std::vector<std::byte> {
-  auto payload = encodePayload(packet);
-  PacketHeader header{.version = protocolVersion,
-                      .type = PacketType::Chat,
-                      .payloadSize =
-                          static_cast<std::uint32_t>(payload.size())};
-  auto headerBytes = encodeHeader(header);
-
-  std::vector<std::byte> buffer;
-  buffer.reserve(packetHeaderSize + payload.size());
-  buffer.insert(buffer.end(), headerBytes.begin(), headerBytes.end());
-  buffer.insert(buffer.end(), payload.begin(), payload.end());
-  return buffer;
+  return encodeWithHeader(WireSchema<Packet>::type, packet,
+                          std::move(storage));
 }
 
-[[nodiscard]] inline auto decodeMovement(std::span<const std::byte> payload)
-    -> PacketResult<MovementPacket> {
-  constexpr std::size_t reservedBytes = 3;
+// Encodes once into a shareable frame. The bytes land in a recycled frame
+// buffer, so steady-state encoding does not allocate.
+template <typename Packet>
+[[nodiscard]] inline auto encodeFrame(const Packet &packet) -> Net::Frame {
+  Net::FrameBuffer buffer;
+  buffer.storage() = encode(packet, std::move(buffer.storage()));
+  return Net::Frame{std::move(buffer)};
+}
+
+// As few ChatBatch frames as keep every payload within maxPayloadSize;
+// usually one.
+[[nodiscard]] inline auto encodeChatBatches(std::span<const ChatView> messages)
+    -> std::vector<Net::Frame> {
+  constexpr std::size_t countSize = sizeof(std::uint32_t);
+  std::vector<Net::Frame> batches;
+  std::size_t first = 0;
+  auto size = countSize;
+  for (std::size_t index = 0; index < messages.size(); ++index) {
+    auto entrySize = chatEntrySize(messages[index].message);
+    if (index > first && size + entrySize > maxPayloadSize) {
+      batches.push_back(encodeFrame(
+          ChatBatchView{.messages = messages.subspan(first, index - first)}));
+      first = index;
+      size = countSize;
+    }
+    size += entrySize;
+  }
+  batches.push_back(
+      encodeFrame(ChatBatchView{.messages = messages.subspan(first)}));
+  return batches;
+}
+
+// Reads a count-prefixed run of PlayerState records without copying them.
+[[nodiscard]] inline auto readPlayerStateRange(PayloadReader &reader)
+    -> PacketResult<PlayerStateRange> {
+  auto count = reader.read<std::uint32_t>();
+  if (!count) {
+    return std::unexpected(count.error());
+  }
+  auto records = reader.readBytes(std::size_t{*count} * playerStateSize);
+  if (!records) {
+    return std::unexpected(records.error());
+  }
+  return PlayerStateRange{*records};
+}
+
+[[nodiscard]] inline auto viewStateSnapshot(std::span<const std::byte> payload)
+    -> PacketResult<StateSnapshotView> {
   PayloadReader reader{payload};
+  auto focusId = reader.read<std::uint32_t>();
+  if (!focusId) {
+    return std::unexpected(focusId.error());
+  }
+
+  auto players = readPlayerStateRange(reader);
+  if (!players) {
+    return std::unexpected(players.error());
+  }
+
+  if (reader.remaining() != 0) {
+    return std::unexpected(PacketError::SizeMismatch);
+  }
+
+  return StateSnapshotView{.focusPlayer = *focusId, .players = *players};
+}
+
+[[nodiscard]] inline auto
+decodeStateSnapshot(std::span<const std::byte> payload)
+    -> PacketResult<StateSnapshotPacket> {
+  auto view = viewStateSnapshot(payload);
+  if (!view) {
+    return std::unexpected(view.error());
+  }
+
+  StateSnapshotPacket packet{};
+  packet.focusPlayer = view->focusPlayer;
+  packet.players.resize(view->players.size());
+  copyBigEndianWords(view->players.bytes(),
+                     std::as_writable_bytes(std::span{packet.players}));
+  return packet;
+}
+
+[[nodiscard]] inline auto readChatEntry(PayloadReader &reader)
+    -> PacketResult<ChatView> {
   auto playerId = reader.read<std::uint32_t>();
   if (!playerId) {
     return std::unexpected(playerId.error());
   }
 
-  auto directionRaw = reader.readByte();
-  if (!directionRaw) {
-    return std::unexpected(directionRaw.error());
+  auto channel = reader.readByte();
+  if (!channel) {
+    return std::unexpected(channel.error());
+  }
+  if (*channel >= chatChannelCount) {
+    return std::unexpected(PacketError::InvalidPayload);
   }
 
-  auto skipResult = reader.skip(reservedBytes);
-  if (!skipResult) {
-    return std::unexpected(skipResult.error());
+  auto length = reader.read<std::uint16_t>();
+  if (!length) {
+    return std::unexpected(length.error());
   }
 
-  auto directionValue = *directionRaw;
-  if (directionValue > static_cast<std::uint8_t>(Direction::Right)) {
-    return std::unexpected(PacketError::InvalidPayload);
+  auto message = reader.readBytes(*length);
+  if (!message) {
+    return std::unexpected(message.error());
   }
 
-  return MovementPacket{.player = *playerId,
-                        .direction = static_cast<Direction>(directionValue)};
+  return ChatView{
+      .player = *playerId,
+      .channel = static_cast<ChatChannel>(*channel),
+      .message = std::string_view{std::bit_cast<const char *>(message->data()),
+                                  message->size()}};
 }
 
-[[nodiscard]] inline auto
-decodeStateSnapshot(std::span<const std::byte> payload)
-    -> PacketResult<StateSnapshotPacket> {
+[[nodiscard]] inline auto viewChat(std::span<const std::byte> payload)
+    -> PacketResult<ChatView> {
+  PayloadReader reader{payload};
+  auto view = readChatEntry(reader);
+  if (!view) {
+    return std::unexpected(view.error());
+  }
+
+  if (reader.remaining() != 0) {
+    return std::unexpected(PacketError::SizeMismatch);
+  }
+
+  return view;
+}
+
+[[nodiscard]] inline auto decodeChat(std::span<const std::byte> payload)
+    -> PacketResult<ChatPacket> {
+  auto view = viewChat(payload);
+  if (!view) {
+    return std::unexpected(view.error());
+  }
+
+  return ChatPacket{.player = view->player,
+                    .channel = view->channel,
+                    .message = std::string{view->message}};
+}
+
+[[nodiscard]] inline auto decodeChatBatch(std::span<const std::byte> payload)
+    -> PacketResult<ChatBatchPacket> {
+  constexpr std::size_t minEntrySize = chatEntrySize({});
   PayloadReader reader{payload};
+  auto count = reader.read<std::uint32_t>();
+  if (!count) {
+    return std::unexpected(count.error());
+  }
+  if (*count > reader.remaining() / minEntrySize) {
+    return std::unexpected(PacketError::Truncated);
+  }
+
+  ChatBatchPacket packet{};
+  packet.messages.reserve(*count);
+  for (std::uint32_t index = 0; index < *count; ++index) {
+    auto view = readChatEntry(reader);
+    if (!view) {
+      return std::unexpected(view.error());
+    }
+    packet.messages.push_back(
+        ChatPacket{.player = view->player,
+                   .channel = view->channel,
+                   .message = std::string{view->message}});
+  }
+
+  if (reader.remaining() != 0) {
+    return std::unexpected(PacketError::SizeMismatch);
+  }
+
+  return packet;
+}
+
+[[nodiscard]] inline auto readPlayerStates(PayloadReader &reader,
+                                           std::vector<PlayerState> &entries)
+    -> PacketResult<void> {
+  auto range = readPlayerStateRange(reader);
+  if (!range) {
+    return std::unexpected(range.error());
+  }
+
+  entries.resize(range->size());
+  copyBigEndianWords(range->bytes(),
+                     std::as_writable_bytes(std::span{entries}));
+  return {};
+}
+
+[[nodiscard]] inline auto decodeStateDelta(std::span<const std::byte> payload)
+    -> PacketResult<StateDeltaPacket> {
+  PayloadReader reader{payload};
+  auto sequence = reader.read<std::uint32_t>();
+  if (!sequence) {
+    return std::unexpected(sequence.error());
+  }
+
+  auto baseline = reader.read<std::uint32_t>();
+  if (!baseline) {
+    return std::unexpected(baseline.error());
+  }
+
   auto focusId = reader.read<std::uint32_t>();
   if (!focusId) {
     return std::unexpected(focusId.error());
   }
 
-  auto count = reader.read<std::uint32_t>();
+  auto lastInput = reader.read<std::uint32_t>();
+  if (!lastInput) {
+    return std::unexpected(lastInput.error());
+  }
+
+  auto removedCount = reader.read<std::uint32_t>();
+  if (!removedCount) {
+    return std::unexpected(removedCount.error());
+  }
+
+  StateDeltaPacket packet{};
+  packet.sequence = *sequence;
+  packet.baseline = *baseline;
+  packet.focusPlayer = *focusId;
+  packet.lastProcessedInput = *lastInput;
+  auto removed =
+      reader.readBytes(std::size_t{*removedCount} * sizeof(PlayerId));
+  if (!removed) {
+    return std::unexpected(removed.error());
+  }
+  packet.removed.resize(*removedCount);
+  copyBigEndianWords(*removed,
+                     std::as_writable_bytes(std::span{packet.removed}));
+
+  if (auto added = readPlayerStates(reader, packet.added); !added) {
+    return std::unexpected(added.error());
+  }
+  if (auto moved = readPlayerStates(reader, packet.moved); !moved) {
+    return std::unexpected(moved.error());
+  }
+
+  if (reader.remaining() != 0) {
+    return std::unexpected(PacketError::SizeMismatch);
+  }
+
+  return packet;
+}
+
+[[nodiscard]] constexpr auto zigzagEncode(std::int32_t value) noexcept
+    -> std::uint32_t {
+  return (static_cast<std::uint32_t>(value) << 1U) ^
+         static_cast<std::uint32_t>(value >> 31);
+}
+
+[[nodiscard]] constexpr auto zigzagDecode(std::uint32_t value) noexcept
+    -> std::int32_t {
+  return static_cast<std::int32_t>((value >> 1U) ^ (0U - (value & 1U)));
+}
+
+// Ids are written as the zigzagged difference from the previous one, which
+// stays a single byte for the sorted, dense lists the server produces.
+inline void writeCompactIds(PayloadWriter &writer,
+                            std::span<const PlayerId> identifiers) {
+  writer.writeVarint(static_cast<std::uint32_t>(identifiers.size()));
+  PlayerId previous = 0;
+  for (auto identifier : identifiers) {
+    writer.writeVarint(
+        zigzagEncode(static_cast<std::int32_t>(identifier - previous)));
+    previous = identifier;
+  }
+}
+
+// Coordinates are bit-packed using just enough bits for the largest value in
+// the list, so they only fit when none is negative.
+[[nodiscard]] inline auto fitsCompactEncoding(
+    std::span<const PlayerState> entries) noexcept -> bool {
+  return std::ranges::all_of(entries, [](const PlayerState &entry) {
+    return entry.position.x >= 0 && entry.position.y >= 0;
+  });
+}
+
+// Layout: varint count, then (when non-empty) one byte each for the x and y
+// bit widths, the delta-coded ids, and the packed coordinate pairs padded to
+// a whole byte.
+inline void writeCompactStates(PayloadWriter &writer,
+                               std::span<const PlayerState> entries) {
+  writer.writeVarint(static_cast<std::uint32_t>(entries.size()));
+  if (entries.empty()) {
+    return;
+  }
+
+  std::uint32_t largestX = 0;
+  std::uint32_t largestY = 0;
+  for (const auto &entry : entries) {
+    largestX =
+        std::max(largestX, static_cast<std::uint32_t>(entry.position.x));
+    largestY =
+        std::max(largestY, static_cast<std::uint32_t>(entry.position.y));
+  }
+  auto bitsX = static_cast<unsigned>(std::bit_width(largestX));
+  auto bitsY = static_cast<unsigned>(std::bit_width(largestY));
+  writer.writeByte(static_cast<std::uint8_t>(bitsX));
+  writer.writeByte(static_cast<std::uint8_t>(bitsY));
+
+  PlayerId previous = 0;
+  for (const auto &entry : entries) {
+    writer.writeVarint(
+        zigzagEncode(static_cast<std::int32_t>(entry.player - previous)));
+    previous = entry.player;
+  }
+
+  std::uint64_t pending = 0;
+  unsigned pendingBits = 0;
+  auto pack = [&](std::int32_t value, unsigned bitCount) {
+    pending |= std::uint64_t{static_cast<std::uint32_t>(value)} << pendingBits;
+    pendingBits += bitCount;
+    while (pendingBits >= 8) {
+      writer.writeByte(static_cast<std::uint8_t>(pending));
+      pending >>= 8U;
+      pendingBits -= 8;
+    }
+  };
+  for (const auto &entry : entries) {
+    pack(entry.position.x, bitsX);
+    pack(entry.position.y, bitsY);
+  }
+  if (pendingBits > 0) {
+    writer.writeByte(static_cast<std::uint8_t>(pending));
+  }
+}
+
+[[nodiscard]] inline auto readCompactIds(PayloadReader &reader,
+                                         std::vector<PlayerId> &identifiers)
+    -> PacketResult<void> {
+  auto count = reader.readVarint();
   if (!count) {
     return std::unexpected(count.error());
   }
+  // Every id takes at least one byte, which bounds the allocation.
+  if (*count > reader.remaining()) {
+    return std::unexpected(PacketError::Truncated);
+  }
 
-  StateSnapshotPacket packet{};
-  packet.focusPlayer = *focusId;
-  packet.players.reserve(*count);
+  identifiers.resize(*count);
+  PlayerId previous = 0;
+  for (auto &identifier : identifiers) {
+    auto step = reader.readVarint();
+    if (!step) {
+      return std::unexpected(step.error());
+    }
+    previous += static_cast<PlayerId>(zigzagDecode(*step));
+    identifier = previous;
+  }
+  return {};
+}
 
-  for (std::uint32_t index = 0; index < *count; ++index) {
-    auto playerId = reader.read<std::uint32_t>();
-    if (!playerId) {
-      return std::unexpected(playerId.error());
+[[nodiscard]] inline auto readCompactStates(PayloadReader &reader,
+                                            std::vector<PlayerState> &entries)
+    -> PacketResult<void> {
+  constexpr unsigned maxCoordinateBits = 31;
+  auto count = reader.readVarint();
+  if (!count) {
+    return std::unexpected(count.error());
+  }
+  entries.clear();
+  if (*count == 0) {
+    return {};
+  }
+  if (*count > reader.remaining()) {
+    return std::unexpected(PacketError::Truncated);
+  }
+
+  auto bitsX = reader.readByte();
+  if (!bitsX) {
+    return std::unexpected(bitsX.error());
+  }
+  auto bitsY = reader.readByte();
+  if (!bitsY) {
+    return std::unexpected(bitsY.error());
+  }
+  if (*bitsX > maxCoordinateBits || *bitsY > maxCoordinateBits) {
+    return std::unexpected(PacketError::InvalidPayload);
+  }
+
+  entries.resize(*count);
+  PlayerId previous = 0;
+  for (auto &entry : entries) {
+    auto step = reader.readVarint();
+    if (!step) {
+      return std::unexpected(step.error());
     }
+    previous += static_cast<PlayerId>(zigzagDecode(*step));
+    entry.player = previous;
+  }
+
+  auto packedBits = std::size_t{*count} * (std::size_t{*bitsX} + *bitsY);
+  auto packed = reader.readBytes((packedBits + 7) / 8);
+  if (!packed) {
+    return std::unexpected(packed.error());
+  }
 
-    auto positionX = reader.read<std::int32_t>();
-    if (!positionX) {
-      return std::unexpected(positionX.error());
+  std::uint64_t pending = 0;
+  unsigned pendingBits = 0;
+  std::size_t next = 0;
+  auto unpack = [&](unsigned bitCount) -> std::int32_t {
+    while (pendingBits < bitCount) {
+      pending |= std::uint64_t{static_cast<std::uint8_t>((*packed)[next++])}
+                 << pendingBits;
+      pendingBits += 8;
     }
+    auto value = pending & ((std::uint64_t{1} << bitCount) - 1);
+    pending >>= bitCount;
+    pendingBits -= bitCount;
+    return static_cast<std::int32_t>(value);
+  };
+  for (auto &entry : entries) {
+    entry.position.x = unpack(*bitsX);
+    entry.position.y = unpack(*bitsY);
+  }
+  return {};
+}
+
+inline void encodeCompactPayload(PayloadWriter &writer,
+                                 const StateSnapshotPacket &packet) {
+  writer.writeVarint(packet.focusPlayer);
+  writeCompactStates(writer, packet.players);
+}
 
-    auto positionY = reader.read<std::int32_t>();
-    if (!positionY) {
-      return std::unexpected(positionY.error());
+inline void encodeCompactPayload(PayloadWriter &writer,
+                                 const StateDeltaPacket &packet) {
+  writer.writeVarint(packet.sequence);
+  writer.writeVarint(packet.baseline);
+  writer.writeVarint(packet.focusPlayer);
+  writer.writeVarint(packet.lastProcessedInput);
+  writeCompactIds(writer, packet.removed);
+  writeCompactStates(writer, packet.added);
+  writeCompactStates(writer, packet.moved);
+}
+
+// The compact size is only known once written, so the header is patched in
+// afterwards. The full size is a safe reservation.
+template <typename Packet>
+[[nodiscard]] inline auto
+encodeCompactWithHeader(PacketType type, const Packet &packet,
+                        std::vector<std::byte> storage = {})
+    -> std::vector<std::byte> {
+  PayloadWriter writer{std::move(storage)};
+  writer.reserve(packetHeaderSize + payloadSize(packet));
+  writer.writePadding(packetHeaderSize);
+  encodeCompactPayload(writer, packet);
+
+  auto bytes = std::move(writer).release();
+  auto header = encodeHeader(PacketHeader{
+      .version = protocolVersion,
+      .type = type,
+      .payloadSize =
+          static_cast<std::uint32_t>(bytes.size() - packetHeaderSize),
+      .flags = compactEntitiesFlag});
+  std::ranges::copy(header, bytes.begin());
+  return bytes;
+}
+
+// Falls back to the full encoding when the records cannot be packed.
+[[nodiscard]] inline auto encode(const StateSnapshotPacket &packet,
+                                 EntityEncoding encoding,
+                                 std::vector<std::byte> storage = {})
+    -> std::vector<std::byte> {
+  if (encoding == EntityEncoding::Compact &&
+      fitsCompactEncoding(packet.players)) {
+    return encodeCompactWithHeader(PacketType::StateSnapshot, packet,
+                                   std::move(storage));
+  }
+  return encode(packet, std::move(storage));
+}
+
+[[nodiscard]] inline auto encode(const StateDeltaPacket &packet,
+                                 EntityEncoding encoding,
+                                 std::vector<std::byte> storage = {})
+    -> std::vector<std::byte> {
+  if (encoding == EntityEncoding::Compact &&
+      fitsCompactEncoding(packet.added) && fitsCompactEncoding(packet.moved)) {
+    return encodeCompactWithHeader(PacketType::StateDelta, packet,
+                                   std::move(storage));
+  }
+  return encode(packet, std::move(storage));
+}
+
+template <typename Packet>
+[[nodiscard]] inline auto encodeFrame(const Packet &packet,
+                                      EntityEncoding encoding) -> Net::Frame {
+  Net::FrameBuffer buffer;
+  buffer.storage() = encode(packet, encoding, std::move(buffer.storage()));
+  return Net::Frame{std::move(buffer)};
+}
+
+// Compresses whole encoded frames for a peer that accepted
+// compressionCapability. The payload becomes the varint size of the
+// original followed by one LZ4 block. Frames are compressed one by one
+// rather than as a stream, because outbound queues drop stale state frames
+// and a receiver must be able to decode whichever ones arrive. Not
+// thread-safe; each event loop keeps its own.
+class PayloadCompressor {
+public:
+  // Hands back the frame compressed, or untouched if it is small or would
+  // not shrink. The buffer not returned is kept for the next call.
+  [[nodiscard]] auto compress(std::vector<std::byte> frame)
+      -> std::vector<std::byte> {
+    auto header = decodeHeader(std::span{frame}.first(packetHeaderSize));
+    auto payload = std::span<const std::byte>{frame}.subspan(packetHeaderSize);
+    if (!header || payload.size() < compressionThreshold ||
+        (header->flags & compressedPayloadFlag) != 0) {
+      return frame;
+    }
+
+    PayloadWriter writer{std::move(m_spare)};
+    writer.reserve(packetHeaderSize + Lz4::maxCompressedSize(payload.size()) +
+                   sizeof(std::uint32_t) + 1);
+    writer.writePadding(packetHeaderSize);
+    writer.writeVarint(static_cast<std::uint32_t>(payload.size()));
+    auto compressed = std::move(writer).release();
+    m_block.compress(payload, compressed);
+    if (compressed.size() >= frame.size()) {
+      m_spare = std::move(compressed);
+      return frame;
+    }
+
+    header->flags |= compressedPayloadFlag;
+    header->payloadSize =
+        static_cast<std::uint32_t>(compressed.size() - packetHeaderSize);
+    std::ranges::copy(encodeHeader(*header), compressed.begin());
+    m_spare = std::move(frame);
+    return compressed;
+  }
+
+private:
+  Lz4::Compressor m_block;
+  std::vector<std::byte> m_spare;
+};
+
+// Receiving side. Compressed frames come back as views of the inflater's
+// own buffer, valid until the next call; anything else passes through. The
+// original frame's size() is still what to consume from the stream.
+class PayloadInflater {
+public:
+  [[nodiscard]] auto inflate(const FrameView &frame)
+      -> PacketResult<FrameView> {
+    if ((frame.header.flags & compressedPayloadFlag) == 0) {
+      return frame;
+    }
+
+    PayloadReader reader{frame.payload};
+    auto size = reader.readVarint();
+    if (!size) {
+      return std::unexpected(size.error());
+    }
+    if (*size > maxPayloadSize) {
+      return std::unexpected(PacketError::PayloadTooLarge);
     }
+    auto block = reader.readBytes(reader.remaining());
+    if (!block) {
+      return std::unexpected(block.error());
+    }
+
+    m_payload.resize(*size);
+    if (!Lz4::decompress(*block, m_payload)) {
+      return std::unexpected(PacketError::InvalidPayload);
+    }
+    auto header = frame.header;
+    header.flags &= static_cast<std::uint8_t>(~compressedPayloadFlag);
+    header.payloadSize = *size;
+    return FrameView{.header = header, .payload = m_payload};
+  }
+
+private:
+  std::vector<std::byte> m_payload;
+};
+
+// Compressed when the peer accepted compressionCapability.
+template <typename Packet>
+[[nodiscard]] inline auto encodeFrame(const Packet &packet,
+                                      EntityEncoding encoding,
+                                      PayloadCompressor &compressor)
+    -> Net::Frame {
+  Net::FrameBuffer buffer;
+  buffer.storage() = compressor.compress(
+      encode(packet, encoding, std::move(buffer.storage())));
+  return Net::Frame{std::move(buffer)};
+}
+
+[[nodiscard]] inline auto
+decodeCompactStateSnapshot(std::span<const std::byte> payload)
+    -> PacketResult<StateSnapshotPacket> {
+  PayloadReader reader{payload};
+  auto focusId = reader.readVarint();
+  if (!focusId) {
+    return std::unexpected(focusId.error());
+  }
 
-    packet.players.emplace_back(
-        PlayerState{.player = *playerId,
-                    .position = Position{.x = *positionX, .y = *positionY}});
+  StateSnapshotPacket packet{};
+  packet.focusPlayer = *focusId;
+  if (auto players = readCompactStates(reader, packet.players); !players) {
+    return std::unexpected(players.error());
   }
 
   if (reader.remaining() != 0) {
@@ -386,30 +1596,122 @@ decodeStateSnapshot(std::span<const std::byte> payload)
   return packet;
 }
 
-[[nodiscard]] inline auto decodeChat(std::span<const std::byte> payload)
-    -> PacketResult<ChatPacket> {
+[[nodiscard]] inline auto
+decodeCompactStateDelta(std::span<const std::byte> payload)
+    -> PacketResult<StateDeltaPacket> {
   PayloadReader reader{payload};
-  auto playerId = reader.read<std::uint32_t>();
-  if (!playerId) {
-    return std::unexpected(playerId.error());
+  auto sequence = reader.readVarint();
+  if (!sequence) {
+    return std::unexpected(sequence.error());
   }
 
-  std::size_t messageLength = reader.remaining();
-  std::string message;
-  message.resize(messageLength);
-  for (std::size_t i = 0; i < messageLength; ++i) {
-    auto byteResult = reader.readByte();
-    if (!byteResult) {
-      return std::unexpected(byteResult.error());
+  auto baseline = reader.readVarint();
+  if (!baseline) {
+    return std::unexpected(baseline.error());
+  }
+
+  auto focusId = reader.readVarint();
+  if (!focusId) {
+    return std::unexpected(focusId.error());
+  }
+
+  auto lastInput = reader.readVarint();
+  if (!lastInput) {
+    return std::unexpected(lastInput.error());
+  }
+
+  StateDeltaPacket packet{};
+  packet.sequence = *sequence;
+  packet.baseline = *baseline;
+  packet.focusPlayer = *focusId;
+  packet.lastProcessedInput = *lastInput;
+  if (auto removed = readCompactIds(reader, packet.removed); !removed) {
+    return std::unexpected(removed.error());
+  }
+  if (auto added = readCompactStates(reader, packet.added); !added) {
+    return std::unexpected(added.error());
+  }
+  if (auto moved = readCompactStates(reader, packet.moved); !moved) {
+    return std::unexpected(moved.error());
+  }
+
+  if (reader.remaining() != 0) {
+    return std::unexpected(PacketError::SizeMismatch);
+  }
+
+  return packet;
+}
+
+inline auto WireSchema<StateSnapshotPacket>::decode(
+    std::span<const std::byte> payload, bool compact)
+    -> PacketResult<StateSnapshotPacket> {
+  return compact ? decodeCompactStateSnapshot(payload)
+                 : decodeStateSnapshot(payload);
+}
+
+inline auto WireSchema<ChatPacket>::decode(std::span<const std::byte> payload,
+                                           bool /*compact*/)
+    -> PacketResult<ChatPacket> {
+  return decodeChat(payload);
+}
+
+inline auto WireSchema<ChatBatchPacket>::decode(
+    std::span<const std::byte> payload, bool /*compact*/)
+    -> PacketResult<ChatBatchPacket> {
+  return decodeChatBatch(payload);
+}
+
+inline auto WireSchema<StateDeltaPacket>::decode(
+    std::span<const std::byte> payload, bool compact)
+    -> PacketResult<StateDeltaPacket> {
+  return compact ? decodeCompactStateDelta(payload)
+                 : decodeStateDelta(payload);
+}
+
+namespace Detail {
+
+template <typename Packet>
+[[nodiscard]] inline auto decodeAlternative(std::span<const std::byte> payload,
+                                            bool compact)
+    -> PacketResult<PacketVariant> {
+  auto packet = [&]() {
+    if constexpr (FixedWire<Packet>) {
+      return decodeFixed<Packet>(payload);
+    } else {
+      return WireSchema<Packet>::decode(payload, compact);
     }
-    message[i] = static_cast<char>(*byteResult);
+  }();
+  if (!packet) {
+    return std::unexpected(packet.error());
   }
+  return PacketVariant{std::move(*packet)};
+}
 
-  return ChatPacket{.player = *playerId, .message = std::move(message)};
+struct PacketDecoder {
+  PacketResult<PacketVariant> (*decode)(std::span<const std::byte>,
+                                        bool compact){};
+  bool compactForm{};
+};
+
+template <typename Packet>
+inline constexpr bool hasCompactForm =
+    requires { requires WireSchema<Packet>::compactForm; };
+
+template <typename... Packets>
+consteval auto makeDecoders(std::type_identity<std::variant<Packets...>>)
+    -> std::array<PacketDecoder, packetTypeCount> {
+  std::array<PacketDecoder, packetTypeCount> decoders{};
+  ((decoders[static_cast<std::size_t>(WireSchema<Packets>::type)] =
+        PacketDecoder{.decode = &decodeAlternative<Packets>,
+                      .compactForm = hasCompactForm<Packets>}),
+   ...);
+  return decoders;
 }
 
-using PacketVariant =
-    std::variant<MovementPacket, StateSnapshotPacket, ChatPacket>;
+inline constexpr auto packetDecoders =
+    makeDecoders(std::type_identity<PacketVariant>{});
+
+} // namespace Detail
 
 [[nodiscard]] inline auto decodePacket(const PacketHeader &header,
                                        std::span<const std::byte> payload)
@@ -417,32 +1719,22 @@ using PacketVariant =
   if (payload.size() != header.payloadSize) {
     return std::unexpected(PacketError::SizeMismatch);
   }
-
-  switch (header.type) {
-  case PacketType::Movement: {
-    auto packet = decodeMovement(payload);
-    if (!packet) {
-      return std::unexpected(packet.error());
-    }
-    return PacketVariant{*packet};
-  }
-  case PacketType::StateSnapshot: {
-    auto packet = decodeStateSnapshot(payload);
-    if (!packet) {
-      return std::unexpected(packet.error());
-    }
-    return PacketVariant{*packet};
-  }
-  case PacketType::Chat: {
-    auto packet = decodeChat(payload);
-    if (!packet) {
-      return std::unexpected(packet.error());
-    }
-    return PacketVariant{*packet};
+  // Callers inflate compressed frames first.
+  if ((header.flags & compressedPayloadFlag) != 0) {
+    return std::unexpected(PacketError::InvalidPayload);
   }
-  default:
+
+  const auto &decoder =
+      Detail::packetDecoders.at(static_cast<std::size_t>(header.type));
+  if (decoder.decode == nullptr) {
     return std::unexpected(PacketError::UnknownType);
   }
+
+  bool compact = (header.flags & compactEntitiesFlag) != 0;
+  if (compact && !decoder.compactForm) {
+    return std::unexpected(PacketError::InvalidPayload);
+  }
+  return decoder.decode(payload, compact);
 }
 
 } // namespace Moonlapse::Protocol
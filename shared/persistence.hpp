@@ -0,0 +1,497 @@
+#pragma once
+
+#include "concurrency.hpp"
+#include "delta.hpp"
+#include "logging.hpp"
+#include "packets.hpp"
+
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <expected>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <stop_token>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <variant>
+#include <vector>
+
+// Write-behind storage of every player's position. The world image is one
+// full-state StateDeltaPacket frame (no baseline); the journal beside it is
+// a run of ordinary delta frames, each against the state left by the one
+// before, starting from the image's sequence. Both use the wire encoding, so
+// the packet codec, version check included, is the whole file format.
+namespace Moonlapse::Persistence {
+
+enum class StoreErrorCode : std::uint8_t {
+  NotFound,
+  OpenFailed,
+  ReadFailed,
+  WriteFailed,
+  SyncFailed,
+  Corrupt,
+};
+
+struct StoreError {
+  StoreErrorCode code{StoreErrorCode::OpenFailed};
+  std::string message;
+};
+
+template <typename T> using StoreResult = std::expected<T, StoreError>;
+
+namespace Detail {
+
+[[nodiscard]] inline auto makeError(StoreErrorCode code,
+                                    const std::filesystem::path &path,
+                                    std::string_view action, int nativeCode)
+    -> StoreError {
+  return StoreError{
+      .code = code,
+      .message = std::format("{} {}: {}", action, path.string(),
+                             std::generic_category().message(nativeCode))};
+}
+
+struct FileCloser {
+  void operator()(std::FILE *file) const noexcept { std::fclose(file); }
+};
+
+using FileHandle = std::unique_ptr<std::FILE, FileCloser>;
+
+[[nodiscard]] inline auto syncFile(std::FILE *file) noexcept -> bool {
+  if (std::fflush(file) != 0) {
+    return false;
+  }
+#if defined(_WIN32)
+  return ::_commit(::_fileno(file)) == 0;
+#else
+  return ::fsync(::fileno(file)) == 0;
+#endif
+}
+
+} // namespace Detail
+
+[[nodiscard]] inline auto journalPath(const std::filesystem::path &image)
+    -> std::filesystem::path {
+  auto path = image;
+  path += ".journal";
+  return path;
+}
+
+// Read-only view of a whole file: mapped on POSIX, read into memory on
+// Windows.
+class MappedFile {
+public:
+  MappedFile(const MappedFile &) = delete;
+  auto operator=(const MappedFile &) -> MappedFile & = delete;
+  MappedFile(MappedFile &&other) noexcept
+      : m_data{std::exchange(other.m_data, nullptr)},
+        m_size{std::exchange(other.m_size, 0)},
+        m_copy{std::move(other.m_copy)} {}
+  auto operator=(MappedFile &&) -> MappedFile & = delete;
+
+  ~MappedFile() {
+#if !defined(_WIN32)
+    if (m_data != nullptr) {
+      ::munmap(m_data, m_size);
+    }
+#endif
+  }
+
+  [[nodiscard]] static auto open(const std::filesystem::path &path)
+      -> StoreResult<MappedFile> {
+#if defined(_WIN32)
+    std::ifstream stream{path, std::ios::binary};
+    if (!stream) {
+      auto code = std::filesystem::exists(path) ? StoreErrorCode::OpenFailed
+                                                : StoreErrorCode::NotFound;
+      return std::unexpected(
+          StoreError{.code = code, .message = "open " + path.string()});
+    }
+    MappedFile file;
+    file.m_copy.assign(std::istreambuf_iterator<char>{stream}, {});
+    return file;
+#else
+    auto handle = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (handle < 0) {
+      auto nativeCode = errno;
+      return std::unexpected(Detail::makeError(
+          nativeCode == ENOENT ? StoreErrorCode::NotFound
+                               : StoreErrorCode::OpenFailed,
+          path, "open", nativeCode));
+    }
+
+    MappedFile file;
+    struct stat status{};
+    if (::fstat(handle, &status) != 0) {
+      auto nativeCode = errno;
+      ::close(handle);
+      return std::unexpected(Detail::makeError(StoreErrorCode::ReadFailed,
+                                               path, "stat", nativeCode));
+    }
+    if (status.st_size > 0) {
+      auto size = static_cast<std::size_t>(status.st_size);
+      auto *data = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, handle, 0);
+      if (data == MAP_FAILED) {
+        auto nativeCode = errno;
+        ::close(handle);
+        return std::unexpected(Detail::makeError(StoreErrorCode::ReadFailed,
+                                                 path, "mmap", nativeCode));
+      }
+      file.m_data = data;
+      file.m_size = size;
+    }
+    // The mapping outlives the descriptor.
+    ::close(handle);
+    return file;
+#endif
+  }
+
+  [[nodiscard]] auto bytes() const noexcept -> std::span<const std::byte> {
+    if (m_data != nullptr) {
+      return {static_cast<const std::byte *>(m_data), m_size};
+    }
+    return std::as_bytes(std::span<const char>{m_copy});
+  }
+
+private:
+  MappedFile() = default;
+
+  void *m_data{nullptr};
+  std::size_t m_size{0};
+  std::vector<char> m_copy;
+};
+
+// What a previous run left behind, sorted by player id.
+struct SavedWorld {
+  std::uint32_t sequence{Protocol::noBaseline};
+  std::vector<Protocol::PlayerState> states;
+  std::size_t journalRecords{0};
+  // The journal ended in a record that was cut short or did not follow on,
+  // so everything from there was ignored.
+  bool discardedTail{false};
+};
+
+namespace Detail {
+
+// Splits one delta frame off the front of bytes. Unlike extractFrame this
+// has no payload cap: a whole world does not have to fit in a network frame.
+[[nodiscard]] inline auto readRecord(std::span<const std::byte> &bytes)
+    -> Protocol::PacketResult<Protocol::StateDeltaPacket> {
+  auto header = Protocol::decodeHeader(bytes);
+  if (!header) {
+    return std::unexpected(header.error());
+  }
+  auto frameSize =
+      Protocol::packetHeaderSize + std::size_t{header->payloadSize};
+  if (bytes.size() < frameSize) {
+    return std::unexpected(Protocol::PacketError::Truncated);
+  }
+  auto packet = Protocol::decodePacket(
+      *header, bytes.subspan(Protocol::packetHeaderSize, header->payloadSize));
+  bytes = bytes.subspan(frameSize);
+  if (!packet) {
+    return std::unexpected(packet.error());
+  }
+  auto *delta = std::get_if<Protocol::StateDeltaPacket>(&*packet);
+  if (delta == nullptr) {
+    return std::unexpected(Protocol::PacketError::UnknownType);
+  }
+  return std::move(*delta);
+}
+
+} // namespace Detail
+
+// Maps the image, then replays every journal record that follows on from
+// it. Records from before the image, left by a crash between writing it and
+// emptying the journal, are skipped. Missing files mean an empty world; an
+// image that does not decode is an error rather than a silent reset.
+[[nodiscard]] inline auto loadWorld(const std::filesystem::path &image)
+    -> StoreResult<SavedWorld> {
+  SavedWorld saved;
+  std::vector<Protocol::PlayerState> scratch;
+
+  if (auto mapped = MappedFile::open(image); mapped) {
+    auto bytes = mapped->bytes();
+    auto record = Detail::readRecord(bytes);
+    if (!record || record->baseline != Protocol::noBaseline ||
+        !bytes.empty() || !Protocol::applyDelta({}, *record, saved.states)) {
+      return std::unexpected(StoreError{
+          .code = StoreErrorCode::Corrupt,
+          .message = std::format("{} is not a world image", image.string())});
+    }
+    saved.sequence = record->sequence;
+  } else if (mapped.error().code != StoreErrorCode::NotFound) {
+    return std::unexpected(mapped.error());
+  }
+
+  auto journal = MappedFile::open(journalPath(image));
+  if (!journal) {
+    if (journal.error().code == StoreErrorCode::NotFound) {
+      return saved;
+    }
+    return std::unexpected(journal.error());
+  }
+
+  auto bytes = journal->bytes();
+  while (!bytes.empty()) {
+    auto record = Detail::readRecord(bytes);
+    if (!record) {
+      saved.discardedTail = true;
+      break;
+    }
+    if (record->baseline != saved.sequence) {
+      if (saved.journalRecords == 0) {
+        continue;
+      }
+      saved.discardedTail = true;
+      break;
+    }
+    if (!Protocol::applyDelta(saved.states, *record, scratch)) {
+      saved.discardedTail = true;
+      break;
+    }
+    std::swap(saved.states, scratch);
+    saved.sequence = record->sequence;
+    ++saved.journalRecords;
+  }
+  return saved;
+}
+
+// Keeps the image and journal up to date from its own thread. Every
+// journalInterval it takes a copy of the world from source and appends the
+// difference from the last copy it stored, if any, to the journal. Every
+// checkpointInterval, or straight after a failed append, it writes the whole
+// world as a fresh image and empties the journal. Nothing here runs on, or
+// waits for, whoever calls source.
+//
+// Restored players who have not come back yet are not in the live world,
+// so they are kept alongside it until claimed() says their id was reused.
+class WorldWriter {
+public:
+  using Clock = std::chrono::steady_clock;
+  // Called on the writer thread; replaces states with the live players,
+  // sorted by id.
+  using Source = std::function<void(std::vector<Protocol::PlayerState> &)>;
+
+  struct Settings {
+    Clock::duration journalInterval{std::chrono::milliseconds{100}};
+    Clock::duration checkpointInterval{std::chrono::seconds{30}};
+  };
+
+  WorldWriter(std::filesystem::path image, SavedWorld saved, Source source,
+              Settings settings, Logging::Logger &log)
+      : m_image{std::move(image)}, m_source{std::move(source)},
+        m_settings{settings}, m_log{log}, m_dormant{saved.states},
+        m_persisted{std::move(saved.states)}, m_sequence{saved.sequence},
+        m_claims{m_dormant.size()} {
+    m_thread = std::jthread{
+        [this](const std::stop_token &stopToken) { run(stopToken); }};
+  }
+
+  WorldWriter(const WorldWriter &) = delete;
+  auto operator=(const WorldWriter &) -> WorldWriter & = delete;
+  WorldWriter(WorldWriter &&) = delete;
+  auto operator=(WorldWriter &&) -> WorldWriter & = delete;
+
+  // Writes a final image before returning, so source must still work.
+  ~WorldWriter() = default;
+
+  // Any thread, at most once per restored player: the player's id has been
+  // handed out again, so the live world now speaks for it.
+  void claimed(Protocol::PlayerId player) {
+    // Sized for every restored player, so this never fails.
+    static_cast<void>(m_claims.tryPush(player));
+  }
+
+private:
+  void run(const std::stop_token &stopToken) {
+    // The replayed journal may end in a torn record, so it is folded into
+    // a new image before anything is appended to it.
+    checkpoint(true);
+
+    std::mutex sleepMutex;
+    std::condition_variable_any sleeper;
+    auto nextCheckpoint = Clock::now() + m_settings.checkpointInterval;
+    while (!stopToken.stop_requested()) {
+      {
+        std::unique_lock lock{sleepMutex};
+        sleeper.wait_for(lock, stopToken, m_settings.journalInterval,
+                         [] { return false; });
+      }
+      if (m_journal && Clock::now() < nextCheckpoint) {
+        appendJournal();
+        continue;
+      }
+      checkpoint(false);
+      nextCheckpoint = Clock::now() + m_settings.checkpointInterval;
+    }
+    checkpoint(false);
+  }
+
+  // Live players plus restored ones still waiting for their id.
+  void collect() {
+    while (auto player = m_claims.tryPop()) {
+      std::erase_if(m_dormant, [player](const Protocol::PlayerState &state) {
+        return state.player == *player;
+      });
+    }
+    m_source(m_live);
+
+    m_current.clear();
+    auto dormant = m_dormant.begin();
+    for (const auto &state : m_live) {
+      while (dormant != m_dormant.end() && dormant->player < state.player) {
+        m_current.push_back(*dormant++);
+      }
+      // Claimed, but the notice was still in flight.
+      if (dormant != m_dormant.end() && dormant->player == state.player) {
+        ++dormant;
+      }
+      m_current.push_back(state);
+    }
+    m_current.insert(m_current.end(), dormant, m_dormant.end());
+  }
+
+  void appendJournal() {
+    collect();
+    if (m_current == m_persisted) {
+      return;
+    }
+
+    Protocol::diffStates(m_persisted, m_current, m_delta);
+    m_delta.baseline = m_sequence;
+    m_delta.sequence = Protocol::nextSequence(m_sequence);
+    m_encoded = Protocol::encode(m_delta, Protocol::EntityEncoding::Compact,
+                                 std::move(m_encoded));
+    // Flushed every round so a crashed process loses at most one interval;
+    // only a checkpoint waits for the disk itself.
+    if (std::fwrite(m_encoded.data(), 1, m_encoded.size(), m_journal.get()) !=
+            m_encoded.size() ||
+        std::fflush(m_journal.get()) != 0) {
+      // It may now end in half a record; the next round replaces it.
+      m_log.get().write(m_failures, Logging::Level::Error,
+                        "journal write to {} failed",
+                        journalPath(m_image).string());
+      m_journal.reset();
+      return;
+    }
+    m_sequence = m_delta.sequence;
+    std::swap(m_persisted, m_current);
+    ++m_journalRecords;
+  }
+
+  // Written beside the image, synced and renamed over it, so a crash leaves
+  // either the old image or the new one. The journal is emptied only after;
+  // records it still holds from before are older than the new image.
+  void checkpoint(bool force) {
+    collect();
+    if (!force && m_journal && m_journalRecords == 0 &&
+        m_current == m_persisted) {
+      return;
+    }
+
+    auto sequence = Protocol::nextSequence(m_sequence);
+    m_delta.sequence = sequence;
+    m_delta.baseline = Protocol::noBaseline;
+    m_delta.focusPlayer = 0;
+    m_delta.lastProcessedInput = 0;
+    m_delta.removed.clear();
+    m_delta.moved.clear();
+    m_delta.added.assign(m_current.begin(), m_current.end());
+    m_encoded = Protocol::encode(m_delta, Protocol::EntityEncoding::Compact,
+                                 std::move(m_encoded));
+
+    auto temporary = m_image;
+    temporary += ".tmp";
+    if (auto written = writeFile(temporary, m_encoded); !written) {
+      m_log.get().write(m_failures, Logging::Level::Error,
+                        "checkpoint failed: {}", written.error().message);
+      return;
+    }
+    std::error_code renameError;
+    std::filesystem::rename(temporary, m_image, renameError);
+    if (renameError) {
+      m_log.get().write(m_failures, Logging::Level::Error,
+                        "checkpoint failed: rename {}: {}", temporary.string(),
+                        renameError.message());
+      return;
+    }
+    m_sequence = sequence;
+    std::swap(m_persisted, m_current);
+    m_journalRecords = 0;
+
+    auto journal = journalPath(m_image);
+    m_journal.reset(std::fopen(journal.string().c_str(), "wb"));
+    if (!m_journal) {
+      m_log.get().write(m_failures, Logging::Level::Error,
+                        "cannot open journal {}", journal.string());
+      return;
+    }
+    m_log.get().debug("checkpoint {} holds {} player(s)", m_sequence,
+                      m_persisted.size());
+  }
+
+  [[nodiscard]] static auto writeFile(const std::filesystem::path &path,
+                                      std::span<const std::byte> bytes)
+      -> StoreResult<void> {
+    Detail::FileHandle file{std::fopen(path.string().c_str(), "wb")};
+    if (!file) {
+      return std::unexpected(
+          Detail::makeError(StoreErrorCode::OpenFailed, path, "open", errno));
+    }
+    if (std::fwrite(bytes.data(), 1, bytes.size(), file.get()) !=
+        bytes.size()) {
+      return std::unexpected(
+          Detail::makeError(StoreErrorCode::WriteFailed, path, "write", errno));
+    }
+    if (!Detail::syncFile(file.get())) {
+      return std::unexpected(
+          Detail::makeError(StoreErrorCode::SyncFailed, path, "sync", errno));
+    }
+    return {};
+  }
+
+  std::filesystem::path m_image;
+  Source m_source;
+  Settings m_settings;
+  std::reference_wrapper<Logging::Logger> m_log;
+  // A full disk fails every round.
+  Logging::Throttle m_failures{1, std::chrono::seconds{10}};
+  // Writer thread only from here on, apart from the claim queue.
+  std::vector<Protocol::PlayerState> m_dormant;
+  std::vector<Protocol::PlayerState> m_persisted;
+  std::vector<Protocol::PlayerState> m_live;
+  std::vector<Protocol::PlayerState> m_current;
+  Protocol::StateDeltaPacket m_delta;
+  std::vector<std::byte> m_encoded;
+  std::uint32_t m_sequence;
+  std::size_t m_journalRecords{0};
+  Detail::FileHandle m_journal;
+  Concurrency::MpscQueue<Protocol::PlayerId> m_claims;
+  // Last, so the thread stops before anything it uses is destroyed.
+  std::jthread m_thread;
+};
+
+} // namespace Moonlapse::Persistence
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+
+namespace Moonlapse::Net {
+
+// Classic token bucket: refills at a steady rate up to a burst ceiling and
+// admits one event per whole token. Not thread-safe; each owner keeps its
+// own.
+class TokenBucket {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  // A rate of zero admits everything.
+  TokenBucket(double tokensPerSecond, double burst) noexcept
+      : m_rate{tokensPerSecond}, m_burst{std::max(burst, 1.0)},
+        m_tokens{m_burst} {}
+
+  [[nodiscard]] auto tryTake(Clock::time_point now = Clock::now()) noexcept
+      -> bool {
+    if (m_rate <= 0.0) {
+      return true;
+    }
+    if (m_lastRefill != Clock::time_point{}) {
+      auto elapsed = std::chrono::duration<double>(now - m_lastRefill).count();
+      m_tokens = std::min(m_burst, m_tokens + elapsed * m_rate);
+    }
+    m_lastRefill = now;
+    if (m_tokens < 1.0) {
+      return false;
+    }
+    m_tokens -= 1.0;
+    return true;
+  }
+
+private:
+  double m_rate;
+  double m_burst;
+  double m_tokens;
+  Clock::time_point m_lastRefill{};
+};
+
+} // namespace Moonlapse::Net
@@ -0,0 +1,223 @@
+#pragma once
+
+#include "frame.hpp"
+#include "metrics.hpp"
+#include "network.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <format>
+#include <functional>
+#include <memory>
+#include <span>
+#include <stop_token>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace Moonlapse::Metrics {
+
+// Serves GET /metrics on an admin port from its own event loop thread, so a
+// scrape never waits behind game traffic and game threads never format text.
+// One request per connection, closed once the response is out. Clients that
+// stall are closed to make room for new ones, so idle connections cannot
+// lock the scraper out.
+class ScrapeEndpoint {
+public:
+  // Called on the endpoint's thread for every scrape.
+  using Renderer = std::function<std::string()>;
+
+  static constexpr std::size_t maxRequestBytes = 8192;
+  static constexpr std::size_t maxClients = 16;
+  // How long a connection may take to send its request and read the reply.
+  static constexpr std::chrono::seconds clientTimeout{10};
+
+  ScrapeEndpoint(const ScrapeEndpoint &) = delete;
+  auto operator=(const ScrapeEndpoint &) -> ScrapeEndpoint & = delete;
+  ScrapeEndpoint(ScrapeEndpoint &&) = delete;
+  auto operator=(ScrapeEndpoint &&) -> ScrapeEndpoint & = delete;
+  ~ScrapeEndpoint() = default;
+
+  [[nodiscard]] static auto start(std::string_view host, std::uint16_t port,
+                                  Renderer render)
+      -> Net::SocketResult<std::unique_ptr<ScrapeEndpoint>> {
+    auto listener = Net::TcpListener::bind(host, port);
+    if (!listener) {
+      return std::unexpected(listener.error());
+    }
+    if (auto listening = listener->listen(); !listening) {
+      return std::unexpected(listening.error());
+    }
+    if (auto nonBlocking = listener->setNonBlocking(true); !nonBlocking) {
+      return std::unexpected(nonBlocking.error());
+    }
+    auto loop = Net::EventLoop::create();
+    if (!loop) {
+      return std::unexpected(loop.error());
+    }
+
+    std::unique_ptr<ScrapeEndpoint> endpoint{new ScrapeEndpoint{
+        std::move(listener.value()), std::move(loop.value()),
+        std::move(render)}};
+    auto &self = *endpoint;
+    if (auto watching = self.m_loop->watch(
+            self.m_listener.nativeHandle(), Net::IoInterest::Readable,
+            [&self](Net::IoEvent /*event*/) { self.acceptClients(); });
+        !watching) {
+      return std::unexpected(watching.error());
+    }
+    self.m_thread = std::jthread{[&self](const std::stop_token &stopToken) {
+      static_cast<void>(self.m_loop->run(stopToken));
+    }};
+    return endpoint;
+  }
+
+private:
+  using Clock = std::chrono::steady_clock;
+
+  struct Client {
+    Client(Net::TcpSocket socket, Clock::time_point acceptedAt) noexcept
+        : connection{std::move(socket)}, accepted{acceptedAt} {}
+
+    Net::TcpConnection connection;
+    Clock::time_point accepted;
+    bool responded{false};
+  };
+
+  ScrapeEndpoint(Net::TcpListener listener,
+                 std::unique_ptr<Net::EventLoop> loop,
+                 Renderer render) noexcept
+      : m_listener{std::move(listener)}, m_loop{std::move(loop)},
+        m_render{std::move(render)} {}
+
+  void acceptClients() {
+    while (true) {
+      auto socket = m_listener.accept();
+      if (!socket) {
+        return;
+      }
+      if (!socket->setNonBlocking(true).has_value()) {
+        continue;
+      }
+
+      auto now = Clock::now();
+      makeRoom(now);
+      auto client = std::make_shared<Client>(std::move(socket.value()), now);
+      auto handle = client->connection.socket().nativeHandle();
+      auto watching = m_loop->watch(
+          handle, Net::IoInterest::Readable,
+          [this, client](Net::IoEvent /*event*/) { handleEvent(client); });
+      if (watching) {
+        m_clients.push_back(std::move(client));
+      }
+    }
+  }
+
+  // Clients are kept in accept order, so the front is always the oldest.
+  // Ones past their deadline go first; if that frees nothing, the oldest
+  // gives way to the newcomer.
+  void makeRoom(Clock::time_point now) {
+    while (!m_clients.empty() &&
+           (now - m_clients.front()->accepted >= clientTimeout ||
+            m_clients.size() >= maxClients)) {
+      drop(std::shared_ptr<Client>{m_clients.front()});
+    }
+  }
+
+  // A hangup surfaces through fill() or flush(), so the event's flags are
+  // not needed.
+  void handleEvent(const std::shared_ptr<Client> &client) {
+    if (client->responded) {
+      finishResponse(client);
+      return;
+    }
+
+    auto filled = client->connection.fill();
+    auto request = client->connection.received();
+    constexpr std::string_view headerEnd = "\r\n\r\n";
+    auto text = std::string_view{std::bit_cast<const char *>(request.data()),
+                                 request.size()};
+    if (text.find(headerEnd) == std::string_view::npos) {
+      if (!filled || client->connection.peerClosed() ||
+          request.size() > maxRequestBytes) {
+        drop(client);
+      }
+      return;
+    }
+
+    client->responded = true;
+    static_cast<void>(client->connection.queue(respond(text)));
+    finishResponse(client);
+  }
+
+  [[nodiscard]] auto respond(std::string_view request) const -> Net::Frame {
+    auto lineEnd = request.find("\r\n");
+    auto requestLine = request.substr(0, lineEnd);
+    auto method = requestLine.substr(0, requestLine.find(' '));
+    auto target = requestLine.substr(std::min(method.size() + 1,
+                                              requestLine.size()));
+    target = target.substr(0, target.find(' '));
+    target = target.substr(0, target.find('?'));
+
+    std::string status = "200 OK";
+    std::string_view contentType = Exposition::contentType;
+    std::string body;
+    if (method != "GET") {
+      status = "405 Method Not Allowed";
+      contentType = "text/plain";
+      body = "only GET is supported\n";
+    } else if (target != "/metrics") {
+      status = "404 Not Found";
+      contentType = "text/plain";
+      body = "metrics live at /metrics\n";
+    } else {
+      body = m_render();
+    }
+
+    auto response =
+        std::format("HTTP/1.1 {}\r\nContent-Type: {}\r\nContent-Length: "
+                    "{}\r\nConnection: close\r\n\r\n",
+                    status, contentType, body.size());
+    response += body;
+    auto bytes = std::as_bytes(std::span{response});
+    Net::FrameBuffer buffer;
+    buffer.storage().assign(bytes.begin(), bytes.end());
+    return Net::Frame{std::move(buffer)};
+  }
+
+  // Keeps writing on each writable event until the response has gone out.
+  void finishResponse(const std::shared_ptr<Client> &client) {
+    auto flushed = client->connection.flush();
+    if (!flushed || flushed.value()) {
+      drop(client);
+      return;
+    }
+    auto handle = client->connection.socket().nativeHandle();
+    if (!m_loop->modify(handle, Net::IoInterest::Writable).has_value()) {
+      drop(client);
+    }
+  }
+
+  void drop(const std::shared_ptr<Client> &client) {
+    auto &socket = client->connection.socket();
+    m_loop->unwatch(socket.nativeHandle());
+    socket.shutdown();
+    socket.close();
+    std::erase(m_clients, client);
+  }
+
+  Net::TcpListener m_listener;
+  std::unique_ptr<Net::EventLoop> m_loop;
+  Renderer m_render;
+  // Loop thread only.
+  std::vector<std::shared_ptr<Client>> m_clients;
+  // Declared last so the loop stops before anything it touches is gone.
+  std::jthread m_thread;
+};
+
+} // namespace Moonlapse::Metrics
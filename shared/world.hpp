@@ -0,0 +1,309 @@
+#pragma once
+
+#include "packets.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <optional>
+#include <span>
+#include <vector>
+
+namespace Moonlapse::World {
+
+inline constexpr std::int32_t gridWidth = 40;
+inline constexpr std::int32_t gridHeight = 20;
+
+// Fills the map row by row in id order. Shared by every process that places
+// new players, so they agree on where a given id appears.
+[[nodiscard]] constexpr auto spawnPosition(Protocol::PlayerId player) noexcept
+    -> Protocol::Position {
+  auto positionIndex = static_cast<std::int32_t>(player - 1);
+  return Protocol::Position{positionIndex % gridWidth,
+                            (positionIndex / gridWidth) % gridHeight};
+}
+
+[[nodiscard]] constexpr auto clampCoordinate(std::int32_t value,
+                                             std::int32_t ceiling) noexcept
+    -> std::int32_t {
+  return std::clamp(value, 0, ceiling - 1);
+}
+
+// One step in direction, stopping at the map edge. Anything that predicts
+// where a move lands, such as a load generator, must agree with the server.
+constexpr void applyMovement(Protocol::Position &position,
+                             Protocol::Direction direction) noexcept {
+  switch (direction) {
+  case Protocol::Direction::Up:
+    --position.y;
+    break;
+  case Protocol::Direction::Down:
+    ++position.y;
+    break;
+  case Protocol::Direction::Left:
+    --position.x;
+    break;
+  case Protocol::Direction::Right:
+    ++position.x;
+    break;
+  }
+
+  position.x = clampCoordinate(position.x, gridWidth);
+  position.y = clampCoordinate(position.y, gridHeight);
+}
+
+// Uniform grid over a bounded world, rebuilt from scratch each tick. Entries
+// are bucketed by cell with a counting sort so queries walk contiguous
+// memory instead of per-cell containers.
+class SpatialGrid {
+public:
+  SpatialGrid(std::int32_t worldWidth, std::int32_t worldHeight,
+              std::int32_t cellSize)
+      : m_cellSize{std::max(cellSize, 1)},
+        m_columns{std::max((worldWidth + m_cellSize - 1) / m_cellSize, 1)},
+        m_rows{std::max((worldHeight + m_cellSize - 1) / m_cellSize, 1)},
+        m_cellStarts(static_cast<std::size_t>(m_columns * m_rows) + 1) {}
+
+  void rebuild(std::span<const Protocol::PlayerState> states) {
+    std::ranges::fill(m_cellStarts, std::size_t{0});
+    for (const auto &state : states) {
+      ++m_cellStarts[cellIndex(state.position) + 1];
+    }
+    for (std::size_t index = 1; index < m_cellStarts.size(); ++index) {
+      m_cellStarts[index] += m_cellStarts[index - 1];
+    }
+
+    m_entries.resize(states.size());
+    m_cursor.assign(m_cellStarts.begin(), m_cellStarts.end() - 1);
+    for (const auto &state : states) {
+      m_entries[m_cursor[cellIndex(state.position)]++] = state;
+    }
+  }
+
+  // Visits every entry within a square of the given radius around centre.
+  template <typename Visitor>
+  void forEachNear(Protocol::Position centre, std::int32_t radius,
+                   Visitor &&visitor) const {
+    auto firstColumn = columnOf(centre.x - radius);
+    auto lastColumn = columnOf(centre.x + radius);
+    auto firstRow = rowOf(centre.y - radius);
+    auto lastRow = rowOf(centre.y + radius);
+
+    for (auto row = firstRow; row <= lastRow; ++row) {
+      for (auto column = firstColumn; column <= lastColumn; ++column) {
+        auto cell = static_cast<std::size_t>(row * m_columns + column);
+        auto cellEntries = std::span<const Protocol::PlayerState>{m_entries}
+                               .subspan(m_cellStarts[cell],
+                                        m_cellStarts[cell + 1] -
+                                            m_cellStarts[cell]);
+        for (const auto &entry : cellEntries) {
+          if (withinRadius(centre, entry.position, radius)) {
+            visitor(entry);
+          }
+        }
+      }
+    }
+  }
+
+  // Replaces result with the entries near centre, sorted by player id.
+  void query(Protocol::Position centre, std::int32_t radius,
+             std::vector<Protocol::PlayerState> &result) const {
+    result.clear();
+    forEachNear(centre, radius, [&result](const Protocol::PlayerState &entry) {
+      result.push_back(entry);
+    });
+    std::ranges::sort(result, {}, &Protocol::PlayerState::player);
+  }
+
+  [[nodiscard]] static constexpr auto
+  withinRadius(Protocol::Position centre, Protocol::Position other,
+               std::int32_t radius) noexcept -> bool {
+    auto deltaX = other.x - centre.x;
+    auto deltaY = other.y - centre.y;
+    return deltaX >= -radius && deltaX <= radius && deltaY >= -radius &&
+           deltaY <= radius;
+  }
+
+private:
+  [[nodiscard]] auto columnOf(std::int32_t x) const noexcept -> std::int32_t {
+    return std::clamp(x / m_cellSize, 0, m_columns - 1);
+  }
+
+  [[nodiscard]] auto rowOf(std::int32_t y) const noexcept -> std::int32_t {
+    return std::clamp(y / m_cellSize, 0, m_rows - 1);
+  }
+
+  [[nodiscard]] auto cellIndex(Protocol::Position position) const noexcept
+      -> std::size_t {
+    return static_cast<std::size_t>(rowOf(position.y) * m_columns +
+                                    columnOf(position.x));
+  }
+
+  std::int32_t m_cellSize;
+  std::int32_t m_columns;
+  std::int32_t m_rows;
+  std::vector<std::size_t> m_cellStarts;
+  std::vector<std::size_t> m_cursor;
+  std::vector<Protocol::PlayerState> m_entries;
+};
+
+// Splits the world into vertical strips, one per zone server.
+class ZoneLayout {
+public:
+  ZoneLayout(std::int32_t worldWidth, std::size_t zoneCount)
+      : m_zoneCount{std::clamp<std::size_t>(
+            zoneCount, 1, static_cast<std::size_t>(std::max(worldWidth, 1)))},
+        m_zoneWidth{(std::max(worldWidth, 1) +
+                     static_cast<std::int32_t>(m_zoneCount) - 1) /
+                    static_cast<std::int32_t>(m_zoneCount)} {}
+
+  [[nodiscard]] auto zoneCount() const noexcept -> std::size_t {
+    return m_zoneCount;
+  }
+
+  [[nodiscard]] auto zoneOf(Protocol::Position position) const noexcept
+      -> std::size_t {
+    auto zone = std::max(position.x, 0) / m_zoneWidth;
+    return std::min(static_cast<std::size_t>(zone), m_zoneCount - 1);
+  }
+
+private:
+  std::size_t m_zoneCount;
+  std::int32_t m_zoneWidth;
+};
+
+// Identifies one occupant of a PlayerStore slot. The generation changes
+// every time the slot is released, so handles held by a departed player never
+// resolve to whoever reuses the slot.
+struct EntityHandle {
+  std::uint32_t slot{};
+  std::uint32_t generation{};
+
+  friend auto operator==(const EntityHandle &, const EntityHandle &)
+      -> bool = default;
+};
+
+// Dense, slot-indexed player storage. Positions sit in their own contiguous
+// array, and wire ids are slot + 1, so walking the slots yields states
+// already sorted by id. Released slots are reused oldest first.
+class PlayerStore {
+public:
+  [[nodiscard]] static constexpr auto idOf(EntityHandle handle) noexcept
+      -> Protocol::PlayerId {
+    return handle.slot + 1;
+  }
+
+  // Reserves the slot behind an id handed out elsewhere, such as by a
+  // gateway routing players between processes. Fails if it is in use.
+  [[nodiscard]] auto claim(Protocol::PlayerId player)
+      -> std::optional<EntityHandle> {
+    if (player == 0) {
+      return std::nullopt;
+    }
+    auto slot = player - 1;
+    while (m_positions.size() <= slot) {
+      m_freeSlots.push_back(static_cast<std::uint32_t>(m_positions.size()));
+      m_positions.emplace_back();
+      m_generations.push_back(0);
+      m_states.push_back(SlotState::Free);
+    }
+    if (m_states[slot] != SlotState::Free) {
+      return std::nullopt;
+    }
+    std::erase(m_freeSlots, slot);
+    m_states[slot] = SlotState::Reserved;
+    return EntityHandle{.slot = slot, .generation = m_generations[slot]};
+  }
+
+  // Reserves a slot; it stays invisible until spawn().
+  [[nodiscard]] auto allocate() -> EntityHandle {
+    std::uint32_t slot{};
+    if (!m_freeSlots.empty()) {
+      slot = m_freeSlots.front();
+      m_freeSlots.pop_front();
+    } else {
+      slot = static_cast<std::uint32_t>(m_positions.size());
+      m_positions.emplace_back();
+      m_generations.push_back(0);
+      m_states.push_back(SlotState::Free);
+    }
+    m_states[slot] = SlotState::Reserved;
+    return EntityHandle{.slot = slot, .generation = m_generations[slot]};
+  }
+
+  auto spawn(EntityHandle handle, Protocol::Position position) -> bool {
+    if (!holds(handle) || m_states[handle.slot] != SlotState::Reserved) {
+      return false;
+    }
+    m_states[handle.slot] = SlotState::Live;
+    m_positions[handle.slot] = position;
+    ++m_liveCount;
+    return true;
+  }
+
+  // Returns true if the handle was still current, reserved or live.
+  auto release(EntityHandle handle) -> bool {
+    if (!holds(handle)) {
+      return false;
+    }
+    if (m_states[handle.slot] == SlotState::Live) {
+      --m_liveCount;
+    }
+    m_states[handle.slot] = SlotState::Free;
+    ++m_generations[handle.slot];
+    m_freeSlots.push_back(handle.slot);
+    return true;
+  }
+
+  [[nodiscard]] auto isLive(EntityHandle handle) const noexcept -> bool {
+    return holds(handle) && m_states[handle.slot] == SlotState::Live;
+  }
+
+  [[nodiscard]] auto position(EntityHandle handle) noexcept
+      -> Protocol::Position * {
+    return isLive(handle) ? &m_positions[handle.slot] : nullptr;
+  }
+
+  [[nodiscard]] auto liveCount() const noexcept -> std::size_t {
+    return m_liveCount;
+  }
+
+  [[nodiscard]] auto slotCount() const noexcept -> std::size_t {
+    return m_positions.size();
+  }
+
+  // Replaces states with every live player, sorted by id.
+  void gather(std::vector<Protocol::PlayerState> &states) const {
+    states.clear();
+    states.reserve(m_liveCount);
+    for (std::size_t slot = 0; slot < m_positions.size(); ++slot) {
+      if (m_states[slot] == SlotState::Live) {
+        states.push_back(Protocol::PlayerState{
+            .player = static_cast<Protocol::PlayerId>(slot + 1),
+            .position = m_positions[slot]});
+      }
+    }
+  }
+
+private:
+  enum class SlotState : std::uint8_t {
+    Free,
+    Reserved,
+    Live,
+  };
+
+  [[nodiscard]] auto holds(EntityHandle handle) const noexcept -> bool {
+    return handle.slot < m_generations.size() &&
+           m_generations[handle.slot] == handle.generation &&
+           m_states[handle.slot] != SlotState::Free;
+  }
+
+  std::vector<Protocol::Position> m_positions;
+  std::vector<std::uint32_t> m_generations;
+  std::vector<SlotState> m_states;
+  std::deque<std::uint32_t> m_freeSlots;
+  std::size_t m_liveCount{};
+};
+
+} // namespace Moonlapse::World
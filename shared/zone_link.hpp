@@ -0,0 +1,73 @@
+#pragma once
+
+#include "frame.hpp"
+#include "packets.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+// Messages between the gateway and zone servers. They share the client
+// framing so both ends reuse the same receive path, but use packet types
+// clients never send or receive.
+namespace Moonlapse::ZoneLink {
+
+// ZoneEnter: the gateway places a player in a zone, as the first frame on
+// that player's upstream connection. ZoneHandoff: the zone reports that the
+// player walked out of its strip and has been removed. The sequence carries
+// the last snapshot sequence the player was sent, so the next zone continues
+// numbering after it, and the last input the old zone applied, so the next
+// one keeps echoing it until the player moves again.
+struct TransferPacket {
+  Protocol::PlayerId player{};
+  Protocol::Position position{};
+  std::uint32_t sequence{Protocol::noBaseline};
+  std::uint32_t lastProcessedInput{};
+};
+
+} // namespace Moonlapse::ZoneLink
+
+namespace Moonlapse::Protocol {
+
+template <> struct WireSchema<ZoneLink::TransferPacket> {
+  using Packet = ZoneLink::TransferPacket;
+  using Fields = FieldList<Field<&Packet::player, PlayerId>,
+                           Nested<&Packet::position>,
+                           Field<&Packet::sequence, std::uint32_t>,
+                           Field<&Packet::lastProcessedInput, std::uint32_t>>;
+};
+
+static_assert(fixedPayloadSize<ZoneLink::TransferPacket> == 20);
+
+} // namespace Moonlapse::Protocol
+
+namespace Moonlapse::ZoneLink {
+
+[[nodiscard]] inline auto encodeEnter(const TransferPacket &packet)
+    -> Net::Frame {
+  Net::FrameBuffer buffer;
+  buffer.storage() = Protocol::encodeWithHeader(
+      Protocol::PacketType::ZoneEnter, packet, std::move(buffer.storage()));
+  return Net::Frame{std::move(buffer)};
+}
+
+[[nodiscard]] inline auto encodeHandoff(const TransferPacket &packet)
+    -> Net::Frame {
+  Net::FrameBuffer buffer;
+  buffer.storage() = Protocol::encodeWithHeader(
+      Protocol::PacketType::ZoneHandoff, packet, std::move(buffer.storage()));
+  return Net::Frame{std::move(buffer)};
+}
+
+[[nodiscard]] inline auto decodeTransfer(std::span<const std::byte> payload)
+    -> Protocol::PacketResult<TransferPacket> {
+  return Protocol::decodeFixed<TransferPacket>(payload);
+}
+
+[[nodiscard]] constexpr auto isZoneLink(Protocol::PacketType type) noexcept
+    -> bool {
+  return type == Protocol::PacketType::ZoneEnter ||
+         type == Protocol::PacketType::ZoneHandoff;
+}
+
+} // namespace Moonlapse::ZoneLink